@@ -15,6 +15,7 @@ BuildRequires:  openssl-devel
 BuildRequires:  zlib-devel
 BuildRequires:  bzip2-devel
 BuildRequires:  xz-devel
+BuildRequires:  libzstd-devel
 %if 0%{?suse_version}
 BuildRequires:  lzlib-devel
 %endif
@@ -45,9 +46,9 @@ mkdir build
 %build
 pushd build
 %if 0%{?suse_version}
-%cmake -DHAVE_LZLIB_DEVEL:BOOL=ON ..
+%cmake -DHAVE_LZLIB_DEVEL:BOOL=ON -DHAVE_ZSTD:BOOL=ON ..
 %else
-%cmake ..
+%cmake -DHAVE_ZSTD:BOOL=ON ..
 %endif
 %make_build
 make doc
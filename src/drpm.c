@@ -30,6 +30,51 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <stddef.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/* DeltaRPM read once for several operations. Internal data is left
+ * in the file, as it is only needed (once) for applying. Data of the
+ * installed package is read on first use and kept as well. */
+struct drpm_handle {
+    char *filename; // NULL if DeltaRPM cannot be read again
+    struct deltarpm delta;
+    bool int_data_read;
+    struct drpm *info;
+    struct rpm *old_rpm; // installed package, NULL until prepared
+    struct file_info *files;
+    size_t file_count;
+    unsigned short digest_algo;
+    struct cpio_file *cpio_files;
+    size_t cpio_files_len;
+};
+
+/* Applied in parallel by drpm_apply_batch(). */
+struct batch {
+    drpm_apply_job *jobs;
+    const size_t *order;
+    size_t count;
+    size_t next;
+    pthread_mutex_t mutex;
+    const drpm_apply_options *opts;
+    struct rpm_db *db;
+};
+
+/* Job index with estimated cost, for ordering. */
+struct batch_job {
+    size_t index;
+    off_t size;
+};
+
+static int apply(struct drpm_handle *, int, const struct sink *, const drpm_apply_options *, struct rpm_db *);
+static int apply_fd(int, int, const struct sink *, const drpm_apply_options *, struct rpm_db *);
+static int apply_files(const char *, const char *, const char *,
+                       const drpm_apply_options *, struct rpm_db *);
+static void *batch_worker(void *);
+static int batch_job_cmp(const void *, const void *);
+static void handle_free(struct drpm_handle *);
+static int handle_prepare(struct drpm_handle *, struct rpm_db *, int,
+                          struct prelink_cache *, struct verify_cache *);
 
 const char *drpm_strerror(int error)
 {
@@ -56,6 +101,10 @@ const char *drpm_strerror(int error)
         return "file changed";
     case DRPM_ERR_NOINSTALL:
         return "old RPM not installed";
+    case DRPM_ERR_THRESHOLD:
+        return "DeltaRPM exceeds size threshold";
+    case DRPM_ERR_NODIGEST:
+        return "no payload digest to verify against";
     default:
         return "(undefined error value)";
     }
@@ -291,14 +340,47 @@ int drpm_get_ulong_array(struct drpm *delta, int tag, unsigned long **ret_array,
 
 int drpm_make(const char *old_rpm_name, const char *new_rpm_name,
               const char *deltarpm_name, const drpm_make_options *user_opts)
+{
+    int error;
+    int old_rpm_fd = -1;
+    int new_rpm_fd = -1;
+    int deltarpm_fd = -1;
+
+    if (deltarpm_name == NULL || (old_rpm_name == NULL && new_rpm_name == NULL))
+        return DRPM_ERR_ARGS;
+
+    if ((old_rpm_name != NULL && (old_rpm_fd = open(old_rpm_name, O_RDONLY)) < 0) ||
+        (new_rpm_name != NULL && (new_rpm_fd = open(new_rpm_name, O_RDONLY)) < 0) ||
+        (deltarpm_fd = creat(deltarpm_name, CREAT_MODE)) < 0) {
+        error = DRPM_ERR_IO;
+        goto cleanup;
+    }
+
+    /* not leaving incomplete DeltaRPM behind */
+    if ((error = drpm_make_fd(old_rpm_fd, new_rpm_fd, deltarpm_fd, user_opts)) != DRPM_ERR_OK)
+        unlink(deltarpm_name);
+
+cleanup:
+    if (old_rpm_fd >= 0)
+        close(old_rpm_fd);
+    if (new_rpm_fd >= 0)
+        close(new_rpm_fd);
+    if (deltarpm_fd >= 0)
+        close(deltarpm_fd);
+
+    return error;
+}
+
+int drpm_make_fd(int old_rpm_fd, int new_rpm_fd, int deltarpm_fd,
+                 const drpm_make_options *user_opts)
 {
     int error = DRPM_ERR_OK;
 
     drpm_make_options opts = {0};
     const bool rpm_only = (user_opts != NULL && user_opts->rpm_only);
-    const bool alone = (old_rpm_name == NULL || new_rpm_name == NULL);
+    const bool alone = (old_rpm_fd < 0 || new_rpm_fd < 0);
 
-    const char *solo_rpm_name = NULL;
+    int solo_rpm_fd = -1;
     struct rpm *solo_rpm = NULL;
     struct rpm *old_rpm = NULL;
     struct rpm *new_rpm = NULL;
@@ -320,11 +402,11 @@ int drpm_make(const char *old_rpm_name, const char *new_rpm_name,
 
     struct deltarpm delta = {0};
 
-    if (deltarpm_name == NULL || (old_rpm_name == NULL && new_rpm_name == NULL))
+    if (deltarpm_fd < 0 || (old_rpm_fd < 0 && new_rpm_fd < 0))
         return DRPM_ERR_ARGS;
 
     if (alone)
-        solo_rpm_name = (old_rpm_name == NULL) ? new_rpm_name : old_rpm_name;
+        solo_rpm_fd = (old_rpm_fd < 0) ? new_rpm_fd : old_rpm_fd;
 
     if (user_opts == NULL)
         drpm_make_options_defaults(&opts);
@@ -334,9 +416,9 @@ int drpm_make(const char *old_rpm_name, const char *new_rpm_name,
     if (rpm_only && opts.version < 3)
         return DRPM_ERR_ARGS;
 
-    delta.filename = deltarpm_name;
     delta.type = rpm_only ? DRPM_TYPE_RPMONLY : DRPM_TYPE_STANDARD;
     delta.version = opts.version;
+    delta.comp_threads = opts.comp_threads;
 
     if (!opts.comp_from_rpm) {
         delta.comp = opts.comp;
@@ -345,7 +427,7 @@ int drpm_make(const char *old_rpm_name, const char *new_rpm_name,
 
     /* no diff to perform for identity rpm-only deltarpms */
     if (alone && rpm_only) {
-        if ((error = fill_nodiff_deltarpm(&delta, solo_rpm_name, opts.comp_from_rpm)) != DRPM_ERR_OK)
+        if ((error = fill_nodiff_deltarpm(&delta, solo_rpm_fd, opts.comp_from_rpm)) != DRPM_ERR_OK)
             goto cleanup;
         goto write_files;
     }
@@ -355,7 +437,7 @@ int drpm_make(const char *old_rpm_name, const char *new_rpm_name,
 
     /* reading RPM(s) (also creating MD5 sums and determining compressor from archive) */
     if (alone) {
-        if ((error = rpm_read(&solo_rpm, solo_rpm_name, RPM_ARCHIVE_READ_DECOMP,
+        if ((error = rpm_read_fd(&solo_rpm, solo_rpm_fd, RPM_ARCHIVE_READ_DECOMP,
                               &delta.tgt_comp, NULL, delta.tgt_md5)) != DRPM_ERR_OK)
             goto cleanup;
     } else {
@@ -366,9 +448,9 @@ int drpm_make(const char *old_rpm_name, const char *new_rpm_name,
             }
             delta.sequence_len = MD5_DIGEST_LENGTH;
         }
-        if ((error = rpm_read(&old_rpm, old_rpm_name, RPM_ARCHIVE_READ_DECOMP,
+        if ((error = rpm_read_fd(&old_rpm, old_rpm_fd, RPM_ARCHIVE_READ_DECOMP,
                               NULL, rpm_only ? delta.sequence : NULL, NULL)) != DRPM_ERR_OK ||
-            (error = rpm_read(&new_rpm, new_rpm_name, RPM_ARCHIVE_READ_DECOMP,
+            (error = rpm_read_fd(&new_rpm, new_rpm_fd, RPM_ARCHIVE_READ_DECOMP,
                               &delta.tgt_comp, NULL, delta.tgt_md5)) != DRPM_ERR_OK)
             goto cleanup;
     }
@@ -457,7 +539,8 @@ int drpm_make(const char *old_rpm_name, const char *new_rpm_name,
                            &delta.ext_copies, &delta.ext_copies_count,
                            &delta.int_copies, &delta.int_copies_count,
                            opts.addblk ? &delta.add_data : NULL, opts.addblk ? &delta.add_data_len : NULL,
-                           opts.addblk_comp, opts.addblk_comp_level)) != DRPM_ERR_OK)
+                           opts.addblk_comp, opts.addblk_comp_level,
+                           (size_t)delta.tgt_size * opts.size_ratio / 100)) != DRPM_ERR_OK)
         goto cleanup;
 
     delta.int_data_as_ptrs = true;
@@ -465,7 +548,7 @@ int drpm_make(const char *old_rpm_name, const char *new_rpm_name,
 
 write_files:
 
-    if ((error = write_deltarpm(&delta)) != DRPM_ERR_OK)
+    if ((error = write_deltarpm(&delta, deltarpm_fd)) != DRPM_ERR_OK)
         goto cleanup;
 
     if (opts.seqfile != NULL)
@@ -493,14 +576,333 @@ cleanup:
     return error;
 }
 
+/**************************** drpm handle *****************************/
+
+int drpm_open(struct drpm_handle **handle_ret, const char *filename)
+{
+    struct drpm_handle *handle;
+    int error;
+
+    if (handle_ret == NULL || filename == NULL)
+        return DRPM_ERR_ARGS;
+
+    *handle_ret = NULL;
+
+    if ((handle = calloc(1, sizeof(struct drpm_handle))) == NULL ||
+        (handle->filename = malloc(strlen(filename) + 1)) == NULL) {
+        free(handle);
+        return DRPM_ERR_MEMORY;
+    }
+    strcpy(handle->filename, filename);
+
+    if ((error = read_deltarpm_stream(&handle->delta, handle->filename)) != DRPM_ERR_OK) {
+        handle_free(handle);
+        free(handle);
+        return error;
+    }
+
+    *handle_ret = handle;
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_close(struct drpm_handle **handle)
+{
+    if (handle == NULL || *handle == NULL)
+        return DRPM_ERR_ARGS;
+
+    handle_free(*handle);
+
+    free(*handle);
+    *handle = NULL;
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_handle_info(struct drpm_handle *handle, struct drpm **info)
+{
+    int error;
+
+    if (handle == NULL || info == NULL)
+        return DRPM_ERR_ARGS;
+
+    if (handle->info == NULL) {
+        if ((handle->info = malloc(sizeof(struct drpm))) == NULL)
+            return DRPM_ERR_MEMORY;
+        if ((error = deltarpm_to_drpm(&handle->delta, handle->info)) != DRPM_ERR_OK) {
+            free(handle->info);
+            handle->info = NULL;
+            return error;
+        }
+    }
+
+    *info = handle->info;
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_handle_check(struct drpm_handle *handle, int check_mode, const drpm_apply_options *opts)
+{
+    int error;
+    struct prelink_cache *prelink = NULL;
+    struct verify_cache *verify = NULL;
+
+    if (handle == NULL ||
+        (check_mode != DRPM_CHECK_FILESIZES && check_mode != DRPM_CHECK_FULL))
+        return DRPM_ERR_ARGS;
+
+    if (handle->old_rpm != NULL && handle->delta.type != DRPM_TYPE_STANDARD)
+        return DRPM_ERR_OK;
+
+    if ((error = prelink_cache_create(&prelink, (opts == NULL) ? NULL : opts->prelink_dir)) != DRPM_ERR_OK ||
+        (opts != NULL && opts->verify_cache != NULL &&
+         (error = verify_cache_open(&verify, opts->verify_cache)) != DRPM_ERR_OK))
+        goto cleanup;
+
+    if (handle->old_rpm == NULL) {
+        /* reading installed package and expanding sequence, checking files
+         * on the way, so that a changed file is reported before the
+         * sequence mismatch it causes (as by drpm_check_sequence()) */
+        error = handle_prepare(handle, NULL, check_mode, prelink, verify);
+    } else {
+        /* sequence already matched, checking files only */
+        error = check_seqfiles(handle->cpio_files, handle->cpio_files_len,
+                               handle->files, handle->digest_algo, check_mode,
+                               prelink, verify);
+    }
+
+cleanup:
+    if (prelink != NULL)
+        prelink_cache_destroy(&prelink);
+    if (verify != NULL)
+        verify_cache_close(&verify); // failing to save cache is no error
+
+    return error;
+}
+
+int drpm_handle_apply(struct drpm_handle *handle, const char *old_rpm_name,
+                      const char *new_rpm_name, const drpm_apply_options *opts)
+{
+    int error;
+    int old_rpm_fd = -1;
+    struct sink output = {.filedesc = -1};
+
+    if (handle == NULL || new_rpm_name == NULL)
+        return DRPM_ERR_ARGS;
+
+    if ((old_rpm_name != NULL && (old_rpm_fd = open(old_rpm_name, O_RDONLY)) < 0) ||
+        (output.filedesc = creat(new_rpm_name, CREAT_MODE)) < 0) {
+        error = DRPM_ERR_IO;
+        goto cleanup;
+    }
+
+    /* not leaving incomplete or unverified RPM behind */
+    if ((error = apply(handle, old_rpm_fd, &output, opts, NULL)) != DRPM_ERR_OK)
+        unlink(new_rpm_name);
+
+cleanup:
+    if (old_rpm_fd >= 0)
+        close(old_rpm_fd);
+    if (output.filedesc >= 0)
+        close(output.filedesc);
+
+    return error;
+}
+
+/* Reads header of installed package from <db> (or the default database)
+ * and expands the sequence of a standard DeltaRPM against its files,
+ * checking them according to <check_mode>. */
+int handle_prepare(struct drpm_handle *handle, struct rpm_db *db, int check_mode,
+                   struct prelink_cache *prelink, struct verify_cache *verify)
+{
+    int error;
+    struct rpm *old_rpm = NULL;
+    char *old_rpm_nevr = NULL;
+
+    if (handle->old_rpm != NULL)
+        return DRPM_ERR_OK;
+
+    /* reading old RPM header from database */
+    if ((error = rpm_read_header(&old_rpm, db, handle->delta.src_nevr, NULL)) != DRPM_ERR_OK)
+        return error;
+
+    /* checking NEVRs */
+    if ((error = rpm_get_nevr(old_rpm, &old_rpm_nevr)) != DRPM_ERR_OK)
+        goto cleanup_fail;
+    if (strcmp(handle->delta.src_nevr, old_rpm_nevr) != 0) {
+        error = DRPM_ERR_MISMATCH;
+        goto cleanup_fail;
+    }
+
+    handle->old_rpm = old_rpm;
+
+    if (handle->delta.type == DRPM_TYPE_STANDARD) {
+        /* expanding sequence */
+        if ((error = rpm_get_file_info(old_rpm, &handle->files, &handle->file_count, NULL)) != DRPM_ERR_OK ||
+            (error = rpm_get_digest_algo(old_rpm, &handle->digest_algo)) != DRPM_ERR_OK ||
+            (error = expand_sequence(&handle->cpio_files, &handle->cpio_files_len,
+                                     handle->delta.sequence, handle->delta.sequence_len,
+                                     handle->files, handle->file_count, handle->digest_algo,
+                                     check_mode, prelink, verify)) != DRPM_ERR_OK) {
+            handle->old_rpm = NULL;
+            goto cleanup_fail;
+        }
+    }
+
+    goto cleanup;
+
+cleanup_fail:
+    for (size_t i = 0; i < handle->file_count; i++) {
+        free(handle->files[i].name);
+        free(handle->files[i].md5);
+        free(handle->files[i].linkto);
+    }
+    free(handle->files);
+    handle->files = NULL;
+    handle->file_count = 0;
+    rpm_destroy(&old_rpm);
+
+cleanup:
+    free(old_rpm_nevr);
+
+    return error;
+}
+
+void handle_free(struct drpm_handle *handle)
+{
+    for (size_t i = 0; i < handle->file_count; i++) {
+        free(handle->files[i].name);
+        free(handle->files[i].md5);
+        free(handle->files[i].linkto);
+    }
+    free(handle->files);
+    free(handle->cpio_files);
+    rpm_destroy(&handle->old_rpm);
+    if (handle->info != NULL) {
+        drpm_free(handle->info);
+        free(handle->info);
+    }
+    free_deltarpm(&handle->delta);
+    free(handle->filename);
+}
+
 /***************************** drpm apply *****************************/
 
 int drpm_apply(const char *old_rpm_name, const char *deltarpm_name, const char *new_rpm_name)
+{
+    return drpm_apply_ex(old_rpm_name, deltarpm_name, new_rpm_name, NULL);
+}
+
+int drpm_apply_ex(const char *old_rpm_name, const char *deltarpm_name, const char *new_rpm_name,
+                  const drpm_apply_options *user_opts)
+{
+    return apply_files(old_rpm_name, deltarpm_name, new_rpm_name, user_opts, NULL);
+}
+
+int apply_files(const char *old_rpm_name, const char *deltarpm_name, const char *new_rpm_name,
+                const drpm_apply_options *user_opts, struct rpm_db *db)
+{
+    int error;
+    int old_rpm_fd = -1;
+    int deltarpm_fd = -1;
+    struct sink output = {.filedesc = -1};
+
+    if (deltarpm_name == NULL || new_rpm_name == NULL)
+        return DRPM_ERR_ARGS;
+
+    if ((old_rpm_name != NULL && (old_rpm_fd = open(old_rpm_name, O_RDONLY)) < 0) ||
+        (deltarpm_fd = open(deltarpm_name, O_RDONLY)) < 0 ||
+        (output.filedesc = creat(new_rpm_name, CREAT_MODE)) < 0) {
+        error = DRPM_ERR_IO;
+        goto cleanup;
+    }
+
+    /* not leaving incomplete or unverified RPM behind */
+    if ((error = apply_fd(old_rpm_fd, deltarpm_fd, &output, user_opts, db)) != DRPM_ERR_OK)
+        unlink(new_rpm_name);
+
+cleanup:
+    if (old_rpm_fd >= 0)
+        close(old_rpm_fd);
+    if (deltarpm_fd >= 0)
+        close(deltarpm_fd);
+    if (output.filedesc >= 0)
+        close(output.filedesc);
+
+    return error;
+}
+
+int drpm_apply_fd(int old_rpm_fd, int deltarpm_fd, int new_rpm_fd,
+                  const drpm_apply_options *user_opts)
+{
+    const struct sink output = {.filedesc = new_rpm_fd};
+
+    if (deltarpm_fd < 0 || new_rpm_fd < 0)
+        return DRPM_ERR_ARGS;
+
+    return apply_fd(old_rpm_fd, deltarpm_fd, &output, user_opts, NULL);
+}
+
+int drpm_apply_cb(const char *old_rpm_name, const char *deltarpm_name,
+                  drpm_write_func write_func, void *write_arg,
+                  const drpm_apply_options *user_opts)
+{
+    int error;
+    int old_rpm_fd = -1;
+    int deltarpm_fd = -1;
+    const struct sink output = {.filedesc = -1, .write_func = write_func, .write_arg = write_arg};
+
+    if (deltarpm_name == NULL || write_func == NULL)
+        return DRPM_ERR_ARGS;
+
+    if ((old_rpm_name != NULL && (old_rpm_fd = open(old_rpm_name, O_RDONLY)) < 0) ||
+        (deltarpm_fd = open(deltarpm_name, O_RDONLY)) < 0) {
+        error = DRPM_ERR_IO;
+        goto cleanup;
+    }
+
+    error = apply_fd(old_rpm_fd, deltarpm_fd, &output, user_opts, NULL);
+
+cleanup:
+    if (old_rpm_fd >= 0)
+        close(old_rpm_fd);
+    if (deltarpm_fd >= 0)
+        close(deltarpm_fd);
+
+    return error;
+}
+
+/* Reconstructs new RPM from DeltaRPM read from <deltarpm_fd> (see apply()). */
+int apply_fd(int old_rpm_fd, int deltarpm_fd, const struct sink *output,
+             const drpm_apply_options *user_opts, struct rpm_db *db)
+{
+    int error;
+    struct drpm_handle handle = {0};
+
+    if ((error = read_deltarpm_stream_fd(&handle.delta, deltarpm_fd)) != DRPM_ERR_OK)
+        return error;
+
+    error = apply(&handle, old_rpm_fd, output, user_opts, db);
+
+    handle_free(&handle);
+
+    return error;
+}
+
+/* Reconstructs new RPM from DeltaRPM of <handle> and either <old_rpm_fd>
+ * or, if negative, the installed files, passing it to <output>.
+ * Installed package is looked up in <db>, if given. */
+int apply(struct drpm_handle *handle, int old_rpm_fd, const struct sink *output,
+          const drpm_apply_options *user_opts, struct rpm_db *db)
 {
     int error = DRPM_ERR_OK;
-    struct deltarpm delta = {0};
-    const bool from_rpm = (old_rpm_name != NULL);
+    drpm_apply_options opts = {0};
+    struct deltarpm *delta = &handle->delta;
+    const bool from_rpm = (old_rpm_fd >= 0);
     bool rpm_only;
+    bool no_diff;
+    bool uncomp_payload;
+    struct payload_check pchk = {0};
     struct rpm *old_rpm = NULL;
     struct rpm *patched_rpm = NULL;
     unsigned char oldsig_md5[MD5_DIGEST_LENGTH];
@@ -512,14 +914,15 @@ int drpm_apply(const char *old_rpm_name, const char *deltarpm_name, const char *
     struct cpio_file *cpio_files = NULL;
     size_t cpio_files_len = 0;
     struct blocks *blks = NULL;
-    int filedesc;
-    MD5_CTX md5;
+    struct prelink_cache *prelink = NULL;
+    struct checksum md5 = {0};
     unsigned char md5_digest[MD5_DIGEST_LENGTH];
     bool no_full_md5;
     bool has_md5;
     const unsigned char empty_md5[MD5_DIGEST_LENGTH] = {0};
     struct decompstrm *addblk_strm = NULL;
-    unsigned char *addblk_buf = NULL;
+    const unsigned char *addblk_data;
+    const unsigned char *ext_data;
     unsigned char *buffer = NULL;
     size_t buffer_len;
     unsigned char *header = NULL;
@@ -528,7 +931,6 @@ int drpm_apply(const char *old_rpm_name, const char *deltarpm_name, const char *
     const uint32_t *int_copies;
     uint32_t int_copies_count;
     size_t int_copy_len;
-    const unsigned char *int_data;
     const uint32_t *ext_copies;
     uint32_t ext_copies_count;
     size_t ext_copy_len;
@@ -536,24 +938,41 @@ int drpm_apply(const char *old_rpm_name, const char *deltarpm_name, const char *
     uint32_t ext_copies_todo;
     size_t ext_copies_done = 0;
     size_t blk_id;
-    unsigned char *comp_data;
-    size_t comp_data_len;
 
-    if (deltarpm_name == NULL || new_rpm_name == NULL)
-        return DRPM_ERR_ARGS;
-
-    if ((filedesc = creat(new_rpm_name, CREAT_MODE)) < 0)
-        return DRPM_ERR_IO;
-
-    /* reading DeltaRPM */
-    if ((error = read_deltarpm(&delta, deltarpm_name)) != DRPM_ERR_OK)
+    if (user_opts == NULL)
+        drpm_apply_options_defaults(&opts);
+    else
+        opts = *user_opts;
+
+    /* internal data is read as needed, so only once per reading of DeltaRPM */
+    if (handle->int_data_read) {
+        if (handle->filename == NULL)
+            return DRPM_ERR_PROG;
+        free_deltarpm(delta);
+        if ((error = read_deltarpm_stream(delta, handle->filename)) != DRPM_ERR_OK)
+            return error;
+    }
+    handle->int_data_read = true;
+
+    rpm_only = (delta->type == DRPM_TYPE_RPMONLY);
+    no_diff = (rpm_only && delta->tgt_comp == DRPM_COMP_NONE &&
+               delta->int_copies_count == 0 && delta->ext_copies_count == 0);
+    no_full_md5 = (memcmp(empty_md5, delta->tgt_md5, MD5_DIGEST_LENGTH) == 0);
+
+    /* uncompressed payload can only be checked against its digest
+     * (in rpm-only deltas, the header is only known after reconstruction) */
+    uncomp_payload = (opts.uncompressed_payload && delta->tgt_comp != DRPM_COMP_NONE);
+    if (uncomp_payload &&
+        (error = payload_check_init(&pchk, rpm_only ? NULL : delta->head.tgt_rpm,
+                                    rpm_only ? delta->tgt_header_len : 0)) != DRPM_ERR_OK)
         goto cleanup;
-    rpm_only = (delta.type == DRPM_TYPE_RPMONLY);
-    no_full_md5 = (memcmp(empty_md5, delta.tgt_md5, MD5_DIGEST_LENGTH) == 0);
 
     if (from_rpm) {
-        /* reading old RPM */
-        if ((error = rpm_read(&old_rpm, old_rpm_name, RPM_ARCHIVE_READ_DECOMP, NULL, NULL, NULL)) != DRPM_ERR_OK)
+        /* reading old RPM (large archives are decompressed as needed) */
+        if ((error = rpm_read_fd(&old_rpm, old_rpm_fd,
+                                 (no_diff || blocks_in_place(delta->ext_data_len, &opts)) ?
+                                 RPM_ARCHIVE_READ_DECOMP : RPM_ARCHIVE_STREAM_DECOMP,
+                                 NULL, NULL, NULL)) != DRPM_ERR_OK)
             goto cleanup;
         if (rpm_only) {
             /* comparing signature MD5 with DeltaRPM sequence */
@@ -563,71 +982,75 @@ int drpm_apply(const char *old_rpm_name, const char *deltarpm_name, const char *
                 error = DRPM_ERR_FORMAT;
                 goto cleanup;
             }
-            if (memcmp(delta.sequence, oldsig_md5, MD5_DIGEST_LENGTH) != 0) {
+            if (memcmp(delta->sequence, oldsig_md5, MD5_DIGEST_LENGTH) != 0) {
                 error = DRPM_ERR_MISMATCH;
                 goto cleanup;
             }
         }
+
+        /* comparing source NEVRs */
+        if ((error = rpm_get_nevr(old_rpm, &old_rpm_nevr)) != DRPM_ERR_OK)
+            goto cleanup;
+        if (strcmp(delta->src_nevr, old_rpm_nevr) != 0) {
+            error = DRPM_ERR_MISMATCH;
+            goto cleanup;
+        }
+
+        if (!rpm_only) {
+            /* expanding sequence */
+            if ((error = rpm_get_file_info(old_rpm, &files, &file_count, NULL)) != DRPM_ERR_OK ||
+                (error = rpm_get_digest_algo(old_rpm, &digest_algo)) != DRPM_ERR_OK ||
+                (error = expand_sequence(&cpio_files, &cpio_files_len,
+                                         delta->sequence, delta->sequence_len,
+                                         files, file_count, digest_algo,
+                                         DRPM_CHECK_NONE, NULL, NULL)) != DRPM_ERR_OK)
+                goto cleanup;
+        }
     } else {
         // rpm-only deltarpms do not work from filesystem
-        if (rpm_only)
-            return DRPM_ERR_ARGS;
-        // cannot reconstruct source RPMs from filesystem
-        if (rpm_is_sourcerpm(delta.head.tgt_rpm))
-            return DRPM_ERR_ARGS;
-        /* reading old RPM header from database */
-        if ((error = rpm_read_header(&old_rpm, delta.src_nevr, NULL)) != DRPM_ERR_OK)
+        // and source RPMs cannot be reconstructed from filesystem
+        if (rpm_only || rpm_is_sourcerpm(delta->head.tgt_rpm)) {
+            error = DRPM_ERR_ARGS;
             goto cleanup;
-    }
-
-    /* comparing source NEVRs */
-    if ((error = rpm_get_nevr(old_rpm, &old_rpm_nevr)) != DRPM_ERR_OK)
-        goto cleanup;
-    if (strcmp(delta.src_nevr, old_rpm_nevr) != 0) {
-        error = DRPM_ERR_MISMATCH;
-        goto cleanup;
-    }
-
-    if (!rpm_only) {
-        /* expanding sequence */
-        if ((error = rpm_get_file_info(old_rpm, &files, &file_count, NULL)) != DRPM_ERR_OK ||
-            (error = rpm_get_digest_algo(old_rpm, &digest_algo)) != DRPM_ERR_OK ||
-            (error = expand_sequence(&cpio_files, &cpio_files_len,
-                                     delta.sequence, delta.sequence_len,
-                                     files, file_count, digest_algo,
-                                     DRPM_CHECK_NONE)) != DRPM_ERR_OK)
+        }
+        /* installed package and sequence are kept with the handle,
+         * lead and signature are replaced in a copy of the package */
+        if ((error = handle_prepare(handle, db, DRPM_CHECK_NONE, NULL, NULL)) != DRPM_ERR_OK ||
+            (error = rpm_copy_header(&patched_rpm, handle->old_rpm)) != DRPM_ERR_OK)
             goto cleanup;
+        old_rpm = handle->old_rpm;
+        files = handle->files;
+        cpio_files = handle->cpio_files;
+        cpio_files_len = handle->cpio_files_len;
     }
 
     /* overwriting old RPM's lead and signature with new RPM's */
-    patched_rpm = old_rpm;
-    if ((error = rpm_replace_lead_and_signature(patched_rpm, delta.tgt_leadsig, delta.tgt_leadsig_len)) != DRPM_ERR_OK)
+    if (from_rpm)
+        patched_rpm = old_rpm;
+    if ((error = rpm_replace_lead_and_signature(patched_rpm, delta->tgt_leadsig, delta->tgt_leadsig_len)) != DRPM_ERR_OK)
         goto cleanup;
 
-    if (rpm_only && delta.tgt_comp == DRPM_COMP_NONE &&
-        delta.int_copies_count == 0 && delta.ext_copies_count == 0) {
+    if (no_diff) {
     /* no-diff DeltaRPM, no need for reconstruction */
-        if ((error = rpm_write(patched_rpm, new_rpm_name, true, md5_digest, !no_full_md5)) != DRPM_ERR_OK)
+        if ((error = rpm_write(patched_rpm, output, true, md5_digest, !no_full_md5)) != DRPM_ERR_OK)
             goto cleanup;
 
         goto final_check;
     }
 
     /* creating blocks for reading external data */
-    if ((error = blocks_create(&blks, delta.ext_data_len, files,
+    if ((!from_rpm && (error = prelink_cache_create(&prelink, opts.prelink_dir)) != DRPM_ERR_OK) ||
+        (error = blocks_create(&blks, delta->ext_data_len, files,
                                cpio_files, cpio_files_len,
-                               delta.ext_copies, delta.ext_copies_count,
-                               from_rpm ? old_rpm : NULL, rpm_only)) != DRPM_ERR_OK)
+                               delta->ext_copies, delta->ext_copies_count,
+                               from_rpm ? old_rpm : NULL, rpm_only, prelink,
+                               &opts)) != DRPM_ERR_OK)
         goto cleanup;
 
     /* setting up add block */
-    if (delta.add_data_len > 0) {
-        if ((error = decompstrm_init(&addblk_strm, -1, NULL, NULL, delta.add_data, delta.add_data_len)) != DRPM_ERR_OK)
-            goto cleanup;
-        if ((addblk_buf = malloc(block_size())) == NULL) {
-            error = DRPM_ERR_MEMORY;
+    if (delta->add_data_len > 0) {
+        if ((error = decompstrm_init(&addblk_strm, -1, NULL, NULL, delta->add_data, delta->add_data_len)) != DRPM_ERR_OK)
             goto cleanup;
-        }
     }
 
     if ((buffer = malloc(block_size())) == NULL) {
@@ -635,48 +1058,38 @@ int drpm_apply(const char *old_rpm_name, const char *deltarpm_name, const char *
         goto cleanup;
     }
 
-    if (MD5_Init(&md5) != 1) {
-        error = DRPM_ERR_OTHER;
+    if ((error = checksum_init(&md5, DIGESTALGO_MD5)) != DRPM_ERR_OK)
         goto cleanup;
-    }
 
     /* writing lead and signature of new RPM */
-    if (write(filedesc, delta.tgt_leadsig, delta.tgt_leadsig_len) != (ssize_t)delta.tgt_leadsig_len) {
-        error = DRPM_ERR_IO;
+    if ((error = sink_write(output, delta->tgt_leadsig, delta->tgt_leadsig_len)) != DRPM_ERR_OK)
         goto cleanup;
-    }
-    if (!no_full_md5 && MD5_Update(&md5, delta.tgt_leadsig, delta.tgt_leadsig_len) != 1) {
-        error = DRPM_ERR_OTHER;
+    if (!no_full_md5 && (error = checksum_update(&md5, delta->tgt_leadsig, delta->tgt_leadsig_len)) != DRPM_ERR_OK)
         goto cleanup;
-    }
 
     if (!rpm_only) {
         /* standard delta -> write out header (rpm-only includes it in diff) */
-        if ((error = rpm_patch_payload_format(delta.head.tgt_rpm, "cpio")) != DRPM_ERR_OK ||
-            (error = rpm_fetch_header(delta.head.tgt_rpm, &header, &header_size)) != DRPM_ERR_OK)
+        if ((error = rpm_patch_payload_format(delta->head.tgt_rpm, "cpio")) != DRPM_ERR_OK ||
+            (error = rpm_fetch_header(delta->head.tgt_rpm, &header, &header_size)) != DRPM_ERR_OK ||
+            (error = sink_write(output, header, header_size)) != DRPM_ERR_OK)
             goto cleanup;
-        if (write(filedesc, header, header_size) != (ssize_t)header_size) {
-            error = DRPM_ERR_IO;
+        if ((error = checksum_update(&md5, header, header_size)) != DRPM_ERR_OK)
             goto cleanup;
-        }
-        if (MD5_Update(&md5, header, header_size) != 1) {
-            error = DRPM_ERR_OTHER;
-            goto cleanup;
-        }
     }
 
     /* compression stream wrapper, makes sure header is uncompressed if included */
-    if ((error = compstrm_wrapper_init(&csw, delta.tgt_header_len,
-                                       filedesc, delta.tgt_comp, delta.tgt_comp_level)) != DRPM_ERR_OK)
+    if ((error = compstrm_wrapper_init(&csw, delta->tgt_header_len, output,
+                                       uncomp_payload ? DRPM_COMP_NONE : delta->tgt_comp,
+                                       delta->tgt_comp_level,
+                                       uncomp_payload ? NULL : &md5)) != DRPM_ERR_OK)
         goto cleanup;
 
     /* reconstructing from diff data */
 
-    int_copies = delta.int_copies;
-    int_copies_count = delta.int_copies_count;
-    ext_copies = delta.ext_copies;
-    ext_copies_count = delta.ext_copies_count;
-    int_data = delta.int_data.bytes;
+    int_copies = delta->int_copies;
+    int_copies_count = delta->int_copies_count;
+    ext_copies = delta->ext_copies;
+    ext_copies_count = delta->ext_copies_count;
 
     while (int_copies_count--) {
         ext_copies_todo = *int_copies++;
@@ -690,29 +1103,30 @@ int drpm_apply(const char *old_rpm_name, const char *deltarpm_name, const char *
             ext_offset += (int32_t)*ext_copies++; // adjusting external offset
             ext_copy_len = *ext_copies++; // length of external copy
             ext_copies_count--;
-            blk_id = block_id(ext_offset);
 
-            /* performing external copy */
+            /* performing external copy (external data is only copied
+             * if add block applies, otherwise it is passed on in place) */
             while (ext_copy_len > 0) {
-                if ((error = blocks_next(blks, buffer, &buffer_len,
+                blk_id = block_id(ext_offset);
+                if ((error = blocks_next(blks, &ext_data, &buffer_len,
                                          ext_offset, ext_copy_len,
                                          ext_copies_done, blk_id)) != DRPM_ERR_OK)
                     goto cleanup;
 
                 /* applying add block */
-                if (delta.add_data_len > 0) {
-                    if ((error = decompstrm_read(addblk_strm, buffer_len, addblk_buf)) != DRPM_ERR_OK)
+                if (delta->add_data_len > 0) {
+                    if ((error = decompstrm_read_ptr(addblk_strm, buffer_len, &addblk_data)) != DRPM_ERR_OK)
                         goto cleanup;
-                    for (size_t i = 0; i < buffer_len; i++)
-                        buffer[i] += (signed char)addblk_buf[i];
+                    add_bytes(buffer, ext_data, addblk_data, buffer_len);
+                    ext_data = buffer;
                 }
 
-                if ((error = compstrm_wrapper_write(csw, buffer, buffer_len)) != DRPM_ERR_OK)
+                if ((uncomp_payload && (error = payload_check_update(&pchk, ext_data, buffer_len)) != DRPM_ERR_OK) ||
+                    (error = compstrm_wrapper_write(csw, ext_data, buffer_len)) != DRPM_ERR_OK)
                     goto cleanup;
 
                 ext_copy_len -= buffer_len;
                 ext_offset += buffer_len;
-                blk_id++;
             }
 
             ext_copies_done++;
@@ -721,20 +1135,28 @@ int drpm_apply(const char *old_rpm_name, const char *deltarpm_name, const char *
         int_copy_len = *int_copies++;
 
         /* performing internal copy */
-        if ((error = compstrm_wrapper_write(csw, int_data, int_copy_len)) != DRPM_ERR_OK)
-            goto cleanup;
-        int_data += int_copy_len;
+        while (int_copy_len > 0) {
+            buffer_len = MIN(int_copy_len, block_size());
+            if ((error = decompstrm_read(delta->int_data_strm, buffer_len, buffer)) != DRPM_ERR_OK ||
+                (uncomp_payload && (error = payload_check_update(&pchk, buffer, buffer_len)) != DRPM_ERR_OK) ||
+                (error = compstrm_wrapper_write(csw, buffer, buffer_len)) != DRPM_ERR_OK)
+                goto cleanup;
+            int_copy_len -= buffer_len;
+        }
     }
 
-    if ((error = compstrm_wrapper_finish(csw, &comp_data, &comp_data_len)) != DRPM_ERR_OK)
+    if (uncomp_payload) {
+    /* MD5s cover compressed payload -> only match payload digest */
+        if ((error = compstrm_wrapper_finish(csw)) != DRPM_ERR_OK)
+            goto cleanup;
+        error = payload_check_final(&pchk);
         goto cleanup;
+    }
 
     /* finalizing MD5 of written data */
-    if (MD5_Update(&md5, comp_data, comp_data_len) != 1 ||
-        MD5_Final(md5_digest, &md5) != 1) {
-        error = DRPM_ERR_OTHER;
+    if ((error = compstrm_wrapper_finish(csw)) != DRPM_ERR_OK ||
+        (error = checksum_final(&md5, md5_digest)) != DRPM_ERR_OK)
         goto cleanup;
-    }
 
 final_check:
 
@@ -748,7 +1170,7 @@ final_check:
         }
     } else {
     /* match full MD5 */
-        if (memcmp(md5_digest, delta.tgt_md5, MD5_DIGEST_LENGTH) != 0) {
+        if (memcmp(md5_digest, delta->tgt_md5, MD5_DIGEST_LENGTH) != 0) {
             error = DRPM_ERR_MISMATCH;
             goto cleanup;
         }
@@ -756,85 +1178,202 @@ final_check:
 
 cleanup:
 
-    close(filedesc);
-
-    for (size_t i = 0; i < file_count; i++) {
-        free(files[i].name);
-        free(files[i].md5);
-        free(files[i].linkto);
+    if (from_rpm) {
+        for (size_t i = 0; i < file_count; i++) {
+            free(files[i].name);
+            free(files[i].md5);
+            free(files[i].linkto);
+        }
+        free(files);
+        rpm_destroy(&old_rpm);
+        free(cpio_files);
+    } else {
+        rpm_destroy(&patched_rpm);
     }
-    free(files);
-    free_deltarpm(&delta);
-    rpm_destroy(&old_rpm);
     free(old_rpm_nevr);
 
     blocks_destroy(&blks);
+    if (prelink != NULL)
+        prelink_cache_destroy(&prelink);
     decompstrm_destroy(&addblk_strm);
     compstrm_wrapper_destroy(&csw);
-    free(cpio_files);
-    free(addblk_buf);
+    payload_check_free(&pchk);
+    checksum_free(&md5);
     free(buffer);
     free(header);
-    free(comp_data);
 
     return error;
 }
 
-int drpm_check(const char *deltarpm_name, int check_mode)
+int drpm_apply_batch(drpm_apply_job *jobs, size_t job_count, unsigned max_threads,
+                     size_t mem_budget, const drpm_apply_options *user_opts)
 {
     int error = DRPM_ERR_OK;
-    struct deltarpm delta = {0};
-    struct rpm *old_rpm = NULL;
-    char *old_rpm_nevr = NULL;
-    struct file_info *files = NULL;
-    size_t file_count = 0;
-    unsigned short digest_algo;
-
-    if (deltarpm_name == NULL ||
-        (check_mode != DRPM_CHECK_FILESIZES && check_mode != DRPM_CHECK_FULL))
+    drpm_apply_options opts = {0};
+    struct batch batch = {0};
+    struct batch_job *by_size = NULL;
+    size_t *order = NULL;
+    pthread_t *threads = NULL;
+    size_t thread_count;
+    size_t started = 0;
+    bool from_filesystem = false;
+    struct stat stats;
+    long cpus;
+
+    if (jobs == NULL && job_count > 0)
         return DRPM_ERR_ARGS;
 
-    /* reading DeltaRPM */
-    if ((error = read_deltarpm(&delta, deltarpm_name)) != DRPM_ERR_OK)
-        goto cleanup;
+    if (job_count == 0)
+        return DRPM_ERR_OK;
 
-    /* reading old RPM header from database */
-    if ((error = rpm_read_header(&old_rpm, delta.src_nevr, NULL)) != DRPM_ERR_OK)
+    if (user_opts == NULL)
+        drpm_apply_options_defaults(&opts);
+    else
+        opts = *user_opts;
+
+    if (max_threads == 0) {
+        if ((cpus = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+            cpus = 1;
+        max_threads = MIN((unsigned long)cpus, UINT_MAX);
+    }
+    thread_count = MIN(max_threads, job_count);
+
+    /* each running job gets an equal share of the budget */
+    if (mem_budget > 0)
+        opts.cache_size = mem_budget / thread_count;
+
+    if ((by_size = malloc(job_count * sizeof(struct batch_job))) == NULL ||
+        (order = malloc(job_count * sizeof(size_t))) == NULL ||
+        (threads = malloc(thread_count * sizeof(pthread_t))) == NULL) {
+        error = DRPM_ERR_MEMORY;
         goto cleanup;
+    }
 
-    /* checking NEVRs */
-    if ((error = rpm_get_nevr(old_rpm, &old_rpm_nevr)) != DRPM_ERR_OK)
+    /* largest jobs first, so that no long job is left running alone at the end
+     * (size of input files serves as estimate of work) */
+    for (size_t i = 0; i < job_count; i++) {
+        jobs[i].error = DRPM_ERR_OK;
+        by_size[i].index = i;
+        by_size[i].size = 0;
+        if (jobs[i].deltarpm != NULL && stat(jobs[i].deltarpm, &stats) == 0)
+            by_size[i].size += stats.st_size;
+        if (jobs[i].oldrpm != NULL && stat(jobs[i].oldrpm, &stats) == 0)
+            by_size[i].size += stats.st_size;
+        if (jobs[i].oldrpm == NULL)
+            from_filesystem = true;
+    }
+    qsort(by_size, job_count, sizeof(struct batch_job), batch_job_cmp);
+    for (size_t i = 0; i < job_count; i++)
+        order[i] = by_size[i].index;
+
+    /* one rpmdb for all jobs reconstructing from filesystem */
+    if (from_filesystem && (error = rpm_db_open(&batch.db)) != DRPM_ERR_OK)
         goto cleanup;
-    if (strcmp(delta.src_nevr, old_rpm_nevr) != 0) {
-        error = DRPM_ERR_MISMATCH;
+
+    if (pthread_mutex_init(&batch.mutex, NULL) != 0) {
+        error = DRPM_ERR_OTHER;
         goto cleanup;
     }
 
-    if (delta.type == DRPM_TYPE_STANDARD) {
-        /* expanding sequence, checking files */
-        if ((error = rpm_get_file_info(old_rpm, &files, &file_count, NULL)) != DRPM_ERR_OK ||
-            (error = rpm_get_digest_algo(old_rpm, &digest_algo)) != DRPM_ERR_OK ||
-            (error = expand_sequence(NULL, NULL, delta.sequence, delta.sequence_len,
-                                     files, file_count, digest_algo, check_mode)) != DRPM_ERR_OK)
-            goto cleanup;
+    batch.jobs = jobs;
+    batch.order = order;
+    batch.count = job_count;
+    batch.opts = &opts;
+
+    /* calling thread works too, fewer threads only make batch slower */
+    for (size_t i = 1; i < thread_count; i++)
+        if (pthread_create(&threads[started], NULL, batch_worker, &batch) == 0)
+            started++;
+
+    batch_worker(&batch);
+
+    for (size_t i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&batch.mutex);
+
+    /* reporting first failed job */
+    for (size_t i = 0; i < job_count; i++) {
+        if (jobs[i].error != DRPM_ERR_OK) {
+            error = jobs[i].error;
+            break;
+        }
     }
 
 cleanup:
+    if (batch.count == 0)
+        for (size_t i = 0; i < job_count; i++)
+            jobs[i].error = error;
 
-    for (size_t i = 0; i < file_count; i++) {
-        free(files[i].name);
-        free(files[i].md5);
-        free(files[i].linkto);
+    if (batch.db != NULL)
+        rpm_db_close(&batch.db);
+    free(by_size);
+    free(order);
+    free(threads);
+
+    return error;
+}
+
+/* Applies jobs of batch until there are none left. */
+void *batch_worker(void *arg)
+{
+    struct batch *batch = arg;
+    drpm_apply_job *job;
+
+    while (true) {
+        pthread_mutex_lock(&batch->mutex);
+        job = (batch->next < batch->count) ? &batch->jobs[batch->order[batch->next++]] : NULL;
+        pthread_mutex_unlock(&batch->mutex);
+
+        if (job == NULL)
+            break;
+
+        job->error = apply_files(job->oldrpm, job->deltarpm, job->newrpm, batch->opts, batch->db);
     }
-    free(files);
-    free_deltarpm(&delta);
-    rpm_destroy(&old_rpm);
-    free(old_rpm_nevr);
+
+    return NULL;
+}
+
+/* Sorts jobs by size in descending order. */
+int batch_job_cmp(const void *a, const void *b)
+{
+    const off_t size_a = ((const struct batch_job *)a)->size;
+    const off_t size_b = ((const struct batch_job *)b)->size;
+
+    return (size_a < size_b) - (size_a > size_b);
+}
+
+int drpm_check(const char *deltarpm_name, int check_mode)
+{
+    return drpm_check_ex(deltarpm_name, check_mode, NULL);
+}
+
+int drpm_check_ex(const char *deltarpm_name, int check_mode, const drpm_apply_options *opts)
+{
+    int error;
+    struct drpm_handle *handle;
+
+    if (deltarpm_name == NULL ||
+        (check_mode != DRPM_CHECK_FILESIZES && check_mode != DRPM_CHECK_FULL))
+        return DRPM_ERR_ARGS;
+
+    if ((error = drpm_open(&handle, deltarpm_name)) != DRPM_ERR_OK)
+        return error;
+
+    error = drpm_handle_check(handle, check_mode, opts);
+
+    drpm_close(&handle);
 
     return error;
 }
 
 int drpm_check_sequence(const char *old_rpm_name, const char *sequence, int check_mode)
+{
+    return drpm_check_sequence_ex(old_rpm_name, sequence, check_mode, NULL);
+}
+
+int drpm_check_sequence_ex(const char *old_rpm_name, const char *sequence, int check_mode,
+                           const drpm_apply_options *opts)
 {
     int error = DRPM_ERR_OK;
     char *nevr = NULL;
@@ -850,6 +1389,8 @@ int drpm_check_sequence(const char *old_rpm_name, const char *sequence, int chec
     struct file_info *files = NULL;
     size_t file_count = 0;
     unsigned short digest_algo;
+    struct prelink_cache *prelink = NULL;
+    struct verify_cache *verify = NULL;
 
     if (sequence == NULL ||
         (check_mode != DRPM_CHECK_NONE &&
@@ -883,7 +1424,7 @@ int drpm_check_sequence(const char *old_rpm_name, const char *sequence, int chec
 
     if (old_rpm_name == NULL) {
         /* reading header from database */
-        if ((error = rpm_read_header(&old_rpm, nevr, NULL)) != DRPM_ERR_OK)
+        if ((error = rpm_read_header(&old_rpm, NULL, nevr, NULL)) != DRPM_ERR_OK)
             goto cleanup;
         rpm_only = false;
     } else {
@@ -907,11 +1448,18 @@ int drpm_check_sequence(const char *old_rpm_name, const char *sequence, int chec
         /* expanding sequence, checking files */
         if ((error = rpm_get_file_info(old_rpm, &files, &file_count, NULL)) != DRPM_ERR_OK ||
             (error = rpm_get_digest_algo(old_rpm, &digest_algo)) != DRPM_ERR_OK ||
-            (error = expand_sequence(NULL, NULL, seq, seq_len, files, file_count, digest_algo, check_mode)) != DRPM_ERR_OK)
+            (error = prelink_cache_create(&prelink, (opts == NULL) ? NULL : opts->prelink_dir)) != DRPM_ERR_OK ||
+            (check_mode != DRPM_CHECK_NONE && opts != NULL && opts->verify_cache != NULL &&
+             (error = verify_cache_open(&verify, opts->verify_cache)) != DRPM_ERR_OK) ||
+            (error = expand_sequence(NULL, NULL, seq, seq_len, files, file_count, digest_algo, check_mode, prelink, verify)) != DRPM_ERR_OK)
             goto cleanup;
     }
 
 cleanup:
+    if (prelink != NULL)
+        prelink_cache_destroy(&prelink);
+    if (verify != NULL)
+        verify_cache_close(&verify); // failing to save cache is no error
 
     for (size_t i = 0; i < file_count; i++) {
         free(files[i].name);
@@ -26,6 +26,14 @@
  * @date 2014-2016
  * @copyright Copyright &copy; 2014-2016 Red Hat, Inc.
  * This project is released under the GNU Lesser Public License.
+ *
+ * @par Thread safety
+ * All functions may be called concurrently from several threads,
+ * as long as they do not share a ::drpm, ::drpm_make_options or
+ * ::drpm_apply_options object that is being modified, and do not write
+ * to the same files. Lookups in the installed package database are
+ * serialized internally, and rpmlib configuration is read only once
+ * per process.
  */
 
 #ifndef _DRPM_H_
@@ -35,6 +43,8 @@
 #include <config.h>
 #endif
 
+#include <stddef.h>
+
 /**
  * @defgroup drpmMake DRPM Make
  * Tools for creating a DeltaRPM file from two RPM files,
@@ -51,6 +61,9 @@
  * providing the same functionality as
  * [applydeltarpm(8)](http://linux.die.net/man/8/applydeltarpm).
  * @{
+ * @defgroup drpmApplyOptions DRPM Apply Options
+ * Tools for customizing RPM re-creation.
+ *
  * @defgroup drpmCheck DRPM Check
  * Tools for checking if the reconstruction is possible
  * (like <tt>applydeltarpm { -c | -C }</tt>).
@@ -58,6 +71,10 @@
  *
  * @defgroup drpmRead DRPM Read
  * Tools for extracting information from DeltaRPM files.
+ *
+ * @defgroup drpmHandle DRPM Handle
+ * Tools for reading, checking and applying a DeltaRPM file
+ * without parsing it anew for each operation.
  */
 
 /**
@@ -75,6 +92,8 @@
 #define DRPM_ERR_PROG 8         /**< internal programming error */
 #define DRPM_ERR_MISMATCH 9     /**< file changed */
 #define DRPM_ERR_NOINSTALL 10   /**< old RPM not installed */
+#define DRPM_ERR_THRESHOLD 11   /**< DeltaRPM exceeds size threshold */
+#define DRPM_ERR_NODIGEST 12    /**< no payload digest to verify against */
 /** @} */
 
 /**
@@ -107,6 +126,16 @@
  */
 #endif
 #define DRPM_COMP_LZIP 5    /**< lzip */
+/**
+ * @brief zstd
+ *
+ * Used for RPM payloads by current distributions.
+ * DeltaRPM packages compressed with zstd use the same on-disk identifier
+ * as the original deltarpm implementation.
+ *
+ * Only available if drpm was built with HAVE_ZSTD.
+ */
+#define DRPM_COMP_ZSTD 6
 /** @} */
 
 /**
@@ -162,6 +191,39 @@ typedef struct drpm drpm;
  */
 typedef struct drpm_make_options drpm_make_options;
 
+/**
+ * @brief Options for drpm_apply_ex()
+ * @ingroup drpmApplyOptions
+ */
+typedef struct drpm_apply_options drpm_apply_options;
+
+/**
+ * @brief DeltaRPM opened with drpm_open()
+ * @ingroup drpmHandle
+ */
+typedef struct drpm_handle drpm_handle;
+
+/**
+ * @brief Output callback for drpm_apply_cb()
+ * @ingroup drpmApply
+ * Receives consecutive chunks of the new RPM.
+ * A non-zero return value aborts reconstruction with #DRPM_ERR_IO.
+ * @note May be called from a thread other than the caller's,
+ * but never concurrently.
+ */
+typedef int (*drpm_write_func)(void *arg, const void *data, size_t len);
+
+/**
+ * @brief Single reconstruction for drpm_apply_batch()
+ * @ingroup drpmApply
+ */
+typedef struct drpm_apply_job {
+    const char *oldrpm;     /**< Name of old RPM file (if @c NULL, filesystem data is used). */
+    const char *deltarpm;   /**< Name of DeltaRPM file. */
+    const char *newrpm;     /**< Name of new RPM file to be (re-)created. */
+    int error;              /**< Error code of this job (set by drpm_apply_batch()). */
+} drpm_apply_job;
+
 /**
  * @ingroup drpmApply
  * @brief Applies a DeltaRPM to an old RPM or on-disk data to re-create a new RPM.
@@ -172,6 +234,74 @@ typedef struct drpm_make_options drpm_make_options;
  */
 int drpm_apply(const char *oldrpm, const char *deltarpm, const char *newrpm);
 
+/**
+ * @ingroup drpmApply
+ * @brief Same as drpm_apply(), but with options.
+ * @param [in]  oldrpm      Name of old RPM file (if @c NULL, filesystem data is used).
+ * @param [in]  deltarpm    Name of DeltaRPM file.
+ * @param [in]  newrpm      Name of new RPM file to be (re-)created.
+ * @param [in]  opts        Options (if @c NULL, defaults used).
+ * @return Error code.
+ * @note If an error occurs, @p newrpm is removed.
+ * @warning If not @c NULL, @p opts should have been initialized with
+ * drpm_apply_options_init(), otherwise behaviour is undefined.
+ */
+int drpm_apply_ex(const char *oldrpm, const char *deltarpm, const char *newrpm, const drpm_apply_options *opts);
+
+/**
+ * @ingroup drpmApply
+ * @brief Same as drpm_apply_ex(), but with file descriptors.
+ * Data is read from and written to the current file positions.
+ * Descriptors are not closed.
+ * @param [in]  oldrpm      Old RPM file descriptor (if @c -1, filesystem data is used).
+ * @param [in]  deltarpm    DeltaRPM file descriptor.
+ * @param [in]  newrpm      File descriptor to write new RPM to.
+ * @param [in]  opts        Options (if @c NULL, defaults used).
+ * @return Error code.
+ * @note All descriptors may be pipes or sockets, so a DeltaRPM
+ * can be applied while it is still being downloaded.
+ */
+int drpm_apply_fd(int oldrpm, int deltarpm, int newrpm, const drpm_apply_options *opts);
+
+/**
+ * @ingroup drpmApply
+ * @brief Same as drpm_apply_ex(), but passes the new RPM to a callback.
+ * Lets the caller hash, upload or keep the RPM in memory
+ * without writing it to a file first.
+ * @param [in]  oldrpm      Name of old RPM file (if @c NULL, filesystem data is used).
+ * @param [in]  deltarpm    Name of DeltaRPM file.
+ * @param [in]  write_func  Callback receiving the new RPM.
+ * @param [in]  write_arg   Passed to @p write_func as is.
+ * @param [in]  opts        Options (if @c NULL, defaults used).
+ * @return Error code.
+ * @note If an error occurs, data already passed to @p write_func
+ * does not form a complete RPM.
+ */
+int drpm_apply_cb(const char *oldrpm, const char *deltarpm,
+                  drpm_write_func write_func, void *write_arg,
+                  const drpm_apply_options *opts);
+
+/**
+ * @ingroup drpmApply
+ * @brief Applies several DeltaRPMs in parallel.
+ * Jobs are started in order of decreasing size of input files
+ * by a pool of at most @p threads workers (including the calling thread).
+ * Jobs reconstructing from filesystem data share one rpmdb handle.
+ * @param [in,out] jobs     Jobs to perform, each receives its own error code.
+ * @param [in]  count       Number of jobs.
+ * @param [in]  threads     Maximum number of jobs applied at once
+ * (if @c 0, number of online processors).
+ * @param [in]  mem_budget  Bytes of old RPM data cached in memory, split evenly
+ * among running jobs (if @c 0, each job uses the default).
+ * @param [in]  opts        Options applied to all jobs (if @c NULL, defaults used).
+ * @return Error code of first failed job in @p jobs,
+ * or error preventing the batch from starting.
+ * @warning If not @c NULL, @p opts should have been initialized with
+ * drpm_apply_options_init(), otherwise behaviour is undefined.
+ */
+int drpm_apply_batch(drpm_apply_job *jobs, size_t count, unsigned threads,
+                     size_t mem_budget, const drpm_apply_options *opts);
+
 /**
  * @ingroup drpmCheck
  * @brief Checks if the reconstruction is possible based on DeltaRPM file.
@@ -182,6 +312,22 @@ int drpm_apply(const char *oldrpm, const char *deltarpm, const char *newrpm);
  */
 int drpm_check(const char *deltarpm, int checkmode);
 
+/**
+ * @ingroup drpmCheck
+ * @brief Checks if the reconstruction is possible based on DeltaRPM file.
+ * Same as drpm_check(), but with options shared with drpm_apply_ex(),
+ * so that both may reuse files undone from prelink
+ * (see drpm_apply_options_set_prelink_dir()).
+ * Files verified by earlier checks may be skipped
+ * (see drpm_apply_options_set_verify_cache()).
+ * @param [in]  deltarpm    Name of DeltaRPM file.
+ * @param [in]  checkmode   Full check or filesize changes only.
+ * @param [in]  opts        Options (if @c NULL, defaults used).
+ * @return Error code.
+ * @see DRPM_CHECK_FULL, DRPM_CHECK_FILESIZES
+ */
+int drpm_check_ex(const char *deltarpm, int checkmode, const drpm_apply_options *opts);
+
 /**
  * @ingroup drpmCheck
  * @brief Checks if the reconstruction is possible based on sequence ID.
@@ -193,6 +339,21 @@ int drpm_check(const char *deltarpm, int checkmode);
  */
 int drpm_check_sequence(const char *oldrpm, const char *sequence, int checkmode);
 
+/**
+ * @ingroup drpmCheck
+ * @brief Checks if the reconstruction is possible based on sequence ID.
+ * Same as drpm_check_sequence(), but with options shared with
+ * drpm_apply_ex(), like drpm_check_ex().
+ * @param [in]  oldrpm      Name of old RPM file (if @c NULL, filesystem data is used).
+ * @param [in]  sequence    Sequence ID of the DeltaRPM.
+ * @param [in]  checkmode   Full check or filesize changes only.
+ * @param [in]  opts        Options (if @c NULL, defaults used).
+ * @return Error code.
+ * @see DRPM_CHECK_FULL, DRPM_CHECK_FILESIZES
+ */
+int drpm_check_sequence_ex(const char *oldrpm, const char *sequence, int checkmode,
+                           const drpm_apply_options *opts);
+
 /**
  * @ingroup drpmMake
  * @brief Creates a DeltaRPM from two RPMs.
@@ -267,6 +428,21 @@ int drpm_check_sequence(const char *oldrpm, const char *sequence, int checkmode)
  */
 int drpm_make(const char *oldrpm, const char *newrpm, const char *deltarpm, const drpm_make_options *opts);
 
+/**
+ * @ingroup drpmMake
+ * @brief Same as drpm_make(), but with file descriptors.
+ * Data is read from and written to the current file positions.
+ * Descriptors are not closed.
+ * @param [in]  oldrpm      Old RPM file descriptor.
+ * @param [in]  newrpm      New RPM file descriptor.
+ * @param [in]  deltarpm    File descriptor to write DeltaRPM to.
+ * @param [in]  opts        Options (if @c NULL, defaults used).
+ * @return Error code.
+ * @note If either @p oldrpm or @p newrpm is @c -1, an "identity"
+ * deltarpm is created (see drpm_make()).
+ */
+int drpm_make_fd(int oldrpm, int newrpm, int deltarpm, const drpm_make_options *opts);
+
 /**
  * @addtogroup drpmMakeOptions
  * @{
@@ -342,15 +518,34 @@ int drpm_make_options_set_version(drpm_make_options *opts, unsigned short versio
  * By default, the compression method is the same as used in the new RPM.
  * @param [out] opts    Structure specifying options for drpm_make().
  * @param [in]  comp    Compression type.
- * @param [in]  level   Compression level (1-9 or default).
+ * @param [in]  level   Compression level (1-9 or default, 1-22 for zstd).
  * @return Error code.
  * @see drpm_make()
  * @see DRPM_COMP_NONE, DRPM_COMP_GZIP, DRPM_COMP_BZIP2,
- * DRPM_COMP_LZMA, DRPM_COMP_XZ
+ * DRPM_COMP_LZMA, DRPM_COMP_XZ, DRPM_COMP_ZSTD
  * @see DRPM_COMP_LEVEL_DEFAULT
  */
 int drpm_make_options_set_delta_comp(drpm_make_options *opts, unsigned short comp, unsigned short level);
 
+/**
+ * @brief Sets number of threads used to compress the DeltaRPM.
+ * With more than one thread, xz-compressed DeltaRPMs are written in
+ * independently compressed blocks, which also lets drpm_read(),
+ * drpm_apply() and other readers decompress them in parallel.
+ * The result is a valid xz stream, but not byte-identical to
+ * single-threaded output (as produced by the original deltarpm) and
+ * slightly larger.
+ * Other compression types are not affected. The target RPM payload is
+ * always recompressed exactly, regardless of this option.
+ * The default is @c 1.
+ * @param [out] opts    Structure specifying options for drpm_make().
+ * @param [in]  threads Number of threads, @c 0 for number of CPUs.
+ * @return Error code.
+ * @see drpm_make()
+ * @see DRPM_COMP_XZ
+ */
+int drpm_make_options_set_delta_comp_threads(drpm_make_options *opts, unsigned short threads);
+
 /**
  * @brief DeltaRPM compression method is the same as used in the new RPM.
  * May be used to reset DeltaRPM compression option after previously
@@ -380,11 +575,11 @@ int drpm_make_options_forbid_addblk(drpm_make_options *opts);
  * results.
  * @param [out] opts    Structure specifying options for drpm_make().
  * @param [in]  comp    Compression type.
- * @param [in]  level   Compression level (1-9 or default).
+ * @param [in]  level   Compression level (1-9 or default, 1-22 for zstd).
  * @return Error code.
  * @see drpm_make()
  * @see DRPM_COMP_NONE, DRPM_COMP_GZIP, DRPM_COMP_BZIP2,
- * DRPM_COMP_LZMA, DRPM_COMP_XZ
+ * DRPM_COMP_LZMA, DRPM_COMP_XZ, DRPM_COMP_ZSTD
  * @see DRPM_COMP_LEVEL_DEFAULT
  */
 int drpm_make_options_set_addblk_comp(drpm_make_options *opts, unsigned short comp, unsigned short level);
@@ -414,6 +609,25 @@ int drpm_make_options_set_seqfile(drpm_make_options *opts, const char *seqfile);
  */
 int drpm_make_options_add_patches(drpm_make_options *opts, const char *oldrpmprint, const char *oldpatchrpm);
 
+/**
+ * @brief Sets maximum size of the DeltaRPM relative to the target RPM.
+ * DeltaRPMs that are not substantially smaller than the target RPM are
+ * usually not worth distributing. If a non-zero @p percent is given,
+ * drpm_make() estimates the compressed size of the diff data (including
+ * the add block) as it is being created and gives up as soon as the
+ * DeltaRPM would clearly be larger than @p percent percent of the target
+ * RPM, or if it would be once the diff is complete, returning
+ * #DRPM_ERR_THRESHOLD without writing the DeltaRPM.
+ * The default is @c 0 (no limit).
+ * @param [out] opts    Structure specifying options for drpm_make().
+ * @param [in]  percent Size threshold in percent of target RPM size (0-100).
+ * @return Error code.
+ * @note The estimate is conservative, so DeltaRPMs slightly larger
+ * than the threshold may still be created.
+ * @see drpm_make()
+ */
+int drpm_make_options_set_size_ratio(drpm_make_options *opts, unsigned short percent);
+
 /**
  * @brief Limits memory usage.
  * As drpm_make() normally needs about three to four times the size of
@@ -429,6 +643,141 @@ int drpm_make_options_add_patches(drpm_make_options *opts, const char *oldrpmpri
 
 /** @} */
 
+/**
+ * @addtogroup drpmApplyOptions
+ * @{
+ */
+
+/**
+ * @brief Initializes ::drpm_apply_options with default options.
+ * Passing @p *opts to drpm_apply_ex() immediately after would have the same
+ * effect as passing @c NULL instead.
+ * @param [out] opts    Address of options structure pointer.
+ * @return Error code.
+ * @see drpm_apply_ex()
+ */
+int drpm_apply_options_init(drpm_apply_options **opts);
+
+/**
+ * @brief Frees ::drpm_apply_options.
+ * @param [out] opts    Address of options structure pointer.
+ * @return Error code.
+ * @see drpm_apply_ex()
+ */
+int drpm_apply_options_destroy(drpm_apply_options **opts);
+
+/**
+ * @brief Resets options to default values.
+ * Passing @p opts to drpm_apply_ex() immediately after would have the same
+ * effect as passing @c NULL instead.
+ * @param [out] opts    Structure specifying options for drpm_apply_ex().
+ * @return Error code.
+ * @see drpm_apply_ex()
+ */
+int drpm_apply_options_defaults(drpm_apply_options *opts);
+
+/**
+ * @brief Writes the payload of the new RPM uncompressed.
+ * Useful when the new RPM is to be installed right away, as the payload
+ * need not be recompressed. The lead, signature and header are written
+ * unchanged, so the header still describes the compressed payload and
+ * the resulting file is only usable by tools that read the payload
+ * themselves.
+ *
+ * The MD5 of the new RPM cannot be verified in this case. Instead, the
+ * payload is checked against the digest of the uncompressed payload
+ * in the header of the new RPM (@c RPMTAG_PAYLOADDIGESTALT).
+ * If there is no such digest, drpm_apply_ex() fails with
+ * #DRPM_ERR_NODIGEST, if the payload does not match it, with
+ * #DRPM_ERR_MISMATCH. Either way, the new RPM file is removed.
+ * @param [out] opts    Structure specifying options for drpm_apply_ex().
+ * @return Error code.
+ * @note Has no effect if the new RPM has an uncompressed payload anyway.
+ * @see drpm_apply_ex()
+ */
+int drpm_apply_options_uncompressed_payload(drpm_apply_options *opts);
+
+/**
+ * @brief Sets how much old RPM data may be cached in memory.
+ * Data needed again later is kept in memory up to @p bytes and written
+ * to a temporary file beyond that (see drpm_apply_options_set_spill_dir()).
+ * A budget larger than the old RPM's payload avoids the temporary file
+ * altogether, e.g. @c SIZE_MAX.
+ * The default (@c 0) is 40 MB.
+ * An old RPM file whose payload fits within the budget has it decompressed
+ * into memory and read in place, larger payloads are decompressed as needed.
+ * @param [out] opts    Structure specifying options for drpm_apply_ex().
+ * @param [in]  bytes   Cache size in bytes.
+ * @return Error code.
+ * @see drpm_apply_ex()
+ */
+int drpm_apply_options_set_cache_size(drpm_apply_options *opts, size_t bytes);
+
+/**
+ * @brief Limits number of installed files open at once.
+ * Only used when re-creating from filesystem data.
+ * The default (@c 0) is 50.
+ * @param [out] opts    Structure specifying options for drpm_apply_ex().
+ * @param [in]  count   Maximum number of open files.
+ * @return Error code.
+ * @see drpm_apply_ex()
+ */
+int drpm_apply_options_set_open_files(drpm_apply_options *opts, unsigned short count);
+
+/**
+ * @brief Sets directory for the temporary file of data exceeding the cache.
+ * The file is unlinked right after being created.
+ * @param [out] opts    Structure specifying options for drpm_apply_ex().
+ * @param [in]  dir     Directory name (if @c NULL, @c /tmp is used).
+ * @return Error code.
+ * @see drpm_apply_options_set_cache_size()
+ */
+int drpm_apply_options_set_spill_dir(drpm_apply_options *opts, const char *dir);
+
+/**
+ * @brief Sets size of writes to the temporary file.
+ * Data is gathered in memory and written out @p bytes at a time,
+ * rounded down to a multiple of 8 KB.
+ * The default (@c 0) writes each 8 KB block separately.
+ * @param [out] opts    Structure specifying options for drpm_apply_ex().
+ * @param [in]  bytes   Write size in bytes.
+ * @return Error code.
+ * @see drpm_apply_options_set_spill_dir()
+ */
+int drpm_apply_options_set_spill_extent(drpm_apply_options *opts, size_t bytes);
+
+/**
+ * @brief Sets directory in which files undone from prelink are kept.
+ * Installed files modified by prelink are undone with @c prelink @c -u
+ * only once per operation. With a directory, the original contents are
+ * also kept across operations (including drpm_check_ex() and
+ * drpm_check_sequence_ex()), named after
+ * device, inode, modification time and size of the prelinked file.
+ * The directory is not cleaned up by the library.
+ * @param [out] opts    Structure specifying options for drpm_apply_ex().
+ * @param [in]  dir     Directory name (if @c NULL, nothing is kept).
+ * @return Error code.
+ * @see drpm_apply_ex(), drpm_check_ex(), drpm_check_sequence_ex()
+ */
+int drpm_apply_options_set_prelink_dir(drpm_apply_options *opts, const char *dir);
+
+/**
+ * @brief Sets file caching digests of installed files verified by drpm_check_ex()
+ * and drpm_check_sequence_ex().
+ * A file is not read again while its device, inode, size,
+ * modification time and change time match those recorded when it was
+ * last verified. Newly verified files are added to the cache file
+ * once the check is finished.
+ * The file is created if it does not exist and rebuilt if it is invalid.
+ * @param [out] opts    Structure specifying options for drpm_apply_ex().
+ * @param [in]  path    Cache file name (if @c NULL, no cache is used).
+ * @return Error code.
+ * @see drpm_check_ex(), drpm_check_sequence_ex()
+ */
+int drpm_apply_options_set_verify_cache(drpm_apply_options *opts, const char *path);
+
+/** @} */
+
 /**
  * @addtogroup drpmRead
  * @{
@@ -643,6 +992,86 @@ int drpm_destroy(drpm **delta);
 
 /** @} */
 
+/**
+ * @addtogroup drpmHandle
+ * @{
+ */
+
+/**
+ * @brief Opens a DeltaRPM for several operations.
+ * The DeltaRPM is parsed once, except for internal data, which is
+ * only decompressed when applying. The header and file list of the
+ * installed package and the file order expanded from the sequence
+ * are kept after first use, so that e.g. drpm_handle_check() followed
+ * by drpm_handle_apply() reads them only once.
+ * Example of usage:
+ * @code
+ * drpm_handle *handle;
+ *
+ * int error = drpm_open(&handle, "foo.drpm");
+ *
+ * if (error == DRPM_ERR_OK) {
+ *    if ((error = drpm_handle_check(handle, DRPM_CHECK_FULL, NULL)) == DRPM_ERR_OK)
+ *       error = drpm_handle_apply(handle, NULL, "foo.rpm", NULL);
+ *    drpm_close(&handle);
+ * }
+ * @endcode
+ * @param [out] handle      Handle of the DeltaRPM.
+ * @param [in]  filename    Name of DeltaRPM file.
+ * @return Error code.
+ * @note A handle must not be used by several threads at once.
+ * @see drpm_close()
+ */
+int drpm_open(drpm_handle **handle, const char *filename);
+
+/**
+ * @brief Closes a DeltaRPM opened with drpm_open().
+ * Frees all data kept with the handle, including the information
+ * returned by drpm_handle_info().
+ * @param [out] handle  Handle to be closed.
+ * @return Error code.
+ */
+int drpm_close(drpm_handle **handle);
+
+/**
+ * @brief Fetches information about an opened DeltaRPM.
+ * Same as drpm_read(), but without reading the file again.
+ * The information may be queried with drpm_get_uint() etc.
+ * @param [in]  handle  Handle of the DeltaRPM.
+ * @param [out] info    Information about the DeltaRPM (owned by @p handle,
+ *                      not to be freed with drpm_destroy()).
+ * @return Error code.
+ */
+int drpm_handle_info(drpm_handle *handle, drpm **info);
+
+/**
+ * @brief Checks if the reconstruction is possible.
+ * Same as drpm_check_ex(), but with an opened DeltaRPM.
+ * @param [in]  handle      Handle of the DeltaRPM.
+ * @param [in]  checkmode   Full check or filesize changes only.
+ * @param [in]  opts        Options (if @c NULL, defaults used).
+ * @return Error code.
+ * @see DRPM_CHECK_FULL, DRPM_CHECK_FILESIZES
+ */
+int drpm_handle_check(drpm_handle *handle, int checkmode, const drpm_apply_options *opts);
+
+/**
+ * @brief Applies an opened DeltaRPM to re-create a new RPM.
+ * Same as drpm_apply_ex(), but with an opened DeltaRPM.
+ * @param [in]  handle      Handle of the DeltaRPM.
+ * @param [in]  oldrpm      Name of old RPM file (if @c NULL, filesystem data is used).
+ * @param [in]  newrpm      Name of new RPM file to be (re-)created.
+ * @param [in]  opts        Options (if @c NULL, defaults used).
+ * @return Error code.
+ * @note Internal data is decompressed during reconstruction, so applying
+ * the same handle again reads the DeltaRPM file anew.
+ * @note If an error occurs, @p newrpm is removed.
+ */
+int drpm_handle_apply(drpm_handle *handle, const char *oldrpm, const char *newrpm,
+                      const drpm_apply_options *opts);
+
+/** @} */
+
 /**
  * @brief Returns description of error code as a string.
  * Works very similarly to
@@ -25,31 +25,120 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <openssl/evp.h>
 #include <openssl/md5.h>
 #include <openssl/sha.h>
 
 #define BUFFER_SIZE 4096
 
-struct checksum {
+/* full checks read files in large chunks, with several files at once */
+#define CHECK_BUFFER_SIZE (1 << 18)
+#define CHECK_THREADS_MAX 16
+
+#define PRELINK_TMP_DIR "/tmp"
+
+#define VERIFY_CACHE_MAGIC "drpmvc\0\1"
+#define VERIFY_CACHE_MAGIC_LEN 8
+#define VERIFY_ENTRY_SIZE (7 * 8 + 4 + SHA256_DIGEST_LENGTH)
+
+/* Files undone from prelink, so that each installed file is only passed
+ * to prelink once. Images are kept in <dir> (and across operations) if
+ * given, otherwise they are temporary files removed with the cache. */
+struct prelink_cache {
+    char *dir;
+    struct prelink_image *images;
+    size_t images_len;
+    pthread_mutex_t mutex;
+    pthread_cond_t undone; // signalled when an undo in progress ends
+};
+
+/* Digests of installed files verified by earlier checks, kept in <path>.
+ * Entries read from the file are sorted by device and inode and are
+ * only looked up, while newly verified files are added separately. */
+struct verify_cache {
+    char *path;
+    struct verify_entry *entries;
+    size_t entries_len;
+    struct verify_entry *added;
+    size_t added_len;
+    size_t added_max;
+    pthread_mutex_t mutex;
+};
+
+/* Metadata and digest of verified file (stored in big-endian in cache file). */
+struct verify_entry {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    uint64_t mtime_sec;
+    uint64_t mtime_nsec;
+    uint64_t ctime_sec;
+    uint64_t ctime_nsec;
+    uint32_t digest_algo;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    bool added; // not stored
+};
+
+/* A file to be checked. */
+struct check_job {
+    const char *filename;
+    unsigned char digest[MAX(MD5_DIGEST_LENGTH, SHA256_DIGEST_LENGTH)];
+    size_t filesize;
+    int error;
+};
+
+/* Files checked by a pool of threads. */
+struct check_pool {
+    struct check_job *jobs;
+    size_t count;
+    size_t next;
+    size_t failed; // first failed job (<count> if none)
+    pthread_mutex_t mutex;
+    int (*check)(const struct check_pool *, const char *, unsigned short, const unsigned char *, size_t);
     unsigned short digest_algo;
-    union {
-        MD5_CTX md5;
-        SHA256_CTX sha256;
-    } ctx;
+    struct prelink_cache *prelink;
+    struct verify_cache *verify;
+};
+
+/* installed file and its undone image */
+struct prelink_image {
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    off_t size;
+    char *path; // NULL while being undone
 };
 
-static int check_filesize(const char *, unsigned short, const unsigned char *, size_t);
-static int check_full(const char *, unsigned short, const unsigned char *, size_t);
-static int check_prelink(const char *, unsigned short, const unsigned char *, size_t);
-static size_t checksum_digest_len(struct checksum);
-static int checksum_final(struct checksum *, unsigned char *);
-static int checksum_init(struct checksum *, unsigned short);
-static int checksum_update(struct checksum *, const void *, size_t);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static pthread_once_t checksum_md_once = PTHREAD_ONCE_INIT;
+static EVP_MD *checksum_md_md5 = NULL;
+static EVP_MD *checksum_md_sha256 = NULL;
+#endif
+
+static int check_filesize(const struct check_pool *, const char *, unsigned short, const unsigned char *, size_t);
+static int check_full(const struct check_pool *, const char *, unsigned short, const unsigned char *, size_t);
+static int check_prelink(const struct check_pool *, const char *, unsigned short, const unsigned char *, size_t);
+static int check_files(struct check_pool *);
+static void *check_worker(void *);
+static int prelink_undo(const char *, const char *);
+static struct prelink_image *prelink_image_find(struct prelink_cache *, const struct prelink_image *);
+static void verify_entry_create(struct verify_entry *, const struct stat *,
+                                unsigned short, const unsigned char *);
+static int verify_entry_cmp(const void *, const void *);
+static int verify_entry_inode_cmp(const void *, const void *);
+static const EVP_MD *checksum_md(unsigned short);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static void checksum_md_fetch(void);
+static void checksum_md_free(void);
+#endif
+static int payload_check_start(struct payload_check *, struct rpm *);
 static uint16_t elf16(const unsigned char *, bool);
 static uint32_t elf32(const unsigned char *, bool);
 static uint64_t elf64(const unsigned char *, bool, bool);
@@ -61,14 +150,15 @@ static uint64_t elf64(const unsigned char *, bool, bool);
 int expand_sequence(struct cpio_file **seqfiles_ret, size_t *seqfiles_len_ret,
                     const unsigned char *sequence, uint32_t sequence_len,
                     const struct file_info *files, size_t file_count,
-                    unsigned short digest_algo, int check_mode)
+                    unsigned short digest_algo, int check_mode,
+                    struct prelink_cache *prelink, struct verify_cache *verify)
 {
     int error = DRPM_ERR_OK;
     const bool want_seq = (seqfiles_ret != NULL && seqfiles_len_ret != NULL);
     struct cpio_file *seqfiles = NULL;
     size_t *positions;
     size_t positions_len = 0;
-    MD5_CTX seq_md5;
+    struct checksum seq_md5 = {0};
     unsigned char seq_md5_digest[MD5_DIGEST_LENGTH];
     unsigned char digest[MAX(MD5_DIGEST_LENGTH, SHA256_DIGEST_LENGTH)];
     bool even = true;
@@ -84,7 +174,9 @@ int expand_sequence(struct cpio_file **seqfiles_ret, size_t *seqfiles_len_ret,
     char *filename;
     size_t header_len;
     size_t off = 0;
-    int (*check)(const char *, unsigned short, const unsigned char *, size_t);
+    int (*check)(const struct check_pool *, const char *, unsigned short, const unsigned char *, size_t);
+    struct check_pool pool = {0};
+    int check_error;
 
     if (sequence == NULL || sequence_len < MD5_DIGEST_LENGTH || files == NULL)
         return DRPM_ERR_PROG;
@@ -160,18 +252,21 @@ int expand_sequence(struct cpio_file **seqfiles_ret, size_t *seqfiles_len_ret,
         goto cleanup_fail;
     }
 
-    if (want_seq && (seqfiles = malloc((positions_len + 1) * sizeof(struct cpio_file))) == NULL) {
+    if ((want_seq && (seqfiles = malloc((positions_len + 1) * sizeof(struct cpio_file))) == NULL) ||
+        (check != NULL && (pool.jobs = malloc(MAX(positions_len, 1) * sizeof(struct check_job))) == NULL)) {
         error = DRPM_ERR_MEMORY;
         goto cleanup_fail;
     }
+    pool.check = check;
+    pool.digest_algo = digest_algo;
+    pool.prelink = prelink;
+    pool.verify = verify;
 
-    if (MD5_Init(&seq_md5) != 1) {
-        error = DRPM_ERR_OTHER;
+    if ((error = checksum_init(&seq_md5, DIGESTALGO_MD5)) != DRPM_ERR_OK)
         goto cleanup_fail;
-    }
 
-    /* constructing an MD5 to match against the DeltaRPM sequence
-     * checking that files have not changed,
+    /* constructing an MD5 to match against the DeltaRPM sequence,
+     * listing files to check that they have not changed,
      * and constructing an index of CPIO entries. */
     for (size_t i, pos = 0; pos < positions_len; pos++) {
         i = positions[pos];
@@ -192,19 +287,15 @@ int expand_sequence(struct cpio_file **seqfiles_ret, size_t *seqfiles_len_ret,
         if (filename[0] == '/')
             filename++;
 
-        if (MD5_Update(&seq_md5, filename, strlen(filename) + 1) != 1 ||
-            md5_update_be32(&seq_md5, files[i].mode) != 1 ||
-            md5_update_be32(&seq_md5, filesize) != 1 ||
-            md5_update_be32(&seq_md5, rdev) != 1) {
-            error = DRPM_ERR_OTHER;
+        if ((error = checksum_update(&seq_md5, filename, strlen(filename) + 1)) != DRPM_ERR_OK ||
+            (error = checksum_update_be32(&seq_md5, files[i].mode)) != DRPM_ERR_OK ||
+            (error = checksum_update_be32(&seq_md5, filesize)) != DRPM_ERR_OK ||
+            (error = checksum_update_be32(&seq_md5, rdev)) != DRPM_ERR_OK)
             goto cleanup_fail;
-        }
 
         if (S_ISLNK(files[i].mode)) {
-            if (MD5_Update(&seq_md5, files[i].linkto, strlen(files[i].linkto) + 1) != 1) {
-                error = DRPM_ERR_OTHER;
+            if ((error = checksum_update(&seq_md5, files[i].linkto, strlen(files[i].linkto) + 1)) != DRPM_ERR_OK)
                 goto cleanup_fail;
-            }
         } else if (S_ISREG(files[i].mode) && filesize > 0) {
             switch (digest_algo) {
             case DIGESTALGO_MD5:
@@ -212,24 +303,24 @@ int expand_sequence(struct cpio_file **seqfiles_ret, size_t *seqfiles_len_ret,
                     error = DRPM_ERR_FORMAT;
                     goto cleanup_fail;
                 }
-                if (MD5_Update(&seq_md5, digest, MD5_DIGEST_LENGTH) != 1) {
-                    error = DRPM_ERR_OTHER;
+                if ((error = checksum_update(&seq_md5, digest, MD5_DIGEST_LENGTH)) != DRPM_ERR_OK)
                     goto cleanup_fail;
-                }
                 break;
             case DIGESTALGO_SHA256:
                 if (!parse_sha256(digest, files[i].md5)) {
                     error = DRPM_ERR_FORMAT;
                     goto cleanup_fail;
                 }
-                if (MD5_Update(&seq_md5, digest, SHA256_DIGEST_LENGTH) != 1) {
-                    error = DRPM_ERR_OTHER;
+                if ((error = checksum_update(&seq_md5, digest, SHA256_DIGEST_LENGTH)) != DRPM_ERR_OK)
                     goto cleanup_fail;
-                }
                 break;
             }
-            if (check != NULL && (error = check(files[i].name, digest_algo, digest, filesize)) != DRPM_ERR_OK)
-                goto cleanup;
+            if (check != NULL) {
+                pool.jobs[pool.count].filename = files[i].name;
+                memcpy(pool.jobs[pool.count].digest, digest, sizeof(digest));
+                pool.jobs[pool.count].filesize = filesize;
+                pool.count++;
+            }
         }
 
         if (want_seq) {
@@ -245,11 +336,17 @@ int expand_sequence(struct cpio_file **seqfiles_ret, size_t *seqfiles_len_ret,
         }
     }
 
-    if (MD5_Final(seq_md5_digest, &seq_md5) != 1) {
-        error = DRPM_ERR_OTHER;
-        goto cleanup_fail;
+    /* checking files (failed check is reported before other errors) */
+    if (pool.count > 0) {
+        error = check_files(&pool);
+        pool.count = 0;
+        if (error != DRPM_ERR_OK)
+            goto cleanup_fail;
     }
 
+    if ((error = checksum_final(&seq_md5, seq_md5_digest)) != DRPM_ERR_OK)
+        goto cleanup_fail;
+
     if (memcmp(sequence, seq_md5_digest, MD5_DIGEST_LENGTH) != 0) {
         error = DRPM_ERR_MISMATCH;
         goto cleanup_fail;
@@ -272,41 +369,176 @@ int expand_sequence(struct cpio_file **seqfiles_ret, size_t *seqfiles_len_ret,
     goto cleanup;
 
 cleanup_fail:
+    /* files listed before the error would have been checked first */
+    if (pool.count > 0 && (check_error = check_files(&pool)) != DRPM_ERR_OK)
+        error = check_error;
     free(seqfiles);
 
 cleanup:
+    checksum_free(&seq_md5);
     free(positions);
+    free(pool.jobs);
+
+    return error;
+}
+
+/* Performs checks on the individual files listed in <seqfiles>,
+ * an index created by expand_sequence() from <files>. */
+int check_seqfiles(const struct cpio_file *seqfiles, size_t seqfiles_len,
+                   const struct file_info *files, unsigned short digest_algo,
+                   int check_mode, struct prelink_cache *prelink, struct verify_cache *verify)
+{
+    int error = DRPM_ERR_OK;
+    const struct file_info *file;
+    struct check_job *job;
+    struct check_pool pool = {0};
+
+    if (seqfiles == NULL || files == NULL)
+        return DRPM_ERR_PROG;
+
+    switch (check_mode) {
+    case DRPM_CHECK_FULL:
+        pool.check = check_full;
+        break;
+    case DRPM_CHECK_FILESIZES:
+        pool.check = check_filesize;
+        break;
+    default:
+        return DRPM_ERR_PROG;
+    }
+
+    if ((pool.jobs = malloc(MAX(seqfiles_len, 1) * sizeof(struct check_job))) == NULL)
+        return DRPM_ERR_MEMORY;
+    pool.digest_algo = digest_algo;
+    pool.prelink = prelink;
+    pool.verify = verify;
+
+    for (size_t i = 0; i < seqfiles_len; i++) {
+        if (seqfiles[i].index < 0)
+            continue;
+
+        file = &files[seqfiles[i].index];
+        if (!S_ISREG(file->mode) || file->size == 0)
+            continue;
+
+        job = &pool.jobs[pool.count++];
+        if (!((digest_algo == DIGESTALGO_SHA256) ?
+              parse_sha256(job->digest, file->md5) : parse_md5(job->digest, file->md5))) {
+            error = DRPM_ERR_FORMAT;
+            goto cleanup;
+        }
+        job->filename = file->name;
+        job->filesize = file->size;
+    }
+
+    if (pool.count > 0)
+        error = check_files(&pool);
+
+cleanup:
+    free(pool.jobs);
 
     return error;
 }
 
 /******************************* check ********************************/
 
-int check_filesize(const char *filename, unsigned short digest_algo,
-                   const unsigned char *digest, size_t filesize)
+/* Checks files in <pool> using as many threads as there are processors.
+ * Returns error of the first failed file in order, so that the result
+ * is the same as when checking one file after another. */
+int check_files(struct check_pool *pool)
+{
+    pthread_t threads[CHECK_THREADS_MAX];
+    size_t started = 0;
+    size_t thread_count;
+    long cpus;
+
+    if ((cpus = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+        cpus = 1;
+    thread_count = MIN(MIN((size_t)cpus, CHECK_THREADS_MAX), pool->count);
+
+    pool->next = 0;
+    pool->failed = pool->count;
+
+    if (pthread_mutex_init(&pool->mutex, NULL) != 0)
+        return DRPM_ERR_OTHER;
+
+    /* calling thread checks files too */
+    for (size_t i = 1; i < thread_count; i++)
+        if (pthread_create(&threads[started], NULL, check_worker, pool) == 0)
+            started++;
+
+    check_worker(pool);
+
+    for (size_t i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&pool->mutex);
+
+    return (pool->failed < pool->count) ? pool->jobs[pool->failed].error : DRPM_ERR_OK;
+}
+
+void *check_worker(void *arg)
+{
+    struct check_pool *pool = arg;
+    struct check_job *job;
+    size_t index;
+    bool done;
+
+    while (true) {
+        /* files after a failed one need not be checked */
+        pthread_mutex_lock(&pool->mutex);
+        index = pool->next++;
+        done = (index >= pool->failed);
+        pthread_mutex_unlock(&pool->mutex);
+
+        if (done)
+            break;
+
+        job = &pool->jobs[index];
+        job->error = pool->check(pool, job->filename, pool->digest_algo,
+                                 job->digest, job->filesize);
+
+        if (job->error != DRPM_ERR_OK) {
+            pthread_mutex_lock(&pool->mutex);
+            if (index < pool->failed)
+                pool->failed = index;
+            pthread_mutex_unlock(&pool->mutex);
+        }
+    }
+
+    return NULL;
+}
+
+int check_filesize(const struct check_pool *pool, const char *filename,
+                   unsigned short digest_algo, const unsigned char *digest, size_t filesize)
 {
     int error;
     int filedesc;
     unsigned char buf[128];
     ssize_t read_len;
     struct stat stats;
-    bool prelink;
+    bool prelinked;
 
     if (stat(filename, &stats) != 0)
         return DRPM_ERR_NOINSTALL;
 
-    if (stats.st_size == (off_t)filesize)
+    if (stats.st_size == (off_t)filesize ||
+        verify_cache_lookup(pool->verify, &stats, digest_algo, digest))
         return DRPM_ERR_OK;
 
     if (stats.st_size > (off_t)filesize) {
         if ((filedesc = open(filename, O_RDONLY)) < 0)
             return DRPM_ERR_IO;
         if ((read_len = read(filedesc, buf, 128)) > 0) {
-            if ((error = is_prelinked(&prelink, filedesc, buf, read_len)) != DRPM_ERR_OK)
+            if ((error = is_prelinked(&prelinked, filedesc, buf, read_len)) != DRPM_ERR_OK) {
+                close(filedesc);
                 return error;
-            if (prelink) {
+            }
+            if (prelinked) {
                 close(filedesc);
-                return check_prelink(filename, digest_algo, digest, filesize);
+                if ((error = check_prelink(pool, filename, digest_algo, digest, filesize)) == DRPM_ERR_OK)
+                    verify_cache_add(pool->verify, &stats, digest_algo, digest);
+                return error;
             }
         }
         if (read_len < 0) {
@@ -319,36 +551,48 @@ int check_filesize(const char *filename, unsigned short digest_algo,
     return DRPM_ERR_MISMATCH;
 }
 
-int check_full(const char *filename, unsigned short digest_algo,
-               const unsigned char *digest, size_t filesize)
+int check_full(const struct check_pool *pool, const char *filename,
+               unsigned short digest_algo, const unsigned char *digest, size_t filesize)
 {
     int error = DRPM_ERR_OK;
     int filedesc;
-    unsigned char buf[BUFFER_SIZE];
-    struct checksum chsm;
+    unsigned char *buf;
+    struct checksum chsm = {0};
     unsigned char chsm_digest[MAX(MD5_DIGEST_LENGTH, SHA256_DIGEST_LENGTH)];
     ssize_t read_len;
     struct stat stats;
-    bool prelink;
+    bool prelinked;
+
+    if ((buf = malloc(CHECK_BUFFER_SIZE)) == NULL)
+        return DRPM_ERR_MEMORY;
 
-    if ((filedesc = open(filename, O_RDONLY)) < 0)
+    if ((filedesc = open(filename, O_RDONLY)) < 0) {
+        free(buf);
         return DRPM_ERR_IO;
+    }
+
+    posix_fadvise(filedesc, 0, 0, POSIX_FADV_SEQUENTIAL);
 
     if (fstat(filedesc, &stats) != 0) {
         error = DRPM_ERR_NOINSTALL;
         goto cleanup;
     }
 
+    /* unchanged since last verified */
+    if (verify_cache_lookup(pool->verify, &stats, digest_algo, digest))
+        goto cleanup;
+
     if ((error = checksum_init(&chsm, digest_algo)) != DRPM_ERR_OK)
         goto cleanup;
 
     if (stats.st_size > (off_t)filesize) {
-        if ((read_len = read(filedesc, buf, BUFFER_SIZE)) > 0) {
-            if ((error = is_prelinked(&prelink, filedesc, buf, read_len)) != DRPM_ERR_OK)
-                return error;
-            if (prelink) {
-                close(filedesc);
-                return check_prelink(filename, digest_algo, digest, filesize);
+        if ((read_len = read(filedesc, buf, CHECK_BUFFER_SIZE)) > 0) {
+            if ((error = is_prelinked(&prelinked, filedesc, buf, read_len)) != DRPM_ERR_OK)
+                goto cleanup;
+            if (prelinked) {
+                if ((error = check_prelink(pool, filename, digest_algo, digest, filesize)) == DRPM_ERR_OK)
+                    verify_cache_add(pool->verify, &stats, digest_algo, digest);
+                goto cleanup;
             }
             if (read_len > (ssize_t)filesize)
                 read_len = filesize;
@@ -358,7 +602,7 @@ int check_full(const char *filename, unsigned short digest_algo,
         }
     }
 
-    while (filesize > 0 && (read_len = read(filedesc, buf, BUFFER_SIZE)) > 0) {
+    while (filesize > 0 && (read_len = read(filedesc, buf, CHECK_BUFFER_SIZE)) > 0) {
         if ((size_t)read_len > filesize)
             read_len = filesize;
         if ((error = checksum_update(&chsm, buf, read_len)) != DRPM_ERR_OK)
@@ -374,23 +618,27 @@ int check_full(const char *filename, unsigned short digest_algo,
         goto cleanup;
     }
 
+    verify_cache_add(pool->verify, &stats, digest_algo, digest);
+
 cleanup:
+    checksum_free(&chsm);
     close(filedesc);
+    free(buf);
 
     return error;
 }
 
-int check_prelink(const char *filename, unsigned short digest_algo,
-                    const unsigned char *digest, size_t filesize)
+int check_prelink(const struct check_pool *pool, const char *filename,
+                  unsigned short digest_algo, const unsigned char *digest, size_t filesize)
 {
     int error = DRPM_ERR_OK;
     int filedesc;
     unsigned char buf[BUFFER_SIZE];
-    struct checksum chsm;
+    struct checksum chsm = {0};
     unsigned char chsm_digest[MAX(MD5_DIGEST_LENGTH, SHA256_DIGEST_LENGTH)];
     ssize_t read_len;
 
-    if ((error = prelink_open(filename, &filedesc)) != DRPM_ERR_OK)
+    if ((error = prelink_open(pool->prelink, filename, &filedesc)) != DRPM_ERR_OK)
         return error;
 
     if ((error = checksum_init(&chsm, digest_algo)) != DRPM_ERR_OK)
@@ -418,29 +666,319 @@ int check_prelink(const char *filename, unsigned short digest_algo,
     }
 
 cleanup:
+    checksum_free(&chsm);
     close(filedesc);
 
     return error;
 }
 
-/***************************** MD5/SHA256 *****************************/
+/************************* verification cache *************************/
 
-int checksum_init(struct checksum *chsm, unsigned short digest_algo)
+/* Opens cache of verified files at <path>. A missing or unreadable cache
+ * file is treated as empty, as entries can always be verified again. */
+int verify_cache_open(struct verify_cache **verify, const char *path)
 {
-    if (chsm == NULL)
+    int filedesc;
+    struct stat stats;
+    unsigned char *data = NULL;
+    const unsigned char *rec;
+    size_t count = 0;
+
+    if (verify == NULL || path == NULL)
+        return DRPM_ERR_PROG;
+
+    if ((*verify = calloc(1, sizeof(struct verify_cache))) == NULL ||
+        ((*verify)->path = malloc(strlen(path) + 1)) == NULL) {
+        free(*verify);
+        *verify = NULL;
+        return DRPM_ERR_MEMORY;
+    }
+    strcpy((*verify)->path, path);
+
+    if (pthread_mutex_init(&(*verify)->mutex, NULL) != 0) {
+        free((*verify)->path);
+        free(*verify);
+        *verify = NULL;
+        return DRPM_ERR_OTHER;
+    }
+
+    if ((filedesc = open(path, O_RDONLY)) < 0)
+        return DRPM_ERR_OK;
+
+    if (fstat(filedesc, &stats) == 0 && stats.st_size >= VERIFY_CACHE_MAGIC_LEN &&
+        (stats.st_size - VERIFY_CACHE_MAGIC_LEN) % VERIFY_ENTRY_SIZE == 0 &&
+        (data = malloc(stats.st_size)) != NULL &&
+        read(filedesc, data, stats.st_size) == stats.st_size &&
+        memcmp(data, VERIFY_CACHE_MAGIC, VERIFY_CACHE_MAGIC_LEN) == 0)
+        count = (stats.st_size - VERIFY_CACHE_MAGIC_LEN) / VERIFY_ENTRY_SIZE;
+
+    close(filedesc);
+
+    if (count > 0 && ((*verify)->entries = malloc(count * sizeof(struct verify_entry))) != NULL) {
+        rec = data + VERIFY_CACHE_MAGIC_LEN;
+        for (size_t i = 0; i < count; i++, rec += VERIFY_ENTRY_SIZE) {
+            (*verify)->entries[i].dev = parse_be64(rec);
+            (*verify)->entries[i].ino = parse_be64(rec + 8);
+            (*verify)->entries[i].size = parse_be64(rec + 16);
+            (*verify)->entries[i].mtime_sec = parse_be64(rec + 24);
+            (*verify)->entries[i].mtime_nsec = parse_be64(rec + 32);
+            (*verify)->entries[i].ctime_sec = parse_be64(rec + 40);
+            (*verify)->entries[i].ctime_nsec = parse_be64(rec + 48);
+            (*verify)->entries[i].digest_algo = parse_be32(rec + 56);
+            memcpy((*verify)->entries[i].digest, rec + 60, SHA256_DIGEST_LENGTH);
+            (*verify)->entries[i].added = false;
+        }
+        (*verify)->entries_len = count;
+        qsort((*verify)->entries, count, sizeof(struct verify_entry), verify_entry_inode_cmp);
+    }
+
+    free(data);
+
+    return DRPM_ERR_OK;
+}
+
+/* Writes out cache (if files were added) and frees it. The cache file
+ * is replaced at once, so concurrent readers see either version. */
+int verify_cache_close(struct verify_cache **verify)
+{
+    int error = DRPM_ERR_OK;
+    struct verify_entry *all = NULL;
+    size_t all_len;
+    unsigned char rec[VERIFY_ENTRY_SIZE];
+    char *tmp_path = NULL;
+    int filedesc = -1;
+
+    if (verify == NULL || *verify == NULL)
         return DRPM_ERR_PROG;
 
+    if ((*verify)->added_len == 0)
+        goto cleanup;
+
+    all_len = (*verify)->entries_len + (*verify)->added_len;
+
+    if ((all = malloc(all_len * sizeof(struct verify_entry))) == NULL ||
+        (tmp_path = malloc(strlen((*verify)->path) + 8)) == NULL) {
+        error = DRPM_ERR_MEMORY;
+        goto cleanup;
+    }
+
+    /* newly verified files replace entries of the same inode */
+    if ((*verify)->entries_len > 0)
+        memcpy(all, (*verify)->entries, (*verify)->entries_len * sizeof(struct verify_entry));
+    memcpy(all + (*verify)->entries_len, (*verify)->added, (*verify)->added_len * sizeof(struct verify_entry));
+    qsort(all, all_len, sizeof(struct verify_entry), verify_entry_cmp);
+
+    strcpy(tmp_path, (*verify)->path);
+    strcat(tmp_path, ".XXXXXX");
+
+    if ((filedesc = mkstemp(tmp_path)) < 0) {
+        error = DRPM_ERR_IO;
+        goto cleanup;
+    }
+
+    if (write(filedesc, VERIFY_CACHE_MAGIC, VERIFY_CACHE_MAGIC_LEN) != VERIFY_CACHE_MAGIC_LEN) {
+        error = DRPM_ERR_IO;
+        goto cleanup;
+    }
+
+    for (size_t i = 0; i < all_len; i++) {
+        if (i > 0 && all[i].dev == all[i - 1].dev && all[i].ino == all[i - 1].ino)
+            continue;
+        create_be64(all[i].dev, rec);
+        create_be64(all[i].ino, rec + 8);
+        create_be64(all[i].size, rec + 16);
+        create_be64(all[i].mtime_sec, rec + 24);
+        create_be64(all[i].mtime_nsec, rec + 32);
+        create_be64(all[i].ctime_sec, rec + 40);
+        create_be64(all[i].ctime_nsec, rec + 48);
+        create_be32(all[i].digest_algo, rec + 56);
+        memcpy(rec + 60, all[i].digest, SHA256_DIGEST_LENGTH);
+        if (write(filedesc, rec, VERIFY_ENTRY_SIZE) != VERIFY_ENTRY_SIZE) {
+            error = DRPM_ERR_IO;
+            goto cleanup;
+        }
+    }
+
+    if (close(filedesc) != 0 || rename(tmp_path, (*verify)->path) != 0)
+        error = DRPM_ERR_IO;
+    filedesc = -1;
+
+cleanup:
+    if (filedesc >= 0)
+        close(filedesc);
+    if (error != DRPM_ERR_OK && tmp_path != NULL)
+        unlink(tmp_path);
+    free(tmp_path);
+    free(all);
+    pthread_mutex_destroy(&(*verify)->mutex);
+    free((*verify)->entries);
+    free((*verify)->added);
+    free((*verify)->path);
+    free(*verify);
+    *verify = NULL;
+
+    return error;
+}
+
+/* Tells whether file with metadata <stats> has been verified to have
+ * <digest> and has not changed since. */
+bool verify_cache_lookup(const struct verify_cache *verify, const struct stat *stats,
+                         unsigned short digest_algo, const unsigned char *digest)
+{
+    struct verify_entry key;
+    const struct verify_entry *entry;
+
+    if (verify == NULL || verify->entries_len == 0)
+        return false;
+
+    verify_entry_create(&key, stats, digest_algo, digest);
+
+    if ((entry = bsearch(&key, verify->entries, verify->entries_len,
+                         sizeof(struct verify_entry), verify_entry_inode_cmp)) == NULL)
+        return false;
+
+    return entry->size == key.size &&
+           entry->mtime_sec == key.mtime_sec && entry->mtime_nsec == key.mtime_nsec &&
+           entry->ctime_sec == key.ctime_sec && entry->ctime_nsec == key.ctime_nsec &&
+           entry->digest_algo == key.digest_algo &&
+           memcmp(entry->digest, key.digest, SHA256_DIGEST_LENGTH) == 0;
+}
+
+/* Records that file with metadata <stats> has been verified to have <digest>. */
+void verify_cache_add(struct verify_cache *verify, const struct stat *stats,
+                      unsigned short digest_algo, const unsigned char *digest)
+{
+    struct verify_entry *added_tmp;
+
+    if (verify == NULL)
+        return;
+
+    pthread_mutex_lock(&verify->mutex);
+
+    if (verify->added_len == verify->added_max) {
+        if ((added_tmp = realloc(verify->added, MAX(2 * verify->added_max, 64) *
+                                                sizeof(struct verify_entry))) == NULL)
+            goto unlock; // not caching is no error
+        verify->added = added_tmp;
+        verify->added_max = MAX(2 * verify->added_max, 64);
+    }
+
+    verify_entry_create(&verify->added[verify->added_len++], stats, digest_algo, digest);
+
+unlock:
+    pthread_mutex_unlock(&verify->mutex);
+}
+
+void verify_entry_create(struct verify_entry *entry, const struct stat *stats,
+                         unsigned short digest_algo, const unsigned char *digest)
+{
+    entry->dev = stats->st_dev;
+    entry->ino = stats->st_ino;
+    entry->size = stats->st_size;
+    entry->mtime_sec = stats->st_mtim.tv_sec;
+    entry->mtime_nsec = stats->st_mtim.tv_nsec;
+    entry->ctime_sec = stats->st_ctim.tv_sec;
+    entry->ctime_nsec = stats->st_ctim.tv_nsec;
+    entry->digest_algo = digest_algo;
+    memset(entry->digest, 0, SHA256_DIGEST_LENGTH);
+    memcpy(entry->digest, digest, (digest_algo == DIGESTALGO_SHA256) ? SHA256_DIGEST_LENGTH : MD5_DIGEST_LENGTH);
+    entry->added = true;
+}
+
+/* Orders entries by device and inode, newly added entries first
+ * (so that they replace older entries of the same inode). */
+int verify_entry_cmp(const void *a, const void *b)
+{
+    const struct verify_entry *entry_a = a;
+    const struct verify_entry *entry_b = b;
+    int cmp;
+
+    if ((cmp = verify_entry_inode_cmp(a, b)) != 0)
+        return cmp;
+
+    return entry_b->added - entry_a->added;
+}
+
+/* Orders entries by device and inode only, for lookups. */
+int verify_entry_inode_cmp(const void *a, const void *b)
+{
+    const struct verify_entry *entry_a = a;
+    const struct verify_entry *entry_b = b;
+
+    if (entry_a->dev != entry_b->dev)
+        return (entry_a->dev > entry_b->dev) - (entry_a->dev < entry_b->dev);
+
+    return (entry_a->ino > entry_b->ino) - (entry_a->ino < entry_b->ino);
+}
+
+/***************************** MD5/SHA256 *****************************/
+
+/* Digests are computed through EVP, so that OpenSSL may use
+ * the fastest implementation for the CPU (e.g. SHA-NI or AVX2).
+ * With OpenSSL 3, algorithms are fetched from the provider only once,
+ * instead of on each initialization. */
+const EVP_MD *checksum_md(unsigned short digest_algo)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    pthread_once(&checksum_md_once, checksum_md_fetch);
+
     switch (digest_algo) {
     case DIGESTALGO_MD5:
-        if (MD5_Init(&chsm->ctx.md5) != 1)
-            return DRPM_ERR_OTHER;
-        break;
+        return checksum_md_md5 != NULL ? checksum_md_md5 : EVP_md5();
     case DIGESTALGO_SHA256:
-        if (SHA256_Init(&chsm->ctx.sha256) != 1)
-            return DRPM_ERR_OTHER;
-        break;
-    default:
+        return checksum_md_sha256 != NULL ? checksum_md_sha256 : EVP_sha256();
+    }
+#else
+    switch (digest_algo) {
+    case DIGESTALGO_MD5:
+        return EVP_md5();
+    case DIGESTALGO_SHA256:
+        return EVP_sha256();
+    }
+#endif
+
+    return NULL;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+void checksum_md_fetch(void)
+{
+    checksum_md_md5 = EVP_MD_fetch(NULL, "MD5", NULL);
+    checksum_md_sha256 = EVP_MD_fetch(NULL, "SHA256", NULL);
+
+    /* registered after OpenSSL's own cleanup handler, so it runs before it */
+    if (atexit(checksum_md_free) != 0) {
+        checksum_md_free();
+        checksum_md_md5 = NULL;
+        checksum_md_sha256 = NULL;
+    }
+}
+
+void checksum_md_free(void)
+{
+    EVP_MD_free(checksum_md_md5);
+    EVP_MD_free(checksum_md_sha256);
+}
+#endif
+
+int checksum_init(struct checksum *chsm, unsigned short digest_algo)
+{
+    const EVP_MD *md;
+
+    if (chsm == NULL)
+        return DRPM_ERR_PROG;
+
+    chsm->ctx = NULL;
+
+    if ((md = checksum_md(digest_algo)) == NULL)
         return DRPM_ERR_PROG;
+
+    if ((chsm->ctx = EVP_MD_CTX_new()) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    if (EVP_DigestInit_ex(chsm->ctx, md, NULL) != 1) {
+        checksum_free(chsm);
+        return DRPM_ERR_OTHER;
     }
 
     chsm->digest_algo = digest_algo;
@@ -450,32 +988,45 @@ int checksum_init(struct checksum *chsm, unsigned short digest_algo)
 
 int checksum_update(struct checksum *chsm, const void *buf, size_t len)
 {
-    if (chsm == NULL || buf == NULL)
+    if (chsm == NULL || chsm->ctx == NULL || buf == NULL)
         return DRPM_ERR_PROG;
 
-    switch (chsm->digest_algo) {
-    case DIGESTALGO_MD5:
-        return MD5_Update(&chsm->ctx.md5, buf, len) != 1 ? DRPM_ERR_OTHER : DRPM_ERR_OK;
-    case DIGESTALGO_SHA256:
-        return SHA256_Update(&chsm->ctx.sha256, buf, len) != 1 ? DRPM_ERR_OTHER : DRPM_ERR_OK;
-    default:
-        return DRPM_ERR_PROG;
-    }
+    return EVP_DigestUpdate(chsm->ctx, buf, len) != 1 ? DRPM_ERR_OTHER : DRPM_ERR_OK;
+}
+
+int checksum_update_be32(struct checksum *chsm, uint32_t number)
+{
+    unsigned char be32[4];
+
+    create_be32(number, be32);
+
+    return checksum_update(chsm, be32, 4);
 }
 
+/* Writes out digest and frees context. */
 int checksum_final(struct checksum *chsm, unsigned char *digest)
 {
-    if (chsm == NULL || digest == NULL)
-        return DRPM_ERR_PROG;
+    int error = DRPM_ERR_OK;
 
-    switch (chsm->digest_algo) {
-    case DIGESTALGO_MD5:
-        return MD5_Final(digest, &chsm->ctx.md5) != 1 ? DRPM_ERR_OTHER : DRPM_ERR_OK;
-    case DIGESTALGO_SHA256:
-        return SHA256_Final(digest, &chsm->ctx.sha256) != 1 ? DRPM_ERR_OTHER : DRPM_ERR_OK;
-    default:
+    if (chsm == NULL || chsm->ctx == NULL || digest == NULL)
         return DRPM_ERR_PROG;
-    }
+
+    if (EVP_DigestFinal_ex(chsm->ctx, digest, NULL) != 1)
+        error = DRPM_ERR_OTHER;
+
+    checksum_free(chsm);
+
+    return error;
+}
+
+/* Frees context of checksum not finalized (if any). */
+void checksum_free(struct checksum *chsm)
+{
+    if (chsm == NULL)
+        return;
+
+    EVP_MD_CTX_free(chsm->ctx);
+    chsm->ctx = NULL;
 }
 
 size_t checksum_digest_len(struct checksum chsm)
@@ -483,6 +1034,109 @@ size_t checksum_digest_len(struct checksum chsm)
     return chsm.digest_algo == DIGESTALGO_MD5 ? MD5_DIGEST_LENGTH : SHA256_DIGEST_LENGTH;
 }
 
+/*************************** payload check ****************************/
+
+/* Prepares checking of the uncompressed payload.
+ * The payload is preceded by <header_len> bytes of header, which is
+ * then parsed to find the digest. Otherwise, the digest is taken from
+ * <header_rpm>. */
+int payload_check_init(struct payload_check *pchk, struct rpm *header_rpm, size_t header_len)
+{
+    if (pchk == NULL || (header_rpm == NULL && header_len == 0))
+        return DRPM_ERR_PROG;
+
+    pchk->header_rpm = NULL;
+    pchk->header = NULL;
+    pchk->header_len = header_len;
+    pchk->header_pos = 0;
+    pchk->started = false;
+    pchk->chsm.ctx = NULL;
+
+    if (header_len > 0)
+        return (pchk->header = malloc(header_len)) == NULL ? DRPM_ERR_MEMORY : DRPM_ERR_OK;
+
+    return payload_check_start(pchk, header_rpm);
+}
+
+int payload_check_start(struct payload_check *pchk, struct rpm *header_rpm)
+{
+    int error;
+    unsigned short digest_algo;
+    bool has_digest;
+
+    if ((error = rpm_get_payload_digest(header_rpm, &digest_algo, pchk->digest, &has_digest)) != DRPM_ERR_OK)
+        return error;
+
+    if (!has_digest)
+        return DRPM_ERR_NODIGEST;
+
+    if ((error = checksum_init(&pchk->chsm, digest_algo)) != DRPM_ERR_OK)
+        return error;
+
+    pchk->started = true;
+
+    return DRPM_ERR_OK;
+}
+
+int payload_check_update(struct payload_check *pchk, const unsigned char *buffer, size_t buffer_len)
+{
+    int error;
+    size_t header_part;
+
+    if (pchk == NULL || buffer == NULL)
+        return DRPM_ERR_PROG;
+
+    if (pchk->header_pos < pchk->header_len) {
+        header_part = MIN(pchk->header_len - pchk->header_pos, buffer_len);
+        memcpy(pchk->header + pchk->header_pos, buffer, header_part);
+        pchk->header_pos += header_part;
+        buffer += header_part;
+        buffer_len -= header_part;
+        if (pchk->header_pos == pchk->header_len &&
+            ((error = rpm_import_header(&pchk->header_rpm, pchk->header, pchk->header_len)) != DRPM_ERR_OK ||
+             (error = payload_check_start(pchk, pchk->header_rpm)) != DRPM_ERR_OK))
+            return error;
+    }
+
+    if (buffer_len == 0)
+        return DRPM_ERR_OK;
+
+    return checksum_update(&pchk->chsm, buffer, buffer_len);
+}
+
+int payload_check_final(struct payload_check *pchk)
+{
+    int error;
+    unsigned char digest[MAX(MD5_DIGEST_LENGTH, SHA256_DIGEST_LENGTH)];
+
+    if (pchk == NULL)
+        return DRPM_ERR_PROG;
+
+    if (!pchk->started)
+        return DRPM_ERR_FORMAT;
+
+    if ((error = checksum_final(&pchk->chsm, digest)) != DRPM_ERR_OK)
+        return error;
+
+    if (memcmp(digest, pchk->digest, checksum_digest_len(pchk->chsm)) != 0)
+        return DRPM_ERR_MISMATCH;
+
+    return DRPM_ERR_OK;
+}
+
+void payload_check_free(struct payload_check *pchk)
+{
+    if (pchk == NULL)
+        return;
+
+    free(pchk->header);
+    if (pchk->header_rpm != NULL)
+        rpm_destroy(&pchk->header_rpm);
+    checksum_free(&pchk->chsm);
+
+    pchk->header = NULL;
+}
+
 /****************************** prelink *******************************/
 
 uint16_t elf16(const unsigned char *buf, bool little_endian)
@@ -620,42 +1274,236 @@ cleanup:
     return error;
 }
 
-int prelink_open(const char *filename, int *filedesc)
+/* Runs prelink to undo <filename> into existing file <target>. */
+int prelink_undo(const char *filename, const char *target)
 {
     pid_t pid;
-    int fd;
     int status;
     struct stat stats;
-    char template[] = "/tmp/drpm.XXXXXX";
-
-    if (filename == NULL || filedesc == NULL)
-        return DRPM_ERR_PROG;
 
     if (stat("/usr/sbin/prelink", &stats) != 0)
         return DRPM_ERR_OTHER;
 
-    if ((fd = mkstemp(template)) < 0)
-        return DRPM_ERR_IO;
-    close(fd);
-
     pid = fork();
     if (pid == (pid_t)-1) {
         return DRPM_ERR_OTHER;
     }
     if (pid == 0) {
-        execl("/usr/sbin/prelink", "prelink", "-o", template, "-u", filename, NULL);
+        execl("/usr/sbin/prelink", "prelink", "-o", target, "-u", filename, NULL);
         _exit(1);
     }
 
     while (waitpid(pid, &status, 0) == (pid_t)-1);
 
-    if ((fd = open(template, O_RDONLY)) < 0)
-        return DRPM_ERR_IO;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return DRPM_ERR_OTHER;
 
-    unlink(template);
+    return DRPM_ERR_OK;
+}
 
-    *filedesc = fd;
+/* Creates cache of files undone from prelink.
+ * Images are kept in <dir> across operations, unless NULL. */
+int prelink_cache_create(struct prelink_cache **prelink, const char *dir)
+{
+    if (prelink == NULL)
+        return DRPM_ERR_PROG;
+
+    if ((*prelink = malloc(sizeof(struct prelink_cache))) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    (*prelink)->dir = NULL;
+    (*prelink)->images = NULL;
+    (*prelink)->images_len = 0;
+
+    if (dir != NULL && ((*prelink)->dir = malloc(strlen(dir) + 1)) == NULL) {
+        free(*prelink);
+        *prelink = NULL;
+        return DRPM_ERR_MEMORY;
+    }
+    if (dir != NULL)
+        strcpy((*prelink)->dir, dir);
+
+    if (pthread_mutex_init(&(*prelink)->mutex, NULL) != 0) {
+        free((*prelink)->dir);
+        free(*prelink);
+        *prelink = NULL;
+        return DRPM_ERR_OTHER;
+    }
+
+    if (pthread_cond_init(&(*prelink)->undone, NULL) != 0) {
+        pthread_mutex_destroy(&(*prelink)->mutex);
+        free((*prelink)->dir);
+        free(*prelink);
+        *prelink = NULL;
+        return DRPM_ERR_OTHER;
+    }
+
+    return DRPM_ERR_OK;
+}
+
+/* Frees cache, removing images unless kept in a directory. */
+int prelink_cache_destroy(struct prelink_cache **prelink)
+{
+    if (prelink == NULL || *prelink == NULL)
+        return DRPM_ERR_PROG;
+
+    for (size_t i = 0; i < (*prelink)->images_len; i++) {
+        if ((*prelink)->dir == NULL)
+            unlink((*prelink)->images[i].path);
+        free((*prelink)->images[i].path);
+    }
+
+    pthread_cond_destroy(&(*prelink)->undone);
+    pthread_mutex_destroy(&(*prelink)->mutex);
+    free((*prelink)->images);
+    free((*prelink)->dir);
+    free(*prelink);
+    *prelink = NULL;
 
     return DRPM_ERR_OK;
 }
 
+/* Finds image of the same file as <image>, with <prelink> mutex held. */
+struct prelink_image *prelink_image_find(struct prelink_cache *prelink, const struct prelink_image *image)
+{
+    for (size_t i = 0; i < prelink->images_len; i++) {
+        if (prelink->images[i].dev == image->dev && prelink->images[i].ino == image->ino &&
+            prelink->images[i].mtime == image->mtime && prelink->images[i].size == image->size)
+            return &prelink->images[i];
+    }
+
+    return NULL;
+}
+
+/* Opens original contents of prelinked <filename>. Without <prelink>
+ * cache, prelink is run into a temporary file every time. Otherwise,
+ * images are looked up by device, inode, modification time and size
+ * of <filename>, and only created if not found. */
+int prelink_open(struct prelink_cache *prelink, const char *filename, int *filedesc)
+{
+    int error = DRPM_ERR_OK;
+    int fd;
+    struct stat stats;
+    struct prelink_image *images_tmp;
+    struct prelink_image *found;
+    struct prelink_image image;
+    char template[] = PRELINK_TMP_DIR "/drpm.XXXXXX";
+    char *tmp_path = NULL;
+    char *path = NULL;
+    const char *dir;
+    size_t path_len;
+
+    if (filename == NULL || filedesc == NULL)
+        return DRPM_ERR_PROG;
+
+    if (prelink == NULL) {
+        if ((fd = mkstemp(template)) < 0)
+            return DRPM_ERR_IO;
+        close(fd);
+        if ((error = prelink_undo(filename, template)) == DRPM_ERR_OK &&
+            (*filedesc = open(template, O_RDONLY)) < 0)
+            error = DRPM_ERR_IO;
+        unlink(template);
+        return error;
+    }
+
+    if (stat(filename, &stats) != 0)
+        return DRPM_ERR_NOINSTALL;
+
+    image.dev = stats.st_dev;
+    image.ino = stats.st_ino;
+    image.mtime = stats.st_mtime;
+    image.size = stats.st_size;
+
+    /* only looking up and inserting with the lock held, so that other
+     * files are undone in parallel, while threads wanting the same file
+     * wait for the undo already in progress */
+    pthread_mutex_lock(&prelink->mutex);
+
+    /* entry may be gone once woken up (if undo failed), so looking it up again */
+    while ((found = prelink_image_find(prelink, &image)) != NULL && found->path == NULL)
+        pthread_cond_wait(&prelink->undone, &prelink->mutex);
+
+    if (found != NULL) {
+        if ((*filedesc = open(found->path, O_RDONLY)) < 0)
+            error = DRPM_ERR_IO;
+        pthread_mutex_unlock(&prelink->mutex);
+        return error;
+    }
+
+    if ((images_tmp = realloc(prelink->images, (prelink->images_len + 1) * sizeof(struct prelink_image))) == NULL) {
+        pthread_mutex_unlock(&prelink->mutex);
+        return DRPM_ERR_MEMORY;
+    }
+    prelink->images = images_tmp;
+    image.path = NULL;
+    prelink->images[prelink->images_len++] = image;
+
+    pthread_mutex_unlock(&prelink->mutex);
+
+    dir = (prelink->dir == NULL) ? PRELINK_TMP_DIR : prelink->dir;
+    path_len = strlen(dir) + 80;
+
+    if ((tmp_path = malloc(path_len)) == NULL ||
+        (prelink->dir != NULL && (path = malloc(path_len)) == NULL)) {
+        error = DRPM_ERR_MEMORY;
+        goto cleanup;
+    }
+
+    /* images in cache directory are named after the file they undo */
+    if (prelink->dir != NULL)
+        snprintf(path, path_len, "%s/%jx-%jx-%jx-%jx", dir,
+                 (uintmax_t)image.dev, (uintmax_t)image.ino,
+                 (uintmax_t)image.mtime, (uintmax_t)image.size);
+
+    if (path == NULL || (fd = open(path, O_RDONLY)) < 0) {
+        snprintf(tmp_path, path_len, "%s/drpm.XXXXXX", dir);
+        if ((fd = mkstemp(tmp_path)) < 0) {
+            error = DRPM_ERR_IO;
+            goto cleanup;
+        }
+        close(fd);
+        if ((error = prelink_undo(filename, tmp_path)) != DRPM_ERR_OK) {
+            unlink(tmp_path);
+            goto cleanup;
+        }
+        /* renaming only once complete, as other processes may share the directory */
+        if (path != NULL && rename(tmp_path, path) != 0) {
+            unlink(tmp_path);
+            error = DRPM_ERR_IO;
+            goto cleanup;
+        }
+        if ((fd = open((path == NULL) ? tmp_path : path, O_RDONLY)) < 0) {
+            if (path == NULL)
+                unlink(tmp_path);
+            error = DRPM_ERR_IO;
+            goto cleanup;
+        }
+    }
+
+    *filedesc = fd;
+
+cleanup:
+    /* completing entry, or removing it so that the undo may be retried */
+    pthread_mutex_lock(&prelink->mutex);
+    found = prelink_image_find(prelink, &image);
+    if (error == DRPM_ERR_OK) {
+        if (path == NULL) {
+            found->path = tmp_path;
+            tmp_path = NULL;
+        } else {
+            found->path = path;
+            path = NULL;
+        }
+    } else {
+        *found = prelink->images[--prelink->images_len];
+    }
+    pthread_cond_broadcast(&prelink->undone);
+    pthread_mutex_unlock(&prelink->mutex);
+
+    free(tmp_path);
+    free(path);
+
+    return error;
+}
+
@@ -35,9 +35,13 @@
 
 #define MAX_OPEN_FILES 50
 #define MAX_CORE_BLOCKS 5000
+#define MIN_CORE_BLOCKS 16
+#define SPILL_DIR "/tmp"
 
 #define BLOCK_SIZE (1 << 13)
 
+#define PREFETCH_SIZE (1 << 23)
+
 #define BLK_FREE 0
 #define BLK_CORE 1
 #define BLK_CORE_NOPAGE 2
@@ -45,6 +49,11 @@
 
 #define BLOCKS(size) (1 + ((size) - 1) / BLOCK_SIZE)
 
+#define NO_USE SIZE_MAX
+
+/* zeros read in place of external data that has no source */
+static const unsigned char zero_block[BLOCK_SIZE] = {0};
+
 /* a list of open files */
 struct open_file {
     struct open_file *prev;
@@ -52,6 +61,15 @@ struct open_file {
     int filedesc;
     const char *name;
     off_t offset;
+    size_t index; // index of CPIO entry within open_files
+    bool prefetched; // opened by prefetch_range(), not read yet
+};
+
+/* a contiguous piece of external data that is read in place */
+struct segment {
+    uint64_t offset; // offset within external data
+    size_t len;
+    const unsigned char *data; // NULL for zeros
 };
 
 /* a block */
@@ -59,6 +77,8 @@ struct block {
     struct block *next;
     int type;
     unsigned id;
+    size_t next_use; // next external copy reading this block
+    size_t heap_pos; // position in heap of core blocks
     /* core blocks store the buffer directly, while page blocks
      * only store an offset within a temporary file from which to read
      * the data */
@@ -69,16 +89,27 @@ struct block {
 };
 
 struct blocks {
-    struct block *free_core_blocks;
     struct block *core_blocks;
     size_t core_blocks_count;
+    size_t core_blocks_max;
+    unsigned short open_files_max;
+    struct block **heap;
+    size_t heap_len;
 
     struct block *page_blocks;
     size_t page_blocks_count;
     int page_filedesc;
+    const char *spill_dir;
+    unsigned char *spill_buffer; // page blocks not yet written out
+    size_t spill_blocks; // capacity of spill buffer
+    size_t spill_first; // slot of first block in spill buffer
+    size_t spill_len; // blocks in spill buffer
 
     struct block **blocks_table;
     size_t *blocks_max;
+    /* external copies reading each block, in ascending order */
+    size_t *uses_start;
+    uint32_t *uses;
 
     unsigned char *cpio_buffer;
     const char *linkto;
@@ -87,6 +118,7 @@ struct blocks {
     const struct cpio_file *cpio_files;
     size_t cpio_files_len;
     const struct file_info *files;
+    struct prelink_cache *prelink; // installed files undone from prelink
 
     bool from_rpm;
     union {
@@ -106,22 +138,61 @@ struct blocks {
         } from_rpm;
     } rpm_files;
 
+    /* external data from old RPM read into memory is mapped over the
+     * decompressed archive (and synthesized CPIO headers) instead of
+     * using blocks (see blocks_in_place()) */
+    struct segment *segments;
+    size_t segments_count;
+    size_t last_segment;
+    uint64_t segments_len;
+    unsigned char *cpio_headers;
+
     struct block *last_block;
+    size_t last_copy;
+
+    /* installed files are read ahead of external copies */
+    const uint32_t *ext_copies;
+    size_t ext_copies_count;
+    size_t prefetch_copy; // next copy to prefetch
+    size_t prefetch_done; // copies already performed
+    uint64_t prefetch_offset; // external offset after last prefetched copy
+    uint64_t prefetch_len; // prefetched, but not yet copied
 
     int (*fill_block)(struct blocks *, struct block *, size_t, size_t);
 };
 
+static size_t cache_blocks(const struct drpm_apply_options *);
 static int fillblock_filesystem(struct blocks *, struct block *, size_t, size_t);
 static int fillblock_prelink(struct blocks *, struct block *, size_t, size_t, const struct cpio_file *);
 static int fillblock_rpm_rpmonly(struct blocks *, struct block *, size_t, size_t);
 static int fillblock_rpm_standard(struct blocks *, struct block *, size_t, size_t);
-static struct block *get_free_core_block(struct blocks *);
+static int evict_block(struct blocks *, size_t, struct block **);
 static int get_block(struct blocks *, struct block **, size_t, size_t);
+static void heap_push(struct blocks *, struct block *, size_t);
+static void heap_remove(struct blocks *, struct block *);
+static void heap_sift(struct blocks *, size_t);
+static void heap_swap(struct blocks *, size_t, size_t);
+static void heap_update(struct blocks *, struct block *, size_t);
 static int new_core_block(struct blocks *, struct block **);
+static size_t next_use(const struct blocks *, size_t, size_t);
+static void prefetch_files(struct blocks *, size_t);
+static bool prefetch_range(struct blocks *, uint64_t, uint64_t);
+static int map_rpm_rpmonly(struct blocks *, uint64_t);
+static int map_rpm_standard(struct blocks *);
 static int push_block(struct blocks *, const struct block *, size_t);
+static int page_write(struct blocks *, size_t, const unsigned char *);
 static int read_page_block(struct blocks *, struct block *, const struct block *);
+static void segment_add(struct blocks *, const unsigned char *, size_t);
+static int segment_get(struct blocks *, const unsigned char **, size_t *, uint64_t);
 static int write_page_block(struct blocks *, const struct block *, size_t);
 
+/* returns maximum number of core blocks */
+size_t cache_blocks(const struct drpm_apply_options *opts)
+{
+    return (opts->cache_size == 0) ? MAX_CORE_BLOCKS :
+           MAX(opts->cache_size / BLOCK_SIZE, MIN_CORE_BLOCKS);
+}
+
 /* returns size of block */
 size_t block_size()
 {
@@ -134,12 +205,23 @@ size_t block_id(uint64_t offset)
     return offset / BLOCK_SIZE;
 }
 
+/* Decides whether external data from old RPM is read in place, i.e. whether
+ * the old archive is to be decompressed into memory in its entirety.
+ * That is only done if it fits within the block cache anyway, otherwise
+ * the archive is decompressed as blocks are filled. */
+bool blocks_in_place(uint64_t ext_data_len, const struct drpm_apply_options *opts)
+{
+    return ext_data_len <= (uint64_t)cache_blocks(opts) * BLOCK_SIZE;
+}
+
 /* creates blocks for reading external data */
 int blocks_create(struct blocks **blks_ret,
                   uint64_t ext_data_len, const struct file_info *files,
                   const struct cpio_file *cpio_files, size_t cpio_files_len,
                   const uint32_t *ext_copies, size_t ext_copies_count,
-                  struct rpm *old_rpm, bool rpm_only)
+                  struct rpm *old_rpm, bool rpm_only,
+                  struct prelink_cache *prelink,
+                  const struct drpm_apply_options *opts)
 {
     int error = DRPM_ERR_OK;
     const size_t block_count = BLOCKS(ext_data_len);
@@ -147,37 +229,68 @@ int blocks_create(struct blocks **blks_ret,
     size_t max_cpio_header_len;
     uint32_t old_header_size;
     struct blocks blks = {
+        .core_blocks_max = cache_blocks(opts),
+        .open_files_max = (opts->open_files == 0) ? MAX_OPEN_FILES : opts->open_files,
         .page_filedesc = -1,
+        .spill_dir = (opts->spill_dir == NULL) ? SPILL_DIR : opts->spill_dir,
+        .spill_blocks = MAX(opts->spill_extent / BLOCK_SIZE, 1),
         .cpio_files_index = -1,
         .cpio_files = cpio_files,
         .cpio_files_len = cpio_files_len,
         .files = files,
+        .prelink = prelink,
         .from_rpm = (old_rpm != NULL)
     };
 
-    if (blks_ret == NULL)
+    if (blks_ret == NULL || opts == NULL)
         return DRPM_ERR_PROG;
 
     if (block_count >= UINT32_MAX)
         return DRPM_ERR_OVERFLOW;
 
+    *blks_ret = NULL;
+
+    max_cpio_header_len = CPIO_HEADER_SIZE + strlen(CPIO_TRAILER) + 1;
+    max_cpio_header_len += CPIO_PADDING(max_cpio_header_len);
+    for (size_t i = 0; i < cpio_files_len; i++)
+        if (cpio_files[i].header_len > max_cpio_header_len)
+            max_cpio_header_len = cpio_files[i].header_len;
+
+    if ((blks.cpio_buffer = malloc(max_cpio_header_len)) == NULL) {
+        error = DRPM_ERR_MEMORY;
+        goto cleanup;
+    }
+
+    if ((*blks_ret = malloc(sizeof(struct blocks))) == NULL) {
+        error = DRPM_ERR_MEMORY;
+        goto cleanup;
+    }
+
     if (blks.from_rpm) {
         blks.rpm_files.from_rpm.old_rpm = old_rpm;
         blks.rpm_files.from_rpm.rpm_id = 0;
+        blks.rpm_files.from_rpm.old_header = NULL;
+        blks.rpm_files.from_rpm.old_header_size = 0;
+        blks.rpm_files.from_rpm.old_header_offset = 0;
         if (rpm_only) {
             blks.rpm_files.from_rpm.left = ext_data_len;
             if ((error = rpm_fetch_header(old_rpm, &blks.rpm_files.from_rpm.old_header, &old_header_size)) != DRPM_ERR_OK)
                 goto cleanup;
             blks.rpm_files.from_rpm.old_header_size = old_header_size;
-            blks.rpm_files.from_rpm.old_header_offset = 0;
             blks.fill_block = fillblock_rpm_rpmonly;
         } else {
             blks.rpm_files.from_rpm.left = 0;
-            blks.rpm_files.from_rpm.old_header = NULL;
-            blks.rpm_files.from_rpm.old_header_size = 0;
-            blks.rpm_files.from_rpm.old_header_offset = 0;
             blks.fill_block = fillblock_rpm_standard;
         }
+        if (blocks_in_place(ext_data_len, opts)) {
+            if ((error = rpm_only ? map_rpm_rpmonly(&blks, ext_data_len) :
+                                    map_rpm_standard(&blks)) != DRPM_ERR_OK)
+                goto cleanup;
+
+            **blks_ret = blks;
+
+            return DRPM_ERR_OK;
+        }
     } else {
         if ((blks.rpm_files.from_filesytem.open_files = calloc(cpio_files_len, sizeof(struct open_file *))) == NULL) {
             error = DRPM_ERR_MEMORY;
@@ -186,12 +299,17 @@ int blocks_create(struct blocks **blks_ret,
         blks.rpm_files.from_filesytem.files_head = NULL;
         blks.rpm_files.from_filesytem.files_tail = NULL;
         blks.rpm_files.from_filesytem.file_count = 0;
+        blks.ext_copies = ext_copies;
+        blks.ext_copies_count = ext_copies_count;
         blks.fill_block = fillblock_filesystem;
     }
 
-    if ((*blks_ret = malloc(sizeof(struct blocks))) == NULL ||
-        (blks.blocks_table = calloc(block_count, sizeof(struct block *))) == NULL ||
-        (blks.blocks_max = calloc(block_count, sizeof(size_t))) == NULL) {
+    if ((blks.blocks_table = calloc(block_count, sizeof(struct block *))) == NULL ||
+        (blks.blocks_max = calloc(block_count, sizeof(size_t))) == NULL ||
+        (blks.uses_start = calloc(block_count + 1, sizeof(size_t))) == NULL ||
+        (blks.heap = malloc(MIN(blks.core_blocks_max, block_count) * sizeof(struct block *))) == NULL ||
+        (blks.spill_blocks > 1 &&
+         (blks.spill_buffer = malloc(blks.spill_blocks * BLOCK_SIZE)) == NULL)) {
         error = DRPM_ERR_MEMORY;
         goto cleanup;
     }
@@ -201,21 +319,34 @@ int blocks_create(struct blocks **blks_ret,
         blk_i = off / BLOCK_SIZE;
         off += ext_copies[2 * i + 1];
         blk_l = BLOCKS(off);
-        for ( ; blk_i < blk_l; blk_i++)
+        for ( ; blk_i < blk_l; blk_i++) {
             blks.blocks_max[blk_i] = i;
+            blks.uses_start[blk_i + 1]++;
+        }
     }
 
-    max_cpio_header_len = CPIO_HEADER_SIZE + strlen(CPIO_TRAILER) + 1;
-    max_cpio_header_len += CPIO_PADDING(max_cpio_header_len);
-    for (size_t i = 0; i < cpio_files_len; i++)
-        if (cpio_files[i].header_len > max_cpio_header_len)
-            max_cpio_header_len = cpio_files[i].header_len;
+    /* listing copies reading each block (used to decide which block to evict) */
+    for (size_t i = 0; i < block_count; i++)
+        blks.uses_start[i + 1] += blks.uses_start[i];
 
-    if ((blks.cpio_buffer = malloc(max_cpio_header_len)) == NULL) {
+    if ((blks.uses = malloc(MAX(blks.uses_start[block_count], 1) * sizeof(uint32_t))) == NULL) {
         error = DRPM_ERR_MEMORY;
         goto cleanup;
     }
 
+    off = 0;
+    for (size_t blk_i, blk_l, i = 0; i < ext_copies_count; i++) {
+        off += (int32_t)ext_copies[2 * i];
+        blk_i = off / BLOCK_SIZE;
+        off += ext_copies[2 * i + 1];
+        blk_l = BLOCKS(off);
+        for ( ; blk_i < blk_l; blk_i++)
+            blks.uses[blks.uses_start[blk_i]++] = i;
+    }
+
+    memmove(blks.uses_start + 1, blks.uses_start, block_count * sizeof(size_t));
+    blks.uses_start[0] = 0;
+
     **blks_ret = blks;
 
     return DRPM_ERR_OK;
@@ -224,7 +355,17 @@ cleanup:
     free(*blks_ret);
     free(blks.blocks_table);
     free(blks.blocks_max);
+    free(blks.uses_start);
+    free(blks.uses);
+    free(blks.heap);
+    free(blks.spill_buffer);
     free(blks.cpio_buffer);
+    free(blks.segments);
+    free(blks.cpio_headers);
+    if (blks.from_rpm)
+        free(blks.rpm_files.from_rpm.old_header);
+    else
+        free(blks.rpm_files.from_filesytem.open_files);
 
     return error;
 }
@@ -233,7 +374,7 @@ cleanup:
 int blocks_destroy(struct blocks **blks_ref)
 {
     struct blocks *blks;
-    struct block *blk_lists[3];
+    struct block *blk_lists[2];
 
     if (blks_ref == NULL || *blks_ref == NULL)
         return DRPM_ERR_PROG;
@@ -253,10 +394,9 @@ int blocks_destroy(struct blocks **blks_ref)
     }
 
     blk_lists[0] = blks->core_blocks;
-    blk_lists[1] = blks->free_core_blocks;
-    blk_lists[2] = blks->page_blocks;
+    blk_lists[1] = blks->page_blocks;
 
-    for (unsigned short i = 0; i < 3; i++) {
+    for (unsigned short i = 0; i < 2; i++) {
         for (struct block *blk = blk_lists[i], *tmp; blk != NULL; ) {
             if (blk->type != BLK_PAGE)
                 free(blk->data.buffer);
@@ -271,7 +411,13 @@ int blocks_destroy(struct blocks **blks_ref)
 
     free(blks->blocks_table);
     free(blks->blocks_max);
+    free(blks->uses_start);
+    free(blks->uses);
+    free(blks->heap);
+    free(blks->spill_buffer);
     free(blks->cpio_buffer);
+    free(blks->segments);
+    free(blks->cpio_headers);
 
     free(*blks_ref);
 
@@ -280,27 +426,37 @@ int blocks_destroy(struct blocks **blks_ref)
     return DRPM_ERR_OK;
 }
 
-/* fetches external data */
-int blocks_next(struct blocks *blks, unsigned char buffer[BLOCK_SIZE], size_t *buffer_len,
+/* Fetches external data, pointing <*data> at up to <copy_len> bytes
+ * at <offset> (their number stored in <*data_len>, never crossing a block
+ * boundary). The data is only valid until the next call. */
+int blocks_next(struct blocks *blks, const unsigned char **data, size_t *data_len,
                 uint64_t offset, size_t copy_len, size_t copy_cnt, size_t id)
 {
     int error;
     size_t blk_off;
 
-    if (blks == NULL || buffer == NULL || buffer_len == NULL)
+    if (blks == NULL || data == NULL || data_len == NULL)
         return DRPM_ERR_PROG;
 
-    if (blks->last_block == NULL || id != blks->last_block->id) {
+    blk_off = offset % BLOCK_SIZE;
+
+    *data_len = (blk_off + copy_len > BLOCK_SIZE) ? BLOCK_SIZE - blk_off : copy_len;
+
+    if (blks->segments != NULL)
+        return segment_get(blks, data, data_len, offset);
+
+    if (blks->last_block == NULL || id != blks->last_block->id || copy_cnt != blks->last_copy) {
         blks->last_block = blks->blocks_table[id];
-        if ((blks->last_block == NULL || blks->last_block->type == BLK_PAGE) &&
-            (error = get_block(blks, &blks->last_block, id, copy_cnt)) != DRPM_ERR_OK)
-            return error;
+        if (blks->last_block == NULL || blks->last_block->type == BLK_PAGE) {
+            if ((error = get_block(blks, &blks->last_block, id, copy_cnt)) != DRPM_ERR_OK)
+                return error;
+        } else {
+            heap_update(blks, blks->last_block, next_use(blks, id, copy_cnt));
+        }
+        blks->last_copy = copy_cnt;
     }
 
-    blk_off = offset % BLOCK_SIZE;
-
-    *buffer_len = (blk_off + copy_len > BLOCK_SIZE) ? BLOCK_SIZE - blk_off : copy_len;
-    memcpy(buffer, blks->last_block->data.buffer + blk_off, *buffer_len);
+    *data = blks->last_block->data.buffer + blk_off;
 
     return DRPM_ERR_OK;
 }
@@ -308,7 +464,6 @@ int blocks_next(struct blocks *blks, unsigned char buffer[BLOCK_SIZE], size_t *b
 /* gets new block and fills it */
 int get_block(struct blocks *blks, struct block **blk_ret, size_t id, size_t copy_cnt)
 {
-    static size_t cleanup_count = 0;
     int error;
     struct block *blk;
     struct block *page_blk;
@@ -324,57 +479,31 @@ int get_block(struct blocks *blks, struct block **blk_ret, size_t id, size_t cop
         return DRPM_ERR_OK;
     }
 
-    if ((blk = get_free_core_block(blks)) == NULL) {
-        if (blks->core_blocks_count < MAX_CORE_BLOCKS && (++cleanup_count % 8) != 0) {
-            if ((error = new_core_block(blks, &blk)) != DRPM_ERR_OK)
-                return error;
-        } else {
-            for (struct block **blk_ptr = &blks->core_blocks; (blk = *blk_ptr) != NULL; blk_ptr = &blk->next) {
-                if (blks->blocks_max[blk->id] < copy_cnt ||
-                    (blk->id == id && blks->blocks_max[blk->id] == copy_cnt)) {
-                    *blk_ptr = blk->next;
-                    blks->blocks_table[blk->id] = NULL;
-                    blk->type = BLK_FREE;
-                    blk->next = blks->free_core_blocks;
-                    blks->free_core_blocks = blk;
-                } else {
-                    blk_ptr = &blk->next;
-                }
-            }
-            if ((blk = get_free_core_block(blks)) == NULL) {
-                if (blks->core_blocks_count < MAX_CORE_BLOCKS) {
-                    if ((error = new_core_block(blks, &blk)) != DRPM_ERR_OK)
-                        return error;
-                } else {
-                    for (struct block **blk_ptr = &blks->core_blocks; (blk = *blk_ptr) != NULL; blk_ptr = &blk->next) {
-                        if (blk->next == NULL) {
-                            *blk_ptr = NULL;
-                            break;
-                        }
-                    }
-                    blk->next = blks->core_blocks;
-                    blks->core_blocks = blk;
-                    if (blk->type == BLK_PAGE) {
-                        if ((error = write_page_block(blks, blk, copy_cnt)) != DRPM_ERR_OK)
-                            return error;
-                    } else {
-                        blks->blocks_table[blk->id] = NULL;
-                    }
-                    blk->type = BLK_FREE;
-                }
-            }
-        }
+    /* reusing blocks no longer needed before allocating new ones */
+    if (blks->heap_len > 0 && blks->heap[0]->next_use == NO_USE) {
+        if ((error = evict_block(blks, copy_cnt, &blk)) != DRPM_ERR_OK)
+            return error;
+    } else if (blks->core_blocks_count < blks->core_blocks_max) {
+        if ((error = new_core_block(blks, &blk)) != DRPM_ERR_OK)
+            return error;
+    } else if ((error = evict_block(blks, copy_cnt, &blk)) != DRPM_ERR_OK) {
+        return error;
     }
 
     page_blk = blks->blocks_table[id];
-    if (page_blk != NULL && page_blk->type == BLK_PAGE)
-        return read_page_block(blks, blk, page_blk);
+    if (page_blk != NULL && page_blk->type == BLK_PAGE) {
+        if ((error = read_page_block(blks, blk, page_blk)) != DRPM_ERR_OK)
+            return error;
+    } else {
+        /* filling block */
+        if ((error = blks->fill_block(blks, blk, id, copy_cnt)) != DRPM_ERR_OK)
+            return error;
+        blks->blocks_table[id] = blk;
+    }
 
-    /* filling block */
-    if ((error = blks->fill_block(blks, blk, id, copy_cnt)) != DRPM_ERR_OK)
-        return error;
+    heap_push(blks, blk, next_use(blks, id, copy_cnt));
 
-    *blk_ret = blks->blocks_table[id] = blk;
+    *blk_ret = blk;
 
     return DRPM_ERR_OK;
 }
@@ -403,20 +532,30 @@ int new_core_block(struct blocks *blks, struct block **new_ret)
     return DRPM_ERR_OK;
 }
 
-/* pops a free core block and pushes it to core blocks for reuse */
-struct block *get_free_core_block(struct blocks *blks)
+/* Frees the core block needed furthest in the future (Belady's algorithm).
+ * Its data is written to the temporary file if it cannot be re-read. */
+int evict_block(struct blocks *blks, size_t copy_cnt, struct block **blk_ret)
 {
+    int error;
     struct block *blk;
 
-    if (blks->free_core_blocks == NULL)
-        return NULL;
+    if (blks->heap_len == 0)
+        return DRPM_ERR_PROG;
 
-    blk = blks->free_core_blocks;
-    blks->free_core_blocks = blks->free_core_blocks->next;
-    blk->next = blks->core_blocks;
-    blks->core_blocks = blk;
+    blk = blks->heap[0];
+    heap_remove(blks, blk);
 
-    return blk;
+    if (blk->next_use != NO_USE && blk->type == BLK_CORE) {
+        if ((error = write_page_block(blks, blk, copy_cnt)) != DRPM_ERR_OK)
+            return error;
+    } else {
+        blks->blocks_table[blk->id] = NULL;
+    }
+
+    blk->type = BLK_FREE;
+    *blk_ret = blk;
+
+    return DRPM_ERR_OK;
 }
 
 /* inserts a block in table */
@@ -424,20 +563,33 @@ int push_block(struct blocks *blks, const struct block *blk, size_t copy_cnt)
 {
     int error;
     struct block *new;
+    size_t use;
 
     if (blks == NULL || blk == NULL)
         return DRPM_ERR_PROG;
 
-    if ((new = get_free_core_block(blks)) == NULL) {
-        if (blks->core_blocks_count < MAX_CORE_BLOCKS) {
-            if ((error = new_core_block(blks, &new)) != DRPM_ERR_OK)
-                return error;
-        } else if (blk->type == BLK_CORE) {
-            return write_page_block(blks, blk, copy_cnt);
-        } else {
-            blks->blocks_table[blk->id] = NULL;
-            return DRPM_ERR_OK;
-        }
+    use = next_use(blks, blk->id, copy_cnt);
+
+    /* block already held in core is refreshed in place */
+    new = blks->blocks_table[blk->id];
+    if (new != NULL && (new->type == BLK_CORE || new->type == BLK_CORE_NOPAGE)) {
+        new->type = blk->type;
+        memcpy(new->data.buffer, blk->data.buffer, BLOCK_SIZE);
+        heap_update(blks, new, use);
+        return DRPM_ERR_OK;
+    }
+
+    if (blks->core_blocks_count < blks->core_blocks_max) {
+        if ((error = new_core_block(blks, &new)) != DRPM_ERR_OK)
+            return error;
+    } else if (blks->heap_len > 0 && blks->heap[0]->next_use > use) {
+        if ((error = evict_block(blks, copy_cnt, &new)) != DRPM_ERR_OK)
+            return error;
+    } else if (blk->type == BLK_CORE) {
+        return write_page_block(blks, blk, copy_cnt);
+    } else {
+        blks->blocks_table[blk->id] = NULL;
+        return DRPM_ERR_OK;
     }
 
     new->id = blk->id;
@@ -446,14 +598,90 @@ int push_block(struct blocks *blks, const struct block *blk, size_t copy_cnt)
 
     blks->blocks_table[new->id] = new;
 
+    heap_push(blks, new, use);
+
     return DRPM_ERR_OK;
 }
 
+/* Returns the first external copy after <copy_cnt> that reads block <id>. */
+size_t next_use(const struct blocks *blks, size_t id, size_t copy_cnt)
+{
+    size_t low = blks->uses_start[id];
+    size_t high = blks->uses_start[id + 1];
+    size_t mid;
+
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (blks->uses[mid] <= copy_cnt)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return (low < blks->uses_start[id + 1]) ? blks->uses[low] : NO_USE;
+}
+
+/* Core blocks holding data form a max-heap ordered by next use. */
+
+void heap_swap(struct blocks *blks, size_t i, size_t j)
+{
+    struct block *tmp = blks->heap[i];
+
+    blks->heap[i] = blks->heap[j];
+    blks->heap[j] = tmp;
+    blks->heap[i]->heap_pos = i;
+    blks->heap[j]->heap_pos = j;
+}
+
+void heap_sift(struct blocks *blks, size_t pos)
+{
+    size_t child;
+
+    while (pos > 0 && blks->heap[(pos - 1) / 2]->next_use < blks->heap[pos]->next_use) {
+        heap_swap(blks, pos, (pos - 1) / 2);
+        pos = (pos - 1) / 2;
+    }
+
+    while ((child = 2 * pos + 1) < blks->heap_len) {
+        if (child + 1 < blks->heap_len &&
+            blks->heap[child + 1]->next_use > blks->heap[child]->next_use)
+            child++;
+        if (blks->heap[child]->next_use <= blks->heap[pos]->next_use)
+            break;
+        heap_swap(blks, pos, child);
+        pos = child;
+    }
+}
+
+void heap_push(struct blocks *blks, struct block *blk, size_t use)
+{
+    blk->next_use = use;
+    blk->heap_pos = blks->heap_len++;
+    blks->heap[blk->heap_pos] = blk;
+    heap_sift(blks, blk->heap_pos);
+}
+
+void heap_remove(struct blocks *blks, struct block *blk)
+{
+    const size_t pos = blk->heap_pos;
+
+    if (pos != --blks->heap_len) {
+        heap_swap(blks, pos, blks->heap_len);
+        heap_sift(blks, pos);
+    }
+}
+
+void heap_update(struct blocks *blks, struct block *blk, size_t use)
+{
+    blk->next_use = use;
+    heap_sift(blks, blk->heap_pos);
+}
+
 /* insert a page block in table and writes its data to temporary file */
 int write_page_block(struct blocks *blks, const struct block *blk, size_t copy_cnt)
 {
     struct block *new;
-    char template[] = "/tmp/drpmpageXXXXXX";
+    char *template;
 
     if (blks == NULL || blk == NULL || blk->type == BLK_PAGE)
         return DRPM_ERR_PROG;
@@ -465,6 +693,19 @@ int write_page_block(struct blocks *blks, const struct block *blk, size_t copy_c
         }
     }
 
+    if (blks->page_filedesc < 0) {
+        if ((template = malloc(strlen(blks->spill_dir) + strlen("/drpmpageXXXXXX") + 1)) == NULL)
+            return DRPM_ERR_MEMORY;
+        strcpy(template, blks->spill_dir);
+        strcat(template, "/drpmpageXXXXXX");
+        if ((blks->page_filedesc = mkstemp(template)) < 0) {
+            free(template);
+            return DRPM_ERR_IO;
+        }
+        unlink(template);
+        free(template);
+    }
+
     for (new = blks->page_blocks; new != NULL; new = new->next)
         if (blks->blocks_max[new->id] < copy_cnt)
             break;
@@ -477,21 +718,12 @@ int write_page_block(struct blocks *blks, const struct block *blk, size_t copy_c
         new->next = blks->page_blocks;
         blks->page_blocks = new;
         blks->page_blocks_count++;
-        if (blks->page_filedesc < 0) {
-            if ((blks->page_filedesc = mkstemp(template)) < 0) {
-                free(new);
-                return DRPM_ERR_IO;
-            }
-            unlink(template);
-        }
     }
 
     new->id = blk->id;
 
-    if (pwrite(blks->page_filedesc, blk->data.buffer, BLOCK_SIZE, new->data.offset * BLOCK_SIZE) != BLOCK_SIZE) {
-        free(new);
+    if (page_write(blks, new->data.offset, blk->data.buffer) != DRPM_ERR_OK)
         return DRPM_ERR_IO;
-    }
 
     blks->blocks_table[new->id] = new;
 
@@ -501,11 +733,15 @@ int write_page_block(struct blocks *blks, const struct block *blk, size_t copy_c
 /* reads page block data from temporary file into destination block */
 int read_page_block(struct blocks *blks, struct block *dst, const struct block *src)
 {
+    const size_t slot = src->data.offset;
+
     if (blks == NULL || dst == NULL || src == NULL ||
         blks->page_filedesc < 0 || dst->type == BLK_PAGE || src->type != BLK_PAGE)
         return DRPM_ERR_PROG;
 
-    if (pread(blks->page_filedesc, dst->data.buffer, BLOCK_SIZE, src->data.offset * BLOCK_SIZE) != BLOCK_SIZE)
+    if (slot >= blks->spill_first && slot < blks->spill_first + blks->spill_len)
+        memcpy(dst->data.buffer, blks->spill_buffer + (slot - blks->spill_first) * BLOCK_SIZE, BLOCK_SIZE);
+    else if (pread(blks->page_filedesc, dst->data.buffer, BLOCK_SIZE, slot * BLOCK_SIZE) != BLOCK_SIZE)
         return DRPM_ERR_IO;
 
     dst->id = src->id;
@@ -515,6 +751,32 @@ int read_page_block(struct blocks *blks, struct block *dst, const struct block *
     return DRPM_ERR_OK;
 }
 
+/* Writes block data to <slot> of temporary file. Slots appended at the
+ * end are gathered in the spill buffer and written out an extent at a time. */
+int page_write(struct blocks *blks, size_t slot, const unsigned char *data)
+{
+    const size_t spill_end = blks->spill_first + blks->spill_len;
+
+    if (blks->spill_buffer != NULL && slot >= blks->spill_first && slot <= spill_end) {
+        memcpy(blks->spill_buffer + (slot - blks->spill_first) * BLOCK_SIZE, data, BLOCK_SIZE);
+        if (slot < spill_end)
+            return DRPM_ERR_OK;
+        if (++blks->spill_len < blks->spill_blocks)
+            return DRPM_ERR_OK;
+        if (pwrite(blks->page_filedesc, blks->spill_buffer, blks->spill_len * BLOCK_SIZE,
+                   blks->spill_first * BLOCK_SIZE) != (ssize_t)(blks->spill_len * BLOCK_SIZE))
+            return DRPM_ERR_IO;
+        blks->spill_first += blks->spill_len;
+        blks->spill_len = 0;
+        return DRPM_ERR_OK;
+    }
+
+    if (pwrite(blks->page_filedesc, data, BLOCK_SIZE, slot * BLOCK_SIZE) != BLOCK_SIZE)
+        return DRPM_ERR_IO;
+
+    return DRPM_ERR_OK;
+}
+
 /* fills CPIO header and linkto buffers based on file info at <index> */
 void fill_cpio_header(struct blocks *blks, ssize_t index)
 {
@@ -596,7 +858,7 @@ int open_new_file(struct blocks *blks, bool *prelinked, size_t index)
         }
     }
 
-    if (blks->rpm_files.from_filesytem.file_count < MAX_OPEN_FILES) {
+    if (blks->rpm_files.from_filesytem.file_count < blks->open_files_max) {
         if ((new = malloc(sizeof(struct open_file))) == NULL) {
             close(filedesc);
             return DRPM_ERR_MEMORY;
@@ -609,12 +871,15 @@ int open_new_file(struct blocks *blks, bool *prelinked, size_t index)
             files_tail = NULL;
         else
             files_head->prev = NULL;
+        blks->rpm_files.from_filesytem.open_files[new->index] = NULL;
         close(new->filedesc);
     }
 
     new->filedesc = filedesc;
     new->name = file.name;
     new->offset = 0;
+    new->index = index;
+    new->prefetched = false;
     new->prev = NULL;
     new->next = NULL;
 
@@ -666,6 +931,293 @@ struct open_file *get_open_file(struct blocks *blks, size_t index)
     return file;
 }
 
+/* Lets the kernel read installed files needed by upcoming external
+ * copies in the background, so that fillblock_filesystem() does not
+ * wait for each file in turn. Files are opened into the list of open
+ * files, where fillblock_filesystem() picks them up. */
+void prefetch_files(struct blocks *blks, size_t copy_cnt)
+{
+    uint32_t len;
+
+    for ( ; blks->prefetch_done < copy_cnt; blks->prefetch_done++) {
+        if (blks->prefetch_done < blks->prefetch_copy) {
+            blks->prefetch_len -= blks->ext_copies[2 * blks->prefetch_done + 1];
+        } else {
+            /* too late to prefetch this copy */
+            blks->prefetch_offset += (int32_t)blks->ext_copies[2 * blks->prefetch_copy];
+            blks->prefetch_offset += blks->ext_copies[2 * blks->prefetch_copy + 1];
+            blks->prefetch_copy++;
+        }
+    }
+
+    while (blks->prefetch_copy < blks->ext_copies_count && blks->prefetch_len < PREFETCH_SIZE) {
+        blks->prefetch_offset += (int32_t)blks->ext_copies[2 * blks->prefetch_copy];
+        len = blks->ext_copies[2 * blks->prefetch_copy + 1];
+        if (!prefetch_range(blks, blks->prefetch_offset, MIN(len, PREFETCH_SIZE))) {
+            /* retried once earlier prefetched files have been read */
+            blks->prefetch_offset -= (int32_t)blks->ext_copies[2 * blks->prefetch_copy];
+            break;
+        }
+        blks->prefetch_offset += len;
+        blks->prefetch_len += len;
+        blks->prefetch_copy++;
+    }
+}
+
+/* Advises reading of file contents within given range of external data.
+ * Returns false if that would close a prefetched file not read yet
+ * or the file currently read. */
+bool prefetch_range(struct blocks *blks, uint64_t offset, uint64_t len)
+{
+    const uint64_t end = offset + len;
+    const struct cpio_file *cpio;
+    const struct file_info *file;
+    uint64_t content_off;
+    uint64_t from;
+    uint64_t to;
+    size_t low = 0;
+    size_t high = blks->cpio_files_len;
+    size_t mid;
+    size_t pos;
+    struct open_file *open_file;
+    const struct open_file *oldest;
+    bool prelinked;
+
+    /* finding first entry ending after offset */
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        cpio = blks->cpio_files + mid;
+        if (cpio->offset + cpio->header_len + cpio->content_len <= offset)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    for (cpio = blks->cpio_files + low; cpio < blks->cpio_files + blks->cpio_files_len && cpio->offset < end; cpio++) {
+        if (cpio->index < 0)
+            continue;
+        file = blks->files + cpio->index;
+        content_off = cpio->offset + cpio->header_len;
+        if (!S_ISREG(file->mode) || end <= content_off)
+            continue;
+        from = (offset > content_off) ? offset - content_off : 0;
+        to = MIN(end - content_off, file->size);
+        if (from >= to)
+            continue;
+        pos = cpio - blks->cpio_files;
+        if ((open_file = blks->rpm_files.from_filesytem.open_files[pos]) == NULL) {
+            oldest = blks->rpm_files.from_filesytem.files_head;
+            if (blks->rpm_files.from_filesytem.file_count >= blks->open_files_max &&
+                (oldest->prefetched || (ssize_t)oldest->index == blks->cpio_files_index))
+                return false;
+            /* failures are left for fillblock_filesystem() to report */
+            if (open_new_file(blks, &prelinked, pos) != DRPM_ERR_OK || prelinked)
+                continue;
+            open_file = blks->rpm_files.from_filesytem.open_files[pos];
+            open_file->prefetched = true;
+        }
+        posix_fadvise(open_file->filedesc, from, to - from, POSIX_FADV_WILLNEED);
+    }
+
+    return true;
+}
+
+/****************************** segments ******************************/
+
+/* appends <len> bytes at <data> (or zeros if NULL) to external data */
+void segment_add(struct blocks *blks, const unsigned char *data, size_t len)
+{
+    struct segment *seg;
+
+    if (len == 0)
+        return;
+
+    seg = blks->segments + blks->segments_count++;
+    seg->offset = blks->segments_len;
+    seg->len = len;
+    seg->data = data;
+
+    blks->segments_len += len;
+}
+
+/* Points <*data> at external data at <offset>, up to <*len> bytes
+ * (updated to the number of bytes available there). */
+int segment_get(struct blocks *blks, const unsigned char **data, size_t *len, uint64_t offset)
+{
+    const struct segment *seg;
+    size_t lo;
+    size_t hi;
+    size_t mid;
+    size_t seg_off;
+
+    if (*len == 0 || offset + *len > blks->segments_len)
+        return DRPM_ERR_FORMAT;
+
+    /* copies are mostly sequential, so try last segment and its successor first */
+    seg = blks->segments + blks->last_segment;
+    if (offset >= seg->offset + seg->len && blks->last_segment + 1 < blks->segments_count)
+        seg = blks->segments + ++blks->last_segment;
+    if (offset < seg->offset || offset >= seg->offset + seg->len) {
+        lo = 0;
+        hi = blks->segments_count;
+        while (hi - lo > 1) {
+            mid = lo + (hi - lo) / 2;
+            if (blks->segments[mid].offset > offset)
+                hi = mid;
+            else
+                lo = mid;
+        }
+        blks->last_segment = lo;
+        seg = blks->segments + lo;
+    }
+
+    seg_off = offset - seg->offset;
+    *len = MIN(*len, seg->len - seg_off);
+    *data = (seg->data == NULL) ? zero_block : seg->data + seg_off;
+
+    return DRPM_ERR_OK;
+}
+
+/* Maps external data for a standard delta applied from old RPM.
+ * Uses stored file order to quickly locate files in the decompressed
+ * archive. CPIO entries are altered in the same way as when creating
+ * the delta, the altered headers being kept in a single buffer. */
+int map_rpm_standard(struct blocks *blks)
+{
+    int error = DRPM_ERR_OK;
+    const struct cpio_file *cpio;
+    const struct file_info *file;
+    struct rpm *old_rpm = blks->rpm_files.from_rpm.old_rpm;
+    struct cpio_header cpio_hdr;
+    const unsigned char *data;
+    unsigned char *header_ptr;
+    size_t headers_len = 0;
+    size_t c_namesize;
+    size_t c_filesize;
+    const char *name;
+    const char *name_end;
+    size_t name_len;
+    const char *file_name;
+    size_t link_len;
+
+    for (size_t i = 0; i < blks->cpio_files_len; i++)
+        headers_len += blks->cpio_files[i].header_len;
+
+    if ((blks->cpio_headers = malloc(MAX(headers_len, 1))) == NULL ||
+        (blks->segments = malloc((3 * blks->cpio_files_len + 1) * sizeof(struct segment))) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    header_ptr = blks->cpio_headers;
+
+    for (size_t i = 0; i < blks->cpio_files_len; i++) {
+        cpio = blks->cpio_files + i;
+
+        fill_cpio_header(blks, cpio->index);
+        memcpy(header_ptr, blks->cpio_buffer, cpio->header_len);
+        segment_add(blks, header_ptr, cpio->header_len);
+        header_ptr += cpio->header_len;
+
+        if (cpio->index < 0) {
+            segment_add(blks, NULL, cpio->content_len);
+            continue;
+        }
+
+        file = blks->files + cpio->index;
+        file_name = file->name + ((file->name[0] == '/') ? 1 : 0);
+
+        /* skipping archive entries up to the file */
+        while (true) {
+            if ((error = rpm_archive_map_chunk(old_rpm, &data, CPIO_HEADER_SIZE)) != DRPM_ERR_OK ||
+                (error = cpio_header_read(&cpio_hdr, (const char *)data)) != DRPM_ERR_OK)
+                return error;
+
+            c_namesize = cpio_hdr.namesize;
+            c_filesize = cpio_hdr.filesize;
+            c_filesize += CPIO_PADDING(c_filesize);
+
+            if (c_namesize == 0)
+                return DRPM_ERR_FORMAT;
+
+            if ((error = rpm_archive_map_chunk(old_rpm, &data, c_namesize)) != DRPM_ERR_OK ||
+                (error = rpm_archive_map_chunk(old_rpm, NULL, CPIO_PADDING(CPIO_HEADER_SIZE + c_namesize))) != DRPM_ERR_OK)
+                return error;
+
+            name = (const char *)data;
+            name_end = memchr(name, '\0', c_namesize - 1);
+            name_len = (name_end == NULL) ? c_namesize - 1 : (size_t)(name_end - name);
+
+            if (name_len == strlen(CPIO_TRAILER) &&
+                memcmp(name, CPIO_TRAILER, name_len) == 0)
+                return DRPM_ERR_FORMAT;
+
+            if (name_len >= 2 && strncmp(name, "./", 2) == 0) {
+                name += 2;
+                name_len -= 2;
+            }
+
+            if (name_len == strlen(file_name) &&
+                memcmp(name, file_name, name_len) == 0)
+                break;
+
+            if ((error = rpm_archive_map_chunk(old_rpm, NULL, c_filesize)) != DRPM_ERR_OK)
+                return error;
+        }
+
+        if (S_ISREG(file->mode)) {
+            if (c_filesize != cpio->content_len)
+                return DRPM_ERR_MISMATCH;
+            if ((error = rpm_archive_map_chunk(old_rpm, &data, c_filesize)) != DRPM_ERR_OK)
+                return error;
+            segment_add(blks, data, c_filesize);
+            continue;
+        }
+
+        if ((error = rpm_archive_map_chunk(old_rpm, NULL, c_filesize)) != DRPM_ERR_OK)
+            return error;
+
+        if (S_ISLNK(file->mode)) {
+            link_len = MIN(strlen(file->linkto), cpio->content_len);
+            segment_add(blks, (const unsigned char *)file->linkto, link_len);
+            segment_add(blks, NULL, cpio->content_len - link_len);
+        } else {
+            segment_add(blks, NULL, cpio->content_len);
+        }
+    }
+
+    /* trailer is padded with zeros up to the end of the block */
+    if (blks->segments_len % BLOCK_SIZE != 0)
+        segment_add(blks, NULL, BLOCK_SIZE - blks->segments_len % BLOCK_SIZE);
+
+    return DRPM_ERR_OK;
+}
+
+/* Maps external data for an rpm-only delta applied from old RPM.
+ * CPIO data is not altered, but old header is prepended. */
+int map_rpm_rpmonly(struct blocks *blks, uint64_t ext_data_len)
+{
+    int error;
+    const unsigned char *data;
+    size_t header_len;
+    size_t archive_len;
+
+    if ((blks->segments = malloc(3 * sizeof(struct segment))) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    header_len = MIN(blks->rpm_files.from_rpm.old_header_size, ext_data_len);
+    archive_len = ext_data_len - header_len;
+
+    if ((error = rpm_archive_map_chunk(blks->rpm_files.from_rpm.old_rpm, &data, archive_len)) != DRPM_ERR_OK)
+        return error;
+
+    segment_add(blks, blks->rpm_files.from_rpm.old_header, header_len);
+    segment_add(blks, data, archive_len);
+
+    if (blks->segments_len % BLOCK_SIZE != 0)
+        segment_add(blks, NULL, BLOCK_SIZE - blks->segments_len % BLOCK_SIZE);
+
+    return DRPM_ERR_OK;
+}
+
 /***************************** fill block *****************************/
 
 /* Fills a block from old RPM in the case of a standard delta.
@@ -928,6 +1480,8 @@ int fillblock_filesystem(struct blocks *blks, struct block *blk, size_t id, size
     if (blks == NULL || blk == NULL)
         return DRPM_ERR_PROG;
 
+    prefetch_files(blks, copy_cnt);
+
     buf_ptr = blk->data.buffer;
     len = BLOCK_SIZE;
     off = id * BLOCK_SIZE;
@@ -975,16 +1529,17 @@ int fillblock_filesystem(struct blocks *blks, struct block *blk, size_t id, size
                     strncpy((char *)buf_ptr, blks->linkto + file_off, read_len);
             } else if (file_off < blks->files[cpio->index].size) {
                 read_len = MIN(len, blks->files[cpio->index].size - file_off);
-                file = get_open_file(blks, cpio->index);
+                file = get_open_file(blks, blks->cpio_files_index);
                 if (file == NULL) {
-                    if ((error = open_new_file(blks, &prelinked, cpio->index)) != DRPM_ERR_OK)
+                    if ((error = open_new_file(blks, &prelinked, blks->cpio_files_index)) != DRPM_ERR_OK)
                         break;
                     if (prelinked) {
                         blks->cpio_files_index = -1;
                         return fillblock_prelink(blks, blk, id, copy_cnt, cpio);
                     }
-                    file = get_open_file(blks, cpio->index);
+                    file = get_open_file(blks, blks->cpio_files_index);
                 }
+                file->prefetched = false;
                 if (file->offset != (off_t)file_off && lseek(file->filedesc, file_off, SEEK_SET) != (off_t)file_off) {
                     error = DRPM_ERR_IO;
                     break;
@@ -1143,7 +1698,7 @@ int fillblock_prelink(struct blocks *blks, struct block *blk, size_t id, size_t
                                 goto cleanup;
                             if (prelinked) {
                                 close(filedesc);
-                                if ((error = prelink_open(blks->files[cpio->index].name, &filedesc)) != DRPM_ERR_OK)
+                                if ((error = prelink_open(blks->prelink, blks->files[cpio->index].name, &filedesc)) != DRPM_ERR_OK)
                                     goto cleanup;
                             }
                         }
@@ -27,42 +27,106 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <zlib.h>
 #include <bzlib.h>
 #include <lzma.h>
 #ifdef HAVE_LZLIB_DEVEL
 #include <lzlib.h>
 #endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#include <zstd_errors.h>
+#endif
 
 struct compstrm {
     unsigned char *data;
     size_t data_len;
     size_t data_pos;
-    int filedesc;
+    size_t data_alloc;
+    struct sink output;
     union {
         z_stream gzip;
         bz_stream bzip2;
         lzma_stream lzma;
 #ifdef HAVE_LZLIB_DEVEL
         struct LZ_Encoder *lzip;
+#endif
+#ifdef HAVE_ZSTD
+        ZSTD_CCtx *zstd;
 #endif
     } stream;
+    struct bzip2_mt *bzip2_mt;
     int (*write_chunk)(struct compstrm *, size_t, const void *);
     int (*finish)(struct compstrm *);
     bool finished;
+    bool keep_data; // no output, data kept for compstrm_finish()
+    struct checksum *md5; // updated with output (if not NULL)
+};
+
+/* Parallel bzip2 compression.
+ * libbz2 compresses each block independently, so its output can be
+ * reproduced exactly by compressing the input of each block as a separate
+ * single-block stream and concatenating the bit-aligned block data.
+ * Block boundaries are found by replaying libbz2's initial run-length
+ * encoding (see bzip2_mt_scan()). A run still pending when a block
+ * fills up is carried over to the next block, so a block's input ends
+ * where that run starts. */
+
+#define BZIP2_MT_BLOCK_MAX(level) (100000 * (level) - 19)
+#define BZIP2_MT_HEADER_BITS 32
+#define BZIP2_MT_EOS_MAGIC_HI 0x177245
+#define BZIP2_MT_EOS_MAGIC_LO 0x385090
+
+struct bzip2_mt_block {
+    const unsigned char *in;
+    size_t in_len;
+    int level;
+    char *out;
+    unsigned out_len;
+    int error;
+};
+
+struct bzip2_mt {
+    int level;
+    unsigned threads;
+    unsigned char *in; // buffered input
+    size_t in_len;
+    size_t in_alloc;
+    size_t scan_pos; // input already scanned for block boundaries
+    size_t *bounds; // where completed blocks end in input
+    size_t bounds_count;
+    size_t nblock; // size of block being filled
+    unsigned run_ch; // pending run (256 if none)
+    unsigned run_len;
+    uint32_t combined_crc;
+    uint32_t bit_buf; // output bits not yet forming a whole byte
+    unsigned bit_count;
 };
 
+static int compstrm_create(struct compstrm **, const struct sink *, unsigned short, int,
+                           unsigned, bool, struct checksum *);
+static int compstrm_flush(struct compstrm *);
+static int compstrm_reserve(struct compstrm *, size_t);
 static int finish_bzip2(struct compstrm *);
 static int finish_gzip(struct compstrm *);
 static int finish_lzma(struct compstrm *);
 static int init_bzip2(struct compstrm *, int);
 static int init_gzip(struct compstrm *, int);
 static int init_lzma(struct compstrm *, int);
-static int init_xz(struct compstrm *, int);
+static int init_xz(struct compstrm *, int, unsigned);
 static int writechunk(struct compstrm *, size_t, const void *);
 static int writechunk_bzip2(struct compstrm *, size_t, const void *);
 static int writechunk_gzip(struct compstrm *, size_t, const void *);
 static int writechunk_lzma(struct compstrm *, size_t, const void *);
+static int bzip2_mt_append(struct compstrm *, const struct bzip2_mt_block *);
+static int bzip2_mt_compress(struct compstrm *, bool);
+static void *bzip2_mt_compress_block(void *);
+static void bzip2_mt_put_bits(struct compstrm *, uint32_t, unsigned);
+static int bzip2_mt_scan(struct bzip2_mt *);
+static int finish_bzip2_mt(struct compstrm *);
+static int init_bzip2_mt(struct compstrm *, int, unsigned);
+static int writechunk_bzip2_mt(struct compstrm *, size_t, const void *);
 
 #ifdef HAVE_LZLIB_DEVEL
 static int finish_lzip(struct compstrm *);
@@ -85,13 +149,30 @@ static int lzip_error(struct compstrm *strm)
 }
 #endif
 
+#ifdef HAVE_ZSTD
+static int finish_zstd(struct compstrm *);
+static int init_zstd(struct compstrm *, int);
+static int writechunk_zstd(struct compstrm *, size_t, const void *);
+
+static int zstd_error(size_t ret)
+{
+    switch (ZSTD_getErrorCode(ret)) {
+    case ZSTD_error_no_error:
+        return DRPM_ERR_OK;
+    case ZSTD_error_memory_allocation:
+        return DRPM_ERR_MEMORY;
+    default:
+        return DRPM_ERR_OTHER;
+    }
+}
+#endif
+
 /* Functions for finishing compression for individual methods. */
 
 int finish_bzip2(struct compstrm *strm)
 {
     int error = DRPM_ERR_OK;
     int ret;
-    unsigned char *data_tmp;
     char out_buffer[CHUNK_SIZE];
     size_t out_len;
 
@@ -105,11 +186,8 @@ int finish_bzip2(struct compstrm *strm)
         out_len = CHUNK_SIZE - strm->stream.bzip2.avail_out;
         if (out_len == 0)
             continue;
-        if ((data_tmp = realloc(strm->data, strm->data_len + out_len)) == NULL) {
-            error = DRPM_ERR_MEMORY;
+        if ((error = compstrm_reserve(strm, out_len)) != DRPM_ERR_OK)
             goto cleanup;
-        }
-        strm->data = data_tmp;
         memcpy(strm->data + strm->data_len, out_buffer, out_len);
         strm->data_len += out_len;
     } while (ret != BZ_STREAM_END);
@@ -123,7 +201,6 @@ cleanup:
 int finish_gzip(struct compstrm *strm)
 {
     int error = DRPM_ERR_OK;
-    unsigned char *data_tmp;
     unsigned char out_buffer[CHUNK_SIZE];
     size_t out_len;
 
@@ -137,11 +214,8 @@ int finish_gzip(struct compstrm *strm)
         out_len = CHUNK_SIZE - strm->stream.gzip.avail_out;
         if (out_len == 0)
             continue;
-        if ((data_tmp = realloc(strm->data, strm->data_len + out_len)) == NULL) {
-            error = DRPM_ERR_MEMORY;
+        if ((error = compstrm_reserve(strm, out_len)) != DRPM_ERR_OK)
             goto cleanup;
-        }
-        strm->data = data_tmp;
         memcpy(strm->data + strm->data_len, out_buffer, out_len);
         strm->data_len += out_len;
     } while (strm->stream.gzip.avail_out == 0);
@@ -156,7 +230,6 @@ int finish_lzma(struct compstrm *strm)
 {
     int error = DRPM_ERR_OK;
     int ret;
-    unsigned char *data_tmp;
     unsigned char out_buffer[CHUNK_SIZE];
     size_t out_len;
 
@@ -180,11 +253,8 @@ int finish_lzma(struct compstrm *strm)
         out_len = CHUNK_SIZE - strm->stream.lzma.avail_out;
         if (out_len == 0)
             continue;
-        if ((data_tmp = realloc(strm->data, strm->data_len + out_len)) == NULL) {
-            error = DRPM_ERR_MEMORY;
+        if ((error = compstrm_reserve(strm, out_len)) != DRPM_ERR_OK)
             goto cleanup;
-        }
-        strm->data = data_tmp;
         memcpy(strm->data + strm->data_len, out_buffer, out_len);
         strm->data_len += out_len;
     } while (ret != LZMA_STREAM_END);
@@ -200,7 +270,6 @@ int finish_lzip(struct compstrm *strm)
 {
     int error = DRPM_ERR_OK;
     int rd;
-    unsigned char *data_tmp;
     unsigned char out_buffer[CHUNK_SIZE];
     size_t out_len;
 
@@ -216,11 +285,8 @@ int finish_lzip(struct compstrm *strm)
         out_len = rd;
         if (out_len == 0)
             continue;
-        if ((data_tmp = realloc(strm->data, strm->data_len + out_len)) == NULL) {
-            error = DRPM_ERR_MEMORY;
+        if ((error = compstrm_reserve(strm, out_len)) != DRPM_ERR_OK)
             goto cleanup;
-        }
-        strm->data = data_tmp;
         memcpy(strm->data + strm->data_len, out_buffer, out_len);
         strm->data_len += out_len;
     } while (!LZ_compress_finished(strm->stream.lzip));
@@ -232,6 +298,34 @@ cleanup:
 }
 #endif
 
+#ifdef HAVE_ZSTD
+int finish_zstd(struct compstrm *strm)
+{
+    int error = DRPM_ERR_OK;
+    ZSTD_inBuffer in = {NULL, 0, 0};
+    ZSTD_outBuffer out;
+    size_t ret;
+
+    do {
+        if ((error = compstrm_reserve(strm, ZSTD_CStreamOutSize())) != DRPM_ERR_OK)
+            goto cleanup;
+        out.dst = strm->data + strm->data_len;
+        out.size = strm->data_alloc - strm->data_len;
+        out.pos = 0;
+        if (ZSTD_isError(ret = ZSTD_compressStream2(strm->stream.zstd, &out, &in, ZSTD_e_end))) {
+            error = zstd_error(ret);
+            goto cleanup;
+        }
+        strm->data_len += out.pos;
+    } while (ret != 0);
+
+cleanup:
+    ZSTD_freeCCtx(strm->stream.zstd);
+
+    return error;
+}
+#endif
+
 /* Function for initializing compression for individual methods. */
 
 int init_bzip2(struct compstrm *strm, int level)
@@ -311,9 +405,12 @@ int init_lzma(struct compstrm *strm, int level)
     return DRPM_ERR_OK;
 }
 
-int init_xz(struct compstrm *strm, int level)
+/* With more than one thread, input is split into independently
+ * compressed blocks, so output differs from the single-threaded one. */
+int init_xz(struct compstrm *strm, int level, unsigned threads)
 {
     lzma_stream stream = LZMA_STREAM_INIT;
+    lzma_ret ret;
 
     strm->write_chunk = writechunk_lzma;
     strm->finish = finish_lzma;
@@ -323,7 +420,23 @@ int init_xz(struct compstrm *strm, int level)
     if (level == DRPM_COMP_LEVEL_DEFAULT)
         level = 3;
 
-    switch (lzma_easy_encoder(&strm->stream.lzma, level, LZMA_CHECK_SHA256)) {
+#if LZMA_VERSION >= 50020002U
+    if (threads > 1) {
+        lzma_mt mt = {
+            .threads = threads,
+            .preset = level,
+            .check = LZMA_CHECK_SHA256
+        };
+        ret = lzma_stream_encoder_mt(&strm->stream.lzma, &mt);
+    } else {
+        ret = lzma_easy_encoder(&strm->stream.lzma, level, LZMA_CHECK_SHA256);
+    }
+#else
+    (void)threads;
+    ret = lzma_easy_encoder(&strm->stream.lzma, level, LZMA_CHECK_SHA256);
+#endif
+
+    switch (ret) {
     case LZMA_OK:
         break;
     case LZMA_MEM_ERROR:
@@ -353,12 +466,44 @@ int init_lzip(struct compstrm *strm, int level)
 }
 #endif
 
+#ifdef HAVE_ZSTD
+/* Only the level is set and data is streamed (no pledged size), as by
+ * rpmbuild's zstdio without threads ("wN.zstdio"), so that its payloads
+ * are recompressed exactly. Multi-threaded zstd produces different
+ * output, so it is not used here. */
+int init_zstd(struct compstrm *strm, int level)
+{
+    size_t ret;
+
+    strm->write_chunk = writechunk_zstd;
+    strm->finish = finish_zstd;
+
+    if (level == DRPM_COMP_LEVEL_DEFAULT)
+        level = 3;
+
+    if ((strm->stream.zstd = ZSTD_createCCtx()) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    if (ZSTD_isError(ret = ZSTD_CCtx_setParameter(strm->stream.zstd, ZSTD_c_compressionLevel, level))) {
+        ZSTD_freeCCtx(strm->stream.zstd);
+        return zstd_error(ret);
+    }
+
+    return DRPM_ERR_OK;
+}
+#endif
+
 /* Frees memory allocated by compression stream. */
 int compstrm_destroy(struct compstrm **strm)
 {
     if (strm == NULL || *strm == NULL)
         return DRPM_ERR_PROG;
 
+    if ((*strm)->bzip2_mt != NULL) {
+        free((*strm)->bzip2_mt->in);
+        free((*strm)->bzip2_mt->bounds);
+        free((*strm)->bzip2_mt);
+    }
     free((*strm)->data);
     free(*strm);
     *strm = NULL;
@@ -371,9 +516,45 @@ int compstrm_destroy(struct compstrm **strm)
  * If <filedesc> is valid, compressed data will be written to the file. */
 int compstrm_init(struct compstrm **strm, int filedesc, unsigned short comp, int level)
 {
+    const struct sink output = {.filedesc = filedesc};
+
+    return compstrm_create(strm, &output, comp, level, 1, true, NULL);
+}
+
+/* Same as compstrm_init() without output, but compression may use up to
+ * <threads> threads even where that changes the compressed data
+ * (currently xz, which is then written in independently compressed
+ * blocks that can also be decompressed in parallel). Only for data
+ * that need not match a reference, i.e. the DeltaRPM itself. */
+int compstrm_init_par(struct compstrm **strm, unsigned short comp, int level, unsigned threads)
+{
+    return compstrm_create(strm, NULL, comp, level, threads, false, NULL);
+}
+
+/* Same as compstrm_init(), but compressed data is written to <output>
+ * (unless NULL), and compression may use up to <threads> threads where
+ * the output can be kept identical to that of a single thread
+ * (currently bzip2 only). If <md5> is not NULL, it is updated with
+ * compressed data as it is written.
+ * Data written to an output is not kept, so memory use does not depend
+ * on the size of the compressed data. Without an output, all compressed
+ * data is kept to be returned by compstrm_finish(). */
+int compstrm_init_mt(struct compstrm **strm, const struct sink *output, unsigned short comp, int level,
+                     unsigned threads, struct checksum *md5)
+{
+    return compstrm_create(strm, output, comp, level, threads, true, md5);
+}
+
+/* Common part of compstrm_init*(). If <exact>, threads are only used
+ * where output stays identical to that of a single thread. */
+int compstrm_create(struct compstrm **strm, const struct sink *output, unsigned short comp, int level,
+                    unsigned threads, bool exact, struct checksum *md5)
+{
+    const struct sink no_output = {.filedesc = -1};
+
     int error;
 
-    if (strm == NULL || (level != DRPM_COMP_LEVEL_DEFAULT && (level < 1 || level > 9)))
+    if (strm == NULL || (level != DRPM_COMP_LEVEL_DEFAULT && (level < 1 || level > COMP_LEVEL_MAX(comp))))
         return DRPM_ERR_PROG;
 
     if ((*strm = malloc(sizeof(struct compstrm))) == NULL)
@@ -382,8 +563,12 @@ int compstrm_init(struct compstrm **strm, int filedesc, unsigned short comp, int
     (*strm)->data = NULL;
     (*strm)->data_len = 0;
     (*strm)->data_pos = 0;
-    (*strm)->filedesc = filedesc;
+    (*strm)->data_alloc = 0;
+    (*strm)->output = (output != NULL) ? *output : no_output;
+    (*strm)->bzip2_mt = NULL;
     (*strm)->finished = false;
+    (*strm)->keep_data = ((*strm)->output.filedesc < 0 && (*strm)->output.write_func == NULL);
+    (*strm)->md5 = md5;
 
     switch (comp) {
     case DRPM_COMP_NONE:
@@ -395,7 +580,8 @@ int compstrm_init(struct compstrm **strm, int filedesc, unsigned short comp, int
             goto cleanup_fail;
         break;
     case DRPM_COMP_BZIP2:
-        if ((error = init_bzip2(*strm, level)) != DRPM_ERR_OK)
+        if ((error = (threads > 1) ? init_bzip2_mt(*strm, level, threads) :
+                                     init_bzip2(*strm, level)) != DRPM_ERR_OK)
             goto cleanup_fail;
         break;
     case DRPM_COMP_LZMA:
@@ -403,7 +589,7 @@ int compstrm_init(struct compstrm **strm, int filedesc, unsigned short comp, int
             goto cleanup_fail;
         break;
     case DRPM_COMP_XZ:
-        if ((error = init_xz(*strm, level)) != DRPM_ERR_OK)
+        if ((error = init_xz(*strm, level, exact ? 1 : threads)) != DRPM_ERR_OK)
             goto cleanup_fail;
         break;
 #ifdef HAVE_LZLIB_DEVEL
@@ -411,14 +597,22 @@ int compstrm_init(struct compstrm **strm, int filedesc, unsigned short comp, int
         if ((error = init_lzip(*strm, level)) != DRPM_ERR_OK)
             goto cleanup_fail;
         break;
+#endif
+#ifdef HAVE_ZSTD
+    case DRPM_COMP_ZSTD:
+        if ((error = init_zstd(*strm, level)) != DRPM_ERR_OK)
+            goto cleanup_fail;
+        break;
 #endif
     default:
-        return DRPM_ERR_PROG;
+        error = DRPM_ERR_PROG;
+        goto cleanup_fail;
     }
 
     return DRPM_ERR_OK;
 
 cleanup_fail:
+    free((*strm)->data);
     free(*strm);
     *strm = NULL;
 
@@ -427,14 +621,14 @@ cleanup_fail:
 
 /* Finishes up compression.
  * If neither <data> nor <data_len> are NULL, stores all data
- * compressed by this stream in <*data> (and its size in <*data_len>). */
+ * compressed by this stream in <*data> (and its size in <*data_len>).
+ * This is only possible for streams without output. */
 int compstrm_finish(struct compstrm *strm, unsigned char **data, size_t *data_len)
 {
     int error;
-    size_t comp_write_len;
     const bool copy_data = (data != NULL && data_len != NULL);
 
-    if (strm == NULL || strm->finished)
+    if (strm == NULL || strm->finished || (copy_data && !strm->keep_data))
         return DRPM_ERR_PROG;
 
     if (copy_data) {
@@ -443,13 +637,9 @@ int compstrm_finish(struct compstrm *strm, unsigned char **data, size_t *data_le
     }
 
     if (strm->finish != NULL) {
-        if ((error = strm->finish(strm)) != DRPM_ERR_OK)
+        if ((error = strm->finish(strm)) != DRPM_ERR_OK ||
+            (error = compstrm_flush(strm)) != DRPM_ERR_OK)
             return error;
-        comp_write_len = strm->data_len - strm->data_pos;
-        if (strm->filedesc >= 0 && comp_write_len > 0 &&
-            write(strm->filedesc, strm->data + strm->data_pos,
-                  comp_write_len) != (ssize_t)comp_write_len)
-                return DRPM_ERR_IO;
     }
 
     strm->finished = true;
@@ -464,6 +654,18 @@ int compstrm_finish(struct compstrm *strm, unsigned char **data, size_t *data_le
     return DRPM_ERR_OK;
 }
 
+/* Fetches size of data compressed so far by a stream without output.
+ * Compressors buffer input, so this may lag behind what was written. */
+int compstrm_get_comp_size(struct compstrm *strm, size_t *size)
+{
+    if (strm == NULL || size == NULL || !strm->keep_data)
+        return DRPM_ERR_PROG;
+
+    *size = strm->data_len;
+
+    return DRPM_ERR_OK;
+}
+
 int compstrm_write_be32(struct compstrm *strm, uint32_t number)
 {
     unsigned char bytes[4];
@@ -492,7 +694,6 @@ int compstrm_write_be64(struct compstrm *strm, uint64_t number)
 int compstrm_write(struct compstrm *strm, size_t write_len, const void *buffer)
 {
     int error;
-    size_t comp_write_len;
 
     if (strm == NULL || strm->finished)
         return DRPM_ERR_PROG;
@@ -506,15 +707,52 @@ int compstrm_write(struct compstrm *strm, size_t write_len, const void *buffer)
     if ((error = strm->write_chunk(strm, write_len, buffer)) != DRPM_ERR_OK)
         return error;
 
-    comp_write_len = strm->data_len - strm->data_pos;
+    return compstrm_flush(strm);
+}
+
+/* Passes data compressed since last call to output (and MD5).
+ * Unless kept, the data is then dropped and its buffer reused. */
+int compstrm_flush(struct compstrm *strm)
+{
+    int error;
+    const size_t comp_write_len = strm->data_len - strm->data_pos;
+
+    if (comp_write_len == 0)
+        return DRPM_ERR_OK;
+
+    if ((error = sink_write(&strm->output, strm->data + strm->data_pos,
+                            comp_write_len)) != DRPM_ERR_OK ||
+        (strm->md5 != NULL &&
+         (error = checksum_update(strm->md5, strm->data + strm->data_pos,
+                                  comp_write_len)) != DRPM_ERR_OK))
+        return error;
 
-    if (strm->filedesc >= 0 && comp_write_len > 0) {
-        if (write(strm->filedesc, strm->data + strm->data_pos,
-                  comp_write_len) != (ssize_t)comp_write_len)
-            return DRPM_ERR_IO;
+    if (strm->keep_data) {
+        strm->data_pos = strm->data_len;
+    } else {
+        strm->data_len = 0;
+        strm->data_pos = 0;
     }
 
-    strm->data_pos = strm->data_len;
+    return DRPM_ERR_OK;
+}
+
+/* Makes room for <len> more bytes of compressed data. */
+int compstrm_reserve(struct compstrm *strm, size_t len)
+{
+    unsigned char *data_tmp;
+    size_t data_alloc;
+
+    if (strm->data_len + len <= strm->data_alloc)
+        return DRPM_ERR_OK;
+
+    data_alloc = MAX(MAX(2 * strm->data_alloc, strm->data_len + len), CHUNK_SIZE);
+
+    if ((data_tmp = realloc(strm->data, data_alloc)) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    strm->data = data_tmp;
+    strm->data_alloc = data_alloc;
 
     return DRPM_ERR_OK;
 }
@@ -524,12 +762,11 @@ int compstrm_write(struct compstrm *strm, size_t write_len, const void *buffer)
 // no compression
 int writechunk(struct compstrm *strm, size_t in_len, const void *in_buffer)
 {
-    unsigned char *data_tmp;
+    int error;
 
-    if ((data_tmp = realloc(strm->data, strm->data_len + in_len)) == NULL)
-        return DRPM_ERR_MEMORY;
+    if ((error = compstrm_reserve(strm, in_len)) != DRPM_ERR_OK)
+        return error;
 
-    strm->data = data_tmp;
     memcpy(strm->data + strm->data_len, in_buffer, in_len);
     strm->data_len += in_len;
 
@@ -538,9 +775,9 @@ int writechunk(struct compstrm *strm, size_t in_len, const void *in_buffer)
 
 int writechunk_bzip2(struct compstrm *strm, size_t in_len, const void *in_buffer)
 {
-    unsigned char *data_tmp;
     char out_buffer[CHUNK_SIZE];
     size_t out_len;
+    int error;
 
     strm->stream.bzip2.next_in = (char *)in_buffer;
     strm->stream.bzip2.avail_in = in_len;
@@ -552,9 +789,8 @@ int writechunk_bzip2(struct compstrm *strm, size_t in_len, const void *in_buffer
         out_len = CHUNK_SIZE - strm->stream.bzip2.avail_out;
         if (out_len == 0)
             continue;
-        if ((data_tmp = realloc(strm->data, strm->data_len + out_len)) == NULL)
-            return DRPM_ERR_MEMORY;
-        strm->data = data_tmp;
+        if ((error = compstrm_reserve(strm, out_len)) != DRPM_ERR_OK)
+            return error;
         memcpy(strm->data + strm->data_len, out_buffer, out_len);
         strm->data_len += out_len;
     } while (strm->stream.bzip2.avail_out == 0);
@@ -564,9 +800,9 @@ int writechunk_bzip2(struct compstrm *strm, size_t in_len, const void *in_buffer
 
 int writechunk_gzip(struct compstrm *strm, size_t in_len, const void *in_buffer)
 {
-    unsigned char *data_tmp;
     unsigned char out_buffer[CHUNK_SIZE];
     size_t out_len;
+    int error;
 
     strm->stream.gzip.next_in = (unsigned char *)in_buffer;
     strm->stream.gzip.avail_in = in_len;
@@ -578,9 +814,8 @@ int writechunk_gzip(struct compstrm *strm, size_t in_len, const void *in_buffer)
         out_len = CHUNK_SIZE - strm->stream.gzip.avail_out;
         if (out_len == 0)
             continue;
-        if ((data_tmp = realloc(strm->data, strm->data_len + out_len)) == NULL)
-            return DRPM_ERR_MEMORY;
-        strm->data = data_tmp;
+        if ((error = compstrm_reserve(strm, out_len)) != DRPM_ERR_OK)
+            return error;
         memcpy(strm->data + strm->data_len, out_buffer, out_len);
         strm->data_len += out_len;
     } while (strm->stream.gzip.avail_out == 0);
@@ -590,9 +825,9 @@ int writechunk_gzip(struct compstrm *strm, size_t in_len, const void *in_buffer)
 
 int writechunk_lzma(struct compstrm *strm, size_t in_len, const void *in_buffer)
 {
-    unsigned char *data_tmp;
     unsigned char out_buffer[CHUNK_SIZE];
     size_t out_len;
+    int error;
 
     strm->stream.lzma.next_in = (unsigned char *)in_buffer;
     strm->stream.lzma.avail_in = in_len;
@@ -611,12 +846,11 @@ int writechunk_lzma(struct compstrm *strm, size_t in_len, const void *in_buffer)
         out_len = CHUNK_SIZE - strm->stream.lzma.avail_out;
         if (out_len == 0)
             continue;
-        if ((data_tmp = realloc(strm->data, strm->data_len + out_len)) == NULL)
-            return DRPM_ERR_MEMORY;
-        strm->data = data_tmp;
+        if ((error = compstrm_reserve(strm, out_len)) != DRPM_ERR_OK)
+            return error;
         memcpy(strm->data + strm->data_len, out_buffer, out_len);
         strm->data_len += out_len;
-    } while (strm->stream.lzma.avail_out == 0);
+    } while (strm->stream.lzma.avail_out == 0 || strm->stream.lzma.avail_in > 0);
 
     return DRPM_ERR_OK;
 }
@@ -625,7 +859,6 @@ int writechunk_lzma(struct compstrm *strm, size_t in_len, const void *in_buffer)
 int writechunk_lzip(struct compstrm *strm, size_t in_len, const void *in_buffer)
 {
     int error;
-    unsigned char *data_tmp;
     unsigned char out_buffer[CHUNK_SIZE];
     size_t out_len;
     size_t written = 0;
@@ -649,9 +882,8 @@ int writechunk_lzip(struct compstrm *strm, size_t in_len, const void *in_buffer)
         out_len = rd;
         if (out_len == 0)
             continue;
-        if ((data_tmp = realloc(strm->data, strm->data_len + out_len)) == NULL)
-            return DRPM_ERR_MEMORY;
-        strm->data = data_tmp;
+        if ((error = compstrm_reserve(strm, out_len)) != DRPM_ERR_OK)
+            return error;
         memcpy(strm->data + strm->data_len, out_buffer, out_len);
         strm->data_len += out_len;
     };
@@ -659,3 +891,331 @@ int writechunk_lzip(struct compstrm *strm, size_t in_len, const void *in_buffer)
     return DRPM_ERR_OK;
 }
 #endif
+
+#ifdef HAVE_ZSTD
+int writechunk_zstd(struct compstrm *strm, size_t in_len, const void *in_buffer)
+{
+    int error;
+    ZSTD_inBuffer in = {in_buffer, in_len, 0};
+    ZSTD_outBuffer out;
+    size_t ret;
+
+    while (in.pos < in.size) {
+        if ((error = compstrm_reserve(strm, ZSTD_CStreamOutSize())) != DRPM_ERR_OK)
+            return error;
+        out.dst = strm->data + strm->data_len;
+        out.size = strm->data_alloc - strm->data_len;
+        out.pos = 0;
+        if (ZSTD_isError(ret = ZSTD_compressStream2(strm->stream.zstd, &out, &in, ZSTD_e_continue)))
+            return zstd_error(ret);
+        strm->data_len += out.pos;
+    }
+
+    return DRPM_ERR_OK;
+}
+#endif
+
+/* Parallel bzip2 (see struct bzip2_mt). */
+
+int init_bzip2_mt(struct compstrm *strm, int level, unsigned threads)
+{
+    struct bzip2_mt *mt;
+
+    if (level == DRPM_COMP_LEVEL_DEFAULT)
+        level = 9;
+
+    if ((mt = malloc(sizeof(struct bzip2_mt))) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    if ((mt->bounds = malloc(threads * sizeof(size_t))) == NULL ||
+        compstrm_reserve(strm, 4) != DRPM_ERR_OK) {
+        free(mt->bounds);
+        free(mt);
+        return DRPM_ERR_MEMORY;
+    }
+
+    mt->level = level;
+    mt->threads = threads;
+    mt->in = NULL;
+    mt->in_len = 0;
+    mt->in_alloc = 0;
+    mt->scan_pos = 0;
+    mt->bounds_count = 0;
+    mt->nblock = 0;
+    mt->run_ch = 256;
+    mt->run_len = 0;
+    mt->combined_crc = 0;
+    mt->bit_buf = 0;
+    mt->bit_count = 0;
+
+    strm->bzip2_mt = mt;
+    strm->write_chunk = writechunk_bzip2_mt;
+    strm->finish = finish_bzip2_mt;
+
+    /* stream header ("BZh" and block size) */
+    bzip2_mt_put_bits(strm, 'B', 8);
+    bzip2_mt_put_bits(strm, 'Z', 8);
+    bzip2_mt_put_bits(strm, 'h', 8);
+    bzip2_mt_put_bits(strm, '0' + level, 8);
+
+    return DRPM_ERR_OK;
+}
+
+int writechunk_bzip2_mt(struct compstrm *strm, size_t in_len, const void *in_buffer)
+{
+    int error;
+    struct bzip2_mt *mt = strm->bzip2_mt;
+    unsigned char *in_tmp;
+    size_t in_alloc;
+
+    if (mt->in_len + in_len > mt->in_alloc) {
+        in_alloc = MAX(mt->in_len + in_len,
+                       (size_t)BZIP2_MT_BLOCK_MAX(mt->level) * (mt->threads + 1));
+        if ((in_tmp = realloc(mt->in, in_alloc)) == NULL)
+            return DRPM_ERR_MEMORY;
+        mt->in = in_tmp;
+        mt->in_alloc = in_alloc;
+    }
+
+    memcpy(mt->in + mt->in_len, in_buffer, in_len);
+    mt->in_len += in_len;
+
+    while (mt->scan_pos < mt->in_len) {
+        if ((error = bzip2_mt_scan(mt)) != DRPM_ERR_OK ||
+            (mt->bounds_count == mt->threads &&
+             (error = bzip2_mt_compress(strm, false)) != DRPM_ERR_OK))
+            return error;
+    }
+
+    return DRPM_ERR_OK;
+}
+
+int finish_bzip2_mt(struct compstrm *strm)
+{
+    int error;
+    struct bzip2_mt *mt = strm->bzip2_mt;
+
+    /* a block filled up by the very last byte still ends there */
+    if (mt->nblock >= (size_t)BZIP2_MT_BLOCK_MAX(mt->level)) {
+        if (mt->bounds_count == mt->threads &&
+            (error = bzip2_mt_compress(strm, false)) != DRPM_ERR_OK)
+            return error;
+        mt->bounds[mt->bounds_count++] = mt->in_len - mt->run_len;
+        mt->nblock = 0;
+    }
+
+    if ((error = bzip2_mt_compress(strm, true)) != DRPM_ERR_OK)
+        return error;
+
+    if ((error = compstrm_reserve(strm, 11)) != DRPM_ERR_OK)
+        return error;
+
+    /* end of stream marker, combined CRC and padding */
+    bzip2_mt_put_bits(strm, BZIP2_MT_EOS_MAGIC_HI, 24);
+    bzip2_mt_put_bits(strm, BZIP2_MT_EOS_MAGIC_LO, 24);
+    bzip2_mt_put_bits(strm, mt->combined_crc >> 16, 16);
+    bzip2_mt_put_bits(strm, mt->combined_crc & 0xFFFF, 16);
+    if (mt->bit_count > 0)
+        bzip2_mt_put_bits(strm, 0, 8 - mt->bit_count);
+
+    return DRPM_ERR_OK;
+}
+
+/* Replays libbz2's run-length encoding (ADD_CHAR_TO_BLOCK) over
+ * buffered input until a block fills up or the input runs out. */
+int bzip2_mt_scan(struct bzip2_mt *mt)
+{
+    const size_t nblock_max = BZIP2_MT_BLOCK_MAX(mt->level);
+    unsigned ch;
+
+    for (; mt->scan_pos < mt->in_len; mt->scan_pos++) {
+        if (mt->nblock >= nblock_max) {
+            if (mt->bounds_count == mt->threads)
+                return DRPM_ERR_PROG;
+            mt->bounds[mt->bounds_count++] = mt->scan_pos - mt->run_len;
+            mt->nblock = 0;
+            if (mt->bounds_count == mt->threads)
+                return DRPM_ERR_OK;
+        }
+        ch = mt->in[mt->scan_pos];
+        if (ch != mt->run_ch && mt->run_len == 1) {
+            mt->nblock++;
+            mt->run_ch = ch;
+        } else if (ch != mt->run_ch || mt->run_len == 255) {
+            if (mt->run_ch < 256)
+                mt->nblock += (mt->run_len < 4) ? mt->run_len : 5;
+            mt->run_ch = ch;
+            mt->run_len = 1;
+        } else {
+            mt->run_len++;
+        }
+    }
+
+    return DRPM_ERR_OK;
+}
+
+void *bzip2_mt_compress_block(void *arg)
+{
+    struct bzip2_mt_block *blk = arg;
+
+    blk->out_len = blk->in_len + blk->in_len / 100 + 600;
+
+    if ((blk->out = malloc(blk->out_len)) == NULL) {
+        blk->error = DRPM_ERR_MEMORY;
+        return NULL;
+    }
+
+    switch (BZ2_bzBuffToBuffCompress(blk->out, &blk->out_len, (char *)blk->in, blk->in_len,
+                                     blk->level, 0, 0)) {
+    case BZ_OK:
+        blk->error = DRPM_ERR_OK;
+        break;
+    case BZ_MEM_ERROR:
+        blk->error = DRPM_ERR_MEMORY;
+        break;
+    case BZ_CONFIG_ERROR:
+        blk->error = DRPM_ERR_CONFIG;
+        break;
+    default:
+        blk->error = DRPM_ERR_OTHER;
+        break;
+    }
+
+    return NULL;
+}
+
+/* Compresses completed blocks in parallel and appends them to output.
+ * If <last> is true, the remaining input forms the final block. */
+int bzip2_mt_compress(struct compstrm *strm, bool last)
+{
+    int error = DRPM_ERR_OK;
+    struct bzip2_mt *mt = strm->bzip2_mt;
+    struct bzip2_mt_block *blks;
+    pthread_t *threads;
+    bool *started;
+    size_t blks_count = mt->bounds_count;
+    size_t start = 0;
+    size_t end;
+
+    if (last && mt->in_len > (blks_count > 0 ? mt->bounds[blks_count - 1] : 0))
+        blks_count++;
+
+    if (blks_count == 0)
+        return DRPM_ERR_OK;
+
+    blks = calloc(blks_count, sizeof(struct bzip2_mt_block));
+    threads = malloc(blks_count * sizeof(pthread_t));
+    started = calloc(blks_count, sizeof(bool));
+
+    if (blks == NULL || threads == NULL || started == NULL) {
+        error = DRPM_ERR_MEMORY;
+        goto cleanup;
+    }
+
+    for (size_t i = 0; i < blks_count; i++) {
+        end = (i < mt->bounds_count) ? mt->bounds[i] : mt->in_len;
+        blks[i].in = mt->in + start;
+        blks[i].in_len = end - start;
+        blks[i].level = mt->level;
+        start = end;
+        if (i + 1 < blks_count)
+            started[i] = (pthread_create(&threads[i], NULL, bzip2_mt_compress_block, &blks[i]) == 0);
+        if (!started[i])
+            bzip2_mt_compress_block(&blks[i]);
+    }
+
+    for (size_t i = 0; i < blks_count; i++) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        if (error == DRPM_ERR_OK && (error = blks[i].error) == DRPM_ERR_OK)
+            error = bzip2_mt_append(strm, &blks[i]);
+    }
+
+    if (error != DRPM_ERR_OK)
+        goto cleanup;
+
+    /* discarding compressed input */
+    memmove(mt->in, mt->in + start, mt->in_len - start);
+    mt->in_len -= start;
+    mt->scan_pos -= start;
+    mt->bounds_count = 0;
+
+cleanup:
+    if (blks != NULL)
+        for (size_t i = 0; i < blks_count; i++)
+            free(blks[i].out);
+    free(blks);
+    free(threads);
+    free(started);
+
+    return error;
+}
+
+/* Appends the block from a single-block bzip2 stream to output. */
+int bzip2_mt_append(struct compstrm *strm, const struct bzip2_mt_block *blk)
+{
+    struct bzip2_mt *mt = strm->bzip2_mt;
+    const unsigned char *out = (const unsigned char *)blk->out;
+    const size_t out_bits = (size_t)blk->out_len * 8;
+    uint32_t block_crc;
+    size_t end_bits = 0;
+    size_t bit;
+    unsigned pad;
+    uint64_t magic;
+    uint32_t crc;
+    int error;
+
+    if (blk->out_len < 14)
+        return DRPM_ERR_PROG;
+
+    /* block CRC follows 48-bit block magic */
+    block_crc = parse_be32(out + 10);
+
+    /* locating end of block data, i.e. end of stream marker
+     * and combined CRC (same as block CRC) followed by padding */
+    for (pad = 0; pad < 8; pad++) {
+        end_bits = out_bits - pad - 80;
+        magic = 0;
+        for (bit = end_bits; bit < end_bits + 48; bit++)
+            magic = (magic << 1) | ((out[bit / 8] >> (7 - bit % 8)) & 1);
+        crc = 0;
+        for (; bit < end_bits + 80; bit++)
+            crc = (crc << 1) | ((out[bit / 8] >> (7 - bit % 8)) & 1);
+        if (magic == (((uint64_t)BZIP2_MT_EOS_MAGIC_HI << 24) | BZIP2_MT_EOS_MAGIC_LO) &&
+            crc == block_crc &&
+            (pad == 0 || (out[blk->out_len - 1] & ((1 << pad) - 1)) == 0))
+            break;
+    }
+
+    if (pad == 8)
+        return DRPM_ERR_FORMAT;
+
+    if ((error = compstrm_reserve(strm, blk->out_len)) != DRPM_ERR_OK)
+        return error;
+
+    for (bit = BZIP2_MT_HEADER_BITS; bit + 8 <= end_bits; bit += 8)
+        bzip2_mt_put_bits(strm, out[bit / 8], 8);
+    for (; bit < end_bits; bit++)
+        bzip2_mt_put_bits(strm, (out[bit / 8] >> (7 - bit % 8)) & 1, 1);
+
+    mt->combined_crc = ((mt->combined_crc << 1) | (mt->combined_crc >> 31)) ^ block_crc;
+
+    return DRPM_ERR_OK;
+}
+
+/* Appends <count> (at most 24) low bits of <value> to output.
+ * Space for the completed bytes must have been allocated beforehand. */
+void bzip2_mt_put_bits(struct compstrm *strm, uint32_t value, unsigned count)
+{
+    struct bzip2_mt *mt = strm->bzip2_mt;
+
+    mt->bit_buf = (mt->bit_buf << count) | (value & ((1U << count) - 1));
+    mt->bit_count += count;
+
+    while (mt->bit_count >= 8) {
+        mt->bit_count -= 8;
+        strm->data[strm->data_len++] = mt->bit_buf >> mt->bit_count;
+    }
+
+    mt->bit_buf &= (1U << mt->bit_count) - 1;
+}
@@ -23,17 +23,23 @@
 #include "drpm_private.h"
 
 #include <stdlib.h>
+#include <limits.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <zlib.h>
 #include <bzlib.h>
 #include <lzma.h>
 #ifdef HAVE_LZLIB_DEVEL
 #include <lzlib.h>
 #endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#include <zstd_errors.h>
+#endif
 #include <openssl/md5.h>
 
 /* magic bytes for determining compression type */
@@ -42,11 +48,19 @@
 #define MAGIC_LZMA(x) (((x) >> 40) == 0x5D0000)
 #define MAGIC_XZ(x) (((x) >> 16) == 0xFD377A585A00)
 #define MAGIC_LZIP(x) (((x) >> 32) == 0x4C5A4950)
+#define MAGIC_ZSTD(x) (((x) >> 32) == 0x28B52FFD)
+
+/* size of input chunks and of free space kept for decompressed data */
+#define DECOMP_CHUNK_SIZE 65536
+
+/* upper limit on threads used by decompressors that support them */
+#define DECOMP_THREADS_MAX 16
 
 struct decompstrm {
-    unsigned char *data;
+    unsigned char *data; // decompressed data not yet discarded
     size_t data_len;
     size_t data_pos;
+    size_t data_alloc;
     int filedesc;
     union {
         z_stream gzip;
@@ -54,32 +68,43 @@ struct decompstrm {
         lzma_stream lzma;
 #ifdef HAVE_LZLIB_DEVEL
         struct LZ_Decoder *lzip;
+#endif
+#ifdef HAVE_ZSTD
+        ZSTD_DCtx *zstd;
 #endif
     } stream;
     bool lzip_eof;
-    int (*read_chunk)(struct decompstrm *);
+    int (*decode)(struct decompstrm *, unsigned char *, size_t, size_t *);
     void (*finish)(struct decompstrm *);
     size_t comp_size;
-    MD5_CTX *md5;
+    struct checksum *md5;
     const unsigned char *buffer;
     size_t buffer_len;
+    unsigned char *in_data; // input buffer (when reading from file)
+    const unsigned char *in_next; // compressed data not yet decoded
+    size_t in_avail;
+    bool in_eof;
 };
 
+static int account_input(struct decompstrm *, const unsigned char *, size_t);
+static int decode(struct decompstrm *, unsigned char *, size_t, size_t *);
+static int decode_bzip2(struct decompstrm *, unsigned char *, size_t, size_t *);
+static int decode_gzip(struct decompstrm *, unsigned char *, size_t, size_t *);
+static int decode_lzma(struct decompstrm *, unsigned char *, size_t, size_t *);
+static int decode_some(struct decompstrm *, unsigned char *, size_t, size_t *);
+static int decompstrm_reserve(struct decompstrm *, size_t);
+static int fill_input(struct decompstrm *);
 static void finish_bzip2(struct decompstrm *);
 static void finish_gzip(struct decompstrm *);
 static void finish_lzma(struct decompstrm *);
 static int init_bzip2(struct decompstrm *);
 static int init_gzip(struct decompstrm *);
-static int init_lzma(struct decompstrm *);
-static int readchunk(struct decompstrm *);
-static int readchunk_bzip2(struct decompstrm *);
-static int readchunk_gzip(struct decompstrm *);
-static int readchunk_lzma(struct decompstrm *);
+static int init_lzma(struct decompstrm *, bool);
 
 #ifdef HAVE_LZLIB_DEVEL
+static int decode_lzip(struct decompstrm *, unsigned char *, size_t, size_t *);
 static void finish_lzip(struct decompstrm *);
 static int init_lzip(struct decompstrm *);
-static int readchunk_lzip(struct decompstrm *);
 
 static int lzip_error(struct decompstrm *strm)
 {
@@ -97,6 +122,24 @@ static int lzip_error(struct decompstrm *strm)
 }
 #endif
 
+#ifdef HAVE_ZSTD
+static int decode_zstd(struct decompstrm *, unsigned char *, size_t, size_t *);
+static void finish_zstd(struct decompstrm *);
+static int init_zstd(struct decompstrm *);
+
+static int zstd_error(size_t ret)
+{
+    switch (ZSTD_getErrorCode(ret)) {
+    case ZSTD_error_no_error:
+        return DRPM_ERR_OK;
+    case ZSTD_error_memory_allocation:
+        return DRPM_ERR_MEMORY;
+    default:
+        return DRPM_ERR_FORMAT;
+    }
+}
+#endif
+
 /* Functions for finishing decompression for individual methods. */
 
 void finish_bzip2(struct decompstrm *strm)
@@ -121,11 +164,18 @@ void finish_lzip(struct decompstrm *strm)
 }
 #endif
 
+#ifdef HAVE_ZSTD
+void finish_zstd(struct decompstrm *strm)
+{
+    ZSTD_freeDCtx(strm->stream.zstd);
+}
+#endif
+
 /* Functions for initializing decompression for individual methods. */
 
 int init_bzip2(struct decompstrm *strm)
 {
-    strm->read_chunk = readchunk_bzip2;
+    strm->decode = decode_bzip2;
     strm->finish = finish_bzip2;
     strm->stream.bzip2.bzalloc = NULL;
     strm->stream.bzip2.bzfree = NULL;
@@ -147,7 +197,7 @@ int init_bzip2(struct decompstrm *strm)
 
 int init_gzip(struct decompstrm *strm)
 {
-    strm->read_chunk = readchunk_gzip;
+    strm->decode = decode_gzip;
     strm->finish = finish_gzip;
     strm->stream.gzip.zalloc = Z_NULL;
     strm->stream.gzip.zfree = Z_NULL;
@@ -167,15 +217,35 @@ int init_gzip(struct decompstrm *strm)
     return DRPM_ERR_OK;
 }
 
-int init_lzma(struct decompstrm *strm)
+/* xz streams written in multiple blocks with known sizes
+ * (see compstrm_init_par()) are decompressed in parallel. */
+int init_lzma(struct decompstrm *strm, bool xz)
 {
     lzma_stream stream = LZMA_STREAM_INIT;
+    lzma_ret ret;
 
-    strm->read_chunk = readchunk_lzma;
+    strm->decode = decode_lzma;
     strm->finish = finish_lzma;
     strm->stream.lzma = stream;
 
-    switch (lzma_auto_decoder(&strm->stream.lzma, UINT64_MAX, 0)) {
+#if LZMA_VERSION >= 50040002U
+    if (xz) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        lzma_mt mt = {
+            .threads = MIN(MAX(cpus, 1), DECOMP_THREADS_MAX),
+            .memlimit_threading = lzma_physmem() / 4,
+            .memlimit_stop = UINT64_MAX
+        };
+        ret = lzma_stream_decoder_mt(&strm->stream.lzma, &mt);
+    } else {
+        ret = lzma_auto_decoder(&strm->stream.lzma, UINT64_MAX, 0);
+    }
+#else
+    (void)xz;
+    ret = lzma_auto_decoder(&strm->stream.lzma, UINT64_MAX, 0);
+#endif
+
+    switch (ret) {
     case LZMA_OK:
         break;
     case LZMA_MEM_ERROR:
@@ -192,7 +262,7 @@ int init_lzip(struct decompstrm *strm)
 {
     int error;
 
-    strm->read_chunk = readchunk_lzip;
+    strm->decode = decode_lzip;
     strm->finish = finish_lzip;
     strm->lzip_eof = false;
 
@@ -206,6 +276,19 @@ int init_lzip(struct decompstrm *strm)
 }
 #endif
 
+#ifdef HAVE_ZSTD
+int init_zstd(struct decompstrm *strm)
+{
+    strm->decode = decode_zstd;
+    strm->finish = finish_zstd;
+
+    if ((strm->stream.zstd = ZSTD_createDCtx()) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    return DRPM_ERR_OK;
+}
+#endif
+
 /* Frees memory allocated by decompression stream. */
 int decompstrm_destroy(struct decompstrm **strm)
 {
@@ -216,6 +299,7 @@ int decompstrm_destroy(struct decompstrm **strm)
         (*strm)->finish(*strm);
 
     free((*strm)->data);
+    free((*strm)->in_data);
     free(*strm);
     *strm = NULL;
 
@@ -224,25 +308,27 @@ int decompstrm_destroy(struct decompstrm **strm)
 
 /* Initializes decompression stream.
  * The detected compression method will be stored in <*comp> (if not NULL).
- * If <md5> is not NULL, input data will be used to update the MD5 context.
+ * If <md5> is not NULL, input data will be used to update the checksum.
  * If <filedesc> is valid, compressed data will be read from the file.
  * Otherwise, input data is read from <buffer> of size <buffer_len>. */
-int decompstrm_init(struct decompstrm **strm, int filedesc, unsigned short *comp, MD5_CTX *md5,
+int decompstrm_init(struct decompstrm **strm, int filedesc, unsigned short *comp, struct checksum *md5,
                     const unsigned char *buffer, size_t buffer_len)
 {
     uint64_t magic;
+    unsigned char magic_bytes[8];
     int error = DRPM_ERR_OK;
 
     if (strm == NULL || (filedesc < 0 && (buffer == NULL || buffer_len < 8)))
         return DRPM_ERR_PROG;
 
+    /* magic bytes read from file are kept as first input, instead of
+     * seeking back, so that <filedesc> may be a pipe */
     if (filedesc < 0) {
         magic = parse_be64(buffer);
     } else {
-        if ((error = read_be64(filedesc, &magic)) != DRPM_ERR_OK)
+        if ((error = read_full(filedesc, magic_bytes, 8)) != DRPM_ERR_OK)
             return error;
-        if (lseek(filedesc, -8, SEEK_CUR) == -1)
-            return DRPM_ERR_IO;
+        magic = parse_be64(magic_bytes);
     }
 
     if ((*strm = malloc(sizeof(struct decompstrm))) == NULL)
@@ -251,11 +337,28 @@ int decompstrm_init(struct decompstrm **strm, int filedesc, unsigned short *comp
     (*strm)->data = NULL;
     (*strm)->data_len = 0;
     (*strm)->data_pos = 0;
+    (*strm)->data_alloc = 0;
     (*strm)->filedesc = filedesc;
     (*strm)->comp_size = 0;
     (*strm)->md5 = md5;
     (*strm)->buffer = buffer;
     (*strm)->buffer_len = buffer_len;
+    (*strm)->in_data = NULL;
+    (*strm)->in_next = NULL;
+    (*strm)->in_avail = 0;
+    (*strm)->in_eof = false;
+
+    if (filedesc >= 0) {
+        if (((*strm)->in_data = malloc(DECOMP_CHUNK_SIZE)) == NULL) {
+            error = DRPM_ERR_MEMORY;
+            goto cleanup_fail;
+        }
+        memcpy((*strm)->in_data, magic_bytes, 8);
+        (*strm)->in_next = (*strm)->in_data;
+        (*strm)->in_avail = 8;
+        if ((error = account_input(*strm, magic_bytes, 8)) != DRPM_ERR_OK)
+            goto cleanup_fail;
+    }
 
     if (MAGIC_GZIP(magic)) {
         if (comp != NULL)
@@ -270,12 +373,12 @@ int decompstrm_init(struct decompstrm **strm, int filedesc, unsigned short *comp
     } else if (MAGIC_XZ(magic)) {
         if (comp != NULL)
             *comp = DRPM_COMP_XZ;
-        if ((error = init_lzma(*strm)) != DRPM_ERR_OK)
+        if ((error = init_lzma(*strm, true)) != DRPM_ERR_OK)
             goto cleanup_fail;
     } else if (MAGIC_LZMA(magic)) {
         if (comp != NULL)
             *comp = DRPM_COMP_LZMA;
-        if ((error = init_lzma(*strm)) != DRPM_ERR_OK)
+        if ((error = init_lzma(*strm, false)) != DRPM_ERR_OK)
             goto cleanup_fail;
 #ifdef HAVE_LZLIB_DEVEL
     } else if (MAGIC_LZIP(magic)) {
@@ -283,17 +386,25 @@ int decompstrm_init(struct decompstrm **strm, int filedesc, unsigned short *comp
             *comp = DRPM_COMP_LZIP;
         if ((error = init_lzip(*strm)) != DRPM_ERR_OK)
             goto cleanup_fail;
+#endif
+#ifdef HAVE_ZSTD
+    } else if (MAGIC_ZSTD(magic)) {
+        if (comp != NULL)
+            *comp = DRPM_COMP_ZSTD;
+        if ((error = init_zstd(*strm)) != DRPM_ERR_OK)
+            goto cleanup_fail;
 #endif
     } else {
         if (comp != NULL)
             *comp = DRPM_COMP_NONE;
-        (*strm)->read_chunk = readchunk;
+        (*strm)->decode = decode;
         (*strm)->finish = NULL;
     }
 
     return DRPM_ERR_OK;
 
 cleanup_fail:
+    free((*strm)->in_data);
     free(*strm);
     *strm = NULL;
 
@@ -343,24 +454,84 @@ int decompstrm_read_be64(struct decompstrm *strm, uint64_t *buffer_ret)
     return DRPM_ERR_OK;
 }
 
-/* Decompresses enough data to store <read_len> bytes at <buffer_ret>. */
+/* Decompresses enough data to store <read_len> bytes at <buffer_ret>.
+ * Data that has already been read is discarded before decompressing
+ * more, so reading a large stream piece by piece needs little memory.
+ * Large reads are decompressed straight into <buffer_ret>.
+ * If <buffer_ret> is NULL, the data is skipped. */
 int decompstrm_read(struct decompstrm *strm, size_t read_len, void *buffer_ret)
 {
     int error;
+    const unsigned char *data;
+    unsigned char *buffer = buffer_ret;
+    size_t copy_len;
+    size_t decoded;
 
     if (strm == NULL)
         return DRPM_ERR_PROG;
 
+    if (buffer == NULL) {
+        while (read_len > 0) {
+            copy_len = MIN(read_len, DECOMP_CHUNK_SIZE);
+            if ((error = decompstrm_read_ptr(strm, copy_len, &data)) != DRPM_ERR_OK)
+                return error;
+            read_len -= copy_len;
+        }
+        return DRPM_ERR_OK;
+    }
+
+    if (read_len < DECOMP_CHUNK_SIZE) {
+        if ((error = decompstrm_read_ptr(strm, read_len, &data)) != DRPM_ERR_OK)
+            return error;
+        memcpy(buffer, data, read_len);
+        return DRPM_ERR_OK;
+    }
+
+    /* handing out what is already decompressed, then bypassing buffer */
+    copy_len = MIN(read_len, strm->data_len - strm->data_pos);
+    memcpy(buffer, strm->data + strm->data_pos, copy_len);
+    strm->data_pos += copy_len;
+    buffer += copy_len;
+    read_len -= copy_len;
+
+    while (read_len > 0) {
+        if ((error = decode_some(strm, buffer, read_len, &decoded)) != DRPM_ERR_OK)
+            return error;
+        buffer += decoded;
+        read_len -= decoded;
+    }
+
+    return DRPM_ERR_OK;
+}
+
+/* Like decompstrm_read(), but points <*data_ret> at the decompressed
+ * bytes instead of copying them. They are only valid until next read. */
+int decompstrm_read_ptr(struct decompstrm *strm, size_t read_len, const unsigned char **data_ret)
+{
+    int error;
+    size_t decoded;
+
+    if (strm == NULL || data_ret == NULL)
+        return DRPM_ERR_PROG;
+
+    if (strm->data_pos + read_len > strm->data_len && strm->data_pos > 0) {
+        memmove(strm->data, strm->data + strm->data_pos, strm->data_len - strm->data_pos);
+        strm->data_len -= strm->data_pos;
+        strm->data_pos = 0;
+    }
+
     if (UNSIGNED_SUM_OVERFLOWS(strm->data_len, read_len))
         return DRPM_ERR_OVERFLOW;
 
-    while (strm->data_pos + read_len > strm->data_len)
-        if ((error = strm->read_chunk(strm)) != DRPM_ERR_OK)
+    while (strm->data_pos + read_len > strm->data_len) {
+        if ((error = decompstrm_reserve(strm, MAX(read_len, DECOMP_CHUNK_SIZE))) != DRPM_ERR_OK ||
+            (error = decode_some(strm, strm->data + strm->data_len,
+                                 strm->data_alloc - strm->data_len, &decoded)) != DRPM_ERR_OK)
             return error;
+        strm->data_len += decoded;
+    }
 
-    if (buffer_ret != NULL)
-        memcpy(buffer_ret, strm->data + strm->data_pos, read_len);
-
+    *data_ret = strm->data + strm->data_pos;
     strm->data_pos += read_len;
 
     return DRPM_ERR_OK;
@@ -373,15 +544,18 @@ int decompstrm_read_until_eof(struct decompstrm *strm,
 {
     int error;
     bool eof = false;
-    size_t data_len_prev;
+    size_t decoded;
 
     if (strm == NULL || (buffer_ret != NULL && len_ret == NULL))
         return DRPM_ERR_PROG;
 
     while (!eof) {
-        data_len_prev = strm->data_len;
-        switch ((error = strm->read_chunk(strm))) {
+        if ((error = decompstrm_reserve(strm, DECOMP_CHUNK_SIZE)) != DRPM_ERR_OK)
+            return error;
+        switch ((error = decode_some(strm, strm->data + strm->data_len,
+                                     strm->data_alloc - strm->data_len, &decoded))) {
         case DRPM_ERR_OK:
+            strm->data_len += decoded;
             break;
         case DRPM_ERR_FORMAT: // nothing more to read
             eof = true;
@@ -389,8 +563,6 @@ int decompstrm_read_until_eof(struct decompstrm *strm,
         default:
             return error;
         }
-        if (data_len_prev > strm->data_len)
-            return DRPM_ERR_OVERFLOW;
     }
 
     if (len_ret != NULL) {
@@ -406,283 +578,268 @@ int decompstrm_read_until_eof(struct decompstrm *strm,
     return DRPM_ERR_OK;
 }
 
-/* Functions for decompressing chunks of data. */
-
-// no compression
-int readchunk(struct decompstrm *strm)
+/* Makes sure there is room for at least <len> more bytes of data. */
+int decompstrm_reserve(struct decompstrm *strm, size_t len)
 {
-    ssize_t in_len;
     unsigned char *data_tmp;
-    unsigned char buffer[CHUNK_SIZE];
+    size_t data_alloc;
 
-    if (strm->filedesc < 0) {
-        in_len = MIN(CHUNK_SIZE, strm->buffer_len);
-        memcpy(buffer, strm->buffer, in_len);
-        strm->buffer += in_len;
-        strm->buffer_len -= in_len;
-    } else {
-        if ((in_len = read(strm->filedesc, buffer, CHUNK_SIZE)) < 0)
-            return DRPM_ERR_IO;
-    }
+    if (UNSIGNED_SUM_OVERFLOWS(strm->data_len, len))
+        return DRPM_ERR_OVERFLOW;
 
-    if (in_len == 0)
-        return DRPM_ERR_FORMAT;
+    if (strm->data_len + len <= strm->data_alloc)
+        return DRPM_ERR_OK;
+
+    data_alloc = MAX(strm->data_len + len, 2 * strm->data_alloc);
 
-    if ((data_tmp = realloc(strm->data, strm->data_len + in_len)) == NULL)
+    if ((data_tmp = realloc(strm->data, data_alloc)) == NULL)
         return DRPM_ERR_MEMORY;
 
     strm->data = data_tmp;
-    memcpy(strm->data + strm->data_len, buffer, in_len);
-    strm->data_len += in_len;
+    strm->data_alloc = data_alloc;
 
-    strm->comp_size = strm->data_len;
+    return DRPM_ERR_OK;
+}
 
-    if (strm->md5 != NULL && MD5_Update(strm->md5, buffer, in_len) != 1)
-        return DRPM_ERR_OTHER;
+/* Functions for handling compressed input. */
+
+/* Counts input data towards compressed size and MD5. */
+int account_input(struct decompstrm *strm, const unsigned char *buffer, size_t buffer_len)
+{
+    strm->comp_size += buffer_len;
+
+    if (strm->md5 != NULL)
+        return checksum_update(strm->md5, buffer, buffer_len);
 
     return DRPM_ERR_OK;
 }
 
-int readchunk_bzip2(struct decompstrm *strm)
+/* Fetches next chunk of compressed data, unless there is some left.
+ * Input buffers are used in place, files are read into <in_data>. */
+int fill_input(struct decompstrm *strm)
 {
     ssize_t in_len;
-    unsigned char *data_tmp;
-    char in_buffer[CHUNK_SIZE];
-    char out_buffer[CHUNK_SIZE];
-    size_t out_len;
+
+    if (strm->in_avail > 0 || strm->in_eof)
+        return DRPM_ERR_OK;
 
     if (strm->filedesc < 0) {
-        in_len = MIN(CHUNK_SIZE, strm->buffer_len);
-        memcpy(in_buffer, strm->buffer, in_len);
-        strm->buffer += in_len;
-        strm->buffer_len -= in_len;
+        strm->in_next = strm->buffer;
+        strm->in_avail = MIN(DECOMP_CHUNK_SIZE, strm->buffer_len);
+        strm->buffer += strm->in_avail;
+        strm->buffer_len -= strm->in_avail;
     } else {
-        if ((in_len = read(strm->filedesc, in_buffer, CHUNK_SIZE)) < 0)
-            return DRPM_ERR_IO;
+        while ((in_len = read(strm->filedesc, strm->in_data, DECOMP_CHUNK_SIZE)) < 0)
+            if (errno != EINTR)
+                return DRPM_ERR_IO;
+        strm->in_next = strm->in_data;
+        strm->in_avail = in_len;
     }
 
-    if (in_len == 0)
-        return DRPM_ERR_FORMAT;
+    if (strm->in_avail == 0) {
+        strm->in_eof = true;
+        return DRPM_ERR_OK;
+    }
 
-    strm->stream.bzip2.next_in = in_buffer;
-    strm->stream.bzip2.avail_in = in_len;
+    return account_input(strm, strm->in_next, strm->in_avail);
+}
 
-    do {
-        strm->stream.bzip2.next_out = out_buffer;
-        strm->stream.bzip2.avail_out = CHUNK_SIZE;
-        switch (BZ2_bzDecompress(&strm->stream.bzip2)) {
-        case BZ_DATA_ERROR:
-        case BZ_DATA_ERROR_MAGIC:
-            return DRPM_ERR_FORMAT;
-        case BZ_MEM_ERROR:
-            return DRPM_ERR_MEMORY;
-        }
-        out_len = CHUNK_SIZE - strm->stream.bzip2.avail_out;
-        if (out_len == 0)
-            continue;
-        if ((data_tmp = realloc(strm->data, strm->data_len + out_len))
-            == NULL)
-            return DRPM_ERR_MEMORY;
-        strm->data = data_tmp;
-        memcpy(strm->data + strm->data_len, out_buffer, out_len);
-        strm->data_len += out_len;
-    } while (!strm->stream.bzip2.avail_out);
+/* Decompresses between 1 and <out_len> bytes into <out>,
+ * fetching input as needed. Returns DRPM_ERR_FORMAT at end of data. */
+int decode_some(struct decompstrm *strm, unsigned char *out, size_t out_len, size_t *decoded)
+{
+    int error;
+    size_t in_avail;
 
-    strm->comp_size += in_len;
+    *decoded = 0;
 
-    if (strm->md5 != NULL && MD5_Update(strm->md5, in_buffer, in_len) != 1)
-        return DRPM_ERR_OTHER;
+    if (out_len == 0)
+        return DRPM_ERR_OK;
 
-    return DRPM_ERR_OK;
+    while (true) {
+        in_avail = strm->in_avail;
+        if ((error = strm->decode(strm, out, out_len, decoded)) != DRPM_ERR_OK)
+            return error;
+        if (*decoded > 0)
+            return DRPM_ERR_OK;
+        if (strm->in_avail > 0) {
+            /* decoder is done with the stream, rest is ignored */
+            if (strm->in_avail == in_avail)
+                strm->in_avail = 0;
+            continue;
+        }
+        if (strm->in_eof)
+            return DRPM_ERR_FORMAT;
+        if ((error = fill_input(strm)) != DRPM_ERR_OK)
+            return error;
+    }
 }
 
-int readchunk_gzip(struct decompstrm *strm)
+/* Functions for decompressing data using individual methods.
+ * Each makes a single pass over pending input, storing at most
+ * <out_len> bytes of output at <out>. */
+
+// no compression
+int decode(struct decompstrm *strm, unsigned char *out, size_t out_len, size_t *decoded)
 {
+    int error;
     ssize_t in_len;
-    unsigned char *data_tmp;
-    unsigned char in_buffer[CHUNK_SIZE];
-    unsigned char out_buffer[CHUNK_SIZE];
-    size_t out_len;
 
-    if (strm->filedesc < 0) {
-        in_len = MIN(CHUNK_SIZE, strm->buffer_len);
-        memcpy(in_buffer, strm->buffer, in_len);
-        strm->buffer += in_len;
-        strm->buffer_len -= in_len;
-    } else {
-        if ((in_len = read(strm->filedesc, in_buffer, CHUNK_SIZE)) < 0)
-            return DRPM_ERR_IO;
+    /* reading file directly into output */
+    if (strm->in_avail == 0 && !strm->in_eof && strm->filedesc >= 0) {
+        while ((in_len = read(strm->filedesc, out, out_len)) < 0)
+            if (errno != EINTR)
+                return DRPM_ERR_IO;
+        if (in_len == 0) {
+            strm->in_eof = true;
+            *decoded = 0;
+            return DRPM_ERR_OK;
+        }
+        if ((error = account_input(strm, out, in_len)) != DRPM_ERR_OK)
+            return error;
+        *decoded = in_len;
+        return DRPM_ERR_OK;
     }
 
-    if (in_len == 0)
-        return DRPM_ERR_FORMAT;
+    *decoded = MIN(out_len, strm->in_avail);
+    memcpy(out, strm->in_next, *decoded);
+    strm->in_next += *decoded;
+    strm->in_avail -= *decoded;
 
-    strm->stream.gzip.next_in = in_buffer;
-    strm->stream.gzip.avail_in = in_len;
+    return DRPM_ERR_OK;
+}
 
-    do {
-        strm->stream.gzip.next_out = out_buffer;
-        strm->stream.gzip.avail_out = CHUNK_SIZE;
-        switch (inflate(&strm->stream.gzip, Z_SYNC_FLUSH)) {
-        case Z_DATA_ERROR:
-        case Z_NEED_DICT:
-        case Z_STREAM_ERROR:
-            return DRPM_ERR_FORMAT;
-        case Z_MEM_ERROR:
-            return DRPM_ERR_MEMORY;
-        }
-        out_len = CHUNK_SIZE - strm->stream.gzip.avail_out;
-        if (out_len == 0)
-            continue;
-        if ((data_tmp = realloc(strm->data, strm->data_len + out_len))
-            == NULL)
-            return DRPM_ERR_MEMORY;
-        strm->data = data_tmp;
-        memcpy(strm->data + strm->data_len, out_buffer, out_len);
-        strm->data_len += out_len;
-    } while (!strm->stream.gzip.avail_out);
+int decode_bzip2(struct decompstrm *strm, unsigned char *out, size_t out_len, size_t *decoded)
+{
+    const size_t avail_out = MIN(out_len, UINT_MAX);
 
-    strm->comp_size += in_len;
+    strm->stream.bzip2.next_in = (char *)strm->in_next;
+    strm->stream.bzip2.avail_in = strm->in_avail;
+    strm->stream.bzip2.next_out = (char *)out;
+    strm->stream.bzip2.avail_out = avail_out;
 
-    if (strm->md5 != NULL && MD5_Update(strm->md5, in_buffer, in_len) != 1)
-        return DRPM_ERR_OTHER;
+    switch (BZ2_bzDecompress(&strm->stream.bzip2)) {
+    case BZ_DATA_ERROR:
+    case BZ_DATA_ERROR_MAGIC:
+        return DRPM_ERR_FORMAT;
+    case BZ_MEM_ERROR:
+        return DRPM_ERR_MEMORY;
+    }
+
+    *decoded = avail_out - strm->stream.bzip2.avail_out;
+    strm->in_next = (const unsigned char *)strm->stream.bzip2.next_in;
+    strm->in_avail = strm->stream.bzip2.avail_in;
 
     return DRPM_ERR_OK;
 }
 
-int readchunk_lzma(struct decompstrm *strm)
+int decode_gzip(struct decompstrm *strm, unsigned char *out, size_t out_len, size_t *decoded)
 {
-    ssize_t in_len;
-    unsigned char *data_tmp;
-    unsigned char in_buffer[CHUNK_SIZE];
-    unsigned char out_buffer[CHUNK_SIZE];
-    size_t out_len;
+    const size_t avail_out = MIN(out_len, UINT_MAX);
 
-    if (strm->filedesc < 0) {
-        in_len = MIN(CHUNK_SIZE, strm->buffer_len);
-        memcpy(in_buffer, strm->buffer, in_len);
-        strm->buffer += in_len;
-        strm->buffer_len -= in_len;
-    } else {
-        if ((in_len = read(strm->filedesc, in_buffer, CHUNK_SIZE)) < 0)
-            return DRPM_ERR_IO;
-    }
+    strm->stream.gzip.next_in = (unsigned char *)strm->in_next;
+    strm->stream.gzip.avail_in = strm->in_avail;
+    strm->stream.gzip.next_out = out;
+    strm->stream.gzip.avail_out = avail_out;
 
-    if (in_len == 0)
+    switch (inflate(&strm->stream.gzip, Z_SYNC_FLUSH)) {
+    case Z_DATA_ERROR:
+    case Z_NEED_DICT:
+    case Z_STREAM_ERROR:
         return DRPM_ERR_FORMAT;
+    case Z_MEM_ERROR:
+        return DRPM_ERR_MEMORY;
+    }
 
-    strm->stream.lzma.next_in = in_buffer;
-    strm->stream.lzma.avail_in = in_len;
+    *decoded = avail_out - strm->stream.gzip.avail_out;
+    strm->in_next = strm->stream.gzip.next_in;
+    strm->in_avail = strm->stream.gzip.avail_in;
 
-    do {
-        strm->stream.lzma.next_out = out_buffer;
-        strm->stream.lzma.avail_out = CHUNK_SIZE;
-        switch (lzma_code(&strm->stream.lzma, LZMA_RUN)) {
-        case LZMA_OK:
-        case LZMA_STREAM_END:
-            break;
-        case LZMA_FORMAT_ERROR:
-        case LZMA_OPTIONS_ERROR:
-        case LZMA_DATA_ERROR:
-        case LZMA_BUF_ERROR:
-            return DRPM_ERR_FORMAT;
-        case LZMA_MEM_ERROR:
-            return DRPM_ERR_MEMORY;
-        default:
-            return DRPM_ERR_OTHER;
-        }
-        out_len = CHUNK_SIZE - strm->stream.lzma.avail_out;
-        if (out_len == 0)
-            continue;
-        if ((data_tmp = realloc(strm->data, strm->data_len + out_len))
-            == NULL)
-            return DRPM_ERR_MEMORY;
-        strm->data = data_tmp;
-        memcpy(strm->data + strm->data_len, out_buffer, out_len);
-        strm->data_len += out_len;
-    } while (!strm->stream.lzma.avail_out);
+    return DRPM_ERR_OK;
+}
 
-    strm->comp_size += in_len;
+int decode_lzma(struct decompstrm *strm, unsigned char *out, size_t out_len, size_t *decoded)
+{
+    strm->stream.lzma.next_in = strm->in_next;
+    strm->stream.lzma.avail_in = strm->in_avail;
+    strm->stream.lzma.next_out = out;
+    strm->stream.lzma.avail_out = out_len;
 
-    if (strm->md5 != NULL && MD5_Update(strm->md5, in_buffer, in_len) != 1)
+    switch (lzma_code(&strm->stream.lzma, LZMA_RUN)) {
+    case LZMA_OK:
+    case LZMA_STREAM_END:
+    case LZMA_BUF_ERROR: // no progress possible, truncation is caught at EOF
+        break;
+    case LZMA_FORMAT_ERROR:
+    case LZMA_OPTIONS_ERROR:
+    case LZMA_DATA_ERROR:
+        return DRPM_ERR_FORMAT;
+    case LZMA_MEM_ERROR:
+        return DRPM_ERR_MEMORY;
+    default:
         return DRPM_ERR_OTHER;
+    }
+
+    *decoded = out_len - strm->stream.lzma.avail_out;
+    strm->in_next = strm->stream.lzma.next_in;
+    strm->in_avail = strm->stream.lzma.avail_in;
 
     return DRPM_ERR_OK;
 }
 
 #ifdef HAVE_LZLIB_DEVEL
-int readchunk_lzip(struct decompstrm *strm)
+int decode_lzip(struct decompstrm *strm, unsigned char *out, size_t out_len, size_t *decoded)
 {
     int error;
-    unsigned char *data_tmp;
-    ssize_t in_len;
-    unsigned char in_buffer[CHUNK_SIZE];
-    unsigned char out_buffer[CHUNK_SIZE];
-    size_t out_len;
-    ssize_t written = 0;
     int wr;
     int rd;
 
-    if (strm->lzip_eof)
-        return DRPM_ERR_FORMAT;
+    *decoded = 0;
 
-    if (strm->filedesc < 0) {
-        in_len = MIN(CHUNK_SIZE, strm->buffer_len);
-        memcpy(in_buffer, strm->buffer, in_len);
-        strm->buffer += in_len;
-        strm->buffer_len -= in_len;
-    } else {
-        if ((in_len = read(strm->filedesc, in_buffer, CHUNK_SIZE)) < 0)
-            return DRPM_ERR_IO;
+    if (strm->lzip_eof && LZ_decompress_finished(strm->stream.lzip))
+        return DRPM_ERR_OK;
+
+    if (strm->in_avail > 0 && LZ_decompress_write_size(strm->stream.lzip) > 0) {
+        if ((wr = LZ_decompress_write(strm->stream.lzip, strm->in_next,
+                                      MIN(strm->in_avail, INT_MAX))) < 0) {
+            error = lzip_error(strm);
+            return error == DRPM_ERR_OK ? DRPM_ERR_OTHER : error;
+        }
+        strm->in_next += wr;
+        strm->in_avail -= wr;
     }
 
-    if (in_len == 0) {
+    if (strm->in_eof && !strm->lzip_eof) {
         strm->lzip_eof = true;
         LZ_decompress_finish(strm->stream.lzip);
-        do {
-            if ((rd = LZ_decompress_read(strm->stream.lzip, out_buffer, CHUNK_SIZE)) < 0) {
-                error = lzip_error(strm);
-                return error == DRPM_ERR_OK ? DRPM_ERR_OTHER : error;
-            }
-            out_len = rd;
-            if (out_len == 0)
-                continue;
-            if ((data_tmp = realloc(strm->data, strm->data_len + out_len)) == NULL)
-                return DRPM_ERR_MEMORY;
-            strm->data = data_tmp;
-            memcpy(strm->data + strm->data_len, out_buffer, out_len);
-            strm->data_len += out_len;
-        } while (!LZ_decompress_finished(strm->stream.lzip));
-    } else {
-        while (written < in_len) {
-            if (LZ_decompress_write_size(strm->stream.lzip) > 0) {
-                if ((wr = LZ_decompress_write(strm->stream.lzip,
-                                              in_buffer + written,
-                                              in_len - written)) < 0) {
-                    error = lzip_error(strm);
-                    return error == DRPM_ERR_OK ? DRPM_ERR_OTHER : error;
-                }
-                written += wr;
-            }
-            if ((rd = LZ_decompress_read(strm->stream.lzip, out_buffer, CHUNK_SIZE)) < 0) {
-                error = lzip_error(strm);
-                return error == DRPM_ERR_OK ? DRPM_ERR_OTHER : error;
-            }
-            out_len = rd;
-            if (out_len == 0)
-                continue;
-            if ((data_tmp = realloc(strm->data, strm->data_len + out_len)) == NULL)
-                return DRPM_ERR_MEMORY;
-            strm->data = data_tmp;
-            memcpy(strm->data + strm->data_len, out_buffer, out_len);
-            strm->data_len += out_len;
-        };
     }
 
-    strm->comp_size += in_len;
+    do {
+        if ((rd = LZ_decompress_read(strm->stream.lzip, out, MIN(out_len, INT_MAX))) < 0) {
+            error = lzip_error(strm);
+            return error == DRPM_ERR_OK ? DRPM_ERR_OTHER : error;
+        }
+    } while (rd == 0 && strm->lzip_eof && !LZ_decompress_finished(strm->stream.lzip));
 
-    if (strm->md5 != NULL && MD5_Update(strm->md5, in_buffer, in_len) != 1)
-        return DRPM_ERR_OTHER;
+    *decoded = rd;
+
+    return DRPM_ERR_OK;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+int decode_zstd(struct decompstrm *strm, unsigned char *out, size_t out_len, size_t *decoded)
+{
+    ZSTD_inBuffer in = {strm->in_next, strm->in_avail, 0};
+    ZSTD_outBuffer output = {out, out_len, 0};
+    size_t ret;
+
+    if (ZSTD_isError(ret = ZSTD_decompressStream(strm->stream.zstd, &output, &in)))
+        return zstd_error(ret);
+
+    *decoded = output.pos;
+    strm->in_next += in.pos;
+    strm->in_avail -= in.pos;
 
     return DRPM_ERR_OK;
 }
@@ -24,6 +24,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <unistd.h>
 
 #define DELTARPM_COMP_UN 0
 #define DELTARPM_COMP_GZ 1
@@ -32,6 +33,7 @@
 #define DELTARPM_COMP_BZ_17 4
 #define DELTARPM_COMP_LZMA 5
 #define DELTARPM_COMP_XZ 6
+#define DELTARPM_COMP_ZSTD 7
 
 #define DELTARPM_COMP_BZ DELTARPM_COMP_BZ_20
 
@@ -60,6 +62,9 @@ bool deltarpm_decode_comp(uint32_t deltarpm_comp, unsigned short *comp, unsigned
     case DELTARPM_COMP_XZ:
         *comp = DRPM_COMP_XZ;
         break;
+    case DELTARPM_COMP_ZSTD:
+        *comp = DRPM_COMP_ZSTD;
+        break;
     default:
         return false;
     }
@@ -89,6 +94,9 @@ bool deltarpm_encode_comp(uint32_t *deltarpm_comp, unsigned short comp, unsigned
     case DRPM_COMP_XZ:
         *deltarpm_comp = DELTARPM_MKCOMP(DELTARPM_COMP_XZ, level);
         break;
+    case DRPM_COMP_ZSTD:
+        *deltarpm_comp = DELTARPM_MKCOMP(DELTARPM_COMP_ZSTD, level);
+        break;
     default:
         return false;
     }
@@ -123,5 +131,10 @@ void free_deltarpm(struct deltarpm *delta)
     else
         free(delta->int_data.bytes);
 
+    if (delta->int_data_strm != NULL) {
+        decompstrm_destroy(&delta->int_data_strm);
+        close(delta->int_data_filedesc);
+    }
+
     *delta = delta_init;
 }
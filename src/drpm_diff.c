@@ -46,9 +46,24 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <zlib.h>
 
 #define BUFFER_SIZE 4096
 
+/* Size estimation parameters for early abort (see estimate_update()).
+ * A window of SAMPLE_SIZE contiguous bytes of internal data is compressed
+ * every SAMPLE_INTERVAL bytes, and no verdict is made while scanning
+ * before SAMPLE_MIN bytes have been sampled. Since the samples are
+ * compressed with fast deflate, the extrapolated size is scaled by
+ * SAMPLE_SLACK percent to account for the stronger compressors used
+ * for the final DeltaRPM. */
+#define SAMPLE_SIZE 16384
+#define SAMPLE_INTERVAL 262144
+#define SAMPLE_MIN 65536
+#define SAMPLE_SLACK 75
+#define COPY_ENTRY_SIZE 8
+
 struct diff_copy {
     size_t old_off;
     size_t old_len;
@@ -56,11 +71,29 @@ struct diff_copy {
     size_t new_len;
 };
 
+struct size_estimate {
+    size_t limit;
+    uint64_t int_data_len;
+    uint64_t copies_count;
+    uint64_t sample_in;
+    uint64_t sample_out;
+    uint64_t next_sample;
+    unsigned char *window; // sample being gathered
+    size_t window_len;
+    bool complete; // all internal data seen
+    unsigned char *sample_buf;
+    uLong sample_buf_len;
+};
+
 static int create_diff_copies(const struct diff_copy *, size_t,
                               uint32_t **, uint32_t *, uint32_t **, uint32_t *);
 static int create_int_data_array(const struct diff_copy *, const unsigned char *,
                                  const uint32_t *, uint32_t,
                                  const unsigned char ***, uint64_t *);
+static bool estimate_exceeded(const struct size_estimate *, size_t);
+static int estimate_finish(struct size_estimate *);
+static int estimate_sample(struct size_estimate *);
+static int estimate_update(struct size_estimate *, const unsigned char *, size_t);
 
 /* Compares <old> and <new> byte sequences (of lengths <old_len>
  * and <new_len>, respectively).
@@ -73,19 +106,26 @@ static int create_int_data_array(const struct diff_copy *, const unsigned char *
  * External copies will be stored in <*ext_copies_ret> and the number
  * of external copies shall be in <*ext_copies_count_ret>.
  * Internal copies will be stored in <*int_copies_ret> and the number
- * of internal copies shall be in <*int_copies_count_ret>. */
+ * of internal copies shall be in <*int_copies_count_ret>.
+ * If <size_limit> is non-zero, the compressed size of the diff data
+ * (including the add block) is estimated while scanning and
+ * DRPM_ERR_THRESHOLD is returned as soon as the estimate clearly
+ * exceeds <size_limit> bytes, or if it does so once the diff is done. */
 int make_diff(const unsigned char *old, size_t old_len,
               const unsigned char *new, size_t new_len,
               const unsigned char ***int_data_array_ret, uint64_t *int_data_len_ret,
               uint32_t **ext_copies_ret, uint32_t *ext_copies_count_ret,
               uint32_t **int_copies_ret, uint32_t *int_copies_count_ret,
               unsigned char **add_block_ret, uint32_t *add_block_len_ret,
-              unsigned short add_block_comp, int add_block_comp_level)
+              unsigned short add_block_comp, int add_block_comp_level,
+              size_t size_limit)
 {
     int error;
 
+    struct size_estimate estimate = {0};
+
     const bool addblk = (add_block_ret != NULL && add_block_len_ret != NULL);
-    size_t add_block_len;
+    size_t add_block_len = 0;
     struct compstrm *stream;
 
     struct diff_copy *diff_copies = NULL;
@@ -124,6 +164,16 @@ int make_diff(const unsigned char *old, size_t old_len,
     if (addblk)
         *add_block_ret = NULL;
 
+    if (size_limit > 0) {
+        estimate.limit = size_limit;
+        estimate.sample_buf_len = compressBound(SAMPLE_SIZE);
+        if ((estimate.window = malloc(SAMPLE_SIZE)) == NULL ||
+            (estimate.sample_buf = malloc(estimate.sample_buf_len)) == NULL) {
+            free(estimate.window);
+            return DRPM_ERR_MEMORY;
+        }
+    }
+
     //if ((error = sfxsrt_create(&suffix, old, old_len)) != DRPM_ERR_OK)
     if ((error = hash_create(&hashtab, old, old_len)) != DRPM_ERR_OK)
         goto cleanup_fail;
@@ -230,6 +280,17 @@ int make_diff(const unsigned char *old, size_t old_len,
         diff_copies[diff_copies_len].old_len = len_forward;
         diff_copies_len++;
 
+        if (size_limit > 0) {
+            if ((error = estimate_update(&estimate, new + diff_copies[diff_copies_len - 1].new_off,
+                                         diff_copies[diff_copies_len - 1].new_len)) != DRPM_ERR_OK ||
+                (addblk && (error = compstrm_get_comp_size(stream, &add_block_len)) != DRPM_ERR_OK))
+                goto cleanup_fail;
+            if (estimate_exceeded(&estimate, add_block_len)) {
+                error = DRPM_ERR_THRESHOLD;
+                goto cleanup_fail;
+            }
+        }
+
         if (addblk) {
             while (len_forward > 0) {
                 write_len = MIN(len_forward, BUFFER_SIZE);
@@ -255,6 +316,15 @@ int make_diff(const unsigned char *old, size_t old_len,
         (addblk && (error = compstrm_finish(stream, add_block_ret, &add_block_len)) != DRPM_ERR_OK))
         goto cleanup_fail;
 
+    if (size_limit > 0) {
+        if ((error = estimate_finish(&estimate)) != DRPM_ERR_OK)
+            goto cleanup_fail;
+        if (estimate_exceeded(&estimate, add_block_len)) {
+            error = DRPM_ERR_THRESHOLD;
+            goto cleanup_fail;
+        }
+    }
+
     if (addblk)
         *add_block_len_ret = add_block_len;
 
@@ -266,6 +336,8 @@ cleanup_fail:
 
 cleanup:
     free(diff_copies);
+    free(estimate.window);
+    free(estimate.sample_buf);
     //sfxsrt_free(&suffix);
     hash_free(&hashtab);
 
@@ -279,6 +351,92 @@ cleanup:
     return error;
 }
 
+/* Accounts for <len> bytes of internal data starting at <data>.
+ * Every SAMPLE_INTERVAL bytes of internal data, a window of the next
+ * SAMPLE_SIZE bytes is gathered (across chunks, however small) and
+ * compressed to keep a running estimate of the compression ratio. */
+int estimate_update(struct size_estimate *estimate, const unsigned char *data, size_t len)
+{
+    int error;
+    size_t step;
+
+    estimate->copies_count++;
+
+    while (len > 0) {
+        if (estimate->window_len == 0 && estimate->int_data_len < estimate->next_sample) {
+            /* skipping data between samples */
+            step = MIN(len, estimate->next_sample - estimate->int_data_len);
+        } else {
+            step = MIN(len, SAMPLE_SIZE - estimate->window_len);
+            memcpy(estimate->window + estimate->window_len, data, step);
+            estimate->window_len += step;
+        }
+
+        estimate->int_data_len += step;
+        data += step;
+        len -= step;
+
+        if (estimate->window_len == SAMPLE_SIZE) {
+            if ((error = estimate_sample(estimate)) != DRPM_ERR_OK)
+                return error;
+            estimate->next_sample = estimate->int_data_len - SAMPLE_SIZE + SAMPLE_INTERVAL;
+        }
+    }
+
+    return DRPM_ERR_OK;
+}
+
+/* Compresses the window gathered so far and adds it to the samples. */
+int estimate_sample(struct size_estimate *estimate)
+{
+    uLongf comp_len = estimate->sample_buf_len;
+
+    if (compress2(estimate->sample_buf, &comp_len, estimate->window,
+                  estimate->window_len, Z_BEST_SPEED) != Z_OK)
+        return DRPM_ERR_OTHER;
+
+    estimate->sample_in += estimate->window_len;
+    estimate->sample_out += comp_len;
+    estimate->window_len = 0;
+
+    return DRPM_ERR_OK;
+}
+
+/* Samples the last, partially gathered window once all internal data
+ * has been seen. From then on, a verdict is made however little
+ * internal data there is. */
+int estimate_finish(struct size_estimate *estimate)
+{
+    int error;
+
+    if (estimate->window_len > 0 &&
+        (error = estimate_sample(estimate)) != DRPM_ERR_OK)
+        return error;
+
+    estimate->complete = true;
+
+    return DRPM_ERR_OK;
+}
+
+/* Returns true if the estimated compressed size of the diff data and
+ * the <add_block_len> bytes of add block compressed so far is over
+ * the limit, i.e. the DeltaRPM is certain to be too large. */
+bool estimate_exceeded(const struct size_estimate *estimate, size_t add_block_len)
+{
+    uint64_t size = 0;
+
+    if (!estimate->complete && estimate->sample_in < SAMPLE_MIN)
+        return false;
+
+    if (estimate->sample_in > 0)
+        size = estimate->int_data_len * estimate->sample_out / estimate->sample_in;
+    size = size * SAMPLE_SLACK / 100;
+    size += estimate->copies_count * COPY_ENTRY_SIZE;
+    size += add_block_len;
+
+    return size > estimate->limit;
+}
+
 /* Creates internal and external copies from diff data. */
 int create_diff_copies(const struct diff_copy *diff_copies, size_t diff_copies_len,
                        uint32_t **ext_copies_ret, uint32_t *ext_copies_count_ret,
@@ -79,6 +79,17 @@ struct patch_info {
     char *nevr;
     struct patch_file *files;
     size_t file_count;
+    size_t *hash_table;
+    size_t ht_len;
+};
+
+/* buffered reader for rpmlist files */
+
+struct rpml_reader {
+    int filedesc;
+    unsigned char buffer[BUFFER_SIZE];
+    size_t pos;
+    size_t len;
 };
 
 struct rpm_patches {
@@ -87,12 +98,16 @@ struct rpm_patches {
 };
 
 static int cpio_extend(unsigned char **, size_t *, const void *, size_t);
-static bool is_unpatched(const struct rpm_patches *, const char *, const char *);
-static int rpml_get_uint16(int, uint16_t *);
-static int rpml_get_uint32(int, uint32_t *);
-static int rpml_get_string(int, char **);
-static int rpml_get_filename(int, char **, uint32_t *);
-static int rpml_skip(int, off_t);
+static uint32_t name_hash(const char *);
+static int patch_info_index(struct patch_info *);
+static const struct patch_file *patch_info_find(const struct patch_info *, const char *);
+static int read_rpmlist(int, struct patch_info *, bool);
+static int rpml_get_uint16(struct rpml_reader *, uint16_t *);
+static int rpml_get_uint32(struct rpml_reader *, uint32_t *);
+static int rpml_get_string(struct rpml_reader *, char **);
+static int rpml_get_filename(struct rpml_reader *, char **, uint32_t *);
+static int rpml_read(struct rpml_reader *, void *, size_t);
+static int rpml_skip(struct rpml_reader *, size_t);
 static int seq_add(struct files_seq *, unsigned);
 static bool seq_append(struct files_seq *, unsigned);
 static int seq_final(struct files_seq *, unsigned char **, size_t *);
@@ -302,7 +317,7 @@ int parse_cpio_from_rpm_filedata(struct rpm *rpm_file,
 
     unsigned char *sequence = NULL;
     uint32_t sequence_len;
-    MD5_CTX seq_md5;
+    struct checksum seq_md5 = {0};
     unsigned char seq_md5_digest[MD5_DIGEST_LENGTH];
     struct files_seq seq = SEQ_INIT;
     unsigned char *seq_files = NULL;
@@ -329,8 +344,8 @@ int parse_cpio_from_rpm_filedata(struct rpm *rpm_file,
         *offadjn_ret = 0;
     }
 
-    if (MD5_Init(&seq_md5) != 1)
-        return DRPM_ERR_OTHER;
+    if ((error = checksum_init(&seq_md5, DIGESTALGO_MD5)) != DRPM_ERR_OK)
+        return error;
 
     if ((error = rpm_get_file_info(rpm_file, &files, &file_count, &file_colors)) != DRPM_ERR_OK ||
         (error = rpm_get_digest_algo(rpm_file, &digest_algo)) != DRPM_ERR_OK)
@@ -481,23 +496,19 @@ int parse_cpio_from_rpm_filedata(struct rpm *rpm_file,
                                      CPIO_PADDING(CPIO_HEADER_SIZE + cpio_hdr.namesize))) != DRPM_ERR_OK)
                 goto cleanup_fail;
 
-            if (MD5_Update(&seq_md5, name, name_len) != 1 ||
-                md5_update_be32(&seq_md5, cpio_hdr.mode) != 1 ||
-                md5_update_be32(&seq_md5, cpio_hdr.filesize) != 1 ||
-                md5_update_be32(&seq_md5, MKDEV(cpio_hdr.rdevmajor,
-                                                cpio_hdr.rdevminor)) != 1) {
-                error = DRPM_ERR_OTHER;
+            if ((error = checksum_update(&seq_md5, name, name_len)) != DRPM_ERR_OK ||
+                (error = checksum_update_be32(&seq_md5, cpio_hdr.mode)) != DRPM_ERR_OK ||
+                (error = checksum_update_be32(&seq_md5, cpio_hdr.filesize)) != DRPM_ERR_OK ||
+                (error = checksum_update_be32(&seq_md5, MKDEV(cpio_hdr.rdevmajor,
+                                                              cpio_hdr.rdevminor))) != DRPM_ERR_OK)
                 goto cleanup_fail;
-            }
 
             if (S_ISLNK(file.mode)) {
                 if ((error = cpio_extend(&cpio, &cpio_len, file.linkto, cpio_hdr.filesize)) != DRPM_ERR_OK ||
                     (error = cpio_extend(&cpio, &cpio_len, "\0\0\0", CPIO_PADDING(cpio_hdr.filesize))) != DRPM_ERR_OK)
                     goto cleanup_fail;
-                if (MD5_Update(&seq_md5, file.linkto, cpio_hdr.filesize + 1) != 1) {
-                    error = DRPM_ERR_OTHER;
+                if ((error = checksum_update(&seq_md5, file.linkto, cpio_hdr.filesize + 1)) != DRPM_ERR_OK)
                     goto cleanup_fail;
-                }
             } else if (S_ISREG(file.mode) && cpio_hdr.filesize) {
                 switch (digest_algo) {
                 case DIGESTALGO_MD5:
@@ -505,20 +516,16 @@ int parse_cpio_from_rpm_filedata(struct rpm *rpm_file,
                         error = DRPM_ERR_FORMAT;
                         goto cleanup_fail;
                     }
-                    if (MD5_Update(&seq_md5, digest, MD5_DIGEST_LENGTH) != 1) {
-                        error = DRPM_ERR_OTHER;
+                    if ((error = checksum_update(&seq_md5, digest, MD5_DIGEST_LENGTH)) != DRPM_ERR_OK)
                         goto cleanup_fail;
-                    }
                     break;
                 case DIGESTALGO_SHA256:
                     if (!parse_sha256(digest, file.md5)) {
                         error = DRPM_ERR_FORMAT;
                         goto cleanup_fail;
                     }
-                    if (MD5_Update(&seq_md5, digest, SHA256_DIGEST_LENGTH) != 1) {
-                        error = DRPM_ERR_OTHER;
+                    if ((error = checksum_update(&seq_md5, digest, SHA256_DIGEST_LENGTH)) != DRPM_ERR_OK)
                         goto cleanup_fail;
-                    }
                     break;
                 }
             }
@@ -571,10 +578,8 @@ int parse_cpio_from_rpm_filedata(struct rpm *rpm_file,
     if ((error = seq_final(&seq, &seq_files, &seq_files_len)) != DRPM_ERR_OK)
         goto cleanup_fail;
 
-    if (MD5_Final(seq_md5_digest, &seq_md5) != 1) {
-        error = DRPM_ERR_OTHER;
+    if ((error = checksum_final(&seq_md5, seq_md5_digest)) != DRPM_ERR_OK)
         goto cleanup_fail;
-    }
 
     sequence_len = MD5_DIGEST_LENGTH + seq_files_len;
     if ((sequence = malloc(sequence_len)) == NULL) {
@@ -603,6 +608,7 @@ cleanup_fail:
         free(offadjs);
 
 cleanup:
+    checksum_free(&seq_md5);
     for (size_t i = 0; i < file_count; i++) {
         free(files[i].name);
         free(files[i].md5);
@@ -617,12 +623,47 @@ cleanup:
 
 /* RPM patches */
 
-int rpml_get_uint16(int filedesc, uint16_t *ret)
+/* Reads <len> bytes from rpmlist into <dest> (if not NULL),
+ * refilling the buffer as needed. */
+int rpml_read(struct rpml_reader *reader, void *dest, size_t len)
 {
+    unsigned char *out = dest;
+    size_t chunk;
+    ssize_t bytes;
+
+    while (len > 0) {
+        if (reader->pos == reader->len) {
+            if ((bytes = read(reader->filedesc, reader->buffer, BUFFER_SIZE)) < 0)
+                return DRPM_ERR_IO;
+            if (bytes == 0)
+                return DRPM_ERR_FORMAT;
+            reader->pos = 0;
+            reader->len = bytes;
+        }
+        chunk = MIN(len, reader->len - reader->pos);
+        if (out != NULL) {
+            memcpy(out, reader->buffer + reader->pos, chunk);
+            out += chunk;
+        }
+        reader->pos += chunk;
+        len -= chunk;
+    }
+
+    return DRPM_ERR_OK;
+}
+
+int rpml_skip(struct rpml_reader *reader, size_t len)
+{
+    return rpml_read(reader, NULL, len);
+}
+
+int rpml_get_uint16(struct rpml_reader *reader, uint16_t *ret)
+{
+    int error;
     unsigned char buf[2];
 
-    if (read(filedesc, buf, 2) != 2)
-        return DRPM_ERR_FORMAT;
+    if ((error = rpml_read(reader, buf, 2)) != DRPM_ERR_OK)
+        return error;
 
     if (ret != NULL)
         *ret = parse_be16(buf);
@@ -630,12 +671,13 @@ int rpml_get_uint16(int filedesc, uint16_t *ret)
     return DRPM_ERR_OK;
 }
 
-int rpml_get_uint32(int filedesc, uint32_t *ret)
+int rpml_get_uint32(struct rpml_reader *reader, uint32_t *ret)
 {
+    int error;
     unsigned char buf[4];
 
-    if (read(filedesc, buf, 4) != 4)
-        return DRPM_ERR_FORMAT;
+    if ((error = rpml_read(reader, buf, 4)) != DRPM_ERR_OK)
+        return error;
 
     if (ret != NULL)
         *ret = parse_be32(buf);
@@ -643,27 +685,30 @@ int rpml_get_uint32(int filedesc, uint32_t *ret)
     return DRPM_ERR_OK;
 }
 
-int rpml_get_string(int filedesc, char **ret)
+int rpml_get_string(struct rpml_reader *reader, char **ret)
 {
+    int error;
     uint8_t len;
 
-    if (read(filedesc, &len, 1) != 1)
-        return DRPM_ERR_FORMAT;
+    if ((error = rpml_read(reader, &len, 1)) != DRPM_ERR_OK)
+        return error;
 
-    if (ret != NULL) {
-        if ((*ret = malloc(len + 1)) == NULL)
-            return DRPM_ERR_MEMORY;
-        if (read(filedesc, *ret, len) != len) {
-            free(*ret);
-            return DRPM_ERR_FORMAT;
-        }
-        (*ret)[len] = '\0';
+    if (ret == NULL)
+        return rpml_skip(reader, len);
+
+    if ((*ret = malloc(len + 1)) == NULL)
+        return DRPM_ERR_MEMORY;
+    if ((error = rpml_read(reader, *ret, len)) != DRPM_ERR_OK) {
+        free(*ret);
+        *ret = NULL;
+        return error;
     }
+    (*ret)[len] = '\0';
 
     return DRPM_ERR_OK;
 }
 
-int rpml_get_filename(int filedesc, char **filename_ret, uint32_t *filename_len_ret)
+int rpml_get_filename(struct rpml_reader *reader, char **filename_ret, uint32_t *filename_len_ret)
 {
     int error;
     uint8_t off;
@@ -679,13 +724,13 @@ int rpml_get_filename(int filedesc, char **filename_ret, uint32_t *filename_len_
     filename = *filename_ret;
     filename_len = *filename_len_ret;
 
-    if (read(filedesc, buf, 2) != 2)
-        return DRPM_ERR_FORMAT;
+    if ((error = rpml_read(reader, buf, 2)) != DRPM_ERR_OK)
+        return error;
 
     off = buf[0];
 
     if (buf[1] == 0xFF) {
-        if ((error = rpml_get_uint16(filedesc, &len)) != DRPM_ERR_OK)
+        if ((error = rpml_get_uint16(reader, &len)) != DRPM_ERR_OK)
             return error;
     } else {
         len = buf[1];
@@ -697,31 +742,26 @@ int rpml_get_filename(int filedesc, char **filename_ret, uint32_t *filename_len_
         if ((filename = realloc(filename, new_filename_len)) == NULL)
             return DRPM_ERR_MEMORY;
         filename_len = new_filename_len;
+        *filename_ret = filename;
+        *filename_len_ret = filename_len;
     }
 
-    if (read(filedesc, filename + off, len) != len)
-        return DRPM_ERR_FORMAT;
+    if ((error = rpml_read(reader, filename + off, len)) != DRPM_ERR_OK)
+        return error;
 
     filename[off + len] = '\0';
 
-    *filename_ret = filename;
-    *filename_len_ret = filename_len;
-
     return DRPM_ERR_OK;
 }
 
-int rpml_skip(int filedesc, off_t len)
-{
-    return lseek(filedesc, len, SEEK_CUR) != (off_t)-1 ?
-           DRPM_ERR_OK :
-           DRPM_ERR_IO;
-}
-
+/* Reads rpmlist from <filedesc>. The magic number is expected unless
+ * <skip_magic> is set (i.e. it has already been read by the caller). */
 int read_rpmlist(int filedesc, struct patch_info *patch, bool skip_magic)
 {
     int error = DRPM_ERR_OK;
+    struct rpml_reader *reader;
     char *filename = NULL;
-    uint32_t filename_len;
+    uint32_t filename_len = 0;
     const char *fname;
     uint32_t magic;
     char *name = NULL;
@@ -732,36 +772,46 @@ int read_rpmlist(int filedesc, struct patch_info *patch, bool skip_magic)
     uint8_t num2;
     unsigned char buf[4];
     uint8_t read_bytes;
+    struct patch_file *file;
+
+    if ((reader = malloc(sizeof(struct rpml_reader))) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    reader->filedesc = filedesc;
+    reader->pos = 0;
+    reader->len = 0;
 
     if (!skip_magic) {
-        if ((error = rpml_get_uint32(filedesc, &magic)) != DRPM_ERR_OK)
-            return error;
-        if (magic != MAGIC_RPML)
-            return DRPM_ERR_FORMAT;
+        if ((error = rpml_get_uint32(reader, &magic)) != DRPM_ERR_OK)
+            goto cleanup;
+        if (magic != MAGIC_RPML) {
+            error = DRPM_ERR_FORMAT;
+            goto cleanup;
+        }
     }
 
-    if ((error = rpml_get_string(filedesc, &name)) != DRPM_ERR_OK ||
-        (error = rpml_get_string(filedesc, &evr)) != DRPM_ERR_OK)
+    if ((error = rpml_get_string(reader, &name)) != DRPM_ERR_OK ||
+        (error = rpml_get_string(reader, &evr)) != DRPM_ERR_OK)
         goto cleanup;
 
     if ((patch->nevr = malloc(strlen(name) + strlen(evr) + 2)) == NULL) {
-        error = DRPM_ERR_FORMAT;
+        error = DRPM_ERR_MEMORY;
         goto cleanup;
     }
 
     sprintf(patch->nevr, "%s-%s", name, evr);
 
-    if ((error = rpml_get_string(filedesc, NULL)) != DRPM_ERR_OK || // build host
-        (error = rpml_get_uint32(filedesc, NULL)) != DRPM_ERR_OK || // build time
-        (error = rpml_get_uint16(filedesc, &patches_count)) != DRPM_ERR_OK)
+    if ((error = rpml_get_string(reader, NULL)) != DRPM_ERR_OK || // build host
+        (error = rpml_get_uint32(reader, NULL)) != DRPM_ERR_OK || // build time
+        (error = rpml_get_uint16(reader, &patches_count)) != DRPM_ERR_OK)
         goto cleanup;
 
     if (patches_count > 0) {
         for (uint16_t i = 0; i < patches_count; i++)
-            if ((error = rpml_get_string(filedesc, NULL)) != DRPM_ERR_OK)
+            if ((error = rpml_get_string(reader, NULL)) != DRPM_ERR_OK)
                 goto cleanup;
 
-        if ((error = rpml_get_uint32(filedesc, &files_count)) != DRPM_ERR_OK)
+        if ((error = rpml_get_uint32(reader, &files_count)) != DRPM_ERR_OK)
             goto cleanup;
 
         for (uint32_t i = 0; i < files_count; i++) {
@@ -769,21 +819,23 @@ int read_rpmlist(int filedesc, struct patch_info *patch, bool skip_magic)
                 error = DRPM_ERR_MEMORY;
                 goto cleanup;
             }
-            if ((error = rpml_get_filename(filedesc, &filename, &filename_len)))
+            if ((error = rpml_get_filename(reader, &filename, &filename_len)) != DRPM_ERR_OK)
                 goto cleanup;
-            if ((patch->files[patch->file_count].name = malloc(strlen(filename) + 1)) == NULL) {
+            file = &patch->files[patch->file_count];
+            if ((file->name = malloc(strlen(filename) + 1)) == NULL) {
                 error = DRPM_ERR_MEMORY;
+                goto cleanup;
             }
-            strcpy(patch->files[patch->file_count].name, filename);
-            patch->files[patch->file_count].mode = S_IFREG;
-            patch->files[patch->file_count].flags = RPMFILE_UNPATCHED;
-            memset(patch->files[patch->file_count].md5, 0, MD5_DIGEST_LENGTH);
+            strcpy(file->name, filename);
+            file->mode = S_IFREG;
+            file->flags = RPMFILE_UNPATCHED;
+            memset(file->md5, 0, MD5_DIGEST_LENGTH);
             patch->file_count++;
         }
     }
 
     while (true) {
-        if ((error = rpml_get_filename(filedesc, &filename, &filename_len)) != DRPM_ERR_OK)
+        if ((error = rpml_get_filename(reader, &filename, &filename_len)) != DRPM_ERR_OK)
             goto cleanup;
 
         if (strlen(filename) == 0)
@@ -794,60 +846,57 @@ int read_rpmlist(int filedesc, struct patch_info *patch, bool skip_magic)
             goto cleanup;
         }
 
+        file = &patch->files[patch->file_count];
         fname = (strncmp(filename, "./", 2) == 0) ? filename + 2 : filename;
 
-        if ((patch->files[patch->file_count].name = malloc(strlen(fname) + 1)) == NULL) {
+        if ((file->name = malloc(strlen(fname) + 1)) == NULL) {
             error = DRPM_ERR_MEMORY;
             goto cleanup;
         }
 
-        patch->files[patch->file_count].flags = RPMFILE_NONE;
-        memset(patch->files[patch->file_count].md5, 0, MD5_DIGEST_LENGTH);
+        strcpy(file->name, fname);
+        file->flags = RPMFILE_NONE;
+        memset(file->md5, 0, MD5_DIGEST_LENGTH);
+        patch->file_count++;
 
-        if ((error = rpml_get_uint16(filedesc, &patch->files[patch->file_count].mode)) != DRPM_ERR_OK)
+        if ((error = rpml_get_uint16(reader, &file->mode)) != DRPM_ERR_OK)
             goto cleanup;
 
-        if (patch->files[patch->file_count].mode != 0) {
-            if (read(filedesc, &num, 1) != 1) {
-                error = DRPM_ERR_FORMAT;
-                goto cleanup;
-            }
+        if (file->mode == 0)
+            continue;
 
-            if (num == 0xFF) {
-                if (read(filedesc, &num2, 1) != 1 ||
-                    read(filedesc, &num, 1) != 1) {
-                    error = DRPM_ERR_FORMAT;
-                    goto cleanup;
-                }
-                if (((num2 > 0) && (error = rpml_skip(filedesc, num2 + 1)) != DRPM_ERR_OK) ||
-                    ((num & 0xFC) && (error = rpml_skip(filedesc, (num >> 2 & 0x3F) + 1)) != DRPM_ERR_OK))
-                    goto cleanup;
-            } else {
-                if (((num & 0xE0) && (error = rpml_skip(filedesc, (num >> 5 & 7) + 1)) != DRPM_ERR_OK) ||
-                    ((num & 0x1C) && (error = rpml_skip(filedesc, (num >> 2 & 7) + 1)) != DRPM_ERR_OK))
-                    goto cleanup;
-            }
+        if ((error = rpml_read(reader, &num, 1)) != DRPM_ERR_OK)
+            goto cleanup;
 
-            if ((S_ISCHR(patch->files[patch->file_count].mode) || S_ISBLK(patch->files[patch->file_count].mode)) &&
-                (error = rpml_get_uint32(filedesc, NULL)) != DRPM_ERR_OK) // rdev
+        if (num == 0xFF) {
+            if ((error = rpml_read(reader, &num2, 1)) != DRPM_ERR_OK ||
+                (error = rpml_read(reader, &num, 1)) != DRPM_ERR_OK)
+                goto cleanup;
+            if (((num2 > 0) && (error = rpml_skip(reader, num2 + 1)) != DRPM_ERR_OK) ||
+                ((num & 0xFC) && (error = rpml_skip(reader, (num >> 2 & 0x3F) + 1)) != DRPM_ERR_OK))
+                goto cleanup;
+        } else {
+            if (((num & 0xE0) && (error = rpml_skip(reader, (num >> 5 & 7) + 1)) != DRPM_ERR_OK) ||
+                ((num & 0x1C) && (error = rpml_skip(reader, (num >> 2 & 7) + 1)) != DRPM_ERR_OK))
                 goto cleanup;
-
-            if (S_ISREG(patch->files[patch->file_count].mode) || S_ISLNK(patch->files[patch->file_count].mode)) {
-                read_bytes = (num % 4) + 1;
-                memset(buf, 0, 4);
-                if (read(filedesc, buf + (4 - read_bytes), read_bytes) != read_bytes &&
-                    parse_be32(buf) > 0 &&
-                    read(filedesc, patch->files[patch->file_count].md5, MD5_DIGEST_LENGTH) != MD5_DIGEST_LENGTH) {
-                    error = DRPM_ERR_FORMAT;
-                    goto cleanup;
-                }
-            }
         }
 
-        patch->file_count++;
+        if ((S_ISCHR(file->mode) || S_ISBLK(file->mode)) &&
+            (error = rpml_get_uint32(reader, NULL)) != DRPM_ERR_OK) // rdev
+            goto cleanup;
+
+        if (S_ISREG(file->mode) || S_ISLNK(file->mode)) {
+            read_bytes = (num % 4) + 1;
+            memset(buf, 0, 4);
+            if ((error = rpml_read(reader, buf + (4 - read_bytes), read_bytes)) != DRPM_ERR_OK ||
+                (parse_be32(buf) > 0 &&
+                 (error = rpml_read(reader, file->md5, MD5_DIGEST_LENGTH)) != DRPM_ERR_OK))
+                goto cleanup;
+        }
     }
 
 cleanup:
+    free(reader);
     free(filename);
     free(name);
     free(evr);
@@ -855,6 +904,62 @@ cleanup:
     return error;
 }
 
+/* Hashes file name for patch_info lookups (FNV-1a). */
+uint32_t name_hash(const char *name)
+{
+    uint32_t hash = 2166136261U;
+
+    for (; *name != '\0'; name++) {
+        hash ^= (unsigned char)*name;
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+/* Creates hash table of file names, so that patch_info_find()
+ * does not need to scan all files. As with a linear scan,
+ * the first occurence of a duplicate name takes precedence. */
+int patch_info_index(struct patch_info *patch)
+{
+    size_t ht_len = 16;
+    size_t key;
+
+    while (ht_len < 2 * patch->file_count)
+        ht_len <<= 1;
+
+    if ((patch->hash_table = calloc(ht_len, sizeof(size_t))) == NULL)
+        return DRPM_ERR_MEMORY;
+    patch->ht_len = ht_len;
+
+    for (size_t i = 0; i < patch->file_count; i++) {
+        key = name_hash(patch->files[i].name) & (ht_len - 1);
+        while (patch->hash_table[key] &&
+               strcmp(patch->files[patch->hash_table[key] - 1].name, patch->files[i].name) != 0)
+            key = (key + 1) & (ht_len - 1);
+        if (!patch->hash_table[key])
+            patch->hash_table[key] = i + 1;
+    }
+
+    return DRPM_ERR_OK;
+}
+
+/* Finds file in patch info by name. Returns NULL if not found. */
+const struct patch_file *patch_info_find(const struct patch_info *patch, const char *name)
+{
+    size_t key = name_hash(name) & (patch->ht_len - 1);
+    const struct patch_file *file;
+
+    while (patch->hash_table[key]) {
+        file = &patch->files[patch->hash_table[key] - 1];
+        if (strcmp(file->name, name) == 0)
+            return file;
+        key = (key + 1) & (patch->ht_len - 1);
+    }
+
+    return NULL;
+}
+
 /* Reads RPM patches. */
 int patches_read(const char *oldrpmprint, const char *oldpatchrpm, struct rpm_patches **patches)
 {
@@ -864,8 +969,8 @@ int patches_read(const char *oldrpmprint, const char *oldpatchrpm, struct rpm_pa
     struct patch_info *patchrpm;
     uint32_t magic;
     struct rpm *rpmst = NULL;
-    struct file_info *files;
-    size_t file_count;
+    struct file_info *files = NULL;
+    size_t file_count = 0;
     char *fname;
 
     if (patches == NULL)
@@ -877,7 +982,7 @@ int patches_read(const char *oldrpmprint, const char *oldpatchrpm, struct rpm_pa
         return DRPM_ERR_OK;
     }
 
-    if ((*patches = malloc(sizeof(struct rpm_patches))) == NULL)
+    if ((*patches = calloc(1, sizeof(struct rpm_patches))) == NULL)
         return DRPM_ERR_MEMORY;
 
     rpmprint = &(*patches)->rpmprint;
@@ -907,7 +1012,7 @@ int patches_read(const char *oldrpmprint, const char *oldpatchrpm, struct rpm_pa
             (error = rpm_get_nevr(rpmst, &rpmprint->nevr)) != DRPM_ERR_OK ||
             (error = rpm_get_file_info(rpmst, &files, &file_count, NULL)) != DRPM_ERR_OK)
             goto cleanup_fail;
-        if ((rpmprint->files = malloc(file_count)) == NULL) {
+        if ((rpmprint->files = calloc(file_count, sizeof(struct patch_file))) == NULL) {
             error = DRPM_ERR_MEMORY;
             goto cleanup_fail;
         }
@@ -938,6 +1043,10 @@ int patches_read(const char *oldrpmprint, const char *oldpatchrpm, struct rpm_pa
         goto cleanup_fail;
     }
 
+    if ((error = patch_info_index(rpmprint)) != DRPM_ERR_OK ||
+        (error = patch_info_index(patchrpm)) != DRPM_ERR_OK)
+        goto cleanup_fail;
+
     goto cleanup;
 
 cleanup_fail:
@@ -946,6 +1055,14 @@ cleanup_fail:
 cleanup:
     close(filedesc);
 
+    for (size_t i = 0; i < file_count; i++) {
+        free(files[i].name);
+        free(files[i].md5);
+        free(files[i].linkto);
+    }
+    free(files);
+    rpm_destroy(&rpmst);
+
     return error;
 }
 
@@ -958,11 +1075,13 @@ int patches_destroy(struct rpm_patches **patches)
         free((*patches)->rpmprint.files[i].name);
     free((*patches)->rpmprint.files);
     free((*patches)->rpmprint.nevr);
+    free((*patches)->rpmprint.hash_table);
 
     for (size_t i = 0; i < (*patches)->patchrpm.file_count; i++)
         free((*patches)->patchrpm.files[i].name);
     free((*patches)->patchrpm.files);
     free((*patches)->patchrpm.nevr);
+    free((*patches)->patchrpm.hash_table);
 
     free(*patches);
 
@@ -987,25 +1106,17 @@ int patches_check_nevr(const struct rpm_patches *patches, const char *nevr)
 bool is_unpatched(const struct rpm_patches *patches, const char *name,
                   const char rpm_md5[MD5_DIGEST_LENGTH * 2 + 1])
 {
-    size_t i;
+    const struct patch_file *file;
     char patch_md5[MD5_DIGEST_LENGTH * 2 + 1];
 
-    for (i = 0; i < patches->rpmprint.file_count; i++)
-        if (strcmp(name, patches->rpmprint.files[i].name) == 0)
-            break;
-
-    if (i == patches->rpmprint.file_count ||
-        !(patches->rpmprint.files[i].flags & RPMFILE_UNPATCHED))
+    if ((file = patch_info_find(&patches->rpmprint, name)) == NULL ||
+        !(file->flags & RPMFILE_UNPATCHED))
         return false;
 
-    for (i = 0; i < patches->patchrpm.file_count; i++)
-        if (strcmp(name, patches->patchrpm.files[i].name) == 0)
-            break;
-
-    if (i == patches->patchrpm.file_count) // shouldn't happen
+    if ((file = patch_info_find(&patches->patchrpm, name)) == NULL) // shouldn't happen
         return true;
 
-    dump_hex(patch_md5, patches->patchrpm.files[i].md5, MD5_DIGEST_LENGTH);
+    dump_hex(patch_md5, file->md5, MD5_DIGEST_LENGTH);
 
     return (strcmp(rpm_md5, patch_md5) != 0);
 }
@@ -1014,7 +1125,7 @@ bool is_unpatched(const struct rpm_patches *patches, const char *name,
  * only read one RPM file and rpm-only deltarpms take the RPMs' CPIO
  * archives "as is" (i.e. they are not altered based on file metadata),
  * there is nothing to diff. */
-int fill_nodiff_deltarpm(struct deltarpm *delta, const char *rpm_filename,
+int fill_nodiff_deltarpm(struct deltarpm *delta, int rpm_filedesc,
                          bool comp_not_set)
 {
     struct rpm *solo_rpm;
@@ -1034,7 +1145,7 @@ int fill_nodiff_deltarpm(struct deltarpm *delta, const char *rpm_filename,
     }
     delta->sequence_len = MD5_DIGEST_LENGTH;
 
-    if ((error = rpm_read(&solo_rpm, rpm_filename, RPM_ARCHIVE_READ_UNCOMP,
+    if ((error = rpm_read_fd(&solo_rpm, rpm_filedesc, RPM_ARCHIVE_READ_UNCOMP,
                           NULL, delta->sequence, delta->tgt_md5)) != DRPM_ERR_OK ||
         (error = rpm_fetch_lead_and_signature(solo_rpm, &delta->tgt_leadsig, &delta->tgt_leadsig_len)) != DRPM_ERR_OK ||
         (error = rpm_get_nevr(solo_rpm, &nevr)) != DRPM_ERR_OK)
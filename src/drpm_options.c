@@ -73,10 +73,12 @@ int drpm_make_options_defaults(struct drpm_make_options *opts)
     opts->addblk = true;
     opts->addblk_comp = DRPM_COMP_BZIP2;
     opts->addblk_comp_level = DRPM_COMP_LEVEL_DEFAULT;
+    opts->comp_threads = 1;
     opts->seqfile = NULL;
     opts->oldrpmprint = NULL;
     opts->oldpatchrpm = NULL;
     opts->mbytes = 0;
+    opts->size_ratio = 0;
 
     return DRPM_ERR_OK;
 }
@@ -94,7 +96,9 @@ int drpm_make_options_copy(struct drpm_make_options *opts_dst, const struct drpm
     opts_dst->addblk = opts_src->addblk;
     opts_dst->addblk_comp = opts_src->addblk_comp;
     opts_dst->addblk_comp_level = opts_src->addblk_comp_level;
+    opts_dst->comp_threads = opts_src->comp_threads;
     opts_dst->mbytes = opts_src->mbytes;
+    opts_dst->size_ratio = opts_src->size_ratio;
 
     free(opts_dst->seqfile);
     free(opts_dst->oldrpmprint);
@@ -156,7 +160,7 @@ int drpm_make_options_set_version(struct drpm_make_options *opts, unsigned short
 int drpm_make_options_set_delta_comp(struct drpm_make_options *opts, unsigned short comp, unsigned short level)
 {
     if (opts == NULL ||
-        (level != DRPM_COMP_LEVEL_DEFAULT && (level < 1 || level > 9)))
+        (level != DRPM_COMP_LEVEL_DEFAULT && (level < 1 || level > COMP_LEVEL_MAX(comp))))
         return DRPM_ERR_ARGS;
 
     switch (comp) {
@@ -166,6 +170,7 @@ int drpm_make_options_set_delta_comp(struct drpm_make_options *opts, unsigned sh
     case DRPM_COMP_LZMA:
     case DRPM_COMP_XZ:
     case DRPM_COMP_LZIP:
+    case DRPM_COMP_ZSTD:
         opts->comp_from_rpm = false;
         opts->comp = comp;
         opts->comp_level = level;
@@ -177,6 +182,16 @@ int drpm_make_options_set_delta_comp(struct drpm_make_options *opts, unsigned sh
     return DRPM_ERR_OK;
 }
 
+int drpm_make_options_set_delta_comp_threads(struct drpm_make_options *opts, unsigned short threads)
+{
+    if (opts == NULL)
+        return DRPM_ERR_ARGS;
+
+    opts->comp_threads = threads;
+
+    return DRPM_ERR_OK;
+}
+
 int drpm_make_options_get_delta_comp_from_rpm(struct drpm_make_options *opts)
 {
     if (opts == NULL)
@@ -200,7 +215,7 @@ int drpm_make_options_forbid_addblk(struct drpm_make_options *opts)
 int drpm_make_options_set_addblk_comp(struct drpm_make_options *opts, unsigned short comp, unsigned short level)
 {
     if (opts == NULL ||
-        (level != DRPM_COMP_LEVEL_DEFAULT && (level < 1 || level > 9)))
+        (level != DRPM_COMP_LEVEL_DEFAULT && (level < 1 || level > COMP_LEVEL_MAX(comp))))
         return DRPM_ERR_ARGS;
 
     switch (comp) {
@@ -210,6 +225,7 @@ int drpm_make_options_set_addblk_comp(struct drpm_make_options *opts, unsigned s
     case DRPM_COMP_LZMA:
     case DRPM_COMP_XZ:
     case DRPM_COMP_LZIP:
+    case DRPM_COMP_ZSTD:
         opts->addblk = true;
         opts->addblk_comp = comp;
         opts->addblk_comp_level = level;
@@ -267,6 +283,16 @@ int drpm_make_options_add_patches(struct drpm_make_options *opts, const char *ol
     return DRPM_ERR_OK;
 }
 
+int drpm_make_options_set_size_ratio(struct drpm_make_options *opts, unsigned short percent)
+{
+    if (opts == NULL || percent > 100)
+        return DRPM_ERR_ARGS;
+
+    opts->size_ratio = percent;
+
+    return DRPM_ERR_OK;
+}
+
 // TODO: not yet used
 int drpm_make_options_set_memlimit(struct drpm_make_options *opts, unsigned mbytes)
 {
@@ -277,3 +303,157 @@ int drpm_make_options_set_memlimit(struct drpm_make_options *opts, unsigned mbyt
 
     return DRPM_ERR_OK;
 }
+
+int drpm_apply_options_init(struct drpm_apply_options **opts)
+{
+    const struct drpm_apply_options init = {0};
+
+    if (opts == NULL)
+        return DRPM_ERR_ARGS;
+
+    if ((*opts = malloc(sizeof(struct drpm_apply_options))) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    **opts = init;
+
+    drpm_apply_options_defaults(*opts);
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_apply_options_destroy(struct drpm_apply_options **opts)
+{
+    if (opts == NULL)
+        return DRPM_ERR_ARGS;
+
+    free((*opts)->spill_dir);
+    free((*opts)->prelink_dir);
+    free((*opts)->verify_cache);
+    free(*opts);
+    *opts = NULL;
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_apply_options_defaults(struct drpm_apply_options *opts)
+{
+    if (opts == NULL)
+        return DRPM_ERR_ARGS;
+
+    free(opts->spill_dir);
+    free(opts->prelink_dir);
+    free(opts->verify_cache);
+
+    opts->uncompressed_payload = false;
+    opts->cache_size = 0;
+    opts->open_files = 0;
+    opts->spill_dir = NULL;
+    opts->spill_extent = 0;
+    opts->prelink_dir = NULL;
+    opts->verify_cache = NULL;
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_apply_options_uncompressed_payload(struct drpm_apply_options *opts)
+{
+    if (opts == NULL)
+        return DRPM_ERR_ARGS;
+
+    opts->uncompressed_payload = true;
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_apply_options_set_cache_size(struct drpm_apply_options *opts, size_t bytes)
+{
+    if (opts == NULL)
+        return DRPM_ERR_ARGS;
+
+    opts->cache_size = bytes;
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_apply_options_set_open_files(struct drpm_apply_options *opts, unsigned short count)
+{
+    if (opts == NULL)
+        return DRPM_ERR_ARGS;
+
+    opts->open_files = count;
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_apply_options_set_spill_dir(struct drpm_apply_options *opts, const char *dir)
+{
+    char *tmp;
+
+    if (opts == NULL)
+        return DRPM_ERR_ARGS;
+
+    if (dir == NULL) {
+        free(opts->spill_dir);
+        opts->spill_dir = NULL;
+    } else {
+        if ((tmp = malloc(strlen(dir) + 1)) == NULL)
+            return DRPM_ERR_MEMORY;
+        strcpy(tmp, dir);
+        free(opts->spill_dir);
+        opts->spill_dir = tmp;
+    }
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_apply_options_set_spill_extent(struct drpm_apply_options *opts, size_t bytes)
+{
+    if (opts == NULL)
+        return DRPM_ERR_ARGS;
+
+    opts->spill_extent = bytes;
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_apply_options_set_prelink_dir(struct drpm_apply_options *opts, const char *dir)
+{
+    char *tmp;
+
+    if (opts == NULL)
+        return DRPM_ERR_ARGS;
+
+    if (dir == NULL) {
+        free(opts->prelink_dir);
+        opts->prelink_dir = NULL;
+    } else {
+        if ((tmp = malloc(strlen(dir) + 1)) == NULL)
+            return DRPM_ERR_MEMORY;
+        strcpy(tmp, dir);
+        free(opts->prelink_dir);
+        opts->prelink_dir = tmp;
+    }
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_apply_options_set_verify_cache(struct drpm_apply_options *opts, const char *path)
+{
+    char *tmp;
+
+    if (opts == NULL)
+        return DRPM_ERR_ARGS;
+
+    if (path == NULL) {
+        free(opts->verify_cache);
+        opts->verify_cache = NULL;
+    } else {
+        if ((tmp = malloc(strlen(path) + 1)) == NULL)
+            return DRPM_ERR_MEMORY;
+        strcpy(tmp, path);
+        free(opts->verify_cache);
+        opts->verify_cache = tmp;
+    }
+
+    return DRPM_ERR_OK;
+}
@@ -30,10 +30,16 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
 #include <openssl/md5.h>
+#include <openssl/sha.h>
 
 #define CHUNK_SIZE 1024
 
+/* highest compression level accepted for given compression type */
+#define COMP_LEVEL_MAX(comp) ((comp) == DRPM_COMP_ZSTD ? 22 : 9)
+
 #define CREAT_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH)
 
 #define DIGESTALGO_MD5 0
@@ -46,6 +52,7 @@
 #define RPM_ARCHIVE_DONT_READ 0
 #define RPM_ARCHIVE_READ_UNCOMP 1
 #define RPM_ARCHIVE_READ_DECOMP 2
+#define RPM_ARCHIVE_STREAM_DECOMP 3
 
 #define MIN(x,y) (((x) < (y)) ? (x) : (y))
 #define MAX(x,y) (((x) > (y)) ? (x) : (y))
@@ -99,10 +106,47 @@ struct drpm_make_options {
     bool addblk;
     unsigned short addblk_comp;
     unsigned short addblk_comp_level;
+    unsigned short comp_threads; // 0 for number of CPUs
     char *seqfile;
     char *oldrpmprint;
     char *oldpatchrpm;
     unsigned mbytes;
+    unsigned short size_ratio;
+};
+
+/* Destination of output data: <write_func> if set, otherwise
+ * <filedesc> if valid, otherwise nowhere. */
+struct sink {
+    int filedesc;
+    drpm_write_func write_func;
+    void *write_arg;
+};
+
+struct drpm_apply_options {
+    bool uncompressed_payload;
+    size_t cache_size; // old RPM data kept in memory, 0 for default
+    unsigned short open_files; // 0 for default
+    char *spill_dir; // NULL for default
+    size_t spill_extent;
+    char *prelink_dir; // NULL if not kept across operations
+    char *verify_cache; // NULL if not used
+};
+
+struct checksum {
+    unsigned short digest_algo;
+    EVP_MD_CTX *ctx; // NULL if not initialized or finalized
+};
+
+/* Verification of an uncompressed payload against the digest
+ * in the header of the new RPM. */
+struct payload_check {
+    struct rpm *header_rpm; // re-created header (rpm-only deltas)
+    unsigned char *header; // header being re-created
+    size_t header_len;
+    size_t header_pos;
+    bool started; // digest known, payload being checked
+    struct checksum chsm;
+    unsigned char digest[MAX(MD5_DIGEST_LENGTH, SHA256_DIGEST_LENGTH)];
 };
 
 struct cpio_file;
@@ -110,6 +154,9 @@ struct cpio_header;
 struct deltarpm;
 struct file_info;
 
+//drpm_apply.c
+struct prelink_cache;
+struct verify_cache;
 //drpm_block.c
 struct blocks;
 //drpm_compstrm.c
@@ -120,6 +167,9 @@ struct decompstrm;
 struct rpm_patches;
 //drpm_rpm.c
 struct rpm;
+struct rpm_db;
+//drpm_ring.c
+struct ring;
 //drpm_search.c
 struct hash;
 struct sfxsrt;
@@ -127,25 +177,51 @@ struct sfxsrt;
 struct compstrm_wrapper;
 
 //drpm_apply.c
+size_t checksum_digest_len(struct checksum);
+int check_seqfiles(const struct cpio_file *, size_t, const struct file_info *,
+                   unsigned short, int, struct prelink_cache *, struct verify_cache *);
+int checksum_final(struct checksum *, unsigned char *);
+void checksum_free(struct checksum *);
+int checksum_init(struct checksum *, unsigned short);
+int checksum_update(struct checksum *, const void *, size_t);
+int checksum_update_be32(struct checksum *, uint32_t);
 int expand_sequence(struct cpio_file **, size_t *, const unsigned char *, uint32_t,
-                    const struct file_info *, size_t, unsigned short, int);
+                    const struct file_info *, size_t, unsigned short, int,
+                    struct prelink_cache *, struct verify_cache *);
 int is_prelinked(bool *, int, const unsigned char *, ssize_t);
-int prelink_open(const char *, int *);
+int payload_check_final(struct payload_check *);
+void payload_check_free(struct payload_check *);
+int payload_check_init(struct payload_check *, struct rpm *, size_t);
+int payload_check_update(struct payload_check *, const unsigned char *, size_t);
+int prelink_cache_create(struct prelink_cache **, const char *);
+int prelink_cache_destroy(struct prelink_cache **);
+int prelink_open(struct prelink_cache *, const char *, int *);
+void verify_cache_add(struct verify_cache *, const struct stat *,
+                      unsigned short, const unsigned char *);
+int verify_cache_close(struct verify_cache **);
+bool verify_cache_lookup(const struct verify_cache *, const struct stat *,
+                         unsigned short, const unsigned char *);
+int verify_cache_open(struct verify_cache **, const char *);
 
 //drpm_block.c
 size_t block_id(uint64_t offset);
 size_t block_size();
 int blocks_create(struct blocks **, uint64_t, const struct file_info *,
                   const struct cpio_file *, size_t, const uint32_t *, size_t,
-                  struct rpm *, bool);
+                  struct rpm *, bool, struct prelink_cache *,
+                  const struct drpm_apply_options *);
 int blocks_destroy(struct blocks **);
-int blocks_next(struct blocks *, unsigned char *, size_t *, uint64_t, size_t,
+bool blocks_in_place(uint64_t, const struct drpm_apply_options *);
+int blocks_next(struct blocks *, const unsigned char **, size_t *, uint64_t, size_t,
                 size_t, size_t);
 
 //drpm_compstrm.c
 int compstrm_destroy(struct compstrm **);
 int compstrm_finish(struct compstrm *, unsigned char **, size_t *);
+int compstrm_get_comp_size(struct compstrm *, size_t *);
 int compstrm_init(struct compstrm **, int, unsigned short, int);
+int compstrm_init_mt(struct compstrm **, const struct sink *, unsigned short, int, unsigned, struct checksum *);
+int compstrm_init_par(struct compstrm **, unsigned short, int, unsigned);
 int compstrm_write(struct compstrm *, size_t, const void *);
 int compstrm_write_be32(struct compstrm *, uint32_t);
 int compstrm_write_be64(struct compstrm *, uint64_t);
@@ -153,8 +229,9 @@ int compstrm_write_be64(struct compstrm *, uint64_t);
 //drpm_decompstrm.c
 int decompstrm_destroy(struct decompstrm **);
 int decompstrm_get_comp_size(struct decompstrm *, size_t *);
-int decompstrm_init(struct decompstrm **, int, unsigned short *, MD5_CTX *, const unsigned char *, size_t);
+int decompstrm_init(struct decompstrm **, int, unsigned short *, struct checksum *, const unsigned char *, size_t);
 int decompstrm_read(struct decompstrm *, size_t, void *);
+int decompstrm_read_ptr(struct decompstrm *, size_t, const unsigned char **);
 int decompstrm_read_be32(struct decompstrm *, uint32_t *);
 int decompstrm_read_be64(struct decompstrm *, uint64_t *);
 int decompstrm_read_until_eof(struct decompstrm *, size_t *, unsigned char **);
@@ -168,12 +245,13 @@ void free_deltarpm(struct deltarpm *);
 int make_diff(const unsigned char *, size_t, const unsigned char *, size_t,
               const unsigned char ***, uint64_t *, uint32_t **, uint32_t *,
               uint32_t **, uint32_t *, unsigned char **, uint32_t *,
-              unsigned short, int);
+              unsigned short, int, size_t);
 
 //drpm_make.c
 int cpio_header_read(struct cpio_header *, const char *);
 void cpio_header_write(const struct cpio_header *, char *);
-int fill_nodiff_deltarpm(struct deltarpm *, const char *, bool);
+int fill_nodiff_deltarpm(struct deltarpm *, int, bool);
+bool is_unpatched(const struct rpm_patches *, const char *, const char *);
 int parse_cpio_from_rpm_filedata(struct rpm *, unsigned char **, size_t *,
                                  unsigned char **, uint32_t *,
                                  uint32_t **, uint32_t *,
@@ -188,10 +266,17 @@ void drpm_free(struct drpm *);
 int read_be32(int, uint32_t *);
 int read_be64(int, uint64_t *);
 int read_deltarpm(struct deltarpm *, const char *);
+int read_deltarpm_stream(struct deltarpm *, const char *);
+int read_deltarpm_stream_fd(struct deltarpm *, int);
+int read_full(int, void *, size_t);
 
 //drpm_rpm.c
+int rpm_archive_map_chunk(struct rpm *, const unsigned char **, size_t);
 int rpm_archive_read_chunk(struct rpm *, void *, size_t);
 int rpm_archive_rewind(struct rpm *);
+int rpm_copy_header(struct rpm **, struct rpm *);
+int rpm_db_close(struct rpm_db **);
+int rpm_db_open(struct rpm_db **);
 int rpm_destroy(struct rpm **);
 int rpm_fetch_archive(struct rpm *, unsigned char **, size_t *);
 int rpm_fetch_header(struct rpm *, unsigned char **, uint32_t *);
@@ -202,12 +287,17 @@ int rpm_get_comp_level(struct rpm *, unsigned short *);
 int rpm_get_digest_algo(struct rpm *, unsigned short *);
 int rpm_get_file_info(struct rpm *, struct file_info **, size_t *, bool *);
 int rpm_get_nevr(struct rpm *, char **);
+int rpm_get_payload_digest(struct rpm *, unsigned short *, unsigned char *, bool *);
 int rpm_get_payload_format(struct rpm *, unsigned short *);
+int rpm_import_header(struct rpm **, const unsigned char *, size_t);
 bool rpm_is_sourcerpm(struct rpm *);
 int rpm_patch_payload_format(struct rpm *, const char *);
 int rpm_read(struct rpm **, const char *, int, unsigned short *,
              unsigned char *, unsigned char *);
-int rpm_read_header(struct rpm **, const char *, const char *);
+int rpm_read_fd(struct rpm **, int, int, unsigned short *,
+                unsigned char *, unsigned char *);
+int rpm_read_fd_after_magic(struct rpm **, int);
+int rpm_read_header(struct rpm **, struct rpm_db *, const char *, const char *);
 int rpm_replace_lead_and_signature(struct rpm *, unsigned char *, size_t);
 int rpm_signature_empty(struct rpm *);
 int rpm_signature_get_md5(struct rpm *, unsigned char *, bool *);
@@ -216,7 +306,16 @@ int rpm_signature_set_md5(struct rpm *, unsigned char *);
 int rpm_signature_set_size(struct rpm *, uint32_t);
 uint32_t rpm_size_full(struct rpm *);
 uint32_t rpm_size_header(struct rpm *);
-int rpm_write(struct rpm *, const char *, bool, unsigned char *, bool);
+int rpm_write(struct rpm *, const struct sink *, bool, unsigned char *, bool);
+
+//drpm_ring.c
+int ring_acquire(struct ring *, unsigned char **);
+void ring_close(struct ring *, int);
+int ring_commit(struct ring *, size_t);
+int ring_create(struct ring **, size_t, size_t);
+int ring_destroy(struct ring **);
+int ring_peek(struct ring *, const unsigned char **, size_t *);
+void ring_release(struct ring *);
 
 //drpm_search.c
 int hash_create(struct hash **, const unsigned char *, size_t);
@@ -229,10 +328,10 @@ size_t sfxsrt_search(struct sfxsrt *, const unsigned char *, size_t,
                      const unsigned char *, size_t, size_t, size_t, size_t *, size_t *);
 
 //drpm_utils.c
+void add_bytes(unsigned char *, const unsigned char *, const unsigned char *, size_t);
 void create_be32(uint32_t, unsigned char *);
 void create_be64(uint64_t, unsigned char *);
 void dump_hex(char *, const unsigned char *, size_t);
-int md5_update_be32(MD5_CTX *, uint32_t);
 uint16_t parse_be16(const unsigned char *);
 uint32_t parse_be32(const unsigned char *);
 uint64_t parse_be64(const unsigned char *);
@@ -242,17 +341,18 @@ bool parse_md5(unsigned char *, const char *);
 bool parse_sha256(unsigned char *, const char *);
 bool resize16(void **, size_t, size_t);
 bool resize32(void **, size_t, size_t);
+int sink_write(const struct sink *, const void *, size_t);
 
 //drpm_write.c
 int compstrm_wrapper_destroy(struct compstrm_wrapper **);
-int compstrm_wrapper_finish(struct compstrm_wrapper *, unsigned char **, size_t *);
+int compstrm_wrapper_finish(struct compstrm_wrapper *);
 int compstrm_wrapper_init(struct compstrm_wrapper **, size_t,
-                          int, unsigned short, int);
+                          const struct sink *, unsigned short, int, struct checksum *);
 int compstrm_wrapper_write(struct compstrm_wrapper *, const unsigned char *, size_t);
 int write_be32(int, uint32_t);
 int write_be64(int, uint64_t);
 int write_comp(struct compstrm *, size_t *, int, const void *, size_t);
-int write_deltarpm(struct deltarpm *);
+int write_deltarpm(struct deltarpm *, int);
 int write_seqfile(struct deltarpm *, const char *);
 
 struct cpio_file {
@@ -282,6 +382,7 @@ struct deltarpm {
     unsigned short type;
     unsigned short comp;
     unsigned short comp_level;
+    unsigned short comp_threads; // for writing (see compstrm_init_par())
     union {
         struct rpm *tgt_rpm;
         char *tgt_nevr;
@@ -315,6 +416,8 @@ struct deltarpm {
         unsigned char *bytes;
         const unsigned char **ptrs;
     } int_data;
+    struct decompstrm *int_data_strm;
+    int int_data_filedesc;
 };
 
 struct file_info {
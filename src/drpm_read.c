@@ -28,6 +28,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <openssl/md5.h>
 
 #define MAGIC_DRPM 0x6472706D
@@ -35,23 +36,41 @@
 #define MAGIC_DLT(x) (((x) >> 8) == 0x444C54)
 #define MAGIC_DLT3(x) ((x) == 0x444C5433)
 
-static int readdelta_rest(int, struct deltarpm *);
+static int read_deltarpm_common(struct deltarpm *, int, bool);
+static int readdelta_rest(int, struct deltarpm *, bool);
 static int readdelta_rpmonly(int, struct deltarpm *);
 static int readdelta_standard(int, struct deltarpm *);
 
+/* Reads exactly <len> bytes from file into <buffer>.
+ * Pipes and sockets may return less at a time, so reads are repeated.
+ * Hitting end of file early is a format error. */
+int read_full(int filedesc, void *buffer, size_t len)
+{
+    ssize_t bytes_read;
+
+    while (len > 0) {
+        if ((bytes_read = read(filedesc, buffer, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return DRPM_ERR_IO;
+        }
+        if (bytes_read == 0)
+            return DRPM_ERR_FORMAT;
+        buffer = (unsigned char *)buffer + bytes_read;
+        len -= bytes_read;
+    }
+
+    return DRPM_ERR_OK;
+}
+
 /* Reads 32-byte integer in network byte order from file. */
 int read_be32(int filedesc, uint32_t *buffer_ret)
 {
+    int error;
     unsigned char buffer[4];
 
-    switch (read(filedesc, buffer, 4)) {
-    case 4:
-        break;
-    case -1:
-        return DRPM_ERR_IO;
-    default:
-        return DRPM_ERR_FORMAT;
-    }
+    if ((error = read_full(filedesc, buffer, 4)) != DRPM_ERR_OK)
+        return error;
 
     *buffer_ret = parse_be32(buffer);
 
@@ -61,25 +80,22 @@ int read_be32(int filedesc, uint32_t *buffer_ret)
 /* Reads 64-byte integer in network byte order from file. */
 int read_be64(int filedesc, uint64_t *buffer_ret)
 {
+    int error;
     unsigned char buffer[8];
 
-    switch (read(filedesc, buffer, 8)) {
-    case 8:
-        break;
-    case -1:
-        return DRPM_ERR_IO;
-    default:
-        return DRPM_ERR_FORMAT;
-    }
+    if ((error = read_full(filedesc, buffer, 8)) != DRPM_ERR_OK)
+        return error;
 
     *buffer_ret = parse_be64(buffer);
 
     return DRPM_ERR_OK;
 }
 
-/* Reads the rest of the DeltaRPM, i.e. the compressed part
- * that has the same format for standard and rpm-only deltas. */
-int readdelta_rest(int filedesc, struct deltarpm *delta)
+/* Reads the part of DeltaRPM common to both types.
+ * If <stream_int_data> is true, internal data is not read. Instead,
+ * the decompression stream is kept open in <delta->int_data_strm>
+ * for the caller to read internal data from as needed. */
+int readdelta_rest(int filedesc, struct deltarpm *delta, bool stream_int_data)
 {
     struct decompstrm *stream;
     uint32_t version;
@@ -318,7 +334,7 @@ int readdelta_rest(int filedesc, struct deltarpm *delta)
         goto cleanup;
     }
 
-    if (delta->int_data_len > 0) {
+    if (delta->int_data_len > 0 && !stream_int_data) {
         if ((delta->int_data.bytes = malloc(delta->int_data_len)) == NULL) {
             error = DRPM_ERR_MEMORY;
             goto cleanup;
@@ -354,6 +370,11 @@ int readdelta_rest(int filedesc, struct deltarpm *delta)
         }
     }
 
+    if (stream_int_data) {
+        delta->int_data_strm = stream;
+        return DRPM_ERR_OK;
+    }
+
 cleanup:
     decompstrm_destroy(&stream);
 
@@ -365,7 +386,6 @@ int readdelta_rpmonly(int filedesc, struct deltarpm *delta)
 {
     uint32_t version;
     uint32_t tgt_nevr_len;
-    ssize_t bytes_read;
     int error;
 
     if ((error = read_be32(filedesc, &version)) != DRPM_ERR_OK)
@@ -382,11 +402,8 @@ int readdelta_rpmonly(int filedesc, struct deltarpm *delta)
     if ((delta->head.tgt_nevr = malloc(tgt_nevr_len + 1)) == NULL)
         return DRPM_ERR_MEMORY;
 
-    if ((bytes_read = read(filedesc, delta->head.tgt_nevr, tgt_nevr_len)) < 0)
-        return DRPM_ERR_IO;
-
-    if ((uint32_t)bytes_read != tgt_nevr_len)
-        return DRPM_ERR_FORMAT;
+    if ((error = read_full(filedesc, delta->head.tgt_nevr, tgt_nevr_len)) != DRPM_ERR_OK)
+        return error;
 
     delta->head.tgt_nevr[tgt_nevr_len] = '\0';
 
@@ -398,11 +415,8 @@ int readdelta_rpmonly(int filedesc, struct deltarpm *delta)
     if ((delta->add_data = malloc(delta->add_data_len)) == NULL)
         return DRPM_ERR_MEMORY;
 
-    if ((bytes_read = read(filedesc, delta->add_data, delta->add_data_len)) < 0)
-        return DRPM_ERR_IO;
-
-    if ((uint32_t)bytes_read != delta->add_data_len)
-        return DRPM_ERR_FORMAT;
+    if ((error = read_full(filedesc, delta->add_data, delta->add_data_len)) != DRPM_ERR_OK)
+        return error;
 
     return DRPM_ERR_OK;
 }
@@ -413,17 +427,15 @@ int readdelta_standard(int filedesc, struct deltarpm *delta)
     struct rpm *rpmst;
     int error;
 
-    /* reading RPM lead, signature and header */
-    if ((error = rpm_read(&rpmst, delta->filename, RPM_ARCHIVE_DONT_READ, NULL, NULL, NULL)) != DRPM_ERR_OK)
+    /* reading RPM lead (except magic already read), signature and header,
+     * without seeking back, so that the DeltaRPM may come from a pipe */
+    if ((error = rpm_read_fd_after_magic(&rpmst, filedesc)) != DRPM_ERR_OK)
         return error;
 
     /* reading target compression from header (used for older delta versions) */
     if ((error = rpm_get_comp(rpmst, &delta->tgt_comp)) != DRPM_ERR_OK)
         return error;
 
-    if (lseek(filedesc, rpm_size_full(rpmst), SEEK_SET) == (off_t)-1)
-        return DRPM_ERR_IO;
-
     delta->head.tgt_rpm = rpmst;
 
     return DRPM_ERR_OK;
@@ -433,8 +445,6 @@ int readdelta_standard(int filedesc, struct deltarpm *delta)
 int read_deltarpm(struct deltarpm *delta, const char *filename)
 {
     int filedesc;
-    uint32_t magic;
-    int error = DRPM_ERR_OK;
 
     if (filename == NULL || delta == NULL)
         return DRPM_ERR_PROG;
@@ -444,6 +454,48 @@ int read_deltarpm(struct deltarpm *delta, const char *filename)
 
     delta->filename = filename;
 
+    return read_deltarpm_common(delta, filedesc, false);
+}
+
+/* Reads DeltaRPM from file, except for internal data, which is left
+ * to be read from <delta->int_data_strm> (see readdelta_rest()).
+ * The file stays open until the DeltaRPM is freed. */
+int read_deltarpm_stream(struct deltarpm *delta, const char *filename)
+{
+    int filedesc;
+
+    if (filename == NULL || delta == NULL)
+        return DRPM_ERR_PROG;
+
+    if ((filedesc = open(filename, O_RDONLY)) == -1)
+        return DRPM_ERR_IO;
+
+    delta->filename = filename;
+
+    return read_deltarpm_common(delta, filedesc, true);
+}
+
+/* Same as read_deltarpm_stream(), but reads from the current position
+ * of <filedesc>. The DeltaRPM keeps a duplicate of the descriptor,
+ * so <filedesc> is left to the caller. */
+int read_deltarpm_stream_fd(struct deltarpm *delta, int filedesc)
+{
+    if (filedesc < 0 || delta == NULL)
+        return DRPM_ERR_PROG;
+
+    if ((filedesc = dup(filedesc)) == -1)
+        return DRPM_ERR_IO;
+
+    return read_deltarpm_common(delta, filedesc, true);
+}
+
+/* Reads DeltaRPM from <filedesc>, which is closed
+ * unless kept for streaming internal data. */
+int read_deltarpm_common(struct deltarpm *delta, int filedesc, bool stream_int_data)
+{
+    uint32_t magic;
+    int error = DRPM_ERR_OK;
+
     /* determining type of delta by magic bytes and calling relevant subroutine */
 
     if ((error = read_be32(filedesc, &magic)) != DRPM_ERR_OK)
@@ -466,9 +518,14 @@ int read_deltarpm(struct deltarpm *delta, const char *filename)
     }
 
     /* the rest of the delta is the same for both types */
-    if ((error = readdelta_rest(filedesc, delta)) != DRPM_ERR_OK)
+    if ((error = readdelta_rest(filedesc, delta, stream_int_data)) != DRPM_ERR_OK)
         goto cleanup_fail;
 
+    if (stream_int_data) {
+        delta->int_data_filedesc = filedesc;
+        return DRPM_ERR_OK;
+    }
+
     goto cleanup;
 
 cleanup_fail:
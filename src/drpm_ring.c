@@ -0,0 +1,193 @@
+/*
+    Copyright (C) 2026 drpm contributors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "drpm.h"
+#include "drpm_private.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+/* Bounded queue of fixed-size chunks passed from a single producer
+ * thread to a single consumer thread. The producer fills a slot
+ * obtained from ring_acquire() and publishes it with ring_commit(),
+ * the consumer takes it with ring_peek() and hands it back with
+ * ring_release(). Slots are never copied, only their ownership
+ * changes, and each side blocks only when the ring is full or empty. */
+struct ring {
+    unsigned char *data;
+    size_t *slot_lens;
+    size_t slot_size;
+    size_t slot_count;
+    size_t head; // next slot to be filled
+    size_t tail; // next slot to be consumed
+    size_t used; // number of filled slots
+    bool closed;
+    int error;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_full;
+    pthread_cond_t not_empty;
+};
+
+int ring_create(struct ring **rng, size_t slot_size, size_t slot_count)
+{
+    if (rng == NULL || slot_size == 0 || slot_count == 0)
+        return DRPM_ERR_PROG;
+
+    if ((*rng = malloc(sizeof(struct ring))) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    if (((*rng)->data = malloc(slot_size * slot_count)) == NULL ||
+        ((*rng)->slot_lens = malloc(slot_count * sizeof(size_t))) == NULL) {
+        free((*rng)->data);
+        free(*rng);
+        *rng = NULL;
+        return DRPM_ERR_MEMORY;
+    }
+
+    (*rng)->slot_size = slot_size;
+    (*rng)->slot_count = slot_count;
+    (*rng)->head = 0;
+    (*rng)->tail = 0;
+    (*rng)->used = 0;
+    (*rng)->closed = false;
+    (*rng)->error = DRPM_ERR_OK;
+
+    if (pthread_mutex_init(&(*rng)->mutex, NULL) != 0 ||
+        pthread_cond_init(&(*rng)->not_full, NULL) != 0 ||
+        pthread_cond_init(&(*rng)->not_empty, NULL) != 0) {
+        free((*rng)->slot_lens);
+        free((*rng)->data);
+        free(*rng);
+        *rng = NULL;
+        return DRPM_ERR_OTHER;
+    }
+
+    return DRPM_ERR_OK;
+}
+
+int ring_destroy(struct ring **rng)
+{
+    if (rng == NULL || *rng == NULL)
+        return DRPM_ERR_PROG;
+
+    pthread_cond_destroy(&(*rng)->not_empty);
+    pthread_cond_destroy(&(*rng)->not_full);
+    pthread_mutex_destroy(&(*rng)->mutex);
+    free((*rng)->slot_lens);
+    free((*rng)->data);
+    free(*rng);
+    *rng = NULL;
+
+    return DRPM_ERR_OK;
+}
+
+/* Waits for a free slot and stores it in <*slot>.
+ * Fails if the ring has been closed (e.g. the consumer failed). */
+int ring_acquire(struct ring *rng, unsigned char **slot)
+{
+    int error;
+
+    pthread_mutex_lock(&rng->mutex);
+
+    while (rng->used == rng->slot_count && !rng->closed)
+        pthread_cond_wait(&rng->not_full, &rng->mutex);
+
+    if (rng->closed)
+        error = (rng->error != DRPM_ERR_OK) ? rng->error : DRPM_ERR_PROG;
+    else
+        error = DRPM_ERR_OK;
+
+    pthread_mutex_unlock(&rng->mutex);
+
+    if (error == DRPM_ERR_OK)
+        *slot = rng->data + rng->head * rng->slot_size;
+
+    return error;
+}
+
+/* Publishes the slot last acquired, filled with <len> bytes. */
+int ring_commit(struct ring *rng, size_t len)
+{
+    if (len > rng->slot_size)
+        return DRPM_ERR_PROG;
+
+    pthread_mutex_lock(&rng->mutex);
+
+    rng->slot_lens[rng->head] = len;
+    rng->head = (rng->head + 1) % rng->slot_count;
+    rng->used++;
+
+    pthread_cond_signal(&rng->not_empty);
+    pthread_mutex_unlock(&rng->mutex);
+
+    return DRPM_ERR_OK;
+}
+
+/* Waits for a filled slot and stores it in <*slot> (length in <*len>).
+ * Once the ring is closed and drained, <*len> is set to 0. */
+int ring_peek(struct ring *rng, const unsigned char **slot, size_t *len)
+{
+    int error = DRPM_ERR_OK;
+
+    pthread_mutex_lock(&rng->mutex);
+
+    while (rng->used == 0 && !rng->closed)
+        pthread_cond_wait(&rng->not_empty, &rng->mutex);
+
+    if (rng->error != DRPM_ERR_OK) {
+        error = rng->error;
+    } else if (rng->used == 0) {
+        *slot = NULL;
+        *len = 0;
+    } else {
+        *slot = rng->data + rng->tail * rng->slot_size;
+        *len = rng->slot_lens[rng->tail];
+    }
+
+    pthread_mutex_unlock(&rng->mutex);
+
+    return error;
+}
+
+/* Hands the slot last peeked at back to the producer. */
+void ring_release(struct ring *rng)
+{
+    pthread_mutex_lock(&rng->mutex);
+
+    rng->tail = (rng->tail + 1) % rng->slot_count;
+    rng->used--;
+
+    pthread_cond_signal(&rng->not_full);
+    pthread_mutex_unlock(&rng->mutex);
+}
+
+/* Closes the ring. If <error> is DRPM_ERR_OK, the consumer will still
+ * receive all committed slots. Otherwise, both sides fail with <error>
+ * as soon as they next wait on the ring. */
+void ring_close(struct ring *rng, int error)
+{
+    pthread_mutex_lock(&rng->mutex);
+
+    rng->closed = true;
+    if (rng->error == DRPM_ERR_OK)
+        rng->error = error;
+
+    pthread_cond_broadcast(&rng->not_full);
+    pthread_cond_broadcast(&rng->not_empty);
+    pthread_mutex_unlock(&rng->mutex);
+}
@@ -25,6 +25,7 @@
 #include <string.h>
 #include <limits.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <rpm/rpmlib.h>
 #include <rpm/rpmts.h>
 #include <rpm/rpmdb.h>
@@ -36,6 +37,11 @@
 #define RFC4880_HASH_ALGO_MD5 1
 #define RFC4880_HASH_ALGO_SHA256 8
 
+/* digest of uncompressed payload (rpm >= 4.16),
+ * numeric values for building against older rpmlib */
+#define RPM_TAG_PAYLOADDIGESTALGO 5093
+#define RPM_TAG_PAYLOADDIGESTALT 5097
+
 #define RPMSIG_PADDING(offset) PADDING((offset), 8)
 
 #define RPMLEAD_SIZE 96
@@ -48,15 +54,30 @@ struct rpm {
     size_t archive_size;
     size_t archive_offset;
     size_t archive_comp_size;
+    struct decompstrm *archive_strm; // archive decompressed as it is read
+};
+
+/* Installed package database, shared by lookups from several threads. */
+struct rpm_db {
+    rpmts trans;
 };
 
+/* rpmlib configuration is global, so it is only read once per process,
+ * and rpmdb is not safe to use from several threads at once. */
+static pthread_once_t rpm_config_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t rpm_db_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int archive_stream_read(struct rpm *, void *, size_t);
+static int rpm_read_common(struct rpm **, int, size_t, int, unsigned short *,
+                           unsigned char *, unsigned char *);
+static void rpm_config_read(void);
 static void rpm_init(struct rpm *);
 static void rpm_free(struct rpm *);
 static int rpm_export_header(struct rpm *, unsigned char **, size_t *);
 static int rpm_export_signature(struct rpm *, unsigned char **, size_t *);
 static void rpm_header_unload_region(struct rpm *, rpmTagVal);
-static int rpm_read_archive(struct rpm *, const char *, off_t, bool,
-                            unsigned short *, MD5_CTX *, MD5_CTX *);
+static int rpm_read_archive(struct rpm *, int, bool,
+                            unsigned short *, struct checksum *, struct checksum *);
 
 void rpm_init(struct rpm *rpmst)
 {
@@ -70,6 +91,7 @@ void rpm_init(struct rpm *rpmst)
     rpmst->archive_size = 0;
     rpmst->archive_offset = 0;
     rpmst->archive_comp_size = 0;
+    rpmst->archive_strm = NULL;
 }
 
 void rpm_free(struct rpm *rpmst)
@@ -80,6 +102,8 @@ void rpm_free(struct rpm *rpmst)
     headerFree(rpmst->signature);
     headerFree(rpmst->header);
     free(rpmst->archive);
+    if (rpmst->archive_strm != NULL)
+        decompstrm_destroy(&rpmst->archive_strm);
 
     rpm_init(rpmst);
 }
@@ -174,26 +198,18 @@ void rpm_header_unload_region(struct rpm *rpmst, rpmTagVal rpmtag)
     rpmtdFree(td);
 }
 
-int rpm_read_archive(struct rpm *rpmst, const char *filename,
-                     off_t offset, bool decompress, unsigned short *comp_ret,
-                     MD5_CTX *seq_md5, MD5_CTX *full_md5)
+/* Reads the archive from the current position of <filedesc>. */
+int rpm_read_archive(struct rpm *rpmst, int filedesc,
+                     bool decompress, unsigned short *comp_ret,
+                     struct checksum *seq_md5, struct checksum *full_md5)
 {
     struct decompstrm *stream = NULL;
-    int filedesc;
     unsigned char *archive_tmp;
     unsigned char buffer[BUFFER_SIZE];
     ssize_t bytes_read;
-    MD5_CTX *md5;
+    struct checksum *md5;
     int error = DRPM_ERR_OK;
 
-    if ((filedesc = open(filename, O_RDONLY)) < 0)
-        return DRPM_ERR_IO;
-
-    if (lseek(filedesc, offset, SEEK_SET) != offset) {
-        error = DRPM_ERR_IO;
-        goto cleanup;
-    }
-
     if (decompress) {
         // hack: never updating both MD5s when decompressing
         md5 = (seq_md5 == NULL) ? full_md5 : seq_md5;
@@ -210,11 +226,9 @@ int rpm_read_archive(struct rpm *rpmst, const char *filename,
                 error = DRPM_ERR_MEMORY;
                 goto cleanup;
             }
-            if ((seq_md5 != NULL && MD5_Update(seq_md5, buffer, bytes_read) != 1) ||
-                (full_md5 != NULL && MD5_Update(full_md5, buffer, bytes_read) != 1)) {
-                error = DRPM_ERR_OTHER;
+            if ((seq_md5 != NULL && (error = checksum_update(seq_md5, buffer, bytes_read)) != DRPM_ERR_OK) ||
+                (full_md5 != NULL && (error = checksum_update(full_md5, buffer, bytes_read)) != DRPM_ERR_OK))
                 goto cleanup;
-            }
             rpmst->archive = archive_tmp;
             memcpy(rpmst->archive + rpmst->archive_size, buffer, bytes_read);
             rpmst->archive_size += bytes_read;
@@ -230,37 +244,83 @@ cleanup:
     if (stream != NULL)
         decompstrm_destroy(&stream);
 
+    return error;
+}
+
+/* Reads RPM (or RPM-like file) from file <filename> into <*rpmst>.
+ * See rpm_read_fd(). */
+int rpm_read(struct rpm **rpmst, const char *filename,
+             int archive_mode, unsigned short *archive_comp,
+             unsigned char seq_md5_digest[MD5_DIGEST_LENGTH],
+             unsigned char full_md5_digest[MD5_DIGEST_LENGTH])
+{
+    int error;
+    int filedesc;
+
+    if (rpmst == NULL || filename == NULL)
+        return DRPM_ERR_PROG;
+
+    if ((filedesc = open(filename, O_RDONLY)) < 0)
+        return DRPM_ERR_IO;
+
+    error = rpm_read_fd(rpmst, filedesc, archive_mode, archive_comp,
+                        seq_md5_digest, full_md5_digest);
+
     close(filedesc);
 
     return error;
 }
 
-/* Reads RPM (or RPM-like file) from file <filename> into <*rpmst>.
+/* Reads RPM (or RPM-like file) from the current position of <filedesc>
+ * into <*rpmst>. <filedesc> is left open, positioned after what was read.
  * The archive may be decompressed, read "as is", or not read at all.
+ * It may also be decompressed as it is read with rpm_archive_read_chunk(),
+ * in which case <filedesc> must stay open until <*rpmst> is destroyed.
  * If read, the compression method used in the archive is stored in
  * <*archive_comp>.
  * Two MD5 checksums may be created. An MD5 digest of the header
  * and archive will be written to <seq_md5_digest>, while
  * <full_md5_digest> shall be made up of the while file. */
-int rpm_read(struct rpm **rpmst, const char *filename,
-             int archive_mode, unsigned short *archive_comp,
-             unsigned char seq_md5_digest[MD5_DIGEST_LENGTH],
-             unsigned char full_md5_digest[MD5_DIGEST_LENGTH])
+int rpm_read_fd(struct rpm **rpmst, int filedesc,
+                int archive_mode, unsigned short *archive_comp,
+                unsigned char seq_md5_digest[MD5_DIGEST_LENGTH],
+                unsigned char full_md5_digest[MD5_DIGEST_LENGTH])
+{
+    return rpm_read_common(rpmst, filedesc, 0, archive_mode, archive_comp,
+                           seq_md5_digest, full_md5_digest);
+}
+
+/* Reads lead, signature and header of RPM (or RPM-like file) whose
+ * four magic bytes have already been read from <filedesc>.
+ * Same as rpm_read_fd() with RPM_ARCHIVE_DONT_READ otherwise. */
+int rpm_read_fd_after_magic(struct rpm **rpmst, int filedesc)
+{
+    return rpm_read_common(rpmst, filedesc, 4, RPM_ARCHIVE_DONT_READ, NULL, NULL, NULL);
+}
+
+/* Common part of rpm_read_fd*(). The first <lead_read> bytes of the lead
+ * (at most the magic) have already been consumed by the caller.
+ * Nothing is ever seeked, so <filedesc> may be a pipe. */
+int rpm_read_common(struct rpm **rpmst, int filedesc, size_t lead_read,
+                    int archive_mode, unsigned short *archive_comp,
+                    unsigned char seq_md5_digest[MD5_DIGEST_LENGTH],
+                    unsigned char full_md5_digest[MD5_DIGEST_LENGTH])
 {
     FD_t file;
     const unsigned char magic_rpm[4] = {0xED, 0xAB, 0xEE, 0xDB};
-    off_t file_pos;
+    unsigned char padding[7];
+    ssize_t padding_len;
     bool include_archive;
     bool decomp_archive = false;
-    MD5_CTX seq_md5;
-    MD5_CTX full_md5;
+    struct checksum seq_md5 = {0};
+    struct checksum full_md5 = {0};
     unsigned char *signature = NULL;
     size_t signature_len;
     unsigned char *header = NULL;
     size_t header_len;
     int error = DRPM_ERR_OK;
 
-    if (rpmst == NULL || filename == NULL)
+    if (rpmst == NULL || filedesc < 0 || lead_read > sizeof(magic_rpm))
         return DRPM_ERR_PROG;
 
     switch (archive_mode) {
@@ -275,6 +335,11 @@ int rpm_read(struct rpm **rpmst, const char *filename,
         include_archive = true;
         decomp_archive = true;
         break;
+    case RPM_ARCHIVE_STREAM_DECOMP:
+        if (seq_md5_digest != NULL || full_md5_digest != NULL)
+            return DRPM_ERR_PROG;
+        include_archive = false;
+        break;
     default:
         return DRPM_ERR_PROG;
     }
@@ -284,16 +349,31 @@ int rpm_read(struct rpm **rpmst, const char *filename,
 
     rpm_init(*rpmst);
 
-    // hack: extra '\0' to prevent rpmlib from compressing (see rpmio.c)
-    if ((file = Fopen(filename, "rb\0")) == NULL)
+    // unbuffered, so that <filedesc> stays positioned right after the header
+    if ((file = fdDup(filedesc)) == NULL) {
+        free(*rpmst);
         return DRPM_ERR_IO;
+    }
+
+    /* lead is read directly, as pipes may return less than asked for */
+    memcpy((*rpmst)->lead, magic_rpm, lead_read);
+    if ((error = read_full(filedesc, (*rpmst)->lead + lead_read, RPMLEAD_SIZE - lead_read)) != DRPM_ERR_OK)
+        goto cleanup_fail;
+
+    if (memcmp((*rpmst)->lead, magic_rpm, 4) != 0 ||
+        ((*rpmst)->signature = headerRead(file, HEADER_MAGIC_YES)) == NULL) {
+        error = Ferror(file) ? DRPM_ERR_IO : DRPM_ERR_FORMAT;
+        goto cleanup_fail;
+    }
 
-    if (Fread((*rpmst)->lead, 1, RPMLEAD_SIZE, file) != RPMLEAD_SIZE ||
-        memcmp((*rpmst)->lead, magic_rpm, 4) != 0 ||
-        ((*rpmst)->signature = headerRead(file, HEADER_MAGIC_YES)) == NULL ||
-        (file_pos = Ftell(file)) < 0 ||
-        Fseek(file, RPMSIG_PADDING(file_pos), SEEK_CUR) < 0 ||
-        ((*rpmst)->header = headerRead(file, HEADER_MAGIC_YES)) == NULL) {
+    /* signature padding is read rather than skipped,
+     * as <filedesc> need not be seekable */
+    padding_len = RPMSIG_PADDING(headerSizeof((*rpmst)->signature, HEADER_MAGIC_YES));
+
+    if ((error = read_full(filedesc, padding, padding_len)) != DRPM_ERR_OK)
+        goto cleanup_fail;
+
+    if (((*rpmst)->header = headerRead(file, HEADER_MAGIC_YES)) == NULL) {
         error = Ferror(file) ? DRPM_ERR_IO : DRPM_ERR_FORMAT;
         goto cleanup_fail;
     }
@@ -301,43 +381,37 @@ int rpm_read(struct rpm **rpmst, const char *filename,
     if (seq_md5_digest != NULL) {
         if ((error = rpm_export_header(*rpmst, &header, &header_len)) != DRPM_ERR_OK)
             goto cleanup_fail;
-        if (MD5_Init(&seq_md5) != 1 ||
-            MD5_Update(&seq_md5, header, header_len) != 1) {
-            error = DRPM_ERR_OTHER;
+        if ((error = checksum_init(&seq_md5, DIGESTALGO_MD5)) != DRPM_ERR_OK ||
+            (error = checksum_update(&seq_md5, header, header_len)) != DRPM_ERR_OK)
             goto cleanup_fail;
-        }
     }
 
     if (full_md5_digest != NULL) {
         if ((error = rpm_export_signature(*rpmst, &signature, &signature_len)) != DRPM_ERR_OK ||
             (header == NULL && (error = rpm_export_header(*rpmst, &header, &header_len)) != DRPM_ERR_OK))
             goto cleanup_fail;
-        if (MD5_Init(&full_md5) != 1 ||
-            MD5_Update(&full_md5, (*rpmst)->lead, RPMLEAD_SIZE) != 1 ||
-            MD5_Update(&full_md5, signature, signature_len) != 1 ||
-            MD5_Update(&full_md5, header, header_len) != 1) {
-            error = DRPM_ERR_OTHER;
+        if ((error = checksum_init(&full_md5, DIGESTALGO_MD5)) != DRPM_ERR_OK ||
+            (error = checksum_update(&full_md5, (*rpmst)->lead, RPMLEAD_SIZE)) != DRPM_ERR_OK ||
+            (error = checksum_update(&full_md5, signature, signature_len)) != DRPM_ERR_OK ||
+            (error = checksum_update(&full_md5, header, header_len)) != DRPM_ERR_OK)
             goto cleanup_fail;
-        }
     }
 
     if (include_archive) {
-        if ((file_pos = Ftell(file)) < 0) {
-            error = DRPM_ERR_IO;
-            goto cleanup_fail;
-        }
-        if ((error = rpm_read_archive(*rpmst, filename, file_pos,
+        if ((error = rpm_read_archive(*rpmst, filedesc,
                                       decomp_archive, archive_comp,
                                       (seq_md5_digest != NULL) ? &seq_md5 : NULL,
                                       (full_md5_digest != NULL) ? &full_md5 : NULL)) != DRPM_ERR_OK)
             goto cleanup_fail;
     }
 
-    if ((seq_md5_digest != NULL && MD5_Final(seq_md5_digest, &seq_md5) != 1) ||
-        (full_md5_digest != NULL && MD5_Final(full_md5_digest, &full_md5) != 1)) {
-        error = DRPM_ERR_OTHER;
+    if (archive_mode == RPM_ARCHIVE_STREAM_DECOMP &&
+        (error = decompstrm_init(&(*rpmst)->archive_strm, filedesc, archive_comp, NULL, NULL, 0)) != DRPM_ERR_OK)
+        goto cleanup_fail;
+
+    if ((seq_md5_digest != NULL && (error = checksum_final(&seq_md5, seq_md5_digest)) != DRPM_ERR_OK) ||
+        (full_md5_digest != NULL && (error = checksum_final(&full_md5, full_md5_digest)) != DRPM_ERR_OK))
         goto cleanup_fail;
-    }
 
     goto cleanup;
 
@@ -345,6 +419,8 @@ cleanup_fail:
     rpm_free(*rpmst);
 
 cleanup:
+    checksum_free(&seq_md5);
+    checksum_free(&full_md5);
     free(signature);
     free(header);
     Fclose(file);
@@ -365,12 +441,40 @@ int rpm_destroy(struct rpm **rpmst)
     return DRPM_ERR_OK;
 }
 
+/* Decompresses <count> more bytes of the archive to <buffer>.
+ * Skipped data is decompressed piecewise to keep memory use low. */
+int archive_stream_read(struct rpm *rpmst, void *buffer, size_t count)
+{
+    int error;
+    size_t read_len;
+
+    if (buffer != NULL) {
+        if ((error = decompstrm_read(rpmst->archive_strm, count, buffer)) != DRPM_ERR_OK)
+            return error;
+        rpmst->archive_offset += count;
+        return DRPM_ERR_OK;
+    }
+
+    while (count > 0) {
+        read_len = MIN(count, BUFFER_SIZE);
+        if ((error = decompstrm_read(rpmst->archive_strm, read_len, NULL)) != DRPM_ERR_OK)
+            return error;
+        rpmst->archive_offset += read_len;
+        count -= read_len;
+    }
+
+    return DRPM_ERR_OK;
+}
+
 /* Reads <count> bytes to <buffer> from the current offset in the archive. */
 int rpm_archive_read_chunk(struct rpm *rpmst, void *buffer, size_t count)
 {
     if (rpmst == NULL)
         return DRPM_ERR_PROG;
 
+    if (rpmst->archive_strm != NULL)
+        return archive_stream_read(rpmst, buffer, count);
+
     if (rpmst->archive_offset + count > rpmst->archive_size)
         return DRPM_ERR_FORMAT;
 
@@ -382,10 +486,28 @@ int rpm_archive_read_chunk(struct rpm *rpmst, void *buffer, size_t count)
     return DRPM_ERR_OK;
 }
 
+/* Like rpm_archive_read_chunk(), but sets <data> to point at the
+ * <count> bytes in the archive instead of copying them. */
+int rpm_archive_map_chunk(struct rpm *rpmst, const unsigned char **data, size_t count)
+{
+    if (rpmst == NULL || rpmst->archive_strm != NULL)
+        return DRPM_ERR_PROG;
+
+    if (rpmst->archive_offset + count > rpmst->archive_size)
+        return DRPM_ERR_FORMAT;
+
+    if (data != NULL)
+        *data = rpmst->archive + rpmst->archive_offset;
+
+    rpmst->archive_offset += count;
+
+    return DRPM_ERR_OK;
+}
+
 /* Positions the archive offset at the beginning of the archive. */
 int rpm_archive_rewind(struct rpm *rpmst)
 {
-    if (rpmst == NULL)
+    if (rpmst == NULL || rpmst->archive_strm != NULL)
         return DRPM_ERR_PROG;
 
     rpmst->archive_offset = 0;
@@ -478,68 +600,52 @@ int rpm_fetch_archive(struct rpm *rpmst, unsigned char **archive_ret, size_t *le
     return DRPM_ERR_OK;
 }
 
-/* Writes the RPM to <filename>. Will not write the archive unless
+/* Writes the RPM to <output>. Will not write the archive unless
  * <include_archive> is true. May also write an MD5 digest of written
  * data to <digest>. If <full_md5> is false, then this will not include
  * the lead and signature. */
-int rpm_write(struct rpm *rpmst, const char *filename, bool include_archive, unsigned char digest[MD5_DIGEST_LENGTH], bool full_md5)
+int rpm_write(struct rpm *rpmst, const struct sink *output, bool include_archive, unsigned char digest[MD5_DIGEST_LENGTH], bool full_md5)
 {
     int error = DRPM_ERR_OK;
-    FD_t file;
     unsigned char *signature = NULL;
     size_t signature_len;
     unsigned char *header = NULL;
     size_t header_len;
-    MD5_CTX md5;
+    struct checksum md5 = {0};
 
-    if (rpmst == NULL)
+    if (rpmst == NULL || output == NULL)
         return DRPM_ERR_PROG;
 
-    // hack: extra '\0' to prevent rpmlib from compressing (see rpmio.c)
-    if ((file = Fopen(filename, "wb\0")) == NULL)
-        return DRPM_ERR_IO;
-
     if ((error = rpm_export_signature(rpmst, &signature, &signature_len)) != DRPM_ERR_OK ||
         (error = rpm_export_header(rpmst, &header, &header_len)) != DRPM_ERR_OK)
         goto cleanup;
 
-    if (Fwrite(rpmst->lead, 1, RPMLEAD_SIZE, file) != RPMLEAD_SIZE ||
-        Fwrite(signature, 1, signature_len, file) != (ssize_t)signature_len ||
-        Fwrite(header, 1, header_len, file) != (ssize_t)header_len) {
-        error = DRPM_ERR_IO;
+    if ((error = sink_write(output, rpmst->lead, RPMLEAD_SIZE)) != DRPM_ERR_OK ||
+        (error = sink_write(output, signature, signature_len)) != DRPM_ERR_OK ||
+        (error = sink_write(output, header, header_len)) != DRPM_ERR_OK)
         goto cleanup;
-    }
 
     if (digest != NULL) {
-        if (MD5_Init(&md5) != 1 ||
+        if ((error = checksum_init(&md5, DIGESTALGO_MD5)) != DRPM_ERR_OK ||
             (full_md5 &&
-             (MD5_Update(&md5, rpmst->lead, RPMLEAD_SIZE) != 1 ||
-              MD5_Update(&md5, signature, signature_len) != 1)) ||
-            MD5_Update(&md5, header, header_len) != 1) {
-            error = DRPM_ERR_OTHER;
+             ((error = checksum_update(&md5, rpmst->lead, RPMLEAD_SIZE)) != DRPM_ERR_OK ||
+              (error = checksum_update(&md5, signature, signature_len)) != DRPM_ERR_OK)) ||
+            (error = checksum_update(&md5, header, header_len)) != DRPM_ERR_OK)
             goto cleanup;
-        }
     }
 
     if (include_archive) {
-        if (Fwrite(rpmst->archive, 1, rpmst->archive_size, file)
-            != (ssize_t)rpmst->archive_size) {
-            error = DRPM_ERR_IO;
+        if ((error = sink_write(output, rpmst->archive, rpmst->archive_size)) != DRPM_ERR_OK)
             goto cleanup;
-        }
-        if (digest != NULL && MD5_Update(&md5, rpmst->archive, rpmst->archive_size) != 1) {
-            error = DRPM_ERR_OTHER;
+        if (digest != NULL && (error = checksum_update(&md5, rpmst->archive, rpmst->archive_size)) != DRPM_ERR_OK)
             goto cleanup;
-        }
     }
 
-    if (digest != NULL && MD5_Final(digest, &md5) != 1) {
-        error = DRPM_ERR_OTHER;
+    if (digest != NULL && (error = checksum_final(&md5, digest)) != DRPM_ERR_OK)
         goto cleanup;
-    }
 
 cleanup:
-    Fclose(file);
+    checksum_free(&md5);
     free(signature);
     free(header);
 
@@ -606,6 +712,8 @@ int rpm_get_comp(struct rpm *rpmst, unsigned short *comp)
         *comp = DRPM_COMP_LZMA;
     } else if (strcmp(payload_comp, "xz") == 0) {
         *comp = DRPM_COMP_XZ;
+    } else if (strcmp(payload_comp, "zstd") == 0) {
+        *comp = DRPM_COMP_ZSTD;
     } else {
         return DRPM_ERR_FORMAT;
     }
@@ -613,10 +721,15 @@ int rpm_get_comp(struct rpm *rpmst, unsigned short *comp)
     return DRPM_ERR_OK;
 }
 
-/* Determines the compression level from the header. */
+/* Determines the compression level from the header.
+ * Only zstd levels may have two digits (e.g. "19"). Flags for threaded
+ * compression ("19T8") are rejected, as its output cannot be reproduced. */
 int rpm_get_comp_level(struct rpm *rpmst, unsigned short *level)
 {
+    int error;
     const char *payload_flags;
+    unsigned short comp;
+    unsigned short lvl = 0;
 
     if (rpmst == NULL || level == NULL)
         return DRPM_ERR_PROG;
@@ -624,11 +737,22 @@ int rpm_get_comp_level(struct rpm *rpmst, unsigned short *level)
     if ((payload_flags = headerGetString(rpmst->header, RPMTAG_PAYLOADFLAGS)) == NULL)
         return DRPM_ERR_FORMAT;
 
-    if (strlen(payload_flags) != 1 ||
-        payload_flags[0] < '1' || payload_flags[0] > '9')
+    if ((error = rpm_get_comp(rpmst, &comp)) != DRPM_ERR_OK)
+        return error;
+
+    if (strlen(payload_flags) < 1 || strlen(payload_flags) > 2)
         return DRPM_ERR_FORMAT;
 
-    *level = payload_flags[0] - '0';
+    for (const char *c = payload_flags; *c != '\0'; c++) {
+        if (*c < '0' || *c > '9')
+            return DRPM_ERR_FORMAT;
+        lvl = lvl * 10 + (*c - '0');
+    }
+
+    if (lvl < 1 || lvl > COMP_LEVEL_MAX(comp))
+        return DRPM_ERR_FORMAT;
+
+    *level = lvl;
 
     return DRPM_ERR_OK;
 }
@@ -674,6 +798,64 @@ cleanup:
     return error;
 }
 
+/* Fetches the digest of the uncompressed payload from the header.
+ * <*has_digest> is set to false if the header does not include it. */
+int rpm_get_payload_digest(struct rpm *rpmst, unsigned short *digestalgo,
+                           unsigned char *digest, bool *has_digest)
+{
+    int error = DRPM_ERR_OK;
+    rpmtd tag_data;
+    const uint32_t *algo;
+    const char *digest_hex;
+
+    if (rpmst == NULL || digestalgo == NULL || digest == NULL || has_digest == NULL)
+        return DRPM_ERR_PROG;
+
+    *has_digest = false;
+
+    tag_data = rpmtdNew();
+
+    if (headerGet(rpmst->header, RPM_TAG_PAYLOADDIGESTALGO, tag_data, HEADERGET_MINMEM) != 1)
+        goto cleanup;
+
+    if ((algo = rpmtdNextUint32(tag_data)) == NULL) {
+        error = DRPM_ERR_FORMAT;
+        goto cleanup;
+    }
+
+    switch (*algo) {
+    case RFC4880_HASH_ALGO_MD5:
+        *digestalgo = DIGESTALGO_MD5;
+        break;
+    case RFC4880_HASH_ALGO_SHA256:
+        *digestalgo = DIGESTALGO_SHA256;
+        break;
+    default:
+        error = DRPM_ERR_FORMAT;
+        goto cleanup;
+    }
+
+    rpmtdFreeData(tag_data);
+
+    if (headerGet(rpmst->header, RPM_TAG_PAYLOADDIGESTALT, tag_data, HEADERGET_MINMEM) != 1)
+        goto cleanup;
+
+    if ((digest_hex = rpmtdNextString(tag_data)) == NULL ||
+        !(*digestalgo == DIGESTALGO_MD5 ? parse_md5(digest, digest_hex) :
+                                          parse_sha256(digest, digest_hex))) {
+        error = DRPM_ERR_FORMAT;
+        goto cleanup;
+    }
+
+    *has_digest = true;
+
+cleanup:
+    rpmtdFreeData(tag_data);
+    rpmtdFree(tag_data);
+
+    return error;
+}
+
 /* Determines the payload format from the header. */
 int rpm_get_payload_format(struct rpm *rpmst, unsigned short *payfmt)
 {
@@ -994,9 +1176,102 @@ cleanup:
     return error;
 }
 
-/* Reads only the header of an installed RPM from the database.
- * The RPM is identified by its <nevr> string. */
-int rpm_read_header(struct rpm **rpmst, const char *nevr, const char *arch)
+/* Creates RPM data from an exported header (including magic),
+ * e.g. one re-created by applying an rpm-only DeltaRPM. */
+int rpm_import_header(struct rpm **rpmst, const unsigned char *header, size_t len)
+{
+    if (rpmst == NULL || header == NULL)
+        return DRPM_ERR_PROG;
+
+    if (len <= sizeof(rpm_header_magic) ||
+        memcmp(header, rpm_header_magic, sizeof(rpm_header_magic)) != 0)
+        return DRPM_ERR_FORMAT;
+
+    if ((*rpmst = malloc(sizeof(struct rpm))) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    rpm_init(*rpmst);
+
+    if (((*rpmst)->header = headerImport((void *)(header + sizeof(rpm_header_magic)),
+                                         len - sizeof(rpm_header_magic),
+                                         HEADERIMPORT_COPY)) == NULL) {
+        free(*rpmst);
+        *rpmst = NULL;
+        return DRPM_ERR_FORMAT;
+    }
+
+    return DRPM_ERR_OK;
+}
+
+/* Copies the header of <rpmst> (without lead, signature and archive),
+ * so that the copy may be modified while the original is kept. */
+int rpm_copy_header(struct rpm **copy, struct rpm *rpmst)
+{
+    int error;
+    unsigned char *header;
+    size_t header_size;
+
+    if (copy == NULL || rpmst == NULL)
+        return DRPM_ERR_PROG;
+
+    if ((error = rpm_export_header(rpmst, &header, &header_size)) != DRPM_ERR_OK)
+        return error;
+
+    error = rpm_import_header(copy, header, header_size);
+
+    free(header);
+
+    return error;
+}
+
+/* Reads rpmlib configuration, called once per process via pthread_once(). */
+void rpm_config_read(void)
+{
+    rpmReadConfigFiles(NULL, NULL);
+}
+
+/* Opens rpmdb once for multiple calls of rpm_read_header(). */
+int rpm_db_open(struct rpm_db **db)
+{
+    if (db == NULL)
+        return DRPM_ERR_PROG;
+
+    if ((*db = malloc(sizeof(struct rpm_db))) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    pthread_once(&rpm_config_once, rpm_config_read);
+
+    pthread_mutex_lock(&rpm_db_mutex);
+    (*db)->trans = rpmtsCreate();
+    if (rpmtsOpenDB((*db)->trans, O_RDONLY) != 0) {
+        rpmtsFree((*db)->trans);
+        pthread_mutex_unlock(&rpm_db_mutex);
+        free(*db);
+        *db = NULL;
+        return DRPM_ERR_CONFIG;
+    }
+    pthread_mutex_unlock(&rpm_db_mutex);
+
+    return DRPM_ERR_OK;
+}
+
+int rpm_db_close(struct rpm_db **db)
+{
+    if (db == NULL || *db == NULL)
+        return DRPM_ERR_PROG;
+
+    pthread_mutex_lock(&rpm_db_mutex);
+    rpmtsFree((*db)->trans);
+    pthread_mutex_unlock(&rpm_db_mutex);
+    free(*db);
+    *db = NULL;
+
+    return DRPM_ERR_OK;
+}
+
+/* Reads header of installed package from rpmdb.
+ * If <db> is NULL, the database is opened just for this lookup. */
+int rpm_read_header(struct rpm **rpmst, struct rpm_db *db, const char *nevr, const char *arch)
 {
     int error = DRPM_ERR_OK;
     rpmts trans = NULL;
@@ -1008,6 +1283,7 @@ int rpm_read_header(struct rpm **rpmst, const char *nevr, const char *arch)
     char *str = NULL;
     unsigned char *header = NULL;
     size_t header_size;
+    bool locked = false;
 
     if (rpmst == NULL || nevr == NULL)
         return DRPM_ERR_PROG;
@@ -1050,9 +1326,12 @@ int rpm_read_header(struct rpm **rpmst, const char *nevr, const char *arch)
     }
     name = str;
 
-    rpmReadConfigFiles(NULL, NULL);
+    pthread_once(&rpm_config_once, rpm_config_read);
+
+    pthread_mutex_lock(&rpm_db_mutex);
+    locked = true;
 
-    trans = rpmtsCreate();
+    trans = (db != NULL) ? db->trans : rpmtsCreate();
 
     iter = rpmtsInitIterator(trans, RPMTAG_NAME, name, 0);
     rpmdbSetIteratorRE(iter, RPMTAG_EPOCH, RPMMIRE_STRCMP, epoch);
@@ -1085,7 +1364,10 @@ cleanup_fail:
 
 cleanup:
     rpmdbFreeIterator(iter);
-    rpmtsFree(trans);
+    if (db == NULL)
+        rpmtsFree(trans);
+    if (locked)
+        pthread_mutex_unlock(&rpm_db_mutex);
     free(str);
 
     return error;
@@ -27,12 +27,35 @@
 #include <string.h>
 #include <stdbool.h>
 #include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <openssl/md5.h>
 #include <openssl/sha.h>
 
 static bool resize(void **, size_t, size_t, size_t);
 
+/* Stores bytewise sums (modulo 256) of <src> and <add> in <dst>.
+ * Works on eight bytes at a time, masking off the top bit of each byte
+ * so that carries do not cross into the neighbouring byte. */
+void add_bytes(unsigned char *dst, const unsigned char *src, const unsigned char *add, size_t len)
+{
+    const uint64_t high = 0x8080808080808080;
+    uint64_t a;
+    uint64_t b;
+    size_t i = 0;
+
+    for ( ; i + 8 <= len; i += 8) {
+        memcpy(&a, src + i, 8);
+        memcpy(&b, add + i, 8);
+        a = ((a & ~high) + (b & ~high)) ^ ((a ^ b) & high);
+        memcpy(dst + i, &a, 8);
+    }
+
+    for ( ; i < len; i++)
+        dst[i] = src[i] + add[i];
+}
+
 /* Reads 16-byte integer in network byte order buffer. */
 uint16_t parse_be16(const unsigned char buffer[2])
 {
@@ -83,15 +106,6 @@ void create_be64(uint64_t in, unsigned char out[8])
     out[7] = in;
 }
 
-int md5_update_be32(MD5_CTX *md5, uint32_t number)
-{
-    unsigned char be32[4];
-
-    create_be32(number, be32);
-
-    return MD5_Update(md5, be32, 4);
-}
-
 /* Represents array of bytes pointed to by <source> of size <count>
  * as human-readable ASCII hexadecimals and stores this string in
  * <dest> (should be at least of size <count> * 2 + 1). */
@@ -178,3 +192,35 @@ bool resize32(void **buffer, size_t members_count, size_t member_size)
 {
     return resize(buffer, members_count, member_size, 32);
 }
+
+/* Writes <len> bytes from <buffer> to <output>.
+ * Nothing is written if neither a callback nor a file is set. */
+int sink_write(const struct sink *output, const void *buffer, size_t len)
+{
+    ssize_t written;
+
+    if (output == NULL || (buffer == NULL && len > 0))
+        return DRPM_ERR_PROG;
+
+    if (len == 0)
+        return DRPM_ERR_OK;
+
+    if (output->write_func != NULL)
+        return output->write_func(output->write_arg, buffer, len) == 0 ? DRPM_ERR_OK : DRPM_ERR_IO;
+
+    if (output->filedesc < 0)
+        return DRPM_ERR_OK;
+
+    /* pipes and sockets may take less at a time */
+    while (len > 0) {
+        if ((written = write(output->filedesc, buffer, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return DRPM_ERR_IO;
+        }
+        buffer = (const unsigned char *)buffer + written;
+        len -= written;
+    }
+
+    return DRPM_ERR_OK;
+}
@@ -24,18 +24,44 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <openssl/md5.h>
 #include <rpm/rpmlib.h>
 
+/* compression and writing run in separate threads, each fed through
+ * a ring of PIPE_SLOT_COUNT chunks of PIPE_SLOT_SIZE bytes */
+#define PIPE_SLOT_SIZE (1 << 17)
+#define PIPE_SLOT_COUNT 8
+
+/* upper limit on threads used by compressors that support them */
+#define COMP_THREADS_MAX 16
+
 /* Wrapper for struct compstrm. Used to prepend uncompressed header. */
 struct compstrm_wrapper {
     struct compstrm *strm; // compression stream
-    int filedesc; // file descriptor
+    struct sink output; // where data is written
     size_t uncomp_len; // length of uncompressed data
     size_t uncomp_left; // how much uncompressed data left to write
-    unsigned char *uncomp_data; // uncompressed data
+    struct checksum *md5; // updated with output (if not NULL)
+    struct ring *ring; // data waiting to be compressed
+    unsigned char *slot; // ring slot being filled
+    size_t slot_len; // bytes in ring slot being filled
+    pthread_t thread; // compression thread
+    bool thread_running; // compression thread not yet joined
+    int thread_error; // error returned by compression thread
+    struct ring *out_ring; // compressed data waiting to be written
+    unsigned char *out_slot; // out_ring slot being filled
+    size_t out_slot_len; // bytes in out_ring slot being filled
+    pthread_t writer; // writing thread
+    bool writer_running; // writing thread not yet joined
+    int writer_error; // error returned by writing thread
 };
 
+static int compstrm_wrapper_put(void *, const void *, size_t);
+static void *compstrm_wrapper_thread(void *);
+static void *compstrm_wrapper_writer(void *);
+
 /* Writes 32-byte integer in network byte order to file. */
 int write_be32(int filedesc, uint32_t number)
 {
@@ -62,11 +88,11 @@ int write_be64(int filedesc, uint64_t number)
     return DRPM_ERR_OK;
 }
 
-/* Writes out the DeltaRPM. */
-int write_deltarpm(struct deltarpm *delta)
+/* Writes out the DeltaRPM to <filedesc>. */
+int write_deltarpm(struct deltarpm *delta, int filedesc)
 {
     int error = DRPM_ERR_OK;
-    int filedesc = -1;
+    const struct sink output = {.filedesc = filedesc};
     struct compstrm *stream = NULL;
     uint32_t tgt_nevr_len;
     uint32_t src_nevr_len;
@@ -76,12 +102,14 @@ int write_deltarpm(struct deltarpm *delta)
     uint32_t ext_copies_size;
     unsigned char *header = NULL;
     uint32_t header_size;
-    MD5_CTX md5;
+    struct checksum md5;
     unsigned char md5_digest[MD5_DIGEST_LENGTH] = {0};
     unsigned char *strm_data = NULL;
     size_t strm_data_len;
+    unsigned threads;
+    long cpus;
 
-    if (delta->type != DRPM_TYPE_STANDARD && delta->type != DRPM_TYPE_RPMONLY)
+    if ((delta->type != DRPM_TYPE_STANDARD && delta->type != DRPM_TYPE_RPMONLY) || filedesc < 0)
         return DRPM_ERR_PROG;
 
     version[0] = 'D';
@@ -92,7 +120,10 @@ int write_deltarpm(struct deltarpm *delta)
 
     src_nevr_len = strlen(delta->src_nevr) + 1;
 
-    if ((error = compstrm_init(&stream, -1, delta->comp, (int)delta->comp_level)) != DRPM_ERR_OK ||
+    if ((threads = delta->comp_threads) == 0 && (cpus = sysconf(_SC_NPROCESSORS_ONLN)) > 0)
+        threads = MIN(cpus, COMP_THREADS_MAX);
+
+    if ((error = compstrm_init_par(&stream, delta->comp, (int)delta->comp_level, MAX(threads, 1))) != DRPM_ERR_OK ||
         (error = compstrm_write(stream, 4, version)) != DRPM_ERR_OK ||
         (error = compstrm_write_be32(stream, src_nevr_len)) != DRPM_ERR_OK ||
         (error = compstrm_write(stream, src_nevr_len, delta->src_nevr)) != DRPM_ERR_OK ||
@@ -202,29 +233,26 @@ int write_deltarpm(struct deltarpm *delta)
     switch (delta->type) {
     case DRPM_TYPE_STANDARD:
         if ((error = rpm_fetch_header(delta->head.tgt_rpm, &header, &header_size)) != DRPM_ERR_OK)
-            return error;
+            goto cleanup;
 
-        if (MD5_Init(&md5) != 1 ||
-            MD5_Update(&md5, header, header_size) != 1 ||
-            MD5_Update(&md5, strm_data, strm_data_len) != 1 ||
-            MD5_Final(md5_digest, &md5) != 1)
-            return DRPM_ERR_OTHER;
+        if ((error = checksum_init(&md5, DIGESTALGO_MD5)) != DRPM_ERR_OK)
+            goto cleanup;
+        if ((error = checksum_update(&md5, header, header_size)) != DRPM_ERR_OK ||
+            (error = checksum_update(&md5, strm_data, strm_data_len)) != DRPM_ERR_OK ||
+            (error = checksum_final(&md5, md5_digest)) != DRPM_ERR_OK) {
+            checksum_free(&md5);
+            goto cleanup;
+        }
 
         if ((error = rpm_signature_empty(delta->head.tgt_rpm)) != DRPM_ERR_OK ||
             (error = rpm_signature_set_size(delta->head.tgt_rpm, header_size + strm_data_len)) != DRPM_ERR_OK ||
             (error = rpm_signature_set_md5(delta->head.tgt_rpm, md5_digest)) != DRPM_ERR_OK ||
             (error = rpm_signature_reload(delta->head.tgt_rpm)) != DRPM_ERR_OK ||
-            (error = rpm_write(delta->head.tgt_rpm, delta->filename, false, NULL, false)) != DRPM_ERR_OK)
-            return error;
-
-        if ((filedesc = open(delta->filename, O_WRONLY | O_APPEND)) < 0)
-            return DRPM_ERR_IO;
+            (error = rpm_write(delta->head.tgt_rpm, &output, false, NULL, false)) != DRPM_ERR_OK)
+            goto cleanup;
         break;
 
     case DRPM_TYPE_RPMONLY:
-        if ((filedesc = creat(delta->filename, CREAT_MODE)) < 0)
-            return DRPM_ERR_IO;
-
         if (write(filedesc, "drpm", 4) != 4 ||
             write(filedesc, version, 4) != 4) {
             error = DRPM_ERR_IO;
@@ -239,17 +267,13 @@ int write_deltarpm(struct deltarpm *delta)
             goto cleanup;
         }
 
-        if ((error = write_be32(filedesc, delta->add_data_len)) != DRPM_ERR_OK)
-            goto cleanup;
-        if (write(filedesc, delta->add_data, delta->add_data_len) != (ssize_t)delta->add_data_len) {
-            error = DRPM_ERR_IO;
+        if ((error = write_be32(filedesc, delta->add_data_len)) != DRPM_ERR_OK ||
+            (error = sink_write(&output, delta->add_data, delta->add_data_len)) != DRPM_ERR_OK)
             goto cleanup;
-        }
         break;
     }
 
-    if (write(filedesc, strm_data, strm_data_len) != (ssize_t)strm_data_len)
-        error = DRPM_ERR_IO;
+    error = sink_write(&output, strm_data, strm_data_len);
 
 cleanup:
     if (error == DRPM_ERR_OK)
@@ -259,7 +283,6 @@ cleanup:
 
     free(header);
     free(strm_data);
-    close(filedesc);
 
     return error;
 }
@@ -289,35 +312,147 @@ cleanup:
     return error;
 }
 
-/* Wrapper functions for compstrm. Used to prepend uncompressed header. */
+/* Wrapper functions for compstrm. Used to prepend uncompressed header.
+ * Data passes through three stages: the caller reconstructs it, a
+ * compression thread compresses it and a writing thread passes it to
+ * the output, updating <md5> (if given) on the way. Output is the same
+ * as with compstrm alone, as the compressors do not depend on how the
+ * input is split into chunks. The uncompressed part is written by the
+ * caller, before any compressed data can reach the writing thread.
+ * Nothing is retained once written. */
 
-int compstrm_wrapper_init(struct compstrm_wrapper **csw, size_t uncomp_len,
-                          int filedesc, unsigned short comp, int level)
+void *compstrm_wrapper_thread(void *arg)
 {
+    struct compstrm_wrapper *csw = arg;
+    const unsigned char *slot;
+    size_t slot_len;
     int error;
 
-    if (csw == NULL || filedesc < 0)
-        return DRPM_ERR_PROG;
+    while ((error = ring_peek(csw->ring, &slot, &slot_len)) == DRPM_ERR_OK && slot_len > 0) {
+        error = compstrm_write(csw->strm, slot_len, slot);
+        ring_release(csw->ring);
+        if (error != DRPM_ERR_OK) {
+            ring_close(csw->ring, error);
+            break;
+        }
+    }
 
-    if ((*csw = malloc(sizeof(struct compstrm_wrapper))) == NULL ||
-        ((*csw)->uncomp_data = malloc(uncomp_len)) == NULL) {
-        free(*csw);
-        *csw = NULL;
-        return DRPM_ERR_MEMORY;
+    csw->thread_error = error;
+
+    return NULL;
+}
+
+/* Output of the compression stream, handing data to the writing thread. */
+int compstrm_wrapper_put(void *arg, const void *data, size_t len)
+{
+    struct compstrm_wrapper *csw = arg;
+    const unsigned char *buffer = data;
+    size_t write_len;
+    int error;
+
+    while (len > 0) {
+        if (csw->out_slot == NULL) {
+            if ((error = ring_acquire(csw->out_ring, &csw->out_slot)) != DRPM_ERR_OK)
+                return error;
+            csw->out_slot_len = 0;
+        }
+        write_len = MIN(len, PIPE_SLOT_SIZE - csw->out_slot_len);
+        memcpy(csw->out_slot + csw->out_slot_len, buffer, write_len);
+        buffer += write_len;
+        len -= write_len;
+        csw->out_slot_len += write_len;
+        if (csw->out_slot_len == PIPE_SLOT_SIZE) {
+            if ((error = ring_commit(csw->out_ring, csw->out_slot_len)) != DRPM_ERR_OK)
+                return error;
+            csw->out_slot = NULL;
+        }
     }
 
-    if ((error = compstrm_init(&(*csw)->strm, filedesc, comp, level)) != DRPM_ERR_OK) {
-        free((*csw)->uncomp_data);
-        free(*csw);
-        *csw = NULL;
-        return error;
+    return DRPM_ERR_OK;
+}
+
+void *compstrm_wrapper_writer(void *arg)
+{
+    struct compstrm_wrapper *csw = arg;
+    const unsigned char *slot;
+    size_t slot_len;
+    int error;
+
+    while ((error = ring_peek(csw->out_ring, &slot, &slot_len)) == DRPM_ERR_OK && slot_len > 0) {
+        if ((error = sink_write(&csw->output, slot, slot_len)) == DRPM_ERR_OK && csw->md5 != NULL)
+            error = checksum_update(csw->md5, slot, slot_len);
+        ring_release(csw->out_ring);
+        if (error != DRPM_ERR_OK) {
+            ring_close(csw->out_ring, error);
+            break;
+        }
     }
 
-    (*csw)->filedesc = filedesc;
+    csw->writer_error = error;
+
+    return NULL;
+}
+
+int compstrm_wrapper_init(struct compstrm_wrapper **csw, size_t uncomp_len,
+                          const struct sink *output, unsigned short comp, int level,
+                          struct checksum *md5)
+{
+    int error;
+    long cpus;
+    struct sink comp_output = {.filedesc = -1, .write_func = compstrm_wrapper_put};
+
+    if (csw == NULL || output == NULL)
+        return DRPM_ERR_PROG;
+
+    if ((*csw = malloc(sizeof(struct compstrm_wrapper))) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    (*csw)->strm = NULL;
+    (*csw)->ring = NULL;
+    (*csw)->slot = NULL;
+    (*csw)->slot_len = 0;
+    (*csw)->thread_running = false;
+    (*csw)->thread_error = DRPM_ERR_OK;
+    (*csw)->out_ring = NULL;
+    (*csw)->out_slot = NULL;
+    (*csw)->out_slot_len = 0;
+    (*csw)->writer_running = false;
+    (*csw)->writer_error = DRPM_ERR_OK;
+
+    if ((cpus = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+        cpus = 1;
+
+    comp_output.write_arg = *csw;
+
+    if ((error = compstrm_init_mt(&(*csw)->strm, &comp_output, comp, level,
+                                  MIN(cpus, COMP_THREADS_MAX), NULL)) != DRPM_ERR_OK ||
+        (error = ring_create(&(*csw)->ring, PIPE_SLOT_SIZE, PIPE_SLOT_COUNT)) != DRPM_ERR_OK ||
+        (error = ring_create(&(*csw)->out_ring, PIPE_SLOT_SIZE, PIPE_SLOT_COUNT)) != DRPM_ERR_OK)
+        goto cleanup_fail;
+
+    (*csw)->output = *output;
     (*csw)->uncomp_len = uncomp_len;
     (*csw)->uncomp_left = uncomp_len;
+    (*csw)->md5 = md5;
+
+    if (pthread_create(&(*csw)->writer, NULL, compstrm_wrapper_writer, *csw) != 0) {
+        error = DRPM_ERR_OTHER;
+        goto cleanup_fail;
+    }
+    (*csw)->writer_running = true;
+
+    if (pthread_create(&(*csw)->thread, NULL, compstrm_wrapper_thread, *csw) != 0) {
+        error = DRPM_ERR_OTHER;
+        goto cleanup_fail;
+    }
+    (*csw)->thread_running = true;
 
     return DRPM_ERR_OK;
+
+cleanup_fail:
+    compstrm_wrapper_destroy(csw);
+
+    return error;
 }
 
 int compstrm_wrapper_destroy(struct compstrm_wrapper **csw)
@@ -325,60 +460,108 @@ int compstrm_wrapper_destroy(struct compstrm_wrapper **csw)
     if (csw == NULL || *csw == NULL)
         return DRPM_ERR_PROG;
 
-    compstrm_destroy(&(*csw)->strm);
-    free((*csw)->uncomp_data);
+    /* both rings are closed first, as the compression thread
+     * may be waiting for the writing thread */
+    if ((*csw)->thread_running)
+        ring_close((*csw)->ring, DRPM_ERR_OTHER);
+    if ((*csw)->writer_running)
+        ring_close((*csw)->out_ring, DRPM_ERR_OTHER);
+    if ((*csw)->thread_running)
+        pthread_join((*csw)->thread, NULL);
+    if ((*csw)->writer_running)
+        pthread_join((*csw)->writer, NULL);
+
+    if ((*csw)->ring != NULL)
+        ring_destroy(&(*csw)->ring);
+    if ((*csw)->out_ring != NULL)
+        ring_destroy(&(*csw)->out_ring);
+    if ((*csw)->strm != NULL)
+        compstrm_destroy(&(*csw)->strm);
     free(*csw);
+    *csw = NULL;
 
     return DRPM_ERR_OK;
 }
 
 int compstrm_wrapper_write(struct compstrm_wrapper *csw, const unsigned char *buffer, size_t buffer_len)
 {
+    int error;
     size_t write_len;
 
-    if (csw == NULL || csw->strm == NULL || csw->filedesc < 0)
+    if (csw == NULL || csw->strm == NULL)
         return DRPM_ERR_PROG;
 
-    if (csw->uncomp_left > 0) {
-        if (buffer_len == 0)
-            return DRPM_ERR_OK;
+    if (buffer_len == 0)
+        return DRPM_ERR_OK;
 
-        if (buffer == NULL)
-            return DRPM_ERR_PROG;
+    if (buffer == NULL)
+        return DRPM_ERR_PROG;
 
+    if (csw->uncomp_left > 0) {
         write_len = MIN(csw->uncomp_left, buffer_len);
-        if (write(csw->filedesc, buffer, write_len) != (ssize_t)write_len)
-            return DRPM_ERR_IO;
-        memcpy(csw->uncomp_data + csw->uncomp_len - csw->uncomp_left, buffer, write_len);
+        if ((error = sink_write(&csw->output, buffer, write_len)) != DRPM_ERR_OK ||
+            (csw->md5 != NULL &&
+             (error = checksum_update(csw->md5, buffer, write_len)) != DRPM_ERR_OK))
+            return error;
         buffer += write_len;
         buffer_len -= write_len;
         csw->uncomp_left -= write_len;
     }
 
-    return compstrm_write(csw->strm, buffer_len, buffer);
+    /* handing data over to compression thread */
+    while (buffer_len > 0) {
+        if (csw->slot == NULL) {
+            if ((error = ring_acquire(csw->ring, &csw->slot)) != DRPM_ERR_OK)
+                return error;
+            csw->slot_len = 0;
+        }
+        write_len = MIN(buffer_len, PIPE_SLOT_SIZE - csw->slot_len);
+        memcpy(csw->slot + csw->slot_len, buffer, write_len);
+        buffer += write_len;
+        buffer_len -= write_len;
+        csw->slot_len += write_len;
+        if (csw->slot_len == PIPE_SLOT_SIZE) {
+            if ((error = ring_commit(csw->ring, csw->slot_len)) != DRPM_ERR_OK)
+                return error;
+            csw->slot = NULL;
+        }
+    }
+
+    return DRPM_ERR_OK;
 }
 
-int compstrm_wrapper_finish(struct compstrm_wrapper *csw, unsigned char **data, size_t *data_len)
+int compstrm_wrapper_finish(struct compstrm_wrapper *csw)
 {
     int error;
-    unsigned char *data_tmp;
 
-    if (csw == NULL)
+    if (csw == NULL || !csw->thread_running)
         return DRPM_ERR_PROG;
 
-    if ((error = compstrm_finish(csw->strm, data, data_len)) != DRPM_ERR_OK)
+    /* flushing last chunk and waiting for compression thread */
+    if (csw->slot != NULL && csw->slot_len > 0 &&
+        (error = ring_commit(csw->ring, csw->slot_len)) != DRPM_ERR_OK)
         return error;
+    csw->slot = NULL;
 
-    if ((data_tmp = realloc(*data, csw->uncomp_len + *data_len)) == NULL) {
-        free(*data);
-        return DRPM_ERR_MEMORY;
-    }
+    ring_close(csw->ring, DRPM_ERR_OK);
+    pthread_join(csw->thread, NULL);
+    csw->thread_running = false;
 
-    memmove(data_tmp + csw->uncomp_len, data_tmp, *data_len);
-    memcpy(data_tmp, csw->uncomp_data, csw->uncomp_len);
+    /* rest of compressed data is handed over by this thread,
+     * then the writing thread is waited for as well */
+    if ((error = csw->thread_error) == DRPM_ERR_OK &&
+        (error = compstrm_finish(csw->strm, NULL, NULL)) == DRPM_ERR_OK &&
+        csw->out_slot != NULL && csw->out_slot_len > 0)
+        error = ring_commit(csw->out_ring, csw->out_slot_len);
+    csw->out_slot = NULL;
 
-    *data = data_tmp;
-    *data_len += csw->uncomp_len;
+    ring_close(csw->out_ring, error);
+    pthread_join(csw->writer, NULL);
+    csw->writer_running = false;
 
-    return DRPM_ERR_OK;
+    /* a failed write also makes the compression stream fail */
+    if (csw->writer_error != DRPM_ERR_OK)
+        return csw->writer_error;
+
+    return error;
 }
@@ -23,14 +23,19 @@
 #endif
 
 #include "../src/drpm.h"
+#include "../src/drpm_private.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <openssl/md5.h>
+#include <openssl/evp.h>
 
 #include <stdarg.h>
 #include <stddef.h>
@@ -45,18 +50,58 @@
 #define DELTARPM_STANDARD "standard.drpm"
 #define DELTARPM_RPMONLY_NOADDBLK "rpmonly-noaddblk.drpm"
 #define DELTARPM_STANDARD_LZIP "standard-lzip.drpm"
+#define DELTARPM_STANDARD_ZSTD "standard-zstd.drpm"
+#define DELTARPM_STANDARD_ZSTD_PAYLOAD "standard-zstd-payload.drpm"
+#define DELTARPM_STANDARD_XZ_MT "standard-xz-mt.drpm"
+#define DELTARPM_SIZE_RATIO "size-ratio.drpm"
+#define DELTARPM_THRESHOLD "threshold.drpm"
+#define DELTARPM_STANDARD_DIGEST "standard-digest.drpm"
+#define DELTARPM_RPMONLY_DIGEST "rpmonly-digest.drpm"
+#define DELTARPM_STANDARD_BADDIGEST "standard-baddigest.drpm"
 
 #define OLDRPM_1 "drpm-old.rpm"
 #define NEWRPM_1 "drpm-new.rpm"
 #define OLDRPM_2 "cmocka-old.rpm"
 #define NEWRPM_2 "cmocka-new.rpm"
+#define NEWRPM_DIGEST "drpm-new-digest.rpm"
+#define NEWRPM_BADDIGEST "drpm-new-baddigest.rpm"
+#define NEWRPM_ZSTD "drpm-new-zstd.rpm"
 
 #define RPMOUT_STANDARD "standard.rpm"
 #define RPMOUT_RPMONLY_NOADDBLK "rpmonly-noaddblk.rpm"
 #define RPMOUT_STANDARD_LZIP "standard-lzip.rpm"
+#define RPMOUT_STANDARD_ZSTD "standard-zstd.rpm"
+#define RPMOUT_STANDARD_ZSTD_PAYLOAD "standard-zstd-payload.rpm"
+#define RPMOUT_STANDARD_XZ_MT "standard-xz-mt.rpm"
+#define RPMOUT_STANDARD_UNCOMPRESSED "standard-uncompressed.rpm"
+#define RPMOUT_STANDARD_DIGEST "standard-digest.rpm"
+#define RPMOUT_RPMONLY_DIGEST "rpmonly-digest.rpm"
+#define RPMOUT_STANDARD_BADDIGEST "standard-baddigest.rpm"
+#define RPMOUT_STANDARD_SPILL "standard-spill.rpm"
+#define RPMOUT_RPMONLY_STREAM "rpmonly-stream.rpm"
+#define RPMOUT_STANDARD_PIPE "standard-pipe.rpm"
+#define RPMOUT_STANDARD_HANDLE "standard-handle.rpm"
+#define RPMOUT_HANDLE_FAIL "handle-fail.rpm"
+#define RPMOUT_BATCH_STANDARD "batch-standard.rpm"
+#define RPMOUT_BATCH_RPMONLY_NOADDBLK "batch-rpmonly-noaddblk.rpm"
 
 #define SEQFILE "seqfile.txt"
 
+#define RPMLIST_PRINT "print.rpml"
+#define RPMLIST_PATCH "patch.rpml"
+#define RPMLIST_LONG_NAME_LEN 5000 // longer than the rpmlist read buffer
+
+#define PRELINK_DIR "prelink-XXXXXX"
+#define PRELINK_FILE_SIZE 45000 // original contents span six blocks
+#define PRELINK_CHECK_SIZE 128 // smaller than prelinked file
+#define VERIFY_FILE "verify-XXXXXX"
+#define MIN_CACHE_DIR "min-cache-XXXXXX"
+#define MIN_CACHE_FILES 4
+#define MIN_CACHE_FILE_SIZE 100000 // over 12 blocks, several times the minimum cache in total
+
+#define STRESS_THREADS 8
+#define STRESS_ROUNDS 4
+
 // garbage collector for drpm_read tests
 struct read_deltas {
     unsigned short index;
@@ -81,6 +126,194 @@ static off_t filesize(const char *path)
     return stats.st_size;
 }
 
+// computes MD5 of file contents, false if the file cannot be read
+static bool file_md5(const char *path, unsigned char digest[MD5_DIGEST_LENGTH])
+{
+    unsigned char buffer[BUFSIZ];
+    EVP_MD_CTX *ctx;
+    FILE *file;
+    size_t len;
+    bool ok;
+
+    if ((file = fopen(path, "rb")) == NULL)
+        return false;
+
+    if ((ctx = EVP_MD_CTX_new()) == NULL) {
+        fclose(file);
+        return false;
+    }
+
+    ok = (EVP_DigestInit_ex(ctx, EVP_md5(), NULL) == 1);
+    while (ok && (len = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        ok = (EVP_DigestUpdate(ctx, buffer, len) == 1);
+    ok = ok && !ferror(file) && EVP_DigestFinal_ex(ctx, digest, NULL) == 1;
+
+    EVP_MD_CTX_free(ctx);
+    fclose(file);
+
+    return ok;
+}
+
+// installed file passing is_prelinked(): ELF with .gnu.prelink_undo section
+static void write_prelinked_elf(const char *path)
+{
+    static const char strtab[] = "\0.gnu.prelink_undo";
+    unsigned char elf[256] = {0x7F, 'E', 'L', 'F', 2, 1, 1};
+    FILE *file;
+
+    elf[40] = 64; // e_shoff
+    elf[58] = 64; // e_shentsize
+    elf[60] = 2; // e_shnum
+    elf[62] = 1; // e_shstrndx
+    elf[64] = 1; // section 0 named .gnu.prelink_undo
+    elf[128 + 4] = 3; // section 1 is SHT_STRTAB
+    elf[128 + 24] = 192; // sh_offset
+    elf[128 + 32] = sizeof(strtab); // sh_size
+    memcpy(elf + 192, strtab, sizeof(strtab));
+
+    assert_non_null(file = fopen(path, "wb"));
+    assert_int_equal(sizeof(elf), fwrite(elf, 1, sizeof(elf), file));
+    assert_int_equal(0, fclose(file));
+}
+
+// installed prelinked file with its original contents in a prelink cache directory
+struct prelink_fixture {
+    char dir[sizeof(PRELINK_DIR)];
+    char path[sizeof(PRELINK_DIR) + 4];
+    char image_path[sizeof(PRELINK_DIR) + 80];
+};
+
+// Creates a new directory holding a file that passes is_prelinked() and
+// <image> named as prelink_open() looks it up, so prelink itself is not needed.
+static void prelink_fixture_create(struct prelink_fixture *fixture,
+                                   const unsigned char *image, size_t image_len)
+{
+    struct stat stats;
+    FILE *file;
+
+    strcpy(fixture->dir, PRELINK_DIR);
+    assert_non_null(mkdtemp(fixture->dir));
+    snprintf(fixture->path, sizeof(fixture->path), "%s/lib", fixture->dir);
+    write_prelinked_elf(fixture->path);
+
+    assert_int_equal(0, stat(fixture->path, &stats));
+    snprintf(fixture->image_path, sizeof(fixture->image_path), "%s/%jx-%jx-%jx-%jx", fixture->dir,
+             (uintmax_t)stats.st_dev, (uintmax_t)stats.st_ino,
+             (uintmax_t)stats.st_mtime, (uintmax_t)stats.st_size);
+    assert_non_null(file = fopen(fixture->image_path, "wb"));
+    assert_int_equal(image_len, fwrite(image, 1, image_len, file));
+    assert_int_equal(0, fclose(file));
+}
+
+static void prelink_fixture_remove(const struct prelink_fixture *fixture)
+{
+    assert_int_equal(0, unlink(fixture->image_path));
+    assert_int_equal(0, unlink(fixture->path));
+    assert_int_equal(0, rmdir(fixture->dir));
+}
+
+// compares files by their MD5
+static bool same_md5(const char *path1, const char *path2)
+{
+    unsigned char digest1[MD5_DIGEST_LENGTH];
+    unsigned char digest2[MD5_DIGEST_LENGTH];
+
+    return file_md5(path1, digest1) && file_md5(path2, digest2) &&
+           memcmp(digest1, digest2, MD5_DIGEST_LENGTH) == 0;
+}
+
+// rpmlist file as written by makepatchrpm / rpmprint
+struct rpmlist {
+    unsigned char data[2 * RPMLIST_LONG_NAME_LEN + 1024];
+    size_t len;
+};
+
+static void rpmlist_put(struct rpmlist *list, const void *data, size_t len)
+{
+    assert_true(list->len + len <= sizeof(list->data));
+    memcpy(list->data + list->len, data, len);
+    list->len += len;
+}
+
+static void rpmlist_put_string(struct rpmlist *list, const char *str)
+{
+    const uint8_t len = strlen(str);
+
+    rpmlist_put(list, &len, 1);
+    rpmlist_put(list, str, len);
+}
+
+// file name sharing its prefix with the previous one (if any)
+static void rpmlist_put_filename(struct rpmlist *list, const char *prev, const char *name)
+{
+    size_t off = 0;
+    size_t len;
+    unsigned char buf[4];
+
+    while (prev != NULL && off < 0xFF && prev[off] != '\0' && prev[off] == name[off])
+        off++;
+    len = strlen(name + off);
+
+    buf[0] = off;
+    buf[1] = (len < 0xFF) ? len : 0xFF;
+    buf[2] = len >> 8;
+    buf[3] = len & 0xFF;
+
+    rpmlist_put(list, buf, (len < 0xFF) ? 2 : 4);
+    rpmlist_put(list, name + off, len);
+}
+
+// <unpatched> files are listed only if non-NULL (as if patches were applied)
+static void rpmlist_put_header(struct rpmlist *list, const char *name, const char *evr,
+                               const char **unpatched, uint32_t unpatched_count)
+{
+    const unsigned char build_time[4] = {0x57, 0x00, 0x00, 0x00};
+    const unsigned char count[4] = {unpatched_count >> 24, unpatched_count >> 16,
+                                    unpatched_count >> 8, unpatched_count};
+
+    list->len = 0;
+    rpmlist_put(list, "RPML", 4);
+    rpmlist_put_string(list, name);
+    rpmlist_put_string(list, evr);
+    rpmlist_put_string(list, "build.example.com");
+    rpmlist_put(list, build_time, sizeof(build_time));
+
+    if (unpatched == NULL) {
+        rpmlist_put(list, "\0\0", 2);
+        return;
+    }
+
+    rpmlist_put(list, "\0\1", 2);
+    rpmlist_put_string(list, "fix-foo.patch");
+    rpmlist_put(list, count, sizeof(count));
+    for (uint32_t i = 0; i < unpatched_count; i++)
+        rpmlist_put_filename(list, (i > 0) ? unpatched[i - 1] : NULL, unpatched[i]);
+}
+
+// <attrs> are the optional fields and file size, <md5> follows if not NULL
+static void rpmlist_put_file(struct rpmlist *list, const char *prev, const char *name,
+                             uint16_t mode, const unsigned char *attrs, size_t attrs_len,
+                             const unsigned char md5[MD5_DIGEST_LENGTH])
+{
+    const unsigned char mode_buf[2] = {mode >> 8, mode & 0xFF};
+
+    rpmlist_put_filename(list, prev, name);
+    rpmlist_put(list, mode_buf, sizeof(mode_buf));
+    if (attrs_len > 0)
+        rpmlist_put(list, attrs, attrs_len);
+    if (md5 != NULL)
+        rpmlist_put(list, md5, MD5_DIGEST_LENGTH);
+}
+
+static void rpmlist_write(const struct rpmlist *list, const char *path, size_t len)
+{
+    FILE *file;
+
+    assert_non_null(file = fopen(path, "wb"));
+    assert_int_equal(len, fwrite(list->data, 1, len, file));
+    assert_int_equal(0, fclose(file));
+}
+
 /***************************** drpm_make ******************************/
 
 static int make_setup(void **state)
@@ -152,6 +385,59 @@ static void make_standard(void **state)
     assert_int_equal(DRPM_ERR_OK, drpm_make(OLDRPM_1, NEWRPM_1, DELTARPM_STANDARD, opts));
 }
 
+// NEWRPM_DIGEST is NEWRPM_1 with payload digests added to its header
+static void make_standard_digest(void **state)
+{
+    drpm_make_options *opts = *state;
+    assert_int_equal(DRPM_ERR_OK, drpm_make_options_defaults(opts));
+
+    assert_int_equal(DRPM_ERR_OK, drpm_make(OLDRPM_1, NEWRPM_DIGEST, DELTARPM_STANDARD_DIGEST, opts));
+}
+
+static void make_rpmonly_digest(void **state)
+{
+    drpm_make_options *opts = *state;
+    assert_int_equal(DRPM_ERR_OK, drpm_make_options_defaults(opts));
+
+    assert_int_equal(DRPM_ERR_OK, drpm_make_options_set_type(opts, DRPM_TYPE_RPMONLY));
+
+    assert_int_equal(DRPM_ERR_OK, drpm_make(OLDRPM_1, NEWRPM_DIGEST, DELTARPM_RPMONLY_DIGEST, opts));
+}
+
+// NEWRPM_BADDIGEST has a digest that does not match its uncompressed payload
+static void make_standard_baddigest(void **state)
+{
+    drpm_make_options *opts = *state;
+    assert_int_equal(DRPM_ERR_OK, drpm_make_options_defaults(opts));
+
+    assert_int_equal(DRPM_ERR_OK, drpm_make(OLDRPM_1, NEWRPM_BADDIGEST, DELTARPM_STANDARD_BADDIGEST, opts));
+}
+
+// a DeltaRPM within the size threshold is made as usual
+static void make_size_ratio(void **state)
+{
+    drpm_make_options *opts = *state;
+    assert_int_equal(DRPM_ERR_OK, drpm_make_options_defaults(opts));
+
+    assert_int_equal(DRPM_ERR_ARGS, drpm_make_options_set_size_ratio(opts, 101));
+    assert_int_equal(DRPM_ERR_OK, drpm_make_options_set_size_ratio(opts, 100));
+
+    assert_int_equal(DRPM_ERR_OK, drpm_make(OLDRPM_2, NEWRPM_2, DELTARPM_SIZE_RATIO, opts));
+    assert_true(filesize(DELTARPM_SIZE_RATIO) < filesize(NEWRPM_2));
+}
+
+// no DeltaRPM fits in 1% of the target RPM
+static void make_threshold(void **state)
+{
+    drpm_make_options *opts = *state;
+    assert_int_equal(DRPM_ERR_OK, drpm_make_options_defaults(opts));
+
+    assert_int_equal(DRPM_ERR_OK, drpm_make_options_set_size_ratio(opts, 1));
+
+    assert_int_equal(DRPM_ERR_THRESHOLD, drpm_make(OLDRPM_2, NEWRPM_2, DELTARPM_THRESHOLD, opts));
+    assert_int_equal(-1, filesize(DELTARPM_THRESHOLD));
+}
+
 // equivalent to: makedeltarpm -r -z gzip,off <OLDRPM_2> <NEWRPM_2> <DELTARPM_RPMONLY_NOADDBLK>
 static void make_rpmonly_noaddblk(void **state)
 {
@@ -178,6 +464,233 @@ static void make_standard_lzip(void **state)
 }
 #endif
 
+#ifdef HAVE_ZSTD
+// testing zstd support, levels above 9 only valid for zstd
+static void make_standard_zstd(void **state)
+{
+    drpm_make_options *opts = *state;
+    assert_int_equal(DRPM_ERR_OK, drpm_make_options_defaults(opts));
+
+    assert_int_equal(DRPM_ERR_ARGS, drpm_make_options_set_delta_comp(opts, DRPM_COMP_XZ, 19));
+    assert_int_equal(DRPM_ERR_OK, drpm_make_options_set_delta_comp(opts, DRPM_COMP_ZSTD, 19));
+    assert_int_equal(DRPM_ERR_OK, drpm_make_options_set_addblk_comp(opts, DRPM_COMP_ZSTD, DRPM_COMP_LEVEL_DEFAULT));
+
+    assert_int_equal(DRPM_ERR_OK, drpm_make(OLDRPM_2, NEWRPM_2, DELTARPM_STANDARD_ZSTD, opts));
+}
+
+// NEWRPM_ZSTD is NEWRPM_1 with its payload recompressed like rpmbuild's
+// "w19.zstdio" (zstd level 19, streamed, no threads)
+static void make_standard_zstd_payload(void **state)
+{
+    drpm_make_options *opts = *state;
+    assert_int_equal(DRPM_ERR_OK, drpm_make_options_defaults(opts));
+
+    assert_int_equal(DRPM_ERR_OK, drpm_make(OLDRPM_1, NEWRPM_ZSTD, DELTARPM_STANDARD_ZSTD_PAYLOAD, opts));
+}
+#endif
+
+// multi-threaded xz (not in makedeltarpm)
+static void make_standard_xz_mt(void **state)
+{
+    drpm_make_options *opts = *state;
+    assert_int_equal(DRPM_ERR_OK, drpm_make_options_defaults(opts));
+
+    assert_int_equal(DRPM_ERR_OK, drpm_make_options_set_delta_comp(opts, DRPM_COMP_XZ, DRPM_COMP_LEVEL_DEFAULT));
+    assert_int_equal(DRPM_ERR_OK, drpm_make_options_set_delta_comp_threads(opts, 0));
+
+    assert_int_equal(DRPM_ERR_OK, drpm_make(OLDRPM_2, NEWRPM_2, DELTARPM_STANDARD_XZ_MT, opts));
+}
+
+// rpm-print and patch RPM file lists used with makedeltarpm -p
+static void make_patches_rpmlist(void **state)
+{
+    static const unsigned char md5_foo[MD5_DIGEST_LENGTH] = {
+        0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11};
+    static const unsigned char md5_lib[MD5_DIGEST_LENGTH] = {
+        0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22,
+        0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22};
+    static const unsigned char md5_doc[MD5_DIGEST_LENGTH] = {
+        0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab,
+        0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab};
+    static const unsigned char md5_dup[MD5_DIGEST_LENGTH] = {
+        0x33, 0x33, 0x33, 0x33, 0x33, 0x33, 0x33, 0x33,
+        0x33, 0x33, 0x33, 0x33, 0x33, 0x33, 0x33, 0x33};
+    const char hex_foo[] = "11111111111111111111111111111111";
+    const char hex_lib[] = "22222222222222222222222222222222";
+    const char hex_doc[] = "abababababababababababababababab";
+    const char hex_dup[] = "33333333333333333333333333333333";
+    const char hex_none[] = "00000000000000000000000000000000";
+    // size 5 (1 byte)
+    const unsigned char attrs_foo[] = {0x00, 0x05};
+    // size 0 (2 bytes), no MD5 follows
+    const unsigned char attrs_bar[] = {0x01, 0x00, 0x00};
+    // extended: 4 + 2 bytes of optional fields, size 7 (2 bytes)
+    const unsigned char attrs_lib[] = {0xFF, 0x03, 0x05, 'u', 's', 'e', 'r', 'g', 'r', 0x00, 0x07};
+    // 2 bytes of optional fields, no size
+    const unsigned char attrs_dir[] = {0x20, 'o', 'k'};
+    // rdev (4 bytes)
+    const unsigned char attrs_dev[] = {0x00, 0x00, 0x01, 0x00, 0x03};
+    // size 65536 (3 bytes)
+    const unsigned char attrs_doc[] = {0x02, 0x01, 0x00, 0x00};
+    char doc[RPMLIST_LONG_NAME_LEN + 1];
+    char doc_path[RPMLIST_LONG_NAME_LEN + 3];
+    const char *unpatched[] = {"usr/bin/foo", "usr/bin/bar", "usr/lib/libfoo.so", doc};
+    struct rpmlist list;
+    struct rpm_patches *patches = NULL;
+
+    (void)state;
+
+    memset(doc, 'x', RPMLIST_LONG_NAME_LEN);
+    memcpy(doc, "usr/share/doc/", 14);
+    doc[RPMLIST_LONG_NAME_LEN] = '\0';
+    sprintf(doc_path, "./%s", doc);
+
+    rpmlist_put_header(&list, "foo", "1.0-1", NULL, 0);
+    rpmlist_put_file(&list, NULL, "./usr/bin/foo", S_IFREG | 0755,
+                     attrs_foo, sizeof(attrs_foo), md5_foo);
+    rpmlist_put_file(&list, "./usr/bin/foo", "./usr/bin/bar", S_IFREG | 0644,
+                     attrs_bar, sizeof(attrs_bar), NULL);
+    rpmlist_put_file(&list, "./usr/bin/bar", "./usr/lib/libfoo.so", S_IFLNK | 0777,
+                     attrs_lib, sizeof(attrs_lib), md5_lib);
+    rpmlist_put_file(&list, "./usr/lib/libfoo.so", "./usr/share", S_IFDIR | 0755,
+                     attrs_dir, sizeof(attrs_dir), NULL);
+    rpmlist_put_file(&list, "./usr/share", "./dev/null", S_IFCHR | 0666,
+                     attrs_dev, sizeof(attrs_dev), NULL);
+    rpmlist_put_file(&list, "./dev/null", doc_path, S_IFREG | 0644,
+                     attrs_doc, sizeof(attrs_doc), md5_doc);
+    rpmlist_put_file(&list, doc_path, "./usr/bin/foo", S_IFREG | 0644,
+                     attrs_foo, sizeof(attrs_foo), md5_dup);
+    rpmlist_put_file(&list, "./usr/bin/foo", "./ghost", 0, NULL, 0, NULL);
+    rpmlist_put(&list, "\0\0", 2);
+    rpmlist_write(&list, RPMLIST_PATCH, list.len);
+
+    rpmlist_put_header(&list, "foo", "1.0-1", unpatched, sizeof(unpatched) / sizeof(unpatched[0]));
+    rpmlist_put_file(&list, doc, "./usr/share", S_IFDIR | 0755,
+                     attrs_dir, sizeof(attrs_dir), NULL);
+    rpmlist_put_file(&list, "./usr/share", "./usr/bin/foo", S_IFREG | 0755,
+                     attrs_foo, sizeof(attrs_foo), md5_foo);
+    rpmlist_put(&list, "\0\0", 2);
+    rpmlist_write(&list, RPMLIST_PRINT, list.len);
+
+    assert_int_equal(DRPM_ERR_OK, patches_read(RPMLIST_PRINT, RPMLIST_PATCH, &patches));
+    assert_non_null(patches);
+
+    assert_int_equal(DRPM_ERR_OK, patches_check_nevr(patches, "foo-1.0-1"));
+    assert_int_equal(DRPM_ERR_ARGS, patches_check_nevr(patches, "foo-1.0-2"));
+
+    // unpatched files are skipped unless they match the patch RPM
+    assert_false(is_unpatched(patches, "usr/bin/foo", hex_foo));
+    assert_true(is_unpatched(patches, "usr/bin/foo", hex_dup));
+    assert_false(is_unpatched(patches, "usr/bin/bar", hex_none));
+    assert_true(is_unpatched(patches, "usr/bin/bar", hex_foo));
+    assert_false(is_unpatched(patches, "usr/lib/libfoo.so", hex_lib));
+    assert_true(is_unpatched(patches, "usr/lib/libfoo.so", hex_foo));
+    assert_false(is_unpatched(patches, doc, hex_doc));
+    assert_true(is_unpatched(patches, doc, hex_none));
+
+    // not listed as unpatched in rpm-print
+    assert_false(is_unpatched(patches, "usr/share", hex_foo));
+    assert_false(is_unpatched(patches, "dev/null", hex_foo));
+    assert_false(is_unpatched(patches, "usr/bin/baz", hex_foo));
+
+    assert_int_equal(DRPM_ERR_OK, patches_destroy(&patches));
+    assert_null(patches);
+
+    assert_int_equal(0, unlink(RPMLIST_PRINT));
+    assert_int_equal(0, unlink(RPMLIST_PATCH));
+}
+
+// rpm-print may also be the old RPM itself
+static void make_patches_rpm(void **state)
+{
+    struct rpm *rpmst = NULL;
+    char *nevr = NULL;
+    char *evr;
+    struct rpmlist list;
+    struct rpm_patches *patches = NULL;
+
+    (void)state;
+
+    assert_int_equal(DRPM_ERR_OK, rpm_read(&rpmst, OLDRPM_1, RPM_ARCHIVE_DONT_READ, NULL, NULL, NULL));
+    assert_int_equal(DRPM_ERR_OK, rpm_get_nevr(rpmst, &nevr));
+    assert_int_equal(DRPM_ERR_OK, rpm_destroy(&rpmst));
+
+    // NEVR is rebuilt as "<name>-<evr>"
+    assert_non_null(evr = strrchr(nevr, '-'));
+    *evr++ = '\0';
+    rpmlist_put_header(&list, nevr, evr, NULL, 0);
+    rpmlist_put(&list, "\0\0", 2);
+    rpmlist_write(&list, RPMLIST_PATCH, list.len);
+    evr[-1] = '-';
+
+    assert_int_equal(DRPM_ERR_OK, patches_read(OLDRPM_1, RPMLIST_PATCH, &patches));
+    assert_non_null(patches);
+    assert_int_equal(DRPM_ERR_OK, patches_check_nevr(patches, nevr));
+    assert_int_equal(DRPM_ERR_OK, patches_destroy(&patches));
+
+    free(nevr);
+    assert_int_equal(0, unlink(RPMLIST_PATCH));
+}
+
+static void make_patches_malformed(void **state)
+{
+    const unsigned char md5[MD5_DIGEST_LENGTH] = {0x11};
+    const unsigned char attrs[] = {0x00, 0x05};
+    const char *unpatched[] = {"usr/bin/foo"};
+    struct rpmlist list;
+    size_t file_len;
+    struct rpm_patches *patches = NULL;
+
+    (void)state;
+
+    rpmlist_put_header(&list, "foo", "1.0-1", unpatched, 1);
+    rpmlist_put(&list, "\0\0", 2);
+    rpmlist_write(&list, RPMLIST_PRINT, list.len);
+
+    rpmlist_put_header(&list, "foo", "1.0-1", NULL, 0);
+    rpmlist_put_file(&list, NULL, "./usr/bin/foo", S_IFREG | 0755, attrs, sizeof(attrs), md5);
+    file_len = list.len;
+    rpmlist_put(&list, "\0\0", 2);
+
+    // truncated in MD5
+    rpmlist_write(&list, RPMLIST_PATCH, file_len - MD5_DIGEST_LENGTH / 2);
+    assert_int_equal(DRPM_ERR_FORMAT, patches_read(RPMLIST_PRINT, RPMLIST_PATCH, &patches));
+    assert_null(patches);
+
+    // missing end of file list
+    rpmlist_write(&list, RPMLIST_PATCH, file_len);
+    assert_int_equal(DRPM_ERR_FORMAT, patches_read(RPMLIST_PRINT, RPMLIST_PATCH, &patches));
+    assert_null(patches);
+
+    // truncated in header
+    rpmlist_write(&list, RPMLIST_PATCH, 6);
+    assert_int_equal(DRPM_ERR_FORMAT, patches_read(RPMLIST_PRINT, RPMLIST_PATCH, &patches));
+    assert_null(patches);
+
+    list.data[0] = 'X';
+    rpmlist_write(&list, RPMLIST_PATCH, list.len);
+    assert_int_equal(DRPM_ERR_FORMAT, patches_read(RPMLIST_PRINT, RPMLIST_PATCH, &patches));
+    assert_null(patches);
+
+    // rpm-print neither an RPM nor an rpmlist
+    assert_int_equal(DRPM_ERR_FORMAT, patches_read(RPMLIST_PATCH, RPMLIST_PRINT, &patches));
+    assert_null(patches);
+
+    assert_int_equal(DRPM_ERR_IO, patches_read(RPMLIST_PRINT, "nonexistent.rpml", &patches));
+    assert_null(patches);
+
+    // complete again
+    list.data[0] = 'R';
+    rpmlist_write(&list, RPMLIST_PATCH, list.len);
+    assert_int_equal(DRPM_ERR_OK, patches_read(RPMLIST_PRINT, RPMLIST_PATCH, &patches));
+    assert_true(is_unpatched(patches, "usr/bin/foo", "00000000000000000000000000000000"));
+    assert_int_equal(DRPM_ERR_OK, patches_destroy(&patches));
+
+    assert_int_equal(0, unlink(RPMLIST_PRINT));
+    assert_int_equal(0, unlink(RPMLIST_PATCH));
+}
+
 /***************************** drpm_read ******************************/
 
 static int read_setup(void **state)
@@ -836,6 +1349,127 @@ static void check_sequence(void **state)
     assert_int_equal(DRPM_ERR_OK, drpm_check_sequence(OLDRPM_1, (const char *)*state, DRPM_CHECK_NONE));
 }
 
+static void check_sequence_ex(void **state)
+{
+    drpm_apply_options *opts;
+
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_init(&opts));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_set_prelink_dir(opts, "."));
+    assert_int_equal(DRPM_ERR_OK, drpm_check_sequence_ex(OLDRPM_1, (const char *)*state, DRPM_CHECK_NONE, opts));
+    assert_int_equal(DRPM_ERR_ARGS, drpm_check_sequence_ex(OLDRPM_1, (const char *)*state, DRPM_CHECK_FULL, opts));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_destroy(&opts));
+}
+
+// Installed files are checked the same way from drpm_check_sequence_ex().
+// A prelinked file (larger than its original contents, like real ones)
+// is checked against the image in the prelink cache directory.
+static void check_prelink_cached(void **state)
+{
+    struct prelink_fixture fixture;
+    unsigned char image[PRELINK_CHECK_SIZE];
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    char md5[2 * MD5_DIGEST_LENGTH + 1];
+    struct file_info file = {.mode = S_IFREG | 0644, .size = PRELINK_CHECK_SIZE, .md5 = md5};
+    const struct cpio_file cpio_file = {.index = 0};
+    struct prelink_cache *prelink;
+
+    (void)state;
+
+    for (size_t i = 0; i < PRELINK_CHECK_SIZE; i++)
+        image[i] = (unsigned char)i;
+
+    prelink_fixture_create(&fixture, image, sizeof(image));
+    file.name = fixture.path;
+
+    assert_true(file_md5(fixture.image_path, digest));
+    for (size_t i = 0; i < MD5_DIGEST_LENGTH; i++)
+        snprintf(md5 + 2 * i, 3, "%02x", digest[i]);
+
+    assert_int_equal(DRPM_ERR_OK, prelink_cache_create(&prelink, fixture.dir));
+    assert_int_equal(DRPM_ERR_OK, check_seqfiles(&cpio_file, 1, &file, DIGESTALGO_MD5,
+                                                 DRPM_CHECK_FULL, prelink, NULL));
+    assert_int_equal(DRPM_ERR_OK, check_seqfiles(&cpio_file, 1, &file, DIGESTALGO_MD5,
+                                                 DRPM_CHECK_FILESIZES, prelink, NULL));
+    md5[0] = (md5[0] == '0') ? '1' : '0';
+    assert_int_equal(DRPM_ERR_MISMATCH, check_seqfiles(&cpio_file, 1, &file, DIGESTALGO_MD5,
+                                                       DRPM_CHECK_FULL, prelink, NULL));
+    assert_int_equal(DRPM_ERR_OK, prelink_cache_destroy(&prelink));
+
+    prelink_fixture_remove(&fixture);
+}
+
+// a missing installed file is reported before the sequence mismatch it causes
+static void check_missing_file(void **state)
+{
+    // MD5 of the sequence does not match, only the first file listed
+    const unsigned char sequence[MD5_DIGEST_LENGTH + 1] = {[MD5_DIGEST_LENGTH] = 0x10};
+    char md5[] = "0123456789abcdef0123456789abcdef";
+    char name[] = "/nonexistent/drpm-missing-file";
+    struct file_info file = {.name = name, .mode = S_IFREG | 0644, .size = 10, .md5 = md5};
+
+    (void)state;
+
+    assert_int_equal(DRPM_ERR_MISMATCH, expand_sequence(NULL, NULL, sequence, sizeof(sequence),
+                                                        &file, 1, DIGESTALGO_MD5,
+                                                        DRPM_CHECK_NONE, NULL, NULL));
+    assert_int_equal(DRPM_ERR_NOINSTALL, expand_sequence(NULL, NULL, sequence, sizeof(sequence),
+                                                         &file, 1, DIGESTALGO_MD5,
+                                                         DRPM_CHECK_FILESIZES, NULL, NULL));
+    assert_int_equal(DRPM_ERR_IO, expand_sequence(NULL, NULL, sequence, sizeof(sequence),
+                                                  &file, 1, DIGESTALGO_MD5,
+                                                  DRPM_CHECK_FULL, NULL, NULL));
+}
+
+// second check is served from the verify cache saved by the first one
+static void check_verify_cached(void **state)
+{
+    char path[] = VERIFY_FILE;
+    char cache_path[sizeof(VERIFY_FILE) + 6];
+    unsigned char contents[PRELINK_CHECK_SIZE];
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    char md5[2 * MD5_DIGEST_LENGTH + 1];
+    struct file_info file = {.mode = S_IFREG | 0644, .size = PRELINK_CHECK_SIZE, .md5 = md5};
+    const struct cpio_file cpio_file = {.index = 0};
+    struct verify_cache *verify;
+    struct stat stats;
+    int filedesc;
+
+    (void)state;
+
+    for (size_t i = 0; i < PRELINK_CHECK_SIZE; i++)
+        contents[i] = (unsigned char)i;
+
+    assert_true((filedesc = mkstemp(path)) >= 0);
+    assert_int_equal(sizeof(contents), write(filedesc, contents, sizeof(contents)));
+    assert_int_equal(0, close(filedesc));
+    snprintf(cache_path, sizeof(cache_path), "%s.cache", path);
+    file.name = path;
+
+    assert_true(file_md5(path, digest));
+    for (size_t i = 0; i < MD5_DIGEST_LENGTH; i++)
+        snprintf(md5 + 2 * i, 3, "%02x", digest[i]);
+
+    assert_int_equal(DRPM_ERR_OK, verify_cache_open(&verify, cache_path));
+    assert_int_equal(DRPM_ERR_OK, check_seqfiles(&cpio_file, 1, &file, DIGESTALGO_MD5,
+                                                 DRPM_CHECK_FULL, NULL, verify));
+    assert_int_equal(DRPM_ERR_OK, verify_cache_close(&verify));
+
+    // size no longer matches, so only a cache hit lets the check pass
+    file.size = PRELINK_CHECK_SIZE + 1;
+    assert_int_equal(DRPM_ERR_MISMATCH, check_seqfiles(&cpio_file, 1, &file, DIGESTALGO_MD5,
+                                                       DRPM_CHECK_FILESIZES, NULL, NULL));
+
+    assert_int_equal(DRPM_ERR_OK, verify_cache_open(&verify, cache_path));
+    assert_int_equal(0, stat(path, &stats));
+    assert_true(verify_cache_lookup(verify, &stats, DIGESTALGO_MD5, digest));
+    assert_int_equal(DRPM_ERR_OK, check_seqfiles(&cpio_file, 1, &file, DIGESTALGO_MD5,
+                                                 DRPM_CHECK_FILESIZES, NULL, verify));
+    assert_int_equal(DRPM_ERR_OK, verify_cache_close(&verify));
+
+    assert_int_equal(0, unlink(cache_path));
+    assert_int_equal(0, unlink(path));
+}
+
 /***************************** drpm_apply *****************************/
 
 static void apply_standard(void **state)
@@ -858,6 +1492,745 @@ static void apply_standard_lzip(void **state)
 }
 #endif
 
+#ifdef HAVE_ZSTD
+static void apply_standard_zstd(void **state)
+{
+    (void)state;
+    assert_int_equal(DRPM_ERR_OK, drpm_apply(OLDRPM_2, DELTARPM_STANDARD_ZSTD, RPMOUT_STANDARD_ZSTD));
+}
+
+// zstd payload must be recompressed exactly for the MD5 to match
+static void apply_standard_zstd_payload(void **state)
+{
+    drpm *delta = NULL;
+    unsigned tgt_comp;
+
+    (void)state;
+
+    assert_int_equal(DRPM_ERR_OK, drpm_read(&delta, DELTARPM_STANDARD_ZSTD_PAYLOAD));
+    assert_int_equal(DRPM_ERR_OK, drpm_get_uint(delta, DRPM_TAG_TGTCOMP, &tgt_comp));
+    assert_int_equal(DRPM_COMP_ZSTD, tgt_comp);
+    assert_int_equal(DRPM_ERR_OK, drpm_destroy(&delta));
+
+    assert_int_equal(DRPM_ERR_OK, drpm_apply(OLDRPM_1, DELTARPM_STANDARD_ZSTD_PAYLOAD, RPMOUT_STANDARD_ZSTD_PAYLOAD));
+    assert_true(same_md5(RPMOUT_STANDARD_ZSTD_PAYLOAD, NEWRPM_ZSTD));
+}
+#endif
+
+static void apply_standard_xz_mt(void **state)
+{
+    (void)state;
+    assert_int_equal(DRPM_ERR_OK, drpm_apply(OLDRPM_2, DELTARPM_STANDARD_XZ_MT, RPMOUT_STANDARD_XZ_MT));
+}
+
+// NEWRPM_1 has no uncompressed payload digest to check against
+static void apply_standard_uncompressed(void **state)
+{
+    drpm_apply_options *opts;
+
+    (void)state;
+
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_init(&opts));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_uncompressed_payload(opts));
+    assert_int_equal(DRPM_ERR_NODIGEST, drpm_apply_ex(OLDRPM_1, DELTARPM_STANDARD, RPMOUT_STANDARD_UNCOMPRESSED, opts));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_destroy(&opts));
+
+    // unverified RPM is not left behind
+    assert_int_equal(-1, filesize(RPMOUT_STANDARD_UNCOMPRESSED));
+}
+
+static void apply_standard_digest(void **state)
+{
+    drpm_apply_options *opts;
+
+    (void)state;
+
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_init(&opts));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_uncompressed_payload(opts));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_ex(OLDRPM_1, DELTARPM_STANDARD_DIGEST, RPMOUT_STANDARD_DIGEST, opts));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_destroy(&opts));
+
+    // payload is written uncompressed
+    assert_true(filesize(RPMOUT_STANDARD_DIGEST) > filesize(NEWRPM_DIGEST));
+}
+
+// header of the new RPM is only available as part of the output here
+static void apply_rpmonly_digest(void **state)
+{
+    drpm_apply_options *opts;
+
+    (void)state;
+
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_init(&opts));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_uncompressed_payload(opts));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_ex(OLDRPM_1, DELTARPM_RPMONLY_DIGEST, RPMOUT_RPMONLY_DIGEST, opts));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_destroy(&opts));
+
+    assert_true(filesize(RPMOUT_RPMONLY_DIGEST) > filesize(NEWRPM_DIGEST));
+}
+
+static void apply_standard_baddigest(void **state)
+{
+    drpm_apply_options *opts;
+
+    (void)state;
+
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_init(&opts));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_uncompressed_payload(opts));
+    assert_int_equal(DRPM_ERR_MISMATCH, drpm_apply_ex(OLDRPM_1, DELTARPM_STANDARD_BADDIGEST, RPMOUT_STANDARD_BADDIGEST, opts));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_destroy(&opts));
+
+    assert_int_equal(-1, filesize(RPMOUT_STANDARD_BADDIGEST));
+}
+
+// smallest cache, so that old RPM data goes through the spill file
+static void apply_standard_spill(void **state)
+{
+    drpm_apply_options *opts;
+
+    (void)state;
+
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_init(&opts));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_set_cache_size(opts, 1));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_set_spill_dir(opts, "."));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_set_spill_extent(opts, 1 << 16));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_ex(OLDRPM_1, DELTARPM_STANDARD, RPMOUT_STANDARD_SPILL, opts));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_destroy(&opts));
+    assert_int_equal(filesize(RPMOUT_STANDARD), filesize(RPMOUT_STANDARD_SPILL));
+}
+
+// Reads external data of a prelinked installed file with an unlimited
+// cache budget. The first copy reads
+// a block in the middle of the file, so fillblock_prelink() pushes every
+// other block of it into a heap sized for exactly as many blocks.
+static void apply_prelink_unlimited(void **state)
+{
+    const size_t order[] = {2, 5, 0, 1, 2, 3, 4, 5};
+    const size_t copies_count = sizeof(order) / sizeof(*order);
+    struct prelink_fixture fixture;
+    unsigned char image[PRELINK_FILE_SIZE];
+    unsigned char *ext_data;
+    const unsigned char *data;
+    size_t data_len;
+    size_t header_len;
+    uint64_t ext_data_len;
+    uint64_t offset;
+    uint64_t prev_end = 0;
+    uint64_t from;
+    uint64_t to;
+    size_t len;
+    uint32_t ext_copies[2 * sizeof(order) / sizeof(*order)];
+    struct cpio_file cpio_files[2];
+    struct file_info file = {.mode = S_IFREG | 0644, .size = PRELINK_FILE_SIZE};
+    struct prelink_cache *prelink;
+    struct blocks *blks;
+    drpm_apply_options *opts;
+
+    (void)state;
+
+    for (size_t i = 0; i < PRELINK_FILE_SIZE; i++)
+        image[i] = (unsigned char)((i * 2654435761u) >> 13);
+
+    prelink_fixture_create(&fixture, image, sizeof(image));
+    file.name = fixture.path;
+
+    header_len = CPIO_HEADER_SIZE + strlen(fixture.path) + 3;
+    cpio_files[0].index = 0;
+    cpio_files[0].header_len = header_len + CPIO_PADDING(header_len);
+    cpio_files[0].content_len = PRELINK_FILE_SIZE + CPIO_PADDING(PRELINK_FILE_SIZE);
+    cpio_files[0].offset = 0;
+    header_len = CPIO_HEADER_SIZE + strlen(CPIO_TRAILER) + 1;
+    cpio_files[1].index = -1;
+    cpio_files[1].header_len = header_len + CPIO_PADDING(header_len);
+    cpio_files[1].content_len = 0;
+    cpio_files[1].offset = cpio_files[0].header_len + cpio_files[0].content_len;
+    ext_data_len = cpio_files[1].offset + cpio_files[1].header_len;
+
+    assert_int_equal(5, block_id(ext_data_len - 1));
+
+    for (size_t i = 0; i < copies_count; i++) {
+        offset = order[i] * block_size();
+        len = MIN(block_size(), ext_data_len - offset);
+        ext_copies[2 * i] = (uint32_t)(int32_t)(offset - prev_end);
+        ext_copies[2 * i + 1] = len;
+        prev_end = offset + len;
+    }
+
+    assert_non_null(ext_data = malloc(ext_data_len));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_init(&opts));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_set_cache_size(opts, SIZE_MAX));
+    assert_int_equal(DRPM_ERR_OK, prelink_cache_create(&prelink, fixture.dir));
+    assert_int_equal(DRPM_ERR_OK, blocks_create(&blks, ext_data_len, &file, cpio_files, 2,
+                                                ext_copies, copies_count, NULL, false, prelink, opts));
+
+    for (size_t i = 0; i < copies_count; i++) {
+        offset = order[i] * block_size();
+        memset(ext_data + offset, 0, ext_copies[2 * i + 1]);
+        for (len = ext_copies[2 * i + 1]; len > 0; len -= data_len, offset += data_len) {
+            assert_int_equal(DRPM_ERR_OK, blocks_next(blks, &data, &data_len, offset, len,
+                                                      i, block_id(offset)));
+            memcpy(ext_data + offset, data, data_len);
+        }
+        // original contents read, not those of the installed file
+        from = MAX(order[i] * block_size(), cpio_files[0].header_len);
+        to = MIN(offset, cpio_files[0].header_len + PRELINK_FILE_SIZE);
+        if (from < to)
+            assert_memory_equal(image + (from - cpio_files[0].header_len), ext_data + from, to - from);
+    }
+
+    assert_int_equal(DRPM_ERR_OK, blocks_destroy(&blks));
+    assert_int_equal(DRPM_ERR_OK, prelink_cache_destroy(&prelink));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_destroy(&opts));
+    free(ext_data);
+
+    prelink_fixture_remove(&fixture);
+}
+
+// Reads external data of installed files, one whole block per copy,
+// in <order> (block IDs), concatenating copied data into <out>.
+static void blocks_copy_all(const struct file_info *files, const struct cpio_file *cpio_files,
+                            size_t cpio_files_len, uint64_t ext_data_len,
+                            const size_t *order, size_t copies_count,
+                            const drpm_apply_options *opts, unsigned char *out)
+{
+    uint32_t *ext_copies;
+    struct blocks *blks;
+    const unsigned char *data;
+    size_t data_len;
+    uint64_t offset;
+    uint64_t prev_end = 0;
+    size_t len;
+
+    assert_non_null(ext_copies = malloc(2 * copies_count * sizeof(uint32_t)));
+
+    for (size_t i = 0; i < copies_count; i++) {
+        offset = order[i] * block_size();
+        len = MIN(block_size(), ext_data_len - offset);
+        ext_copies[2 * i] = (uint32_t)(int32_t)(offset - prev_end);
+        ext_copies[2 * i + 1] = len;
+        prev_end = offset + len;
+    }
+
+    assert_int_equal(DRPM_ERR_OK, blocks_create(&blks, ext_data_len, files, cpio_files, cpio_files_len,
+                                                ext_copies, copies_count, NULL, false, NULL, opts));
+
+    for (size_t i = 0; i < copies_count; i++) {
+        offset = order[i] * block_size();
+        for (len = ext_copies[2 * i + 1]; len > 0; len -= data_len, offset += data_len, out += data_len) {
+            assert_int_equal(DRPM_ERR_OK, blocks_next(blks, &data, &data_len, offset, len,
+                                                      i, block_id(offset)));
+            memcpy(out, data, data_len);
+        }
+    }
+
+    assert_int_equal(DRPM_ERR_OK, blocks_destroy(&blks));
+    free(ext_copies);
+}
+
+// Reads external data of installed files through a cache of the minimum
+// number of blocks (and only two open files), so that blocks keep being
+// evicted to the page file and read back, and files are prefetched and
+// reopened. Passes over all blocks go forwards, by a stride of 7 and
+// backwards. Data copied must match that read with an unlimited cache.
+static void apply_min_cache(void **state)
+{
+    char dir[] = MIN_CACHE_DIR;
+    char names[MIN_CACHE_FILES][sizeof(MIN_CACHE_DIR) + 2];
+    unsigned char *contents[MIN_CACHE_FILES];
+    struct file_info files[MIN_CACHE_FILES];
+    struct cpio_file cpio_files[MIN_CACHE_FILES + 1];
+    size_t header_len;
+    size_t file_size;
+    uint64_t ext_data_len = 0;
+    size_t block_count;
+    size_t *order;
+    size_t copies_count;
+    size_t out_len;
+    unsigned char *out;
+    unsigned char *out_ref;
+    FILE *file;
+    drpm_apply_options *opts;
+
+    (void)state;
+
+    assert_non_null(mkdtemp(dir));
+
+    for (size_t i = 0; i < MIN_CACHE_FILES; i++) {
+        file_size = MIN_CACHE_FILE_SIZE + 1001 * i;
+        assert_non_null(contents[i] = malloc(file_size));
+        for (size_t j = 0; j < file_size; j++)
+            contents[i][j] = (unsigned char)(((j + 7919 * i) * 2654435761u) >> 13);
+        contents[i][0] = 0; // not an ELF file
+
+        snprintf(names[i], sizeof(names[i]), "%s/%zu", dir, i);
+        assert_non_null(file = fopen(names[i], "wb"));
+        assert_int_equal(file_size, fwrite(contents[i], 1, file_size, file));
+        assert_int_equal(0, fclose(file));
+
+        memset(&files[i], 0, sizeof(struct file_info));
+        files[i].name = names[i];
+        files[i].mode = S_IFREG | 0644;
+        files[i].size = file_size;
+
+        header_len = CPIO_HEADER_SIZE + strlen(names[i]) + 3;
+        cpio_files[i].index = i;
+        cpio_files[i].header_len = header_len + CPIO_PADDING(header_len);
+        cpio_files[i].content_len = file_size + CPIO_PADDING(file_size);
+        cpio_files[i].offset = ext_data_len;
+        ext_data_len += cpio_files[i].header_len + cpio_files[i].content_len;
+    }
+    header_len = CPIO_HEADER_SIZE + strlen(CPIO_TRAILER) + 1;
+    cpio_files[MIN_CACHE_FILES].index = -1;
+    cpio_files[MIN_CACHE_FILES].header_len = header_len + CPIO_PADDING(header_len);
+    cpio_files[MIN_CACHE_FILES].content_len = 0;
+    cpio_files[MIN_CACHE_FILES].offset = ext_data_len;
+    ext_data_len += cpio_files[MIN_CACHE_FILES].header_len;
+
+    block_count = block_id(ext_data_len - 1) + 1;
+    assert_int_not_equal(0, block_count % 7);
+    copies_count = 3 * block_count;
+    assert_non_null(order = malloc(copies_count * sizeof(size_t)));
+    for (size_t i = 0; i < block_count; i++) {
+        order[i] = i;
+        order[block_count + i] = (7 * i) % block_count;
+        order[2 * block_count + i] = block_count - 1 - i;
+    }
+
+    out_len = 3 * ext_data_len;
+    assert_non_null(out = malloc(out_len));
+    assert_non_null(out_ref = malloc(out_len));
+
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_init(&opts));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_set_cache_size(opts, SIZE_MAX));
+    blocks_copy_all(files, cpio_files, MIN_CACHE_FILES + 1, ext_data_len, order, copies_count, opts, out_ref);
+
+    // first pass reads external data in order
+    for (size_t i = 0; i < MIN_CACHE_FILES; i++)
+        assert_memory_equal(contents[i], out_ref + cpio_files[i].offset + cpio_files[i].header_len,
+                            files[i].size);
+
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_set_cache_size(opts, 1));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_set_open_files(opts, 2));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_set_spill_dir(opts, dir));
+    assert_false(blocks_in_place(ext_data_len / 3, opts)); // cache holds less than a pass
+    blocks_copy_all(files, cpio_files, MIN_CACHE_FILES + 1, ext_data_len, order, copies_count, opts, out);
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_destroy(&opts));
+
+    assert_memory_equal(out_ref, out, out_len);
+
+    for (size_t i = 0; i < MIN_CACHE_FILES; i++) {
+        assert_int_equal(0, unlink(names[i]));
+        free(contents[i]);
+    }
+    assert_int_equal(0, rmdir(dir));
+    free(order);
+    free(out);
+    free(out_ref);
+}
+
+// smallest cache, so that old RPM archive is decompressed as needed
+static void apply_rpmonly_stream(void **state)
+{
+    drpm_apply_options *opts;
+
+    (void)state;
+
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_init(&opts));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_set_cache_size(opts, 1));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_set_spill_dir(opts, "."));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_ex(OLDRPM_2, DELTARPM_RPMONLY_NOADDBLK, RPMOUT_RPMONLY_STREAM, opts));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_destroy(&opts));
+    assert_int_equal(filesize(RPMOUT_RPMONLY_NOADDBLK), filesize(RPMOUT_RPMONLY_STREAM));
+}
+
+static void *feed_pipe(void *arg)
+{
+    int *fds = arg;
+    char buffer[4096];
+    ssize_t len;
+
+    while ((len = read(fds[0], buffer, sizeof(buffer))) > 0)
+        if (write(fds[1], buffer, len) != len)
+            break;
+
+    close(fds[1]);
+
+    return NULL;
+}
+
+// DeltaRPM read from a pipe, as while downloading, output matches apply_standard
+static void apply_standard_pipe(void **state)
+{
+    pthread_t feeder;
+    int pipefds[2];
+    int feedfds[2];
+    int old_rpm_fd;
+    int new_rpm_fd;
+    int error;
+    char buffer[4096];
+
+    (void)state;
+
+    assert_int_equal(0, pipe(pipefds));
+    assert_true((feedfds[0] = open(DELTARPM_STANDARD, O_RDONLY)) >= 0);
+    feedfds[1] = pipefds[1];
+    assert_true((old_rpm_fd = open(OLDRPM_1, O_RDONLY)) >= 0);
+    assert_true((new_rpm_fd = open(RPMOUT_STANDARD_PIPE, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0);
+    assert_int_equal(0, pthread_create(&feeder, NULL, feed_pipe, feedfds));
+
+    error = drpm_apply_fd(old_rpm_fd, pipefds[0], new_rpm_fd, NULL);
+
+    // draining the pipe, so that the feeder cannot block if apply stopped early
+    while (read(pipefds[0], buffer, sizeof(buffer)) > 0)
+        ;
+    close(pipefds[0]);
+    assert_int_equal(0, pthread_join(feeder, NULL));
+    close(feedfds[0]);
+    close(old_rpm_fd);
+    close(new_rpm_fd);
+
+    assert_int_equal(DRPM_ERR_OK, error);
+    assert_true(same_md5(RPMOUT_STANDARD_PIPE, RPMOUT_STANDARD));
+}
+
+static int count_bytes(void *arg, const void *data, size_t len)
+{
+    (void)data;
+    *(off_t *)arg += len;
+    return 0;
+}
+
+// same output as apply_standard, only passed to a callback
+static void apply_standard_cb(void **state)
+{
+    off_t written = 0;
+
+    (void)state;
+
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_cb(OLDRPM_1, DELTARPM_STANDARD, count_bytes, &written, NULL));
+    assert_int_equal(filesize(RPMOUT_STANDARD), written);
+}
+
+// applying twice reads internal data again, output matches apply_standard
+static void apply_standard_handle(void **state)
+{
+    drpm_handle *handle;
+    drpm *info;
+    unsigned type;
+
+    (void)state;
+
+    assert_int_equal(DRPM_ERR_OK, drpm_open(&handle, DELTARPM_STANDARD));
+    assert_int_equal(DRPM_ERR_OK, drpm_handle_info(handle, &info));
+    assert_int_equal(DRPM_ERR_OK, drpm_get_uint(info, DRPM_TAG_TYPE, &type));
+    assert_int_equal(DRPM_TYPE_STANDARD, type);
+    assert_int_equal(DRPM_ERR_OK, drpm_handle_apply(handle, OLDRPM_1, RPMOUT_STANDARD_HANDLE, NULL));
+    assert_true(same_md5(RPMOUT_STANDARD_HANDLE, RPMOUT_STANDARD));
+    // applying again re-reads internal data consumed by the first apply
+    assert_int_equal(DRPM_ERR_OK, drpm_handle_apply(handle, OLDRPM_1, RPMOUT_STANDARD_HANDLE, NULL));
+    assert_true(same_md5(RPMOUT_STANDARD_HANDLE, RPMOUT_STANDARD));
+    assert_int_equal(DRPM_ERR_OK, drpm_close(&handle));
+    assert_null(handle);
+}
+
+// failed applies do not leave incomplete or unverified output behind
+static void apply_handle_fail(void **state)
+{
+    drpm_handle *handle;
+    drpm_apply_options *opts;
+
+    (void)state;
+
+    // old RPM does not match, nothing written yet
+    assert_int_equal(DRPM_ERR_OK, drpm_open(&handle, DELTARPM_STANDARD));
+    assert_int_equal(DRPM_ERR_MISMATCH, drpm_handle_apply(handle, OLDRPM_2, RPMOUT_HANDLE_FAIL, NULL));
+    assert_int_equal(-1, filesize(RPMOUT_HANDLE_FAIL));
+    assert_int_equal(DRPM_ERR_OK, drpm_close(&handle));
+
+    // payload digest checked only after the whole RPM has been written
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_init(&opts));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_uncompressed_payload(opts));
+    assert_int_equal(DRPM_ERR_OK, drpm_open(&handle, DELTARPM_STANDARD_BADDIGEST));
+    assert_int_equal(DRPM_ERR_MISMATCH, drpm_handle_apply(handle, OLDRPM_1, RPMOUT_HANDLE_FAIL, opts));
+    assert_int_equal(-1, filesize(RPMOUT_HANDLE_FAIL));
+    assert_int_equal(DRPM_ERR_OK, drpm_close(&handle));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_destroy(&opts));
+}
+
+// results should match those of drpm_check(), also when checked again
+static void apply_standard_handle_check(void **state)
+{
+    drpm_handle *handle;
+    const int expected = drpm_check(DELTARPM_STANDARD, DRPM_CHECK_FULL);
+
+    (void)state;
+
+    assert_int_equal(DRPM_ERR_ARGS, drpm_handle_check(NULL, DRPM_CHECK_FULL, NULL));
+
+    assert_int_equal(DRPM_ERR_OK, drpm_open(&handle, DELTARPM_STANDARD));
+    assert_int_equal(DRPM_ERR_ARGS, drpm_handle_check(handle, DRPM_CHECK_NONE, NULL));
+    assert_int_equal(expected, drpm_handle_check(handle, DRPM_CHECK_FULL, NULL));
+    assert_int_equal(expected, drpm_handle_check(handle, DRPM_CHECK_FULL, NULL));
+
+    // usually DRPM_ERR_NOINSTALL, as test RPMs are not installed
+    if (expected == DRPM_ERR_OK) {
+        // installed package kept with the handle must stay unchanged
+        assert_int_equal(DRPM_ERR_OK, drpm_handle_apply(handle, NULL, RPMOUT_STANDARD_HANDLE, NULL));
+        assert_true(same_md5(RPMOUT_STANDARD_HANDLE, RPMOUT_STANDARD));
+        assert_int_equal(DRPM_ERR_OK, drpm_handle_check(handle, DRPM_CHECK_FILESIZES, NULL));
+        assert_int_equal(DRPM_ERR_OK, drpm_handle_apply(handle, NULL, RPMOUT_STANDARD_HANDLE, NULL));
+        assert_true(same_md5(RPMOUT_STANDARD_HANDLE, RPMOUT_STANDARD));
+    }
+
+    assert_int_equal(DRPM_ERR_OK, drpm_close(&handle));
+}
+
+// outputs should match those of single applies
+static void apply_batch(void **state)
+{
+    drpm_apply_job jobs[] = {
+        {OLDRPM_1, DELTARPM_STANDARD, RPMOUT_BATCH_STANDARD, DRPM_ERR_OTHER},
+        {OLDRPM_2, DELTARPM_RPMONLY_NOADDBLK, RPMOUT_BATCH_RPMONLY_NOADDBLK, DRPM_ERR_OTHER}
+    };
+
+    (void)state;
+
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_batch(jobs, 2, 2, 1 << 20, NULL));
+    assert_int_equal(DRPM_ERR_OK, jobs[0].error);
+    assert_int_equal(DRPM_ERR_OK, jobs[1].error);
+    assert_int_equal(filesize(RPMOUT_STANDARD), filesize(RPMOUT_BATCH_STANDARD));
+    assert_int_equal(filesize(RPMOUT_RPMONLY_NOADDBLK), filesize(RPMOUT_BATCH_RPMONLY_NOADDBLK));
+}
+
+/***************************** concurrency ****************************/
+
+struct stress_arg {
+    unsigned id;
+    int fs_error; // expected result of applying from filesystem
+    int error;
+};
+
+// Each thread makes, applies and reads deltas with its own files.
+// Applying from the filesystem looks up the installed package in rpmdb,
+// whether it is installed or not.
+static void *stress_thread(void *arg)
+{
+    struct stress_arg *stress = arg;
+    char deltarpm[32];
+    char rpmout[32];
+    drpm_make_options *opts;
+    drpm *delta;
+    int error;
+
+    snprintf(deltarpm, sizeof(deltarpm), "stress-%u.drpm", stress->id);
+    snprintf(rpmout, sizeof(rpmout), "stress-%u.rpm", stress->id);
+
+    if ((stress->error = drpm_make_options_init(&opts)) != DRPM_ERR_OK)
+        return NULL;
+
+    for (unsigned i = 0; i < STRESS_ROUNDS && stress->error == DRPM_ERR_OK; i++) {
+        if (i % 2) {
+            if ((stress->error = drpm_apply(OLDRPM_2, DELTARPM_RPMONLY_NOADDBLK, rpmout)) != DRPM_ERR_OK)
+                break;
+        } else {
+            if ((stress->error = drpm_make(OLDRPM_1, NEWRPM_1, deltarpm, opts)) != DRPM_ERR_OK ||
+                (stress->error = drpm_apply(OLDRPM_1, deltarpm, rpmout)) != DRPM_ERR_OK)
+                break;
+        }
+        if (!same_md5(rpmout, (i % 2) ? RPMOUT_RPMONLY_NOADDBLK : RPMOUT_STANDARD)) {
+            stress->error = DRPM_ERR_MISMATCH;
+            break;
+        }
+        if ((error = drpm_apply(NULL, DELTARPM_STANDARD, rpmout)) != stress->fs_error ||
+            (error == DRPM_ERR_OK && !same_md5(rpmout, RPMOUT_STANDARD))) {
+            stress->error = (error == stress->fs_error) ? DRPM_ERR_MISMATCH : error;
+            break;
+        }
+        if ((stress->error = drpm_read(&delta, DELTARPM_RPMONLY)) != DRPM_ERR_OK)
+            break;
+        stress->error = drpm_destroy(&delta);
+    }
+
+    drpm_make_options_destroy(&opts);
+    remove(deltarpm);
+    remove(rpmout);
+
+    return NULL;
+}
+
+static void stress_concurrent(void **state)
+{
+    pthread_t threads[STRESS_THREADS];
+    struct stress_arg args[STRESS_THREADS];
+    int fs_error;
+
+    (void)state;
+
+    // usually DRPM_ERR_NOINSTALL, as test RPMs are not installed
+    fs_error = drpm_apply(NULL, DELTARPM_STANDARD, "stress-fs.rpm");
+    remove("stress-fs.rpm");
+
+    for (unsigned i = 0; i < STRESS_THREADS; i++) {
+        args[i].id = i;
+        args[i].fs_error = fs_error;
+        args[i].error = DRPM_ERR_OK;
+        assert_int_equal(0, pthread_create(&threads[i], NULL, stress_thread, &args[i]));
+    }
+
+    for (unsigned i = 0; i < STRESS_THREADS; i++) {
+        assert_int_equal(0, pthread_join(threads[i], NULL));
+        assert_int_equal(DRPM_ERR_OK, args[i].error);
+    }
+}
+
+struct prelink_arg {
+    struct prelink_cache *prelink;
+    const char *path;
+    int error;
+    unsigned char image[PRELINK_CHECK_SIZE];
+};
+
+static void *prelink_thread(void *arg)
+{
+    struct prelink_arg *prelink = arg;
+    int filedesc;
+
+    if ((prelink->error = prelink_open(prelink->prelink, prelink->path, &filedesc)) != DRPM_ERR_OK)
+        return NULL;
+    if (read(filedesc, prelink->image, PRELINK_CHECK_SIZE) != PRELINK_CHECK_SIZE)
+        prelink->error = DRPM_ERR_IO;
+    close(filedesc);
+
+    return NULL;
+}
+
+// cached images are opened while undoing other files fails (no prelink here)
+static void stress_prelink_open(void **state)
+{
+    pthread_t threads[STRESS_THREADS];
+    struct prelink_arg args[STRESS_THREADS];
+    struct prelink_fixture fixture;
+    struct prelink_cache *prelink;
+    unsigned char image[PRELINK_CHECK_SIZE];
+    char uncached_path[sizeof(fixture.path) + 16];
+
+    (void)state;
+
+    for (size_t i = 0; i < PRELINK_CHECK_SIZE; i++)
+        image[i] = (unsigned char)i;
+
+    prelink_fixture_create(&fixture, image, sizeof(image));
+    snprintf(uncached_path, sizeof(uncached_path), "%s/uncached", fixture.dir);
+    write_prelinked_elf(uncached_path);
+
+    assert_int_equal(DRPM_ERR_OK, prelink_cache_create(&prelink, fixture.dir));
+
+    for (unsigned round = 0; round < 2; round++) {
+        for (unsigned i = 0; i < STRESS_THREADS; i++) {
+            args[i].prelink = prelink;
+            args[i].path = (i % 2) ? uncached_path : fixture.path;
+            assert_int_equal(0, pthread_create(&threads[i], NULL, prelink_thread, &args[i]));
+        }
+
+        for (unsigned i = 0; i < STRESS_THREADS; i++) {
+            assert_int_equal(0, pthread_join(threads[i], NULL));
+            if (i % 2) {
+                assert_int_not_equal(DRPM_ERR_OK, args[i].error);
+            } else {
+                assert_int_equal(DRPM_ERR_OK, args[i].error);
+                assert_memory_equal(image, args[i].image, PRELINK_CHECK_SIZE);
+            }
+        }
+    }
+
+    assert_int_equal(DRPM_ERR_OK, prelink_cache_destroy(&prelink));
+
+    assert_int_equal(0, unlink(uncached_path));
+    prelink_fixture_remove(&fixture);
+}
+
+/***************************** compstrm *******************************/
+
+// compresses <in> in chunks of varying size
+static void compress_chunks(unsigned short comp, int level, unsigned threads,
+                            const unsigned char *in, size_t in_len,
+                            unsigned char **out, size_t *out_len)
+{
+    struct compstrm *strm;
+    size_t chunk;
+
+    if (threads > 1)
+        assert_int_equal(DRPM_ERR_OK, compstrm_init_mt(&strm, NULL, comp, level, threads, NULL));
+    else
+        assert_int_equal(DRPM_ERR_OK, compstrm_init(&strm, -1, comp, level));
+
+    for (size_t pos = 0, i = 0; pos < in_len; pos += chunk, i++) {
+        chunk = MIN(in_len - pos, 1 + (i * 7919) % 100000);
+        assert_int_equal(DRPM_ERR_OK, compstrm_write(strm, chunk, in + pos));
+    }
+
+    assert_int_equal(DRPM_ERR_OK, compstrm_finish(strm, out, out_len));
+    assert_int_equal(DRPM_ERR_OK, compstrm_destroy(&strm));
+}
+
+// output of parallel bzip2 must be that of libbz2, so that payloads
+// are recompressed exactly; input spans several blocks, with runs of
+// lengths around the RLE threshold, literals and long runs over which
+// blocks fill up (positioned by the run-length encoded size so far)
+static void compstrm_bzip2_mt_exact(void **state)
+{
+    unsigned char *in;
+    size_t in_len;
+    unsigned char *out_st;
+    unsigned char *out_mt;
+    size_t out_st_len;
+    size_t out_mt_len;
+    uint32_t rnd = 1;
+    size_t len;
+    uint64_t rle_len;
+    uint64_t block_end;
+
+    (void)state;
+
+    for (int level = 1; level <= 9; level++) {
+        in_len = 400000 * level;
+        assert_non_null(in = malloc(in_len));
+        rle_len = 0;
+        block_end = 100000 * level - 19;
+
+        for (size_t pos = 0; pos < in_len; pos += len) {
+            rnd = rnd * 1103515245 + 12345;
+            if (rle_len + 2500 >= block_end) {
+                len = MIN(255 * 1000 + 37 * (size_t)level, in_len - pos);
+                memset(in + pos, 'x', len);
+                rle_len += 5 * (len / 255) + MIN(len % 255, 5);
+                block_end += 100000 * level - 19;
+            } else if ((rnd >> 16) % 4 == 0) {
+                len = MIN(1 + (rnd >> 24) % 8, in_len - pos);
+                memset(in + pos, (rnd >> 4) & 0xFF, len);
+                rle_len += MIN(len, 5);
+            } else {
+                len = MIN(1 + (rnd >> 24) % 64, in_len - pos);
+                for (size_t i = 0; i < len; i++) {
+                    rnd = rnd * 1103515245 + 12345;
+                    in[pos + i] = rnd >> 24;
+                }
+                rle_len += len;
+            }
+        }
+
+        compress_chunks(DRPM_COMP_BZIP2, level, 1, in, in_len, &out_st, &out_st_len);
+        compress_chunks(DRPM_COMP_BZIP2, level, 4, in, in_len, &out_mt, &out_mt_len);
+
+        assert_int_equal(out_st_len, out_mt_len);
+        assert_memory_equal(out_st, out_mt, out_st_len);
+
+        free(out_st);
+        free(out_mt);
+        free(in);
+    }
+}
+
 /***************************** run tests ******************************/
 
 int main()
@@ -869,8 +2242,21 @@ int main()
         cmocka_unit_test(make_rpmonly),
         cmocka_unit_test(make_standard),
         cmocka_unit_test(make_rpmonly_noaddblk),
+        cmocka_unit_test(make_standard_xz_mt),
+        cmocka_unit_test(make_size_ratio),
+        cmocka_unit_test(make_threshold),
+        cmocka_unit_test(make_standard_digest),
+        cmocka_unit_test(make_rpmonly_digest),
+        cmocka_unit_test(make_standard_baddigest),
+        cmocka_unit_test(make_patches_rpmlist),
+        cmocka_unit_test(make_patches_rpm),
+        cmocka_unit_test(make_patches_malformed),
 #ifdef HAVE_LZLIB_DEVEL
-        cmocka_unit_test(make_standard_lzip)
+        cmocka_unit_test(make_standard_lzip),
+#endif
+#ifdef HAVE_ZSTD
+        cmocka_unit_test(make_standard_zstd),
+        cmocka_unit_test(make_standard_zstd_payload),
 #endif
     };
     const struct CMUnitTest read_tests[] = {
@@ -884,15 +2270,45 @@ int main()
 #endif
     };
     const struct CMUnitTest check_tests[] = {
-        cmocka_unit_test(check_sequence)
+        cmocka_unit_test(check_sequence),
+        cmocka_unit_test(check_sequence_ex),
+        cmocka_unit_test(check_prelink_cached),
+        cmocka_unit_test(check_verify_cached),
+        cmocka_unit_test(check_missing_file)
     };
     const struct CMUnitTest apply_tests[] = {
         cmocka_unit_test(apply_standard),
         cmocka_unit_test(apply_rpmonly_noaddblk),
+        cmocka_unit_test(apply_standard_uncompressed),
+        cmocka_unit_test(apply_standard_digest),
+        cmocka_unit_test(apply_rpmonly_digest),
+        cmocka_unit_test(apply_standard_baddigest),
+        cmocka_unit_test(apply_standard_spill),
+        cmocka_unit_test(apply_prelink_unlimited),
+        cmocka_unit_test(apply_min_cache),
+        cmocka_unit_test(apply_rpmonly_stream),
+        cmocka_unit_test(apply_standard_pipe),
+        cmocka_unit_test(apply_standard_cb),
+        cmocka_unit_test(apply_standard_handle),
+        cmocka_unit_test(apply_standard_handle_check),
+        cmocka_unit_test(apply_handle_fail),
+        cmocka_unit_test(apply_batch),
+        cmocka_unit_test(apply_standard_xz_mt),
 #ifdef HAVE_LZLIB_DEVEL
-        cmocka_unit_test(apply_standard_lzip)
+        cmocka_unit_test(apply_standard_lzip),
+#endif
+#ifdef HAVE_ZSTD
+        cmocka_unit_test(apply_standard_zstd),
+        cmocka_unit_test(apply_standard_zstd_payload),
 #endif
     };
+    const struct CMUnitTest compstrm_tests[] = {
+        cmocka_unit_test(compstrm_bzip2_mt_exact)
+    };
+    const struct CMUnitTest stress_tests[] = {
+        cmocka_unit_test(stress_concurrent),
+        cmocka_unit_test(stress_prelink_open)
+    };
 
     failed = cmocka_run_group_tests_name("drpm_make()", make_tests, make_setup, make_teardown);
     if (failed)
@@ -910,5 +2326,13 @@ int main()
     if (failed)
         return failed;
 
+    failed = cmocka_run_group_tests_name("compstrm", compstrm_tests, NULL, NULL);
+    if (failed)
+        return failed;
+
+    failed = cmocka_run_group_tests_name("concurrency", stress_tests, NULL, NULL);
+    if (failed)
+        return failed;
+
     return 0;
 }
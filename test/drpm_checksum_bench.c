@@ -0,0 +1,247 @@
+/*
+    Authors:
+        Matej Chalk <mchalk@redhat.com>
+
+    Copyright (C) 2016 Red Hat
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Measures SHA-256 throughput over many small files:
+//  - deprecated SHA256_* calls, one file after another (previous code),
+//  - struct checksum (EVP), one file after another,
+//  - check_seqfiles(), hashing files concurrently in the check thread pool.
+// Usage: drpm_checksum_bench [FILE_COUNT [FILE_SIZE]]
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define OPENSSL_SUPPRESS_DEPRECATED
+
+#include "../src/drpm.h"
+#include "../src/drpm_private.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <openssl/sha.h>
+
+#define BENCH_DIR "checksum-bench-XXXXXX"
+#define BENCH_FILE_COUNT 4096
+#define BENCH_FILE_SIZE 4096
+#define BENCH_ROUNDS 5
+
+struct bench_files {
+    char dir[sizeof(BENCH_DIR)];
+    size_t count;
+    size_t size;
+    char **names;
+    struct file_info *files;
+    struct cpio_file *cpio_files;
+    unsigned char *buffer;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool read_file(const char *name, unsigned char *buffer, size_t size)
+{
+    int filedesc;
+    ssize_t read_len;
+
+    if ((filedesc = open(name, O_RDONLY)) < 0)
+        return false;
+    read_len = read(filedesc, buffer, size);
+    close(filedesc);
+
+    return read_len == (ssize_t)size;
+}
+
+static bool hash_legacy(struct bench_files *bench)
+{
+    SHA256_CTX sha256;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+
+    for (size_t i = 0; i < bench->count; i++) {
+        if (!read_file(bench->names[i], bench->buffer, bench->size) ||
+            SHA256_Init(&sha256) != 1 ||
+            SHA256_Update(&sha256, bench->buffer, bench->size) != 1 ||
+            SHA256_Final(digest, &sha256) != 1)
+            return false;
+    }
+
+    return true;
+}
+
+static bool hash_checksum(struct bench_files *bench)
+{
+    struct checksum chsm = {0};
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+
+    for (size_t i = 0; i < bench->count; i++) {
+        if (!read_file(bench->names[i], bench->buffer, bench->size) ||
+            checksum_init(&chsm, DIGESTALGO_SHA256) != DRPM_ERR_OK ||
+            checksum_update(&chsm, bench->buffer, bench->size) != DRPM_ERR_OK ||
+            checksum_final(&chsm, digest) != DRPM_ERR_OK) {
+            checksum_free(&chsm);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool hash_check_pool(struct bench_files *bench)
+{
+    return check_seqfiles(bench->cpio_files, bench->count, bench->files, DIGESTALGO_SHA256,
+                          DRPM_CHECK_FULL, NULL, NULL) == DRPM_ERR_OK;
+}
+
+static bool bench_create(struct bench_files *bench, size_t count, size_t size)
+{
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    int filedesc;
+
+    memset(bench, 0, sizeof(struct bench_files));
+    strcpy(bench->dir, BENCH_DIR);
+    bench->size = size;
+
+    if (mkdtemp(bench->dir) == NULL ||
+        (bench->names = calloc(count, sizeof(char *))) == NULL ||
+        (bench->files = calloc(count, sizeof(struct file_info))) == NULL ||
+        (bench->cpio_files = calloc(count, sizeof(struct cpio_file))) == NULL ||
+        (bench->buffer = malloc(size)) == NULL)
+        return false;
+
+    for (size_t i = 0; i < count; i++) {
+        bench->count = i + 1;
+
+        for (size_t j = 0; j < size; j++)
+            bench->buffer[j] = (unsigned char)(i * 31 + j);
+
+        if ((bench->names[i] = malloc(sizeof(BENCH_DIR) + 16)) == NULL ||
+            (bench->files[i].md5 = malloc(2 * SHA256_DIGEST_LENGTH + 1)) == NULL)
+            return false;
+        sprintf(bench->names[i], "%s/%zu", bench->dir, i);
+
+        if ((filedesc = open(bench->names[i], O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+            return false;
+        if (write(filedesc, bench->buffer, size) != (ssize_t)size) {
+            close(filedesc);
+            return false;
+        }
+        close(filedesc);
+
+        SHA256(bench->buffer, size, digest);
+        for (size_t j = 0; j < SHA256_DIGEST_LENGTH; j++)
+            sprintf(bench->files[i].md5 + 2 * j, "%02x", digest[j]);
+
+        bench->files[i].name = bench->names[i];
+        bench->files[i].mode = S_IFREG | 0644;
+        bench->files[i].size = size;
+        bench->cpio_files[i].index = i;
+    }
+
+    return true;
+}
+
+static void bench_destroy(struct bench_files *bench)
+{
+    for (size_t i = 0; i < bench->count; i++) {
+        if (bench->names[i] != NULL)
+            unlink(bench->names[i]);
+        free(bench->names[i]);
+        free(bench->files[i].md5);
+    }
+    rmdir(bench->dir);
+
+    free(bench->names);
+    free(bench->files);
+    free(bench->cpio_files);
+    free(bench->buffer);
+}
+
+// prints throughput of the best of BENCH_ROUNDS runs
+static bool bench_run(const char *label, bool (*hash)(struct bench_files *),
+                      struct bench_files *bench)
+{
+    double best = 0.0;
+    double start;
+    double elapsed;
+
+    for (unsigned round = 0; round < BENCH_ROUNDS; round++) {
+        start = now();
+        if (!hash(bench)) {
+            fprintf(stderr, "%s: failed\n", label);
+            return false;
+        }
+        elapsed = now() - start;
+        if (round == 0 || elapsed < best)
+            best = elapsed;
+    }
+
+    printf("%-32s %10.1f MiB/s %10.0f files/s\n", label,
+           bench->count * bench->size / best / (1024 * 1024), bench->count / best);
+
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_files bench;
+    size_t count = BENCH_FILE_COUNT;
+    size_t size = BENCH_FILE_SIZE;
+    bool ok;
+
+    if (argc > 3) {
+        fprintf(stderr, "Usage: %s [FILE_COUNT [FILE_SIZE]]\n", argv[0]);
+        return 2;
+    }
+    if (argc > 1)
+        count = strtoul(argv[1], NULL, 10);
+    if (argc > 2)
+        size = strtoul(argv[2], NULL, 10);
+    if (count == 0 || size == 0 || size > UINT32_MAX) {
+        fprintf(stderr, "%s: invalid file count or size\n", argv[0]);
+        return 2;
+    }
+
+    if (!bench_create(&bench, count, size)) {
+        perror("creating files");
+        bench_destroy(&bench);
+        return 1;
+    }
+
+    printf("SHA-256 over %zu files of %zu bytes\n", count, size);
+
+    ok = bench_run("SHA256_* (sequential)", hash_legacy, &bench) &&
+         bench_run("checksum/EVP (sequential)", hash_checksum, &bench) &&
+         bench_run("check_seqfiles (thread pool)", hash_check_pool, &bench);
+
+    bench_destroy(&bench);
+
+    return ok ? 0 : 1;
+}